@@ -0,0 +1,45 @@
+#ifndef TS_CONT_H
+#define TS_CONT_H
+
+/* The subset of the Traffic Server plugin API used to run work on threads of
+ * our own and hand results back to event threads. Like tslog.h, it declares
+ * symbols that traffic_server provides when it loads the library. */
+
+#include <stdint.h>
+
+#ifndef tsapi
+#define tsapi
+#endif
+
+typedef struct tsapi_cont *TSCont;
+typedef struct tsapi_mutex *TSMutex;
+typedef struct tsapi_action *TSAction;
+typedef struct tsapi_thread *TSThread;
+typedef int64_t TSHRTime;
+
+typedef enum {
+    TS_EVENT_NONE = 0,
+    TS_EVENT_IMMEDIATE = 1,
+    TS_EVENT_TIMEOUT = 2,
+} TSEvent;
+
+typedef enum {
+    TS_THREAD_POOL_NET,
+    TS_THREAD_POOL_TASK,
+} TSThreadPool;
+
+typedef int (*TSEventFunc)(TSCont contp, TSEvent event, void *edata);
+typedef void *(*TSThreadFunc)(void *data);
+
+tsapi TSThread TSThreadCreate(TSThreadFunc func, void *data);
+
+tsapi TSMutex TSMutexCreate(void);
+
+tsapi TSCont TSContCreate(TSEventFunc funcp, TSMutex mutexp);
+tsapi void TSContDestroy(TSCont contp);
+tsapi void TSContDataSet(TSCont contp, void *data);
+tsapi void *TSContDataGet(TSCont contp);
+tsapi TSAction TSContScheduleOnPool(TSCont contp, TSHRTime timeout,
+                                    TSThreadPool tp);
+
+#endif /* TS_CONT_H */
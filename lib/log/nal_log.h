@@ -12,10 +12,55 @@
 #endif
 #endif
 
+#include <stdint.h>
+
+#define NAL_LOG_LEVEL_DEBUG 0
+#define NAL_LOG_LEVEL_STATUS 1
+#define NAL_LOG_LEVEL_NOTE 2
+#define NAL_LOG_LEVEL_WARNING 3
+#define NAL_LOG_LEVEL_ERROR 4
+
+/* Calls of levels below NAL_LOG_MIN_LEVEL compile to nothing, arguments
+ * included. */
+#ifndef NAL_LOG_MIN_LEVEL
+#define NAL_LOG_MIN_LEVEL NAL_LOG_LEVEL_DEBUG
+#endif
+
+/* Debug tags. Every nal_log_debug call site keeps the bit of its tag in a
+ * static, looked up by nal_log_tag_resolve on the first call, so a disabled
+ * call costs a load and a branch on nal_log_tag_mask. NAL_LOG_TAG_UNRESOLVED
+ * stays set in the mask to send unresolved call sites to the lookup. Tags
+ * past the 62nd share one bit. See nal_log_tag.c. */
+#define NAL_LOG_TAG_UNRESOLVED (1ULL << 63)
+extern uint64_t nal_log_tag_mask;
+int nal_log_tag_resolve(uint64_t *bit, const char *tag);
+/* Turns tag on or off until the next nal_log_tags_refresh. */
+void nal_log_tag_set(const char *tag, int on);
+/* Reads the state of all known tags again from where the backend keeps
+ * it, see nal_log_tag.c. */
+void nal_log_tags_refresh(void);
+
+#define NAL_LOG_DEBUG_GATED(tag, call)                                         \
+    do {                                                                       \
+        static uint64_t nal_log_tag_bit_ = NAL_LOG_TAG_UNRESOLVED;             \
+        NAL_LOG_TAG_SYNC();                                                    \
+        uint64_t nal_log_bit_ =                                                \
+            __atomic_load_n(&nal_log_tag_bit_, __ATOMIC_RELAXED);              \
+        if (__builtin_expect(                                                  \
+                (__atomic_load_n(&nal_log_tag_mask, __ATOMIC_RELAXED) &        \
+                 nal_log_bit_) != 0,                                           \
+                0) &&                                                          \
+            (nal_log_bit_ != NAL_LOG_TAG_UNRESOLVED ||                         \
+             nal_log_tag_resolve(&nal_log_tag_bit_, (tag)))) {                 \
+            call;                                                              \
+        }                                                                      \
+    } while (0)
+
 #if NAL_LOG_ATS
 
 #include "tslog.h"
-#define nal_log_debug(tag, ...) TSDebug((tag), __VA_ARGS__)
+#define nal_log_debug(tag, ...)                                                \
+    NAL_LOG_DEBUG_GATED(tag, TSDebug((tag), __VA_ARGS__))
 #define nal_log_status(...) TSStatus(__VA_ARGS__)
 #define nal_log_note(...) TSNote(__VA_ARGS__)
 #define nal_log_warning(...) TSWarning(__VA_ARGS__)
@@ -32,10 +77,15 @@ void nal_log_ngx_debug(ngx_log_t *log, const char *func, const char *file,
                        int line, const char *tag, const char *fmt, ...)
     nal_printflike(6, 7);
 extern volatile ngx_cycle_t *ngx_cycle;
+/* The cycle the tag mask was read under, see nal_log_tag.c. */
+extern volatile void *nal_log_tag_cycle;
+#define NAL_LOG_TAG_SYNC()                                                     \
+    if (__builtin_expect((void *)ngx_cycle != nal_log_tag_cycle, 0))           \
+    nal_log_tags_refresh()
 #define nal_log_debug(tag, ...)                                                \
-    if (ngx_cycle->log->log_level & NGX_LOG_DEBUG)                             \
-    nal_log_ngx_debug(ngx_cycle->log, __func__, __FILE__, __LINE__, tag,       \
-                      __VA_ARGS__)
+    NAL_LOG_DEBUG_GATED(tag, nal_log_ngx_debug(ngx_cycle->log, __func__,       \
+                                               __FILE__, __LINE__, tag,        \
+                                               __VA_ARGS__))
 #define nal_log_status(...)                                                    \
     if (ngx_cycle->log->log_level & NGX_LOG_INFO)                              \
     nal_log_ngx_core(NGX_LOG_INFO, ngx_cycle->log, __VA_ARGS__)
@@ -49,6 +99,32 @@ extern volatile ngx_cycle_t *ngx_cycle;
     if (ngx_cycle->log->log_level & NGX_LOG_ERR)                               \
     nal_log_ngx_core(NGX_LOG_ERR, ngx_cycle->log, __VA_ARGS__)
 
+#elif NAL_LOG_RING
+
+/* Records go into a lock-free ring of the calling thread as the format
+ * pointer plus the raw arguments, and a background thread formats them to
+ * stderr, see nal_log_ring.c. Format strings must be string literals. */
+#define NAL_LOG_RING_DEBUG NAL_LOG_LEVEL_DEBUG
+#define NAL_LOG_RING_STATUS NAL_LOG_LEVEL_STATUS
+#define NAL_LOG_RING_NOTE NAL_LOG_LEVEL_NOTE
+#define NAL_LOG_RING_WARNING NAL_LOG_LEVEL_WARNING
+#define NAL_LOG_RING_ERROR NAL_LOG_LEVEL_ERROR
+void nal_log_ring(int level, const char *fmt, ...) nal_printflike(2, 3);
+void nal_log_ring_debug(const char *func, const char *file, int line,
+                        const char *tag, const char *fmt, ...)
+    nal_printflike(5, 6);
+/* Formats all pending records now. */
+void nal_log_ring_flush(void);
+/* Number of records dropped because the ring of their thread was full. */
+unsigned long long nal_log_ring_dropped(void);
+#define nal_log_debug(tag, ...)                                                \
+    NAL_LOG_DEBUG_GATED(tag, nal_log_ring_debug(__func__, __FILE__, __LINE__,  \
+                                                tag, __VA_ARGS__))
+#define nal_log_status(...) nal_log_ring(NAL_LOG_RING_STATUS, __VA_ARGS__)
+#define nal_log_note(...) nal_log_ring(NAL_LOG_RING_NOTE, __VA_ARGS__)
+#define nal_log_warning(...) nal_log_ring(NAL_LOG_RING_WARNING, __VA_ARGS__)
+#define nal_log_error(...) nal_log_ring(NAL_LOG_RING_ERROR, __VA_ARGS__)
+
 #elif NAL_LOG_NOP
 
 #define nal_log_debug(tag, ...)
@@ -65,7 +141,8 @@ void nal_log_stderr_debug(const char *func, const char *file, int line,
                           const char *tag, const char *fmt, ...)
     nal_printflike(5, 6);
 #define nal_log_debug(tag, ...)                                                \
-    nal_log_stderr_debug(__func__, __FILE__, __LINE__, tag, __VA_ARGS__)
+    NAL_LOG_DEBUG_GATED(tag, nal_log_stderr_debug(__func__, __FILE__,          \
+                                                  __LINE__, tag, __VA_ARGS__))
 #define nal_log_status(...) nal_log_stderr("STATUS", __VA_ARGS__)
 #define nal_log_note(...) nal_log_stderr("NOTE", __VA_ARGS__)
 #define nal_log_warning(...) nal_log_stderr("WARNING", __VA_ARGS__)
@@ -73,4 +150,29 @@ void nal_log_stderr_debug(const char *func, const char *file, int line,
 
 #endif
 
+#ifndef NAL_LOG_TAG_SYNC
+#define NAL_LOG_TAG_SYNC() ((void)0)
+#endif
+
+#if NAL_LOG_MIN_LEVEL > NAL_LOG_LEVEL_DEBUG
+#undef nal_log_debug
+#define nal_log_debug(tag, ...) ((void)0)
+#endif
+#if NAL_LOG_MIN_LEVEL > NAL_LOG_LEVEL_STATUS
+#undef nal_log_status
+#define nal_log_status(...) ((void)0)
+#endif
+#if NAL_LOG_MIN_LEVEL > NAL_LOG_LEVEL_NOTE
+#undef nal_log_note
+#define nal_log_note(...) ((void)0)
+#endif
+#if NAL_LOG_MIN_LEVEL > NAL_LOG_LEVEL_WARNING
+#undef nal_log_warning
+#define nal_log_warning(...) ((void)0)
+#endif
+#if NAL_LOG_MIN_LEVEL > NAL_LOG_LEVEL_ERROR
+#undef nal_log_error
+#define nal_log_error(...) ((void)0)
+#endif
+
 #endif /* NAL_LOG_H */
@@ -0,0 +1,728 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* basename() */
+#endif
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <time.h>
+#include "nal_log.h"
+
+/* Each logging thread owns a ring that only it writes to. A record is the
+ * format pointer and the arguments as read from the va_list, with strings
+ * copied, so logging costs a scan of the format string and a few stores
+ * instead of vsnprintf. The flusher thread formats pending records every
+ * NAL_LOG_RING_FLUSH_NS, merging the rings by timestamp, and writes them to
+ * stderr in the format of nal_log_stderr.c. When a ring is full, records
+ * are dropped and counted.
+ *
+ * Format strings, tags and the func and file of debug records are kept as
+ * pointers, so they must outlive the flush, as string literals do. */
+
+#define NAL_LOG_RING_SIZE (256 * 1024) /* per thread, a power of 2 */
+#define NAL_LOG_RING_MASK (NAL_LOG_RING_SIZE - 1)
+#define NAL_LOG_RING_MAX_ARGS 16
+#define NAL_LOG_RING_MAX_STR 512
+#define NAL_LOG_RING_LINE_SIZE 2048
+#define NAL_LOG_RING_FLUSH_NS (10 * 1000 * 1000)
+
+#define NAL_LOG_RING_PAD 0xffff
+
+#define NAL_LOG_RING_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+enum {
+    NAL_LOG_ARG_INT,
+    NAL_LOG_ARG_UINT,
+    NAL_LOG_ARG_DOUBLE,
+    NAL_LOG_ARG_LDOUBLE,
+    NAL_LOG_ARG_PTR,
+    NAL_LOG_ARG_STR,
+};
+
+enum {
+    NAL_LOG_LEN_NONE,
+    NAL_LOG_LEN_HH,
+    NAL_LOG_LEN_H,
+    NAL_LOG_LEN_L,
+    NAL_LOG_LEN_LL,
+    NAL_LOG_LEN_J,
+    NAL_LOG_LEN_Z,
+    NAL_LOG_LEN_T,
+    NAL_LOG_LEN_BIG_L,
+};
+
+typedef struct {
+    uint32_t size; /* of the record with its args, a multiple of 8 */
+    uint16_t level;
+    uint16_t nargs;
+    int32_t line;
+    uint32_t unused;
+    uint64_t ts;
+    const char *fmt;
+    const char *func;
+    const char *file;
+    const char *tag;
+} nal_log_rec_t;
+
+/* A string or long double argument is followed by len bytes of payload,
+ * padded to 8, after the last arg of the record. */
+typedef struct {
+    uint32_t kind;
+    uint32_t len;
+    union {
+        int64_t i;
+        uint64_t u;
+        double d;
+        const void *p;
+    } v;
+} nal_log_arg_t;
+
+/* A conversion specification of a format string. */
+typedef struct {
+    const char *start; /* the '%' */
+    const char *flags; /* flags, width and precision, as written */
+    size_t flags_len;
+    int len;
+    int nstar;
+    int precision; /* -1 if none, -2 if given as '*' */
+    char conv;
+} nal_log_spec_t;
+
+typedef struct nal_log_ring_s {
+    uint64_t head; /* written by the owner thread */
+    char pad1[56];
+    uint64_t tail; /* written by the flusher */
+    char pad2[56];
+    uint64_t dropped;
+    int owned;
+    uint64_t cursor; /* flusher only */
+    struct nal_log_ring_s *next;
+    unsigned char *buf;
+} nal_log_ring_t;
+
+static nal_log_ring_t *rings;
+static __thread nal_log_ring_t *thread_ring;
+static pthread_key_t ring_key;
+static pthread_once_t ring_once = PTHREAD_ONCE_INIT;
+static int flusher_started;
+static pthread_mutex_t flush_mutex = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t reported_dropped;
+
+static const char *level_names[] = {"DEBUG", "STATUS", "NOTE", "WARNING",
+                                    "ERROR"};
+
+static const char *nal_log_ring_parse(const char *p, nal_log_spec_t *s)
+{
+    s->start = p++;
+    s->flags = p;
+    s->nstar = 0;
+    s->precision = -1;
+    s->len = NAL_LOG_LEN_NONE;
+    while (*p != '\0' && strchr("-+ #0'", *p) != NULL) {
+        p++;
+    }
+    if (*p == '*') {
+        s->nstar++;
+        p++;
+    } else {
+        while (*p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            s->nstar++;
+            s->precision = -2;
+            p++;
+        } else {
+            s->precision = 0;
+            while (*p >= '0' && *p <= '9') {
+                s->precision = s->precision * 10 + (*p++ - '0');
+            }
+        }
+    }
+    s->flags_len = (size_t)(p - s->flags);
+    switch (*p) {
+    case 'h':
+        p++;
+        s->len = NAL_LOG_LEN_H;
+        if (*p == 'h') {
+            p++;
+            s->len = NAL_LOG_LEN_HH;
+        }
+        break;
+    case 'l':
+        p++;
+        s->len = NAL_LOG_LEN_L;
+        if (*p == 'l') {
+            p++;
+            s->len = NAL_LOG_LEN_LL;
+        }
+        break;
+    case 'q':
+        p++;
+        s->len = NAL_LOG_LEN_LL;
+        break;
+    case 'j':
+        p++;
+        s->len = NAL_LOG_LEN_J;
+        break;
+    case 'z':
+        p++;
+        s->len = NAL_LOG_LEN_Z;
+        break;
+    case 't':
+        p++;
+        s->len = NAL_LOG_LEN_T;
+        break;
+    case 'L':
+        p++;
+        s->len = NAL_LOG_LEN_BIG_L;
+        break;
+    }
+    s->conv = *p;
+    return *p != '\0' ? p + 1 : p;
+}
+
+static int64_t nal_log_ring_signed(int len, va_list *ap)
+{
+    switch (len) {
+    case NAL_LOG_LEN_HH:
+        return (signed char)va_arg(*ap, int);
+    case NAL_LOG_LEN_H:
+        return (short)va_arg(*ap, int);
+    case NAL_LOG_LEN_L:
+        return va_arg(*ap, long);
+    case NAL_LOG_LEN_LL:
+        return va_arg(*ap, long long);
+    case NAL_LOG_LEN_J:
+        return va_arg(*ap, intmax_t);
+    case NAL_LOG_LEN_Z:
+        return va_arg(*ap, ssize_t);
+    case NAL_LOG_LEN_T:
+        return va_arg(*ap, ptrdiff_t);
+    default:
+        return va_arg(*ap, int);
+    }
+}
+
+static uint64_t nal_log_ring_unsigned(int len, va_list *ap)
+{
+    switch (len) {
+    case NAL_LOG_LEN_HH:
+        return (unsigned char)va_arg(*ap, unsigned int);
+    case NAL_LOG_LEN_H:
+        return (unsigned short)va_arg(*ap, unsigned int);
+    case NAL_LOG_LEN_L:
+        return va_arg(*ap, unsigned long);
+    case NAL_LOG_LEN_LL:
+        return va_arg(*ap, unsigned long long);
+    case NAL_LOG_LEN_J:
+        return va_arg(*ap, uintmax_t);
+    case NAL_LOG_LEN_Z:
+        return va_arg(*ap, size_t);
+    case NAL_LOG_LEN_T:
+        return (uint64_t)va_arg(*ap, ptrdiff_t);
+    default:
+        return va_arg(*ap, unsigned int);
+    }
+}
+
+static void nal_log_ring_thread_exit(void *arg)
+{
+    nal_log_ring_t *r = arg;
+    thread_ring = NULL;
+    __atomic_store_n(&r->owned, 0, __ATOMIC_RELEASE);
+}
+
+static void nal_log_ring_atfork_child(void)
+{
+    /* Only the forking thread and none of the rings of the others survive,
+     * and neither does the flusher. */
+    pthread_mutex_init(&flush_mutex, NULL);
+    flusher_started = 0;
+    for (nal_log_ring_t *r = rings; r != NULL; r = r->next) {
+        if (r != thread_ring) {
+            r->owned = 0;
+        }
+    }
+}
+
+static void nal_log_ring_init_once(void)
+{
+    pthread_key_create(&ring_key, nal_log_ring_thread_exit);
+    pthread_atfork(NULL, NULL, nal_log_ring_atfork_child);
+    atexit(nal_log_ring_flush);
+}
+
+static void *nal_log_ring_flusher(void *arg)
+{
+    struct timespec ts = {0, NAL_LOG_RING_FLUSH_NS};
+    (void)arg;
+    for (;;) {
+        nanosleep(&ts, NULL);
+        nal_log_ring_flush();
+    }
+    return NULL;
+}
+
+static void nal_log_ring_start_flusher(void)
+{
+    int expected = 0;
+    if (__atomic_load_n(&flusher_started, __ATOMIC_ACQUIRE) ||
+        !__atomic_compare_exchange_n(&flusher_started, &expected, 1, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if (pthread_create(&thread, &attr, nal_log_ring_flusher, NULL) != 0) {
+        fprintf(stderr, "nal_log_ring cannot start the flusher thread\n");
+        __atomic_store_n(&flusher_started, 0, __ATOMIC_RELEASE);
+    }
+    pthread_attr_destroy(&attr);
+}
+
+/* Returns the ring of the calling thread, reusing one left behind by an
+ * exited thread if there is one. */
+static nal_log_ring_t *nal_log_ring_get(void)
+{
+    nal_log_ring_t *r = thread_ring;
+    if (r != NULL) {
+        nal_log_ring_start_flusher();
+        return r;
+    }
+    pthread_once(&ring_once, nal_log_ring_init_once);
+    for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r != NULL;
+         r = r->next) {
+        int expected = 0;
+        if (__atomic_compare_exchange_n(&r->owned, &expected, 1, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            break;
+        }
+    }
+    if (r == NULL) {
+        r = calloc(1, sizeof(*r));
+        if (r == NULL) {
+            return NULL;
+        }
+        r->buf = malloc(NAL_LOG_RING_SIZE);
+        if (r->buf == NULL) {
+            free(r);
+            return NULL;
+        }
+        r->owned = 1;
+        r->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&rings, &r->next, r, 0,
+                                            __ATOMIC_RELEASE,
+                                            __ATOMIC_RELAXED)) {
+        }
+    }
+    thread_ring = r;
+    pthread_setspecific(ring_key, r);
+    nal_log_ring_start_flusher();
+    return r;
+}
+
+static void nal_log_ring_write(int level, const char *func, const char *file,
+                               int line, const char *tag, const char *fmt,
+                               va_list *ap)
+{
+    int saved_errno = errno;
+    nal_log_arg_t args[NAL_LOG_RING_MAX_ARGS];
+    const void *payload[NAL_LOG_RING_MAX_ARGS];
+    long double ldoubles[NAL_LOG_RING_MAX_ARGS];
+    nal_log_spec_t spec;
+    int nargs = 0;
+    size_t size = sizeof(nal_log_rec_t);
+
+    nal_log_ring_t *r = nal_log_ring_get();
+    if (r == NULL) {
+        errno = saved_errno;
+        return;
+    }
+
+    /* Read the args as the conversions of fmt say, stopping at the first
+     * unknown one, whose args cannot be told apart. */
+    const char *p = fmt;
+    while ((p = strchr(p, '%')) != NULL) {
+        if (p[1] == '%') {
+            p += 2;
+            continue;
+        }
+        p = nal_log_ring_parse(p, &spec);
+        if (nargs + spec.nstar + 1 > NAL_LOG_RING_MAX_ARGS) {
+            break;
+        }
+        int precision = spec.precision;
+        for (int i = 0; i < spec.nstar; i++) {
+            nal_log_arg_t *a = &args[nargs++];
+            a->kind = NAL_LOG_ARG_INT;
+            a->len = 0;
+            a->v.i = va_arg(*ap, int);
+            if (precision == -2 && i == spec.nstar - 1) {
+                precision = (int)a->v.i;
+            }
+        }
+        nal_log_arg_t *a = &args[nargs];
+        a->len = 0;
+        payload[nargs] = NULL;
+        switch (spec.conv) {
+        case 'd':
+        case 'i':
+            a->kind = NAL_LOG_ARG_INT;
+            a->v.i = nal_log_ring_signed(spec.len, ap);
+            break;
+        case 'u':
+        case 'o':
+        case 'x':
+        case 'X':
+            a->kind = NAL_LOG_ARG_UINT;
+            a->v.u = nal_log_ring_unsigned(spec.len, ap);
+            break;
+        case 'c':
+            a->kind = NAL_LOG_ARG_INT;
+            a->v.i = va_arg(*ap, int);
+            break;
+        case 'e':
+        case 'E':
+        case 'f':
+        case 'F':
+        case 'g':
+        case 'G':
+        case 'a':
+        case 'A':
+            if (spec.len == NAL_LOG_LEN_BIG_L) {
+                a->kind = NAL_LOG_ARG_LDOUBLE;
+                a->len = sizeof(long double);
+                ldoubles[nargs] = va_arg(*ap, long double);
+                payload[nargs] = &ldoubles[nargs];
+            } else {
+                a->kind = NAL_LOG_ARG_DOUBLE;
+                a->v.d = va_arg(*ap, double);
+            }
+            break;
+        case 'p':
+            a->kind = NAL_LOG_ARG_PTR;
+            a->v.p = va_arg(*ap, void *);
+            break;
+        case 'n':
+            (void)va_arg(*ap, void *);
+            continue;
+        case 's':
+        case 'm': {
+            const char *s;
+            if (spec.conv == 'm') {
+                s = strerror(saved_errno);
+            } else if (spec.len == NAL_LOG_LEN_L) {
+                (void)va_arg(*ap, void *);
+                s = "(wide string)";
+            } else {
+                s = va_arg(*ap, const char *);
+                if (s == NULL) {
+                    s = "(null)";
+                }
+            }
+            size_t max = NAL_LOG_RING_MAX_STR;
+            if (precision >= 0 && (size_t)precision < max) {
+                max = (size_t)precision;
+            }
+            a->kind = NAL_LOG_ARG_STR;
+            a->len = (uint32_t)strnlen(s, max);
+            payload[nargs] = s;
+            break;
+        }
+        default:
+            goto captured;
+        }
+        if (a->kind == NAL_LOG_ARG_STR || a->kind == NAL_LOG_ARG_LDOUBLE) {
+            size += NAL_LOG_RING_ALIGN(a->len + 1);
+        }
+        nargs++;
+    }
+captured:
+    size += (size_t)nargs * sizeof(nal_log_arg_t);
+
+    uint64_t head = r->head;
+    uint64_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    size_t off = head & NAL_LOG_RING_MASK;
+    size_t pad = off + size > NAL_LOG_RING_SIZE ? NAL_LOG_RING_SIZE - off : 0;
+    if (head + pad + size - tail > NAL_LOG_RING_SIZE) {
+        __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+        errno = saved_errno;
+        return;
+    }
+    if (pad > 0) {
+        nal_log_rec_t *rec = (nal_log_rec_t *)(r->buf + off);
+        rec->size = (uint32_t)pad;
+        rec->level = NAL_LOG_RING_PAD;
+        off = 0;
+    }
+
+    nal_log_rec_t *rec = (nal_log_rec_t *)(r->buf + off);
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    rec->size = (uint32_t)size;
+    rec->level = (uint16_t)level;
+    rec->nargs = (uint16_t)nargs;
+    rec->line = line;
+    rec->ts = (uint64_t)now.tv_sec * 1000000000 + (uint64_t)now.tv_nsec;
+    rec->fmt = fmt;
+    rec->func = func;
+    rec->file = file;
+    rec->tag = tag;
+    memcpy(rec + 1, args, (size_t)nargs * sizeof(nal_log_arg_t));
+    unsigned char *out = (unsigned char *)(rec + 1) +
+                         (size_t)nargs * sizeof(nal_log_arg_t);
+    for (int i = 0; i < nargs; i++) {
+        if (args[i].kind == NAL_LOG_ARG_STR) {
+            memcpy(out, payload[i], args[i].len);
+            out[args[i].len] = '\0';
+            out += NAL_LOG_RING_ALIGN(args[i].len + 1);
+        } else if (args[i].kind == NAL_LOG_ARG_LDOUBLE) {
+            memcpy(out, payload[i], args[i].len);
+            out += NAL_LOG_RING_ALIGN(args[i].len + 1);
+        }
+    }
+    __atomic_store_n(&r->head, head + pad + size, __ATOMIC_RELEASE);
+    errno = saved_errno;
+}
+
+void nal_log_ring(int level, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    nal_log_ring_write(level, NULL, NULL, 0, NULL, fmt, &ap);
+    va_end(ap);
+}
+
+void nal_log_ring_debug(const char *func, const char *file, int line,
+                        const char *tag, const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    nal_log_ring_write(NAL_LOG_RING_DEBUG, func, file, line, tag, fmt, &ap);
+    va_end(ap);
+}
+
+#define NAL_LOG_RING_SNPRINTF(o, room, spec, nstar, star, v)                   \
+    ((nstar) == 0   ? snprintf(o, room, spec, v)                               \
+     : (nstar) == 1 ? snprintf(o, room, spec, star[0], v)                      \
+                    : snprintf(o, room, spec, star[0], star[1], v))
+
+/* Formats the message of rec into out, replaying each conversion of the
+ * format with its stored arg. Conversions past the stored args are copied
+ * as written. */
+static size_t nal_log_ring_format(const nal_log_rec_t *rec, char *out,
+                                  size_t size)
+{
+    const nal_log_arg_t *args = (const nal_log_arg_t *)(rec + 1);
+    const unsigned char *payload = (const unsigned char *)(args + rec->nargs);
+    nal_log_spec_t spec;
+    char fmt[64];
+    int star[2];
+    size_t n = 0;
+    int ai = 0;
+
+    const char *p = rec->fmt;
+    while (*p != '\0' && n + 1 < size) {
+        if (*p != '%') {
+            out[n++] = *p++;
+            continue;
+        }
+        if (p[1] == '%') {
+            out[n++] = '%';
+            p += 2;
+            continue;
+        }
+        p = nal_log_ring_parse(p, &spec);
+        if (spec.conv == 'n') {
+            continue;
+        }
+        if (ai + spec.nstar >= rec->nargs ||
+            spec.flags_len + 4 > sizeof(fmt)) {
+            size_t len = (size_t)(p - spec.start);
+            if (len > size - 1 - n) {
+                len = size - 1 - n;
+            }
+            memcpy(out + n, spec.start, len);
+            n += len;
+            continue;
+        }
+        for (int i = 0; i < spec.nstar; i++) {
+            star[i] = (int)args[ai++].v.i;
+        }
+        const nal_log_arg_t *a = &args[ai++];
+        size_t f = 0;
+        fmt[f++] = '%';
+        memcpy(fmt + f, spec.flags, spec.flags_len);
+        f += spec.flags_len;
+        char *o = out + n;
+        size_t room = size - n;
+        int w = 0;
+        switch (a->kind) {
+        case NAL_LOG_ARG_INT:
+        case NAL_LOG_ARG_UINT:
+            if (spec.conv == 'c') {
+                fmt[f++] = 'c';
+                fmt[f] = '\0';
+                w = NAL_LOG_RING_SNPRINTF(o, room, fmt, spec.nstar, star,
+                                          (int)a->v.i);
+                break;
+            }
+            fmt[f++] = 'l';
+            fmt[f++] = 'l';
+            fmt[f++] = spec.conv;
+            fmt[f] = '\0';
+            if (a->kind == NAL_LOG_ARG_INT) {
+                w = NAL_LOG_RING_SNPRINTF(o, room, fmt, spec.nstar, star,
+                                          (long long)a->v.i);
+            } else {
+                w = NAL_LOG_RING_SNPRINTF(o, room, fmt, spec.nstar, star,
+                                          (unsigned long long)a->v.u);
+            }
+            break;
+        case NAL_LOG_ARG_DOUBLE:
+            fmt[f++] = spec.conv;
+            fmt[f] = '\0';
+            w = NAL_LOG_RING_SNPRINTF(o, room, fmt, spec.nstar, star, a->v.d);
+            break;
+        case NAL_LOG_ARG_LDOUBLE: {
+            long double ld;
+            memcpy(&ld, payload, sizeof(ld));
+            payload += NAL_LOG_RING_ALIGN(a->len + 1);
+            fmt[f++] = 'L';
+            fmt[f++] = spec.conv;
+            fmt[f] = '\0';
+            w = NAL_LOG_RING_SNPRINTF(o, room, fmt, spec.nstar, star, ld);
+            break;
+        }
+        case NAL_LOG_ARG_PTR:
+            fmt[f++] = 'p';
+            fmt[f] = '\0';
+            w = NAL_LOG_RING_SNPRINTF(o, room, fmt, spec.nstar, star, a->v.p);
+            break;
+        case NAL_LOG_ARG_STR:
+            fmt[f++] = 's';
+            fmt[f] = '\0';
+            w = NAL_LOG_RING_SNPRINTF(o, room, fmt, spec.nstar, star,
+                                      (const char *)payload);
+            payload += NAL_LOG_RING_ALIGN(a->len + 1);
+            break;
+        }
+        if (w > 0) {
+            n += (size_t)w < room ? (size_t)w : room - 1;
+        }
+    }
+    out[n] = '\0';
+    return n;
+}
+
+static void nal_log_ring_output(const nal_log_rec_t *rec)
+{
+    char msg[NAL_LOG_RING_LINE_SIZE];
+    nal_log_ring_format(rec, msg, sizeof(msg));
+    if (rec->level == NAL_LOG_RING_DEBUG) {
+        fprintf(stderr, "[DEBUG] <%s:%d (%s)> (%s) %s\n", basename(rec->file),
+                rec->line, rec->func, rec->tag, msg);
+    } else {
+        fprintf(stderr, "[%s] %s\n", level_names[rec->level], msg);
+    }
+}
+
+/* Returns the next record of r before head, skipping padding. */
+static const nal_log_rec_t *nal_log_ring_peek(nal_log_ring_t *r, uint64_t head)
+{
+    while (r->cursor < head) {
+        const nal_log_rec_t *rec =
+            (const nal_log_rec_t *)(r->buf + (r->cursor & NAL_LOG_RING_MASK));
+        if (rec->level != NAL_LOG_RING_PAD) {
+            return rec;
+        }
+        r->cursor += rec->size;
+    }
+    return NULL;
+}
+
+void nal_log_ring_flush(void)
+{
+    pthread_mutex_lock(&flush_mutex);
+
+    /* Heads are read once, so records written meanwhile wait for the next
+     * flush and one busy thread cannot keep the flusher here. */
+    size_t count = 0;
+    nal_log_ring_t *list = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    for (nal_log_ring_t *r = list; r != NULL; r = r->next) {
+        count++;
+    }
+    uint64_t heads_small[16];
+    uint64_t *heads = heads_small;
+    if (count > 16) {
+        heads = malloc(count * sizeof(*heads));
+        if (heads == NULL) {
+            pthread_mutex_unlock(&flush_mutex);
+            return;
+        }
+    }
+    size_t i = 0;
+    uint64_t dropped = 0;
+    for (nal_log_ring_t *r = list; r != NULL && i < count; r = r->next) {
+        heads[i++] = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        r->cursor = r->tail;
+        dropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    }
+
+    for (;;) {
+        nal_log_ring_t *min_ring = NULL;
+        const nal_log_rec_t *min_rec = NULL;
+        i = 0;
+        for (nal_log_ring_t *r = list; r != NULL && i < count;
+             r = r->next, i++) {
+            const nal_log_rec_t *rec = nal_log_ring_peek(r, heads[i]);
+            if (rec != NULL && (min_rec == NULL || rec->ts < min_rec->ts)) {
+                min_ring = r;
+                min_rec = rec;
+            }
+        }
+        if (min_rec == NULL) {
+            break;
+        }
+        nal_log_ring_output(min_rec);
+        min_ring->cursor += min_rec->size;
+        __atomic_store_n(&min_ring->tail, min_ring->cursor, __ATOMIC_RELEASE);
+    }
+    i = 0;
+    for (nal_log_ring_t *r = list; r != NULL && i < count; r = r->next, i++) {
+        __atomic_store_n(&r->tail, r->cursor, __ATOMIC_RELEASE);
+    }
+
+    if (dropped > reported_dropped) {
+        fprintf(stderr, "[WARNING] nal_log_ring dropped %llu records\n",
+                (unsigned long long)(dropped - reported_dropped));
+        reported_dropped = dropped;
+    }
+    fflush(stderr);
+    if (heads != heads_small) {
+        free(heads);
+    }
+    pthread_mutex_unlock(&flush_mutex);
+}
+
+unsigned long long nal_log_ring_dropped(void)
+{
+    unsigned long long dropped = 0;
+    for (nal_log_ring_t *r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+         r != NULL; r = r->next) {
+        dropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    }
+    return dropped;
+}
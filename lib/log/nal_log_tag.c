@@ -0,0 +1,160 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "nal_log.h"
+
+/* Registry of debug tags. Tag i < NAL_LOG_TAG_SHARED gets bit i of
+ * nal_log_tag_mask, later ones share bit NAL_LOG_TAG_SHARED, which is set
+ * while any of them is on. Whether a tag is on comes from the backend:
+ *
+ * - ATS: TSIsDebugTagSet, i.e. proxy.config.diags.debug.tags
+ * - nginx: the debug level of the cycle log, for all tags
+ * - stderr and ring: the comma separated tags in the NAL_LOG_DEBUG
+ *   environment variable, "*" for all; all tags are off when it is unset
+ *
+ * A tag is read when it is first logged and again on nal_log_tags_refresh,
+ * which e.g. an ATS plugin calls after a config reload. The nginx build
+ * calls it itself from the first debug call site reached under a new cycle,
+ * since a reload may change the debug level. */
+
+#define NAL_LOG_TAG_SHARED 62
+
+uint64_t nal_log_tag_mask = NAL_LOG_TAG_UNRESOLVED;
+#if NAL_LOG_NGX
+volatile void *nal_log_tag_cycle;
+#endif
+
+static pthread_mutex_t tags_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char **tags;
+static size_t tags_len;
+static size_t tags_cap;
+
+static int nal_log_tag_backend_on(const char *tag)
+{
+#if NAL_LOG_ATS
+    return TSIsDebugTagSet(tag);
+#elif NAL_LOG_NGX
+    (void)tag;
+    return ngx_cycle != NULL && ngx_cycle->log != NULL &&
+           (ngx_cycle->log->log_level & NGX_LOG_DEBUG) != 0;
+#elif NAL_LOG_NOP
+    (void)tag;
+    return 0;
+#else
+    const char *list = getenv("NAL_LOG_DEBUG");
+    if (list == NULL) {
+        return 0;
+    }
+    if (strcmp(list, "*") == 0) {
+        return 1;
+    }
+    size_t len = strlen(tag);
+    for (const char *p = list; *p != '\0';) {
+        const char *end = strchr(p, ',');
+        size_t n = end != NULL ? (size_t)(end - p) : strlen(p);
+        if (n == len && memcmp(p, tag, len) == 0) {
+            return 1;
+        }
+        p += n;
+        if (*p == ',') {
+            p++;
+        }
+    }
+    return 0;
+#endif
+}
+
+static uint64_t nal_log_tag_bit(size_t i)
+{
+    return 1ULL << (i < NAL_LOG_TAG_SHARED ? i : NAL_LOG_TAG_SHARED);
+}
+
+/* Returns the index of tag, registering it if needed and setting *added,
+ * or -1 on ENOMEM. Called with tags_mutex held. */
+static long nal_log_tag_index(const char *tag, int *added)
+{
+    *added = 0;
+    for (size_t i = 0; i < tags_len; i++) {
+        if (strcmp(tags[i], tag) == 0) {
+            return (long)i;
+        }
+    }
+    if (tags_len == tags_cap) {
+        size_t cap = tags_cap != 0 ? tags_cap * 2 : 16;
+        char **t = realloc(tags, cap * sizeof(*t));
+        if (t == NULL) {
+            return -1;
+        }
+        tags = t;
+        tags_cap = cap;
+    }
+    char *copy = strdup(tag);
+    if (copy == NULL) {
+        return -1;
+    }
+    tags[tags_len] = copy;
+    *added = 1;
+    return (long)tags_len++;
+}
+
+static void nal_log_tag_update(uint64_t bit, int on)
+{
+    if (on) {
+        __atomic_fetch_or(&nal_log_tag_mask, bit, __ATOMIC_RELAXED);
+    } else {
+        __atomic_fetch_and(&nal_log_tag_mask, ~bit, __ATOMIC_RELAXED);
+    }
+}
+
+int nal_log_tag_resolve(uint64_t *bit, const char *tag)
+{
+    int added;
+    pthread_mutex_lock(&tags_mutex);
+    long i = nal_log_tag_index(tag, &added);
+    if (i < 0) {
+        /* Leave the call site unresolved and ask again next time. */
+        pthread_mutex_unlock(&tags_mutex);
+        return nal_log_tag_backend_on(tag);
+    }
+    /* A known tag keeps its state, which nal_log_tag_set may have set. */
+    uint64_t b = nal_log_tag_bit((size_t)i);
+    int on;
+    if (added) {
+        on = nal_log_tag_backend_on(tag);
+        if (on || (size_t)i < NAL_LOG_TAG_SHARED) {
+            nal_log_tag_update(b, on);
+        }
+    } else {
+        on = (__atomic_load_n(&nal_log_tag_mask, __ATOMIC_RELAXED) & b) != 0;
+    }
+    pthread_mutex_unlock(&tags_mutex);
+    __atomic_store_n(bit, b, __ATOMIC_RELAXED);
+    return on;
+}
+
+void nal_log_tag_set(const char *tag, int on)
+{
+    int added;
+    pthread_mutex_lock(&tags_mutex);
+    long i = nal_log_tag_index(tag, &added);
+    if (i >= 0) {
+        nal_log_tag_update(nal_log_tag_bit((size_t)i), on);
+    }
+    pthread_mutex_unlock(&tags_mutex);
+}
+
+void nal_log_tags_refresh(void)
+{
+    pthread_mutex_lock(&tags_mutex);
+#if NAL_LOG_NGX
+    nal_log_tag_cycle = (void *)ngx_cycle;
+#endif
+    uint64_t mask = NAL_LOG_TAG_UNRESOLVED;
+    for (size_t i = 0; i < tags_len; i++) {
+        if (nal_log_tag_backend_on(tags[i])) {
+            mask |= nal_log_tag_bit(i);
+        }
+    }
+    __atomic_store_n(&nal_log_tag_mask, mask, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&tags_mutex);
+}
@@ -0,0 +1,177 @@
+-- Runs write batches and long scans on the async threads of nal_ats_async.c,
+-- so commits and their fsync never stall an event thread of Traffic Server.
+-- Write jobs submitted around the same time share one commit.
+--
+-- A ts_lua coroutine cannot be resumed from the C continuation that completes
+-- a job, so the calling coroutine polls the job, yielding through ts.sleep
+-- between polls. ts.sleep takes whole seconds, so a call waits at least a
+-- second: use this for bulk writes and long scans, not on a request's hot
+-- path.
+--
+-- After env_init and open_databases of nal_lmdb_ats:
+--
+--   local async = require "nal_lmdb_ats_async"
+--   async.start(2, 1024)
+--   local err = async.write({ { "set", "db1", "k", "v" } }, "my_tag")
+
+local ffi = require "ffi"
+local lmdb = require "nal_lmdb_ats"
+
+local S = ffi.load("nal_lmdb_ats")
+
+ffi.cdef[[
+    typedef struct nal_ats_job_s nal_ats_job_t;
+    typedef void (*nal_ats_async_cb)(nal_ats_job_t *job, void *arg);
+
+    int nal_ats_async_start(unsigned int scan_threads, size_t max_queued);
+    nal_ats_job_t *nal_ats_job_new(int kind, const char *tag);
+    void nal_ats_job_free(nal_ats_job_t *job);
+    int nal_ats_job_put(nal_ats_job_t *job, MDB_dbi dbi, const MDB_val *key,
+                        const MDB_val *data);
+    int nal_ats_job_del(nal_ats_job_t *job, MDB_dbi dbi, const MDB_val *key);
+    int nal_ats_job_set_scan(nal_ats_job_t *job, MDB_dbi dbi,
+                             const MDB_val *start, const MDB_val *end,
+                             size_t limit);
+    int nal_ats_async_submit(nal_ats_job_t *job, nal_ats_async_cb cb,
+                             void *arg);
+    int nal_ats_job_done(nal_ats_job_t *job);
+    int nal_ats_job_rc(nal_ats_job_t *job);
+    size_t nal_ats_job_count(nal_ats_job_t *job);
+    int nal_ats_job_entry(nal_ats_job_t *job, size_t i, MDB_val *key,
+                          MDB_val *data);
+    int nal_ats_job_next_key(nal_ats_job_t *job, MDB_val *key);
+]]
+
+local NAL_ATS_JOB_WRITE = 1
+local NAL_ATS_JOB_SCAN = 2
+local MDB_NOTFOUND = -30798
+local ENOMEM = 12
+
+local DEFAULT_SCAN_LIMIT = 1000
+local POLL_DELAY = 1 -- seconds, the smallest delay ts.sleep takes
+
+local _M = {}
+
+local function strerror(rc)
+    return ffi.string(S.nal_strerror(rc))
+end
+
+local function set_val(val, s)
+    val.mv_size = #s
+    val.mv_data = s
+end
+
+-- start starts the writer thread and scan_threads scan threads. Jobs beyond
+-- max_queued pending ones of a kind fail instead of queueing.
+function _M.start(scan_threads, max_queued)
+    local rc = S.nal_ats_async_start(scan_threads or 1, max_queued or 1024)
+    if rc ~= 0 then
+        return strerror(rc)
+    end
+    return nil
+end
+
+local function new_job(kind, tag)
+    local job = S.nal_ats_job_new(kind, tag)
+    if job == nil then
+        return nil
+    end
+    return ffi.gc(job, S.nal_ats_job_free)
+end
+
+-- run submits job and polls it until it is done. Freeing a job still owned
+-- by the async threads is safe, so the coroutine may be killed while waiting.
+local function run(job)
+    local rc = S.nal_ats_async_submit(job, nil, nil)
+    if rc ~= 0 then
+        return rc
+    end
+    while S.nal_ats_job_done(job) == 0 do
+        ts.sleep(POLL_DELAY)
+    end
+    return S.nal_ats_job_rc(job)
+end
+
+-- write applies ops in a write txn on the writer thread and returns an error
+-- string or nil. Each op is {"set", db, key, value} or {"del", db, key}. tag
+-- shows up in txn_stats.
+function _M.write(ops, tag)
+    local job = new_job(NAL_ATS_JOB_WRITE, tag)
+    if job == nil then
+        return strerror(ENOMEM)
+    end
+    local key = ffi.new("MDB_val[1]")
+    local data = ffi.new("MDB_val[1]")
+    for _, op in ipairs(ops) do
+        local kind, dbi = op[1], lmdb.dbi_handle(op[2])
+        if dbi == nil then
+            return "unknown database " .. tostring(op[2])
+        end
+        set_val(key[0], op[3])
+        local rc
+        if kind == "set" then
+            set_val(data[0], op[4])
+            rc = S.nal_ats_job_put(job, dbi, key, data)
+        elseif kind == "del" then
+            rc = S.nal_ats_job_del(job, dbi, key)
+        else
+            return "unknown op " .. tostring(kind)
+        end
+        if rc ~= 0 then
+            return strerror(rc)
+        end
+    end
+    local rc = run(job)
+    if rc ~= 0 then
+        return strerror(rc)
+    end
+    return nil
+end
+
+-- scan returns up to limit entries of db from start_key (or the first key)
+-- below end_key (or to the end) as an array of {key, value} and the key to
+-- resume from, or nil once the range is exhausted.
+function _M.scan(db, start_key, end_key, limit)
+    local dbi = lmdb.dbi_handle(db)
+    if dbi == nil then
+        return nil, nil, "unknown database " .. tostring(db)
+    end
+    local job = new_job(NAL_ATS_JOB_SCAN, nil)
+    if job == nil then
+        return nil, nil, strerror(ENOMEM)
+    end
+    local key = ffi.new("MDB_val[1]")
+    local data = ffi.new("MDB_val[1]")
+    local start, stop
+    if start_key ~= nil then
+        set_val(key[0], start_key)
+        start = key
+    end
+    if end_key ~= nil then
+        set_val(data[0], end_key)
+        stop = data
+    end
+    local rc = S.nal_ats_job_set_scan(job, dbi, start, stop,
+                                      limit or DEFAULT_SCAN_LIMIT)
+    if rc == 0 then
+        rc = run(job)
+    end
+    if rc ~= 0 then
+        return nil, nil, strerror(rc)
+    end
+    local entries = {}
+    for i = 0, tonumber(S.nal_ats_job_count(job)) - 1 do
+        S.nal_ats_job_entry(job, i, key, data)
+        entries[i + 1] = {
+            ffi.string(key[0].mv_data, key[0].mv_size),
+            ffi.string(data[0].mv_data, data[0].mv_size),
+        }
+    end
+    local next_key
+    if S.nal_ats_job_next_key(job, key) ~= MDB_NOTFOUND then
+        next_key = ffi.string(key[0].mv_data, key[0].mv_size)
+    end
+    return entries, next_key
+end
+
+return _M
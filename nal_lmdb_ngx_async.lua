@@ -0,0 +1,169 @@
+-- Runs write batches and long scans on an nginx thread pool through
+-- ngx.run_worker_thread, so commits and their fsync never stall the event
+-- loop of the worker. The calling coroutine yields until the job is done.
+--
+-- nginx.conf:
+--
+--   thread_pool nal_lmdb threads=4;
+--
+-- init_worker_by_lua_block:
+--
+--   local async = require "nal_lmdb_ngx_async"
+--   async.configure({
+--       pool = "nal_lmdb",
+--       env_path = "/var/lib/nal", max_databases = 10, max_readers = 126,
+--       map_size = 1024 * 1024 * 1024, file_mode = tonumber("0644", 8),
+--       databases = { "db1", "db2" },
+--   })
+--
+-- Jobs run in the Lua VMs of the pool threads, which load this module and
+-- nal_lmdb_ngx on their own. Both VMs live in the same process and share the
+-- env and dbi settings made by the worker, so the pool side only needs dbi
+-- handles. A job begins and ends its txns on the pool thread, as LMDB
+-- requires for write txns. With use_tls = 1 every pool thread takes its own
+-- reader slot, so max_readers must cover workers times (threads + 1).
+
+local _M = {}
+
+local DEFAULT_POOL = "default"
+local MODULE_NAME = "nal_lmdb_ngx_async"
+local DEFAULT_SCAN_LIMIT = 1000
+
+local config
+
+-- configure must be called in every worker before submitting jobs. cfg takes
+-- the arguments of env_init by name, plus pool, the thread_pool to run on,
+-- and databases, the names passed to open_databases.
+function _M.configure(cfg)
+    config = {
+        env_path = cfg.env_path,
+        max_databases = cfg.max_databases,
+        max_readers = cfg.max_readers,
+        map_size = cfg.map_size,
+        file_mode = cfg.file_mode,
+        use_tls = cfg.use_tls or 0,
+        databases = {},
+    }
+    for i, db in ipairs(cfg.databases) do
+        config.databases[i] = type(db) == "table" and db.name or db
+    end
+    _M.pool = cfg.pool or DEFAULT_POOL
+end
+
+local function submit(func_name, ...)
+    if config == nil then
+        return nil, "nal_lmdb_ngx_async: configure has not been called"
+    end
+    local ok, res, err = ngx.run_worker_thread(_M.pool, MODULE_NAME,
+                                               func_name, config, ...)
+    if not ok then
+        return nil, res
+    end
+    return res, err
+end
+
+-- write applies ops in one write txn on the pool and returns an error string
+-- or nil. Each op is {"set", db, key, value}, {"del", db, key} or
+-- {"incr", db, key, delta}. tag shows up in txn_stats.
+function _M.write(ops, tag)
+    local _, err = submit("job_write", ops, tag)
+    return err
+end
+
+-- scan returns up to limit entries of db from start_key (or the first key)
+-- below end_key (or to the end) as an array of {key, value} and the key to
+-- resume from, or nil once the range is exhausted.
+function _M.scan(db, start_key, end_key, limit)
+    local res, err = submit("job_scan", db, start_key, end_key,
+                            limit or DEFAULT_SCAN_LIMIT)
+    if res == nil then
+        return nil, nil, err
+    end
+    return res.entries, res.next_key
+end
+
+-- Pool side. The env is set up once per pool thread VM.
+
+local lmdb
+
+local function job_setup(cfg)
+    if lmdb ~= nil then
+        return nil
+    end
+    local l = require "nal_lmdb_ngx"
+    local err = l.env_init(cfg.env_path, cfg.max_databases, cfg.max_readers,
+                           cfg.map_size, cfg.file_mode, cfg.use_tls)
+    if err ~= nil then
+        return err
+    end
+    err = l.open_databases(cfg.databases, true)
+    if err ~= nil then
+        return err
+    end
+    lmdb = l
+    return nil
+end
+
+function _M.job_write(cfg, ops, tag)
+    local err = job_setup(cfg)
+    if err ~= nil then
+        return nil, err
+    end
+    err = lmdb.update(function(txn)
+        for _, op in ipairs(ops) do
+            local kind, db, key = op[1], op[2], op[3]
+            local err2
+            if kind == "set" then
+                err2 = txn:set(key, op[4], db)
+            elseif kind == "del" then
+                err2 = txn:del(key, db)
+            elseif kind == "incr" then
+                local _
+                _, err2 = txn:incr(key, op[4], db)
+            else
+                err2 = "unknown op " .. tostring(kind)
+            end
+            if err2 ~= nil then
+                return err2
+            end
+        end
+        return nil
+    end, tag)
+    return err == nil, err
+end
+
+function _M.job_scan(cfg, db, start_key, end_key, limit)
+    local err = job_setup(cfg)
+    if err ~= nil then
+        return nil, err
+    end
+    local entries, next_key = {}, nil
+    err = lmdb.view(function(txn)
+        return txn:with_cursor(db, function(cursor)
+            local key, val, err2
+            if start_key ~= nil then
+                key, val, err2 = cursor:get(start_key, lmdb.SET_RANGE)
+            else
+                key, val, err2 = cursor:get("", lmdb.FIRST)
+            end
+            while key ~= nil do
+                if end_key ~= nil and key >= end_key then
+                    return nil
+                end
+                if #entries == limit then
+                    next_key = key
+                    return nil
+                end
+                entries[#entries + 1] = { key, val }
+                key, val, err2 = cursor:get("", lmdb.NEXT)
+            end
+            return err2
+        end)
+    end)
+    if err ~= nil then
+        return nil, err
+    end
+    return { entries = entries, next_key = next_key }
+end
+
+return _M
@@ -0,0 +1,24 @@
+-- Same API as nal_lmdb_stderr, logging through the per-thread rings of
+-- nal_log_ring.c, which keeps debug logging cheap enough for hot paths.
+local ffi = require "ffi"
+local setup = require "nal_lmdb_setup"
+
+local lmdb = setup("nal_lmdb_ring")
+local S = ffi.load("nal_lmdb_ring")
+
+ffi.cdef[[
+    void nal_log_ring_flush(void);
+    unsigned long long nal_log_ring_dropped(void);
+]]
+
+-- log_flush formats all pending log records now.
+function lmdb.log_flush()
+    S.nal_log_ring_flush()
+end
+
+-- log_dropped returns the number of records dropped on full rings.
+function lmdb.log_dropped()
+    return tonumber(S.nal_log_ring_dropped())
+end
+
+return lmdb
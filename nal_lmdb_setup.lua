@@ -1,5 +1,6 @@
 local function setup(shlib_name)
     local ffi = require "ffi"
+    local bit = require "bit"
     local S = ffi.load(shlib_name)
 
     ffi.cdef[[
@@ -51,16 +52,47 @@ local function setup(shlib_name)
 
         int nal_txn_begin(nal_txn_ptr parent, nal_txn_ptr *txn);
         int nal_readonly_txn_begin(nal_txn_ptr parent, nal_txn_ptr *txn);
+        int nal_txn_try_begin(nal_txn_ptr parent, nal_txn_ptr *txn);
         int nal_txn_commit(nal_txn_ptr txn);
         void nal_txn_abort(nal_txn_ptr txn);
         int nal_txn_renew(nal_txn_ptr txn);
         void nal_txn_reset(nal_txn_ptr txn);
         int nal_dbi_open(nal_txn_ptr txn, const char *name, MDB_dbi *dbi);
         int nal_readonly_dbi_open(nal_txn_ptr txn, const char *name, MDB_dbi *dbi);
+        int nal_dbi_set_flags(MDB_dbi dbi, unsigned int flags);
         int nal_put(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key, MDB_val *data);
         int nal_del(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key);
         int nal_get(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key, MDB_val *data);
 
+        int nal_get_version(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key,
+                            MDB_val *data, uint64_t *version);
+        int nal_put_if_absent(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key,
+                              MDB_val *data, uint64_t *version);
+        int nal_put_if_version(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key,
+                               MDB_val *data, uint64_t expected, uint64_t *version);
+        int nal_del_if_version(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key,
+                               uint64_t expected, uint64_t *version);
+
+        uint64_t nal_generation(MDB_dbi dbi);
+        const volatile uint64_t *nal_generation_ptr(MDB_dbi dbi);
+        int nal_generation_wait(MDB_dbi dbi, uint64_t last_seen, int timeout_ms,
+                                uint64_t *current);
+
+        int nal_merge(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key, int op,
+                      MDB_val *operand, size_t limit, MDB_val *result);
+
+        typedef struct nal_view_s {
+            const char *data;
+            size_t size;
+            nal_txn_ptr txn;
+            struct nal_view_s *next;
+            int registered;
+        } nal_view_t;
+
+        void nal_view_set_debug(int on);
+        int nal_view_get(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key, nal_view_t *view);
+        void nal_view_release(nal_view_t *view);
+
         int nal_cursor_open(nal_txn_ptr txn, MDB_dbi dbi, nal_cursor_ptr *cursor);
         void nal_cursor_close(nal_cursor_ptr cursor);
         int nal_cursor_get(nal_cursor_ptr cursor, MDB_val *key, MDB_val *data,
@@ -68,15 +100,270 @@ local function setup(shlib_name)
         int nal_cursor_put(nal_cursor_ptr cursor, MDB_val *key, MDB_val *data,
                            unsigned int flags);
         int nal_cursor_del(nal_cursor_ptr cursor, unsigned int flags);
+
+        typedef struct nal_shard_store_s nal_shard_store_t;
+        typedef struct nal_shard_scan_s nal_shard_scan_t;
+
+        int nal_shard_store_open(const char *base_path, unsigned int num_shards,
+                                 size_t max_databases, unsigned int max_readers,
+                                 size_t map_size, uint32_t file_mode, int use_tls,
+                                 int read_only, nal_shard_store_t **store);
+        void nal_shard_store_close(nal_shard_store_t *store);
+        unsigned int nal_shard_count(nal_shard_store_t *store);
+        unsigned int nal_shard_of(nal_shard_store_t *store, const MDB_val *key);
+
+        int nal_shard_dbi_open(nal_shard_store_t *store, const char *name,
+                               int read_only, unsigned int *db);
+        int nal_shard_txn_begin(nal_shard_store_t *store, unsigned int shard,
+                                int read_only, nal_txn_ptr *txn);
+        int nal_shard_get(nal_shard_store_t *store, nal_txn_ptr txn, unsigned int db,
+                          MDB_val *key, MDB_val *data);
+        int nal_shard_put(nal_shard_store_t *store, nal_txn_ptr txn, unsigned int db,
+                          MDB_val *key, MDB_val *data);
+        int nal_shard_del(nal_shard_store_t *store, nal_txn_ptr txn, unsigned int db,
+                          MDB_val *key);
+
+        int nal_shard_scan_open(nal_shard_store_t *store, unsigned int db,
+                                MDB_val *start, nal_shard_scan_t **scan);
+        int nal_shard_scan_next(nal_shard_scan_t *scan, MDB_val *key, MDB_val *data);
+        void nal_shard_scan_close(nal_shard_scan_t *scan);
+
+        int nal_changelog_open(nal_txn_ptr txn, int read_only);
+        int nal_changelog_last_seq(nal_txn_ptr txn, uint64_t *seq);
+        int nal_changelog_ship(nal_txn_ptr txn, uint64_t after_seq, size_t max_records,
+                               int fd, uint64_t *last_seq);
+        int nal_changelog_truncate(nal_txn_ptr txn, uint64_t upto_seq);
+
+        typedef struct nal_tuple_builder_s {
+            unsigned char *buf;
+            size_t cap;
+            size_t len;
+            unsigned int depth;
+        } nal_tuple_builder_t;
+
+        typedef struct nal_tuple_reader_s {
+            const unsigned char *p;
+            const unsigned char *end;
+            unsigned int depth;
+        } nal_tuple_reader_t;
+
+        typedef struct nal_tuple_item_s {
+            int type;
+            int64_t i;
+            uint64_t u;
+            double d;
+            const char *raw;
+            size_t raw_len;
+            size_t len;
+        } nal_tuple_item_t;
+
+        void nal_tuple_init(nal_tuple_builder_t *b, void *buf, size_t cap);
+        void nal_tuple_add_null(nal_tuple_builder_t *b);
+        void nal_tuple_add_bool(nal_tuple_builder_t *b, int v);
+        void nal_tuple_add_bytes(nal_tuple_builder_t *b, const void *data, size_t len);
+        void nal_tuple_add_int(nal_tuple_builder_t *b, int64_t v);
+        void nal_tuple_add_uint(nal_tuple_builder_t *b, uint64_t v);
+        void nal_tuple_add_double(nal_tuple_builder_t *b, double v);
+        void nal_tuple_begin_nested(nal_tuple_builder_t *b);
+        void nal_tuple_end_nested(nal_tuple_builder_t *b);
+        void nal_tuple_add_bytes_prefix(nal_tuple_builder_t *b, const void *data,
+                                        size_t len);
+        void nal_tuple_reader_init(nal_tuple_reader_t *r, const void *data, size_t len);
+        int nal_tuple_next(nal_tuple_reader_t *r, nal_tuple_item_t *item);
+        size_t nal_tuple_unescape(const char *raw, size_t raw_len, void *dst);
+        size_t nal_tuple_range_end(const void *prefix, size_t len, void *dst);
+
+        int nal_bloom_open(MDB_dbi dbi, size_t expected_keys, unsigned int bits_per_key);
+        int nal_bloom_rebuild(MDB_dbi dbi);
+        int nal_bloom_stats(MDB_dbi dbi, uint64_t *added, uint64_t *deleted);
+
+        typedef struct nal_cache_stats_s {
+            uint64_t budget;
+            uint64_t used;
+            uint64_t evicted;
+            uint64_t evict_runs;
+        } nal_cache_stats_t;
+        int nal_cache_open(MDB_dbi dbi, uint64_t budget, int policy, size_t slots);
+        int nal_cache_evict(nal_txn_ptr txn, MDB_dbi dbi, size_t count,
+                            size_t *evicted);
+        int nal_cache_stats(nal_txn_ptr txn, MDB_dbi dbi, nal_cache_stats_t *stats);
+
+        typedef struct nal_env_stats_s {
+            uint64_t map_size;
+            uint64_t page_size;
+            uint64_t map_pages;
+            uint64_t last_txnid;
+            uint64_t oldest_reader_txnid;
+            uint32_t max_readers;
+            uint32_t num_readers;
+            uint64_t dbis;
+            uint32_t main_depth;
+            uint64_t main_pages;
+        } nal_env_stats_t;
+        typedef struct nal_dbi_stats_s {
+            uint32_t page_size;
+            uint32_t depth;
+            uint64_t branch_pages;
+            uint64_t leaf_pages;
+            uint64_t overflow_pages;
+            uint64_t entries;
+            uint64_t key_bytes;
+            uint64_t value_bytes;
+            double leaf_fill;
+            double overflow_fill;
+        } nal_dbi_stats_t;
+        typedef struct nal_freelist_stats_s {
+            uint64_t records;
+            uint64_t free_pages;
+            uint64_t pinned_pages;
+            uint64_t runs;
+            uint64_t max_run;
+            uint64_t run_hist[16];
+        } nal_freelist_stats_t;
+        int nal_env_stats(nal_env_stats_t *stats);
+        int nal_dbi_stats(nal_txn_ptr txn, MDB_dbi dbi, int scan,
+                          nal_dbi_stats_t *stats);
+        int nal_freelist_stats(nal_txn_ptr txn, nal_freelist_stats_t *stats);
+
+        int nal_blob_open(nal_txn_ptr txn, int read_only, size_t threshold);
+        int nal_blob_gc(nal_txn_ptr txn, unsigned int max_live_pct,
+                        size_t max_segments, size_t *moved_bytes);
+
+        typedef struct nal_dedup_stats_s {
+            uint64_t values;
+            uint64_t refs;
+            uint64_t value_bytes;
+        } nal_dedup_stats_t;
+        int nal_dedup_open(nal_txn_ptr txn, int read_only, size_t min_size);
+        int nal_dedup_stats(nal_txn_ptr txn, nal_dedup_stats_t *stats);
+
+        typedef struct nal_txn_stats_s {
+            char tag[32];
+            uint64_t committed;
+            uint64_t aborted;
+            uint64_t lock_wait_ns;
+            uint64_t lock_wait_max_ns;
+            uint64_t hold_ns;
+            uint64_t hold_max_ns;
+            uint64_t commit_ns;
+            uint64_t commit_max_ns;
+            uint64_t new_pages;
+        } nal_txn_stats_t;
+        void nal_txn_set_tag(const char *tag);
+        void nal_txn_set_slow_threshold(uint64_t hold_us);
+        size_t nal_txn_stats_get(nal_txn_stats_t *stats, size_t max);
+        void nal_txn_stats_reset(void);
+
+        void nal_log_tag_set(const char *tag, int on);
+        void nal_log_tags_refresh(void);
+
+        typedef struct nal_phf_s nal_phf_t;
+        int nal_phf_export(nal_txn_ptr txn, MDB_dbi dbi, const char *path);
+        int nal_phf_open(const char *path, nal_phf_t **phf);
+        void nal_phf_close(nal_phf_t *phf);
+        size_t nal_phf_count(nal_phf_t *phf);
+        int nal_phf_get(nal_phf_t *phf, MDB_val *key, MDB_val *data);
+
+        typedef struct nal_scan_s nal_scan_t;
+        int nal_scan_open(MDB_dbi dbi, const MDB_val *start, const MDB_val *end,
+                          const MDB_val *after, size_t max_entries, uint64_t max_us,
+                          nal_scan_t **scan);
+        int nal_scan_next(nal_scan_t *scan, MDB_val *key, MDB_val *data);
+        void nal_scan_pause(nal_scan_t *scan);
+        int nal_scan_token(const nal_scan_t *scan, MDB_val *token);
+        size_t nal_scan_count(const nal_scan_t *scan);
+        void nal_scan_close(nal_scan_t *scan);
+
+        typedef int (*nal_pscan_fn)(void *arg, unsigned int worker,
+                                    const MDB_val *key, const MDB_val *data);
+        typedef struct nal_pscan_opts_s {
+            const MDB_val *start;
+            const MDB_val *end;
+            unsigned int threads;
+            int sum;
+            size_t group_prefix_len;
+            int group_delim;
+            size_t max_groups;
+            nal_pscan_fn fn;
+            void *arg;
+        } nal_pscan_opts_t;
+        typedef struct nal_pscan_group_s {
+            MDB_val key;
+            uint64_t count;
+            int64_t sum;
+        } nal_pscan_group_t;
+        typedef struct nal_pscan_result_s {
+            uint64_t count;
+            int64_t sum;
+            uint64_t skipped;
+            size_t partitions;
+            unsigned int threads;
+            size_t num_groups;
+            nal_pscan_group_t *groups;
+        } nal_pscan_result_t;
+        void nal_pscan_opts_init(nal_pscan_opts_t *opts);
+        int nal_pscan_run(MDB_dbi dbi, const nal_pscan_opts_t *opts,
+                          nal_pscan_result_t **result);
+        void nal_pscan_result_free(nal_pscan_result_t *result);
+
+        typedef struct nal_filter_s nal_filter_t;
+        int nal_filter_new(nal_filter_t **filter);
+        void nal_filter_free(nal_filter_t *filter);
+        int nal_filter_key_prefix(nal_filter_t *filter, const MDB_val *prefix);
+        int nal_filter_key_regex(nal_filter_t *filter, const char *pattern,
+                                 int icase);
+        int nal_filter_add_bytes(nal_filter_t *filter, int target, size_t offset,
+                                 int op, const MDB_val *operand);
+        int nal_filter_add_field(nal_filter_t *filter, int target,
+                                 unsigned int index, int op, const MDB_val *operand);
+        int nal_filter_batch(nal_cursor_ptr cursor, const nal_filter_t *filter,
+                             MDB_cursor_op op, const MDB_val *key, MDB_val *keys,
+                             MDB_val *values, size_t max, size_t *n);
     ]]
 
     local c_txn_ptr_type = ffi.typeof("nal_txn_ptr[1]")
     local c_dbi_type = ffi.typeof("MDB_dbi[1]")
     local c_val_type = ffi.typeof("MDB_val[1]")
     local c_cursor_ptr_type = ffi.typeof("nal_cursor_ptr[1]")
+    local c_uint_type = ffi.typeof("unsigned int[1]")
+    local c_uint64_type = ffi.typeof("uint64_t[1]")
+    local c_int64_type = ffi.typeof("int64_t[1]")
+    local c_int64_ptr_type = ffi.typeof("const int64_t *")
+    local c_char_ptr_type = ffi.typeof("const char *")
+    local c_view_type = ffi.typeof("nal_view_t")
+    local c_uint64_t = ffi.typeof("uint64_t")
+    local c_byte_array_type = ffi.typeof("unsigned char[?]")
+    local c_shard_store_ptr_type = ffi.typeof("nal_shard_store_t *[1]")
+    local c_shard_scan_ptr_type = ffi.typeof("nal_shard_scan_t *[1]")
+    local c_phf_ptr_type = ffi.typeof("nal_phf_t *[1]")
+    local c_scan_ptr_type = ffi.typeof("nal_scan_t *[1]")
+    local c_pscan_opts_type = ffi.typeof("nal_pscan_opts_t")
+    local c_pscan_result_ptr_type = ffi.typeof("nal_pscan_result_t *[1]")
+    local c_filter_ptr_type = ffi.typeof("nal_filter_t *[1]")
+    local c_val_array_type = ffi.typeof("MDB_val[?]")
+    local c_size_type = ffi.typeof("size_t[1]")
+    local c_txn_stats_array_type = ffi.typeof("nal_txn_stats_t[?]")
 
     local MDB_SUCCESS = 0
     local MDB_NOTFOUND = -30798
+    local EAGAIN = 11
+
+    local NAL_VERSION_CONFLICT = -30600
+    local NAL_DBI_VERSIONED = 0x1
+    local NAL_DBI_BLOB = 0x2
+    local NAL_DBI_DEDUP = 0x4
+    local NAL_BLOB_DEFAULT_THRESHOLD = 2048
+    local NAL_DEDUP_DEFAULT_MIN_SIZE = 64
+    local NAL_BLOOM_DEFAULT_BITS_PER_KEY = 10
+    local BLOOM_DEFAULT_EXPECTED_KEYS = 1000000
+    local NAL_CACHE_DEFAULT_SLOTS = 1048576
+    local cache_policies = { lru = 0, lfu = 1 }
+
+    local MERGE_ADD = 1
+    local MERGE_MIN = 2
+    local MERGE_MAX = 3
+    local MERGE_APPEND = 4
+    local MERGE_OR = 5
 
     local function nal_strerror(err)
         return ffi.string(S.nal_strerror(err))
@@ -145,6 +432,8 @@ local function setup(shlib_name)
 
     local ro_txns = {}
     local dbis = {}
+    -- Perfect hash tables that answer gets for databases opened with phf.
+    local phfs = {}
 
     local txn_mt = {}
     txn_mt.__index = txn_mt
@@ -162,7 +451,13 @@ local function setup(shlib_name)
         nal_key[0].mv_size = key_len
         nal_key[0].mv_data = key
         local nal_data = ffi.new(c_val_type)
-        local rc = S.nal_get(self, dbis[db], nal_key, nal_data)
+        local phf = phfs[db]
+        local rc
+        if phf ~= nil then
+            rc = S.nal_phf_get(phf, nal_key, nal_data)
+        else
+            rc = S.nal_get(self, dbis[db], nal_key, nal_data)
+        end
         if rc ~= 0 then
             if rc == MDB_NOTFOUND then
                 return nil, 0
@@ -205,6 +500,162 @@ local function setup(shlib_name)
         return nil
     end
 
+    function txn_mt:merge_raw(key, key_len, op, operand, operand_len, db, limit)
+        local nal_key = ffi.new(c_val_type)
+        local nal_operand = ffi.new(c_val_type)
+        local nal_result = ffi.new(c_val_type)
+        nal_key[0].mv_size = key_len
+        nal_key[0].mv_data = key
+        nal_operand[0].mv_size = operand_len
+        nal_operand[0].mv_data = ffi.cast(c_char_ptr_type, operand)
+        local rc = S.nal_merge(self, dbis[db], nal_key, op, nal_operand, limit or 0, nal_result)
+        if rc ~= MDB_SUCCESS then
+            return nil, 0, nal_strerror(rc)
+        end
+        return nal_result[0].mv_data, nal_result[0].mv_size
+    end
+
+    -- merge applies op to the value of key in C without copying it to Lua.
+    -- MERGE_ADD, MERGE_MIN and MERGE_MAX take and return a number (int64 in
+    -- the database); MERGE_APPEND and MERGE_OR take and return a string.
+    function txn_mt:merge(key, op, operand, db, limit)
+        if op == MERGE_APPEND or op == MERGE_OR then
+            local val, val_len, err = self:merge_raw(key, #key, op, operand, #operand, db, limit)
+            if val == nil then
+                return nil, err
+            end
+            return ffi.string(val, val_len)
+        end
+
+        local val, val_len, err = self:merge_raw(key, #key, op, ffi.new(c_int64_type, operand), 8, db)
+        if val == nil then
+            return nil, err
+        end
+        return tonumber(ffi.cast(c_int64_ptr_type, val)[0])
+    end
+
+    function txn_mt:incr(key, delta, db)
+        return self:merge(key, MERGE_ADD, delta, db)
+    end
+
+    function txn_mt:get_version(key, db)
+        local nal_key = ffi.new(c_val_type)
+        nal_key[0].mv_size = #key
+        nal_key[0].mv_data = key
+        local nal_data = ffi.new(c_val_type)
+        local version = ffi.new(c_uint64_type)
+        local rc = S.nal_get_version(self, dbis[db], nal_key, nal_data, version)
+        if rc ~= 0 then
+            if rc == MDB_NOTFOUND then
+                return nil, 0
+            end
+            return nil, 0, nal_strerror(rc)
+        end
+        return ffi.string(nal_data[0].mv_data, nal_data[0].mv_size), tonumber(version[0])
+    end
+
+    -- The conditional writes return err, version. version is the new version
+    -- on success and the current one (0 if absent) on conflict.
+    function txn_mt:put_if_absent(key, data, db)
+        local nal_key = ffi.new(c_val_type)
+        local nal_data = ffi.new(c_val_type)
+        nal_key[0].mv_size = #key
+        nal_key[0].mv_data = key
+        nal_data[0].mv_size = #data
+        nal_data[0].mv_data = data
+        local version = ffi.new(c_uint64_type)
+        local rc = S.nal_put_if_absent(self, dbis[db], nal_key, nal_data, version)
+        if rc ~= MDB_SUCCESS then
+            return nal_strerror(rc), tonumber(version[0])
+        end
+        return nil, tonumber(version[0])
+    end
+
+    function txn_mt:put_if_version(key, data, expected, db)
+        local nal_key = ffi.new(c_val_type)
+        local nal_data = ffi.new(c_val_type)
+        nal_key[0].mv_size = #key
+        nal_key[0].mv_data = key
+        nal_data[0].mv_size = #data
+        nal_data[0].mv_data = data
+        local version = ffi.new(c_uint64_type)
+        local rc = S.nal_put_if_version(self, dbis[db], nal_key, nal_data, expected, version)
+        if rc ~= MDB_SUCCESS then
+            return nal_strerror(rc), tonumber(version[0])
+        end
+        return nil, tonumber(version[0])
+    end
+
+    function txn_mt:del_if_version(key, expected, db)
+        local nal_key = ffi.new(c_val_type)
+        nal_key[0].mv_size = #key
+        nal_key[0].mv_data = key
+        local version = ffi.new(c_uint64_type)
+        local rc = S.nal_del_if_version(self, dbis[db], nal_key, expected, version)
+        if rc ~= MDB_SUCCESS then
+            return nal_strerror(rc), tonumber(version[0])
+        end
+        return nil, tonumber(version[0])
+    end
+
+    -- savepoint runs f(sub) in a nested txn. If f returns an error or raises
+    -- one, only the changes made by f are rolled back and the error is
+    -- returned; the outer txn stays usable either way.
+    function txn_mt:savepoint(f)
+        local sub, err = txn_begin(self)
+        if err ~= nil then
+            return err
+        end
+
+        local ok, err2 = pcall(f, sub)
+        if not ok or err2 ~= nil then
+            S.nal_txn_abort(sub)
+            return err2
+        end
+        return txn_commit(sub)
+    end
+
+    -- get_view returns a view of the value of key that points into the map
+    -- instead of a copy. It is only valid until the txn ends or is reset.
+    function txn_mt:get_view(key, db)
+        local nal_key = ffi.new(c_val_type)
+        nal_key[0].mv_size = #key
+        nal_key[0].mv_data = key
+        local v = ffi.gc(ffi.new(c_view_type), S.nal_view_release)
+        local rc = S.nal_view_get(self, dbis[db], nal_key, v)
+        if rc ~= 0 then
+            if rc == MDB_NOTFOUND then
+                return nil
+            end
+            return nil, nal_strerror(rc)
+        end
+        return v
+    end
+
+    -- scan_range calls f(key, value) for the keys in [lo, hi) in order until
+    -- f returns true. A nil hi means no upper bound, a nil or empty lo none
+    -- below.
+    function txn_mt:scan_range(db, lo, hi, f)
+        return self:with_cursor(db, function(cursor)
+            local key, val, err
+            if lo == nil or lo == "" then
+                key, val, err = cursor:get("", S.MDB_FIRST)
+            else
+                key, val, err = cursor:get(lo, S.MDB_SET_RANGE)
+            end
+            while key ~= nil do
+                if hi ~= nil and key >= hi then
+                    return nil
+                end
+                if f(key, val) then
+                    return nil
+                end
+                key, val, err = cursor:get("", S.MDB_NEXT)
+            end
+            return err
+        end)
+    end
+
     function txn_mt:open_cursor(db)
         local cursor = ffi.new(c_cursor_ptr_type)
         local rc = S.nal_cursor_open(self, dbis[db], cursor)
@@ -224,6 +675,37 @@ local function setup(shlib_name)
         return err
     end
 
+    -- Calls f(key, value) for the entries matching flt, a filter from
+    -- filter_new, in key order until f returns true, fetching batch of them
+    -- (default 64) per call into C.
+    local FILTER_DEFAULT_BATCH = 64
+
+    function txn_mt:filter_scan(db, flt, f, batch)
+        batch = batch or FILTER_DEFAULT_BATCH
+        local keys = ffi.new(c_val_array_type, batch)
+        local values = ffi.new(c_val_array_type, batch)
+        local n = ffi.new(c_size_type)
+        return self:with_cursor(db, function(cursor)
+            local op = S.MDB_FIRST
+            while true do
+                local rc = S.nal_filter_batch(cursor, flt.filter, op, nil,
+                                              keys, values, batch, n)
+                if rc == MDB_NOTFOUND then
+                    return nil
+                elseif rc ~= MDB_SUCCESS then
+                    return nal_strerror(rc)
+                end
+                for i = 0, tonumber(n[0]) - 1 do
+                    if f(ffi.string(keys[i].mv_data, keys[i].mv_size),
+                         ffi.string(values[i].mv_data, values[i].mv_size)) then
+                        return nil
+                    end
+                end
+                op = S.MDB_NEXT
+            end
+        end)
+    end
+
     ffi.metatype("struct MDB_txn", txn_mt)
 
     local cursor_mt = {}
@@ -291,7 +773,89 @@ local function setup(shlib_name)
 
     ffi.metatype("struct MDB_cursor", cursor_mt)
 
-    local function update(f)
+    local function ngx_print_chunk(ptr, len)
+        local ok, err = ngx.print(ffi.string(ptr, len))
+        if not ok then
+            return err
+        end
+        return nil
+    end
+
+    local view_mt = {}
+    view_mt.__index = view_mt
+
+    -- A released view has no data, one whose txn ended or was reset first
+    -- loses its txn (and in debug mode gets a poison pointer).
+    function view_mt:check()
+        if self.data == nil then
+            error("nal_lmdb: use of released view", 2)
+        end
+        if self.txn == nil then
+            error("nal_lmdb: use of view after its txn ended", 2)
+        end
+    end
+
+    function view_mt:__len()
+        self:check()
+        return tonumber(self.size)
+    end
+
+    -- string copies len bytes from offset (0-based) out of the view, the whole
+    -- value by default. A range past the end of the value is an error.
+    function view_mt:string(offset, len)
+        self:check()
+        local size = tonumber(self.size)
+        offset = offset or 0
+        len = len or size - offset
+        if offset < 0 or len < 0 or offset + len > size then
+            error("nal_lmdb: view range out of bounds", 2)
+        end
+        return ffi.string(self.data + offset, len)
+    end
+
+    -- chunks iterates over the value as (ptr, len) pairs of at most size
+    -- bytes, for sinks that take a pointer.
+    function view_mt:chunks(size)
+        self:check()
+        local total = tonumber(self.size)
+        local offset = 0
+        return function()
+            if offset >= total then
+                return nil
+            end
+            self:check()
+            local len = math.min(size, total - offset)
+            local ptr = self.data + offset
+            offset = offset + len
+            return ptr, len
+        end
+    end
+
+    -- print hands the value chunk by chunk to write(ptr, len), which returns
+    -- nil or an error, so the bytes go from the map to the sink without a Lua
+    -- string in between. Without write the value goes to the nginx response;
+    -- ngx.print only takes Lua strings, so that path still copies each chunk.
+    function view_mt:print(write, chunk_size)
+        write = write or ngx_print_chunk
+        for ptr, len in self:chunks(chunk_size or 65536) do
+            local err = write(ptr, len)
+            if err ~= nil then
+                return err
+            end
+        end
+        return nil
+    end
+
+    function view_mt:release()
+        S.nal_view_release(ffi.gc(self, nil))
+    end
+
+    ffi.metatype("struct nal_view_s", view_mt)
+
+    -- update runs f in a write txn. tag names the caller in txn_stats and in
+    -- slow txn warnings.
+    local function update(f, tag)
+        S.nal_txn_set_tag(tag)
         local txn, err = txn_begin(nil)
         if err ~= nil then
             return err
@@ -305,6 +869,60 @@ local function setup(shlib_name)
         return txn_commit(txn)
     end
 
+    local WOULD_BLOCK = nal_strerror(EAGAIN)
+
+    -- try_update is update that returns WOULD_BLOCK at once instead of
+    -- waiting while another worker holds the write lock.
+    local function try_update(f, tag)
+        S.nal_txn_set_tag(tag)
+        local txn = ffi.new(c_txn_ptr_type)
+        local rc = S.nal_txn_try_begin(nil, txn)
+        if rc ~= MDB_SUCCESS then
+            return nal_strerror(rc)
+        end
+
+        local err = f(txn[0])
+        if err ~= nil then
+            S.nal_txn_abort(txn[0])
+            return err
+        end
+        return txn_commit(txn[0])
+    end
+
+    local UPDATE_BACKOFF_MIN_DELAY = 0.001
+    local UPDATE_BACKOFF_MAX_DELAY = 0.05
+    local UPDATE_BACKOFF_TIMEOUT = 5
+
+    -- update_with_backoff retries try_update with exponential backoff,
+    -- yielding through opts.sleep (ngx.sleep or ts.sleep by default) so the
+    -- event loop keeps running. It returns WOULD_BLOCK after opts.timeout
+    -- seconds. opts: tag, sleep, timeout, min_delay, max_delay.
+    local function update_with_backoff(f, opts)
+        opts = opts or {}
+        local sleep = opts.sleep
+        if sleep == nil then
+            local ngx_ = rawget(_G, "ngx")
+            local ts_ = rawget(_G, "ts")
+            sleep = (ngx_ and ngx_.sleep) or (ts_ and ts_.sleep)
+        end
+        if sleep == nil then
+            return "update_with_backoff: no sleep function"
+        end
+        local delay = opts.min_delay or UPDATE_BACKOFF_MIN_DELAY
+        local max_delay = opts.max_delay or UPDATE_BACKOFF_MAX_DELAY
+        local remaining = opts.timeout or UPDATE_BACKOFF_TIMEOUT
+        while true do
+            local err = try_update(f, opts.tag)
+            if err ~= WOULD_BLOCK or remaining <= 0 then
+                return err
+            end
+            local d = delay < remaining and delay or remaining
+            sleep(d)
+            remaining = remaining - d
+            delay = delay * 2 < max_delay and delay * 2 or max_delay
+        end
+    end
+
     local function get_ro_txn()
         local txn = table.remove(ro_txns)
         if txn ~= nil then
@@ -334,6 +952,44 @@ local function setup(shlib_name)
         return err
     end
 
+    -- open_view runs f in a read txn that is committed rather than pooled:
+    -- resetting a txn closes the dbis it opened, committing keeps them.
+    local function open_view(f)
+        local txn, err = readonly_txn_begin(nil)
+        if err ~= nil then
+            return err
+        end
+
+        err = f(txn)
+        if err ~= nil then
+            S.nal_txn_abort(txn)
+            return err
+        end
+        return txn_commit(txn)
+    end
+
+    -- with_view calls f with a view of the value of key, or nil if there is
+    -- none, on a pooled read txn. The view must not be used after f returns.
+    local function with_view(key, db, f)
+        return view(function(txn)
+            local v, err = txn:get_view(key, db)
+            if err ~= nil then
+                return err
+            end
+            err = f(v)
+            if v ~= nil then
+                v:release()
+            end
+            return err
+        end)
+    end
+
+    -- set_view_debug also poisons the data of views whose txn ended or was
+    -- reset, so stale use from C faults instead of reading recycled pages.
+    local function set_view_debug(on)
+        S.nal_view_set_debug(on and 1 or 0)
+    end
+
     local function open_databases(databases, read_only)
         local txn_fn = update
         local open_fn = dbi_open
@@ -341,39 +997,1204 @@ local function setup(shlib_name)
             txn_fn = view
             open_fn = readonly_dbi_open
         end
-        return txn_fn(function(txn)
+        local blooms = {}
+        local caches = {}
+        local tables = {}
+        local err = txn_fn(function(txn)
             for i, db in ipairs(databases) do
-                local dbi, err = open_fn(txn, db)
+                -- An entry is either a name or a table like
+                -- {name = "db1", versioned = true} or {name = "db2", blob = true}
+                -- or {name = "db3", dedup = true}.
+                -- bloom = true or bloom = {expected_keys = n, bits_per_key = b}
+                -- adds a key filter that answers most misses without a lookup.
+                -- cache = {budget = bytes, policy = "lru" or "lfu", slots = n}
+                -- makes puts evict keys to keep the database within budget.
+                -- phf = path serves gets from a table written by phf_export
+                -- instead of the map; writes only show up after the next
+                -- export and open_databases.
+                local name, opts = db, nil
+                if type(db) == "table" then
+                    name, opts = db.name, db
+                end
+                local dbi, err = open_fn(txn, name)
                 if err ~= nil then
                     return err
                 end
-                dbis[db] = dbi
+                if opts ~= nil then
+                    local flags = 0
+                    if opts.versioned then
+                        flags = bit.bor(flags, NAL_DBI_VERSIONED)
+                    end
+                    if opts.blob then
+                        flags = bit.bor(flags, NAL_DBI_BLOB)
+                    end
+                    if opts.dedup then
+                        flags = bit.bor(flags, NAL_DBI_DEDUP)
+                    end
+                    local rc = S.nal_dbi_set_flags(dbi, flags)
+                    if rc ~= MDB_SUCCESS then
+                        return nal_strerror(rc)
+                    end
+                    if opts.bloom then
+                        blooms[#blooms + 1] = { dbi = dbi, opts = opts.bloom }
+                    end
+                    if opts.cache then
+                        caches[#caches + 1] = { dbi = dbi, opts = opts.cache }
+                    end
+                    if opts.phf then
+                        tables[#tables + 1] = { name = name, path = opts.phf }
+                    end
+                end
+                dbis[name] = dbi
             end
         end)
-    end
+        if err ~= nil then
+            return err
+        end
 
-    local function get(key, db)
-        local val
-        local err = view(function(txn)
-            local err2
-            val, err2 = txn:get(key, db)
-            if err2 ~= nil then
-                return err2
+        for _, t in ipairs(tables) do
+            local phf = ffi.new(c_phf_ptr_type)
+            local rc = S.nal_phf_open(t.path, phf)
+            if rc ~= MDB_SUCCESS then
+                return nal_strerror(rc)
             end
+            phfs[t.name] = ffi.gc(phf[0], S.nal_phf_close)
+        end
+
+        -- Filters may need a build, which takes its own txns.
+        for _, b in ipairs(blooms) do
+            local opts = type(b.opts) == "table" and b.opts or {}
+            local rc = S.nal_bloom_open(b.dbi,
+                                        opts.expected_keys or BLOOM_DEFAULT_EXPECTED_KEYS,
+                                        opts.bits_per_key or NAL_BLOOM_DEFAULT_BITS_PER_KEY)
+            if rc ~= MDB_SUCCESS then
+                return nal_strerror(rc)
+            end
+        end
+        for _, c in ipairs(caches) do
+            local policy = cache_policies[c.opts.policy or "lru"]
+            if policy == nil or c.opts.budget == nil then
+                return "open_databases: cache needs a budget and a policy of lru or lfu"
+            end
+            local rc = S.nal_cache_open(c.dbi, c.opts.budget, policy,
+                                        c.opts.slots or NAL_CACHE_DEFAULT_SLOTS)
+            if rc ~= MDB_SUCCESS then
+                return nal_strerror(rc)
+            end
+        end
+        return nil
+    end
+
+    -- dbi_handle returns the dbi handle of a database opened with
+    -- open_databases, for modules calling the C API directly.
+    local function dbi_handle(db)
+        return dbis[db]
+    end
+
+    -- bloom_rebuild rebuilds the key filter of db to forget deleted keys, but
+    -- only once at least min_deletes deletes have been seen since the last
+    -- build. Call it from a timer, outside of any txn.
+    local function bloom_rebuild(db, min_deletes)
+        local added, deleted = ffi.new(c_uint64_type), ffi.new(c_uint64_type)
+        local rc = S.nal_bloom_stats(dbis[db], added, deleted)
+        if rc == MDB_SUCCESS and deleted[0] >= (min_deletes or 0) then
+            rc = S.nal_bloom_rebuild(dbis[db])
+        end
+        if rc ~= MDB_SUCCESS then
+            return nal_strerror(rc)
+        end
+        return nil
+    end
+
+    local function bloom_stats(db)
+        local added, deleted = ffi.new(c_uint64_type), ffi.new(c_uint64_type)
+        local rc = S.nal_bloom_stats(dbis[db], added, deleted)
+        if rc ~= MDB_SUCCESS then
+            return nil, nal_strerror(rc)
+        end
+        return { added = tonumber(added[0]), deleted = tonumber(deleted[0]) }
+    end
 
+    -- cache_evict evicts up to count keys of the cache database db ahead of
+    -- demand, e.g. from a timer, and returns how many it evicted.
+    local function cache_evict(db, count)
+        local evicted = ffi.new("size_t[1]")
+        local err = update(function(txn)
+            local rc = S.nal_cache_evict(txn, dbis[db], count, evicted)
+            if rc ~= MDB_SUCCESS then
+                return nal_strerror(rc)
+            end
             return nil
+        end, "cache_evict")
+        if err ~= nil then
+            return nil, err
+        end
+        return tonumber(evicted[0])
+    end
+
+    -- cache_stats returns the budget and the bytes used of the cache
+    -- database db, and the keys and batches evicted by all processes.
+    local function cache_stats(db)
+        local stats = ffi.new("nal_cache_stats_t")
+        local rc
+        local err = view(function(txn)
+            rc = S.nal_cache_stats(txn, dbis[db], stats)
         end)
-        return val, err
+        if err == nil and rc ~= MDB_SUCCESS then
+            err = nal_strerror(rc)
+        end
+        if err ~= nil then
+            return nil, err
+        end
+        return {
+            budget = tonumber(stats.budget),
+            used = tonumber(stats.used),
+            evicted = tonumber(stats.evicted),
+            evict_runs = tonumber(stats.evict_runs),
+        }
     end
 
-    return {
-        env_init = env_init,
-        update = update,
-        view = view,
-        open_databases = open_databases,
-        get = get,
+    -- env_stats returns how the map is used, in pages of page_size bytes.
+    local function env_stats()
+        local st = ffi.new("nal_env_stats_t")
+        local rc = S.nal_env_stats(st)
+        if rc ~= MDB_SUCCESS then
+            return nil, nal_strerror(rc)
+        end
+        return {
+            map_size = tonumber(st.map_size),
+            page_size = tonumber(st.page_size),
+            map_pages = tonumber(st.map_pages),
+            last_txnid = tonumber(st.last_txnid),
+            oldest_reader_txnid = tonumber(st.oldest_reader_txnid),
+            max_readers = st.max_readers,
+            num_readers = st.num_readers,
+            dbis = tonumber(st.dbis),
+            main_depth = st.main_depth,
+            main_pages = tonumber(st.main_pages),
+        }
+    end
+
+    -- dbi_stats returns the depth, page counts and entries of db. With scan
+    -- it also walks all entries for the key and value bytes and the fill
+    -- factors of leaf and overflow pages, 0 to 1, which takes a while on
+    -- large databases.
+    local function dbi_stats(db, scan)
+        local st = ffi.new("nal_dbi_stats_t")
+        local rc
+        local err = view(function(txn)
+            rc = S.nal_dbi_stats(txn, dbis[db], scan and 1 or 0, st)
+        end)
+        if err == nil and rc ~= MDB_SUCCESS then
+            err = nal_strerror(rc)
+        end
+        if err ~= nil then
+            return nil, err
+        end
+        local stats = {
+            page_size = st.page_size,
+            depth = st.depth,
+            branch_pages = tonumber(st.branch_pages),
+            leaf_pages = tonumber(st.leaf_pages),
+            overflow_pages = tonumber(st.overflow_pages),
+            entries = tonumber(st.entries),
+        }
+        if scan then
+            stats.key_bytes = tonumber(st.key_bytes)
+            stats.value_bytes = tonumber(st.value_bytes)
+            stats.leaf_fill = st.leaf_fill
+            stats.overflow_fill = st.overflow_fill
+        end
+        return stats
+    end
+
+    -- freelist_stats returns the free pages of the env, those still pinned
+    -- by readers, and run_hist[i] counting runs of consecutive free pages
+    -- of 2^(i-1) to 2^i - 1 pages, the last entry all longer ones.
+    local function freelist_stats()
+        local st = ffi.new("nal_freelist_stats_t")
+        local rc
+        local err = view(function(txn)
+            rc = S.nal_freelist_stats(txn, st)
+        end)
+        if err == nil and rc ~= MDB_SUCCESS then
+            err = nal_strerror(rc)
+        end
+        if err ~= nil then
+            return nil, err
+        end
+        local run_hist = {}
+        for i = 0, 15 do
+            run_hist[i + 1] = tonumber(st.run_hist[i])
+        end
+        return {
+            records = tonumber(st.records),
+            free_pages = tonumber(st.free_pages),
+            pinned_pages = tonumber(st.pinned_pages),
+            runs = tonumber(st.runs),
+            max_run = tonumber(st.max_run),
+            run_hist = run_hist,
+        }
+    end
+
+    local NAL_TXN_STATS_MAX_TAGS = 64
+
+    -- txn_stats returns the write txn accounting of this process by update
+    -- tag. Times are in microseconds.
+    local function txn_stats()
+        local stats = ffi.new(c_txn_stats_array_type, NAL_TXN_STATS_MAX_TAGS)
+        local n = tonumber(S.nal_txn_stats_get(stats, NAL_TXN_STATS_MAX_TAGS))
+        local result = {}
+        for i = 0, n - 1 do
+            local s = stats[i]
+            result[ffi.string(s.tag)] = {
+                committed = tonumber(s.committed),
+                aborted = tonumber(s.aborted),
+                lock_wait_us = tonumber(s.lock_wait_ns) / 1000,
+                lock_wait_max_us = tonumber(s.lock_wait_max_ns) / 1000,
+                hold_us = tonumber(s.hold_ns) / 1000,
+                hold_max_us = tonumber(s.hold_max_ns) / 1000,
+                commit_us = tonumber(s.commit_ns) / 1000,
+                commit_max_us = tonumber(s.commit_max_ns) / 1000,
+                new_pages = tonumber(s.new_pages),
+            }
+        end
+        return result
+    end
+
+    local function txn_stats_reset()
+        S.nal_txn_stats_reset()
+    end
+
+    -- set_slow_txn_threshold logs write txns holding the lock longer than
+    -- hold_us microseconds. 0 turns it off.
+    local function set_slow_txn_threshold(hold_us)
+        S.nal_txn_set_slow_threshold(hold_us)
+    end
+
+    -- set_debug_tag turns debug logging of tag ("nal_lmdb" for the core)
+    -- on or off until the next refresh_debug_tags.
+    local function set_debug_tag(tag, on)
+        S.nal_log_tag_set(tag, on and 1 or 0)
+    end
+
+    -- refresh_debug_tags reads the debug tags again from the log backend,
+    -- e.g. after ATS reloaded proxy.config.diags.debug.tags. The nginx build
+    -- does this by itself when the cycle changes.
+    local function refresh_debug_tags()
+        S.nal_log_tags_refresh()
+    end
+
+    local generation_ptrs = {}
+
+    -- generation returns a counter that changes whenever a write txn that
+    -- modified db commits in any process, so derived data can be rebuilt
+    -- exactly when needed. It is a plain load from shared memory.
+    local function generation(db)
+        local ptr = generation_ptrs[db]
+        if ptr == nil then
+            ptr = S.nal_generation_ptr(dbis[db])
+            if ptr == nil then
+                return nil, "generation counter is not available"
+            end
+            generation_ptrs[db] = ptr
+        end
+        return tonumber(ptr[0])
+    end
+
+    -- generation_wait blocks the calling thread until the generation of db
+    -- differs from last_seen or timeout_ms passes. Do not call it from an
+    -- event loop thread.
+    local function generation_wait(db, last_seen, timeout_ms)
+        local current = ffi.new(c_uint64_type)
+        local rc = S.nal_generation_wait(dbis[db], last_seen, timeout_ms, current)
+        if rc ~= MDB_SUCCESS then
+            return tonumber(current[0]), nal_strerror(rc)
+        end
+        return tonumber(current[0])
+    end
+
+    -- get_versioned and put_if_version let most of a read-modify-write run
+    -- in a read txn, holding the write lock only for the conditional write.
+    local function get_versioned(key, db)
+        local val, version
+        local err = view(function(txn)
+            local err2
+            val, version, err2 = txn:get_version(key, db)
+            return err2
+        end)
+        return val, version, err
+    end
+
+    local function put_if_version(key, data, expected, db)
+        local version
+        local err = update(function(txn)
+            local err2
+            err2, version = txn:put_if_version(key, data, expected, db)
+            return err2
+        end)
+        return err, version
+    end
+
+    -- open_blobs enables blob storage for dbis opened with blob = true.
+    -- Values above threshold bytes go to segment files in the env directory.
+    local function open_blobs(threshold, read_only)
+        local txn_fn = read_only and open_view or update
+        return txn_fn(function(txn)
+            local rc = S.nal_blob_open(txn, read_only and 1 or 0,
+                                       threshold or NAL_BLOB_DEFAULT_THRESHOLD)
+            if rc ~= MDB_SUCCESS then
+                return nal_strerror(rc)
+            end
+            return nil
+        end)
+    end
+
+    -- open_dedup enables deduplication for dbis opened with dedup = true.
+    -- Values of at least min_size bytes are stored once per content. Readers
+    -- must call it too, with read_only set.
+    local function open_dedup(min_size, read_only)
+        local txn_fn = read_only and open_view or update
+        return txn_fn(function(txn)
+            local rc = S.nal_dedup_open(txn, read_only and 1 or 0,
+                                        min_size or NAL_DEDUP_DEFAULT_MIN_SIZE)
+            if rc ~= MDB_SUCCESS then
+                return nal_strerror(rc)
+            end
+            return nil
+        end)
+    end
+
+    -- dedup_stats returns the distinct values stored, their bytes and the
+    -- references to them, walking all of them.
+    local function dedup_stats()
+        local st = ffi.new("nal_dedup_stats_t")
+        local rc
+        local err = view(function(txn)
+            rc = S.nal_dedup_stats(txn, st)
+        end)
+        if err == nil and rc ~= MDB_SUCCESS then
+            err = nal_strerror(rc)
+        end
+        if err ~= nil then
+            return nil, err
+        end
+        return {
+            values = tonumber(st.values),
+            refs = tonumber(st.refs),
+            value_bytes = tonumber(st.value_bytes),
+        }
+    end
+
+    -- blob_gc rewrites the live blobs of up to max_segments segments that are
+    -- at most max_live_pct percent live. Call it from a timer in one worker.
+    local function blob_gc(max_live_pct, max_segments)
+        local moved = ffi.new("size_t[1]")
+        local err = update(function(txn)
+            local rc = S.nal_blob_gc(txn, max_live_pct or 50, max_segments or 4,
+                                     moved)
+            if rc ~= MDB_SUCCESS then
+                return nal_strerror(rc)
+            end
+            return nil
+        end, "blob_gc")
+        if err ~= nil then
+            return nil, err
+        end
+        return tonumber(moved[0])
+    end
+
+    -- Tuple keys. pack encodes its arguments so that byte order of keys is
+    -- element-wise order of the tuples: strings, integers (Lua numbers
+    -- without a fraction and int64/uint64 cdata), doubles, booleans, nil and
+    -- tables as nested tuples. tuple_double(x) forces a double. Integers and
+    -- doubles are distinct types that do not compare by value: every integer
+    -- sorts before every double, so pack(100) < pack(1.5). Wrap every write
+    -- of a numeric field that can hold fractions in tuple_double.
+    local TUPLE_TYPE_NULL = 0
+    local TUPLE_TYPE_BYTES = 1
+    local TUPLE_TYPE_INT = 2
+    local TUPLE_TYPE_UINT = 3
+    local TUPLE_TYPE_DOUBLE = 4
+    local TUPLE_TYPE_BOOL = 5
+    local TUPLE_TYPE_NESTED_BEGIN = 6
+    local TUPLE_TYPE_NESTED_END = 7
+
+    local tuple_double_mt = {}
+    local tuple_builder = ffi.new("nal_tuple_builder_t")
+    local tuple_buf_size = 256
+    local tuple_buf = ffi.new(c_byte_array_type, tuple_buf_size)
+
+    local function tuple_double(x)
+        return setmetatable({ value = x }, tuple_double_mt)
+    end
+
+    local function tuple_add(b, v)
+        local t = type(v)
+        if v == nil then
+            S.nal_tuple_add_null(b)
+        elseif t == "string" then
+            S.nal_tuple_add_bytes(b, v, #v)
+        elseif t == "number" then
+            if v == math.floor(v) and v >= -2^63 and v < 2^63 then
+                S.nal_tuple_add_int(b, v)
+            else
+                S.nal_tuple_add_double(b, v)
+            end
+        elseif t == "boolean" then
+            S.nal_tuple_add_bool(b, v and 1 or 0)
+        elseif t == "cdata" then
+            if ffi.istype(c_uint64_t, v) then
+                S.nal_tuple_add_uint(b, v)
+            else
+                S.nal_tuple_add_int(b, v)
+            end
+        elseif t == "table" then
+            if getmetatable(v) == tuple_double_mt then
+                S.nal_tuple_add_double(b, v.value)
+            else
+                S.nal_tuple_begin_nested(b)
+                for i = 1, v.n or #v do
+                    tuple_add(b, v[i])
+                end
+                S.nal_tuple_end_nested(b)
+            end
+        else
+            error("nal_lmdb: cannot pack a " .. t .. " into a tuple", 3)
+        end
+    end
+
+    -- With str_prefix the last element, a string, is left open so the key
+    -- is a prefix of every tuple whose element there starts with it.
+    local function tuple_build(args, n, str_prefix)
+        while true do
+            S.nal_tuple_init(tuple_builder, tuple_buf, tuple_buf_size)
+            for i = 1, n do
+                local v = args[i]
+                if str_prefix and i == n then
+                    S.nal_tuple_add_bytes_prefix(tuple_builder, v, #v)
+                else
+                    tuple_add(tuple_builder, v)
+                end
+            end
+            local len = tonumber(tuple_builder.len)
+            if len <= tuple_buf_size then
+                return ffi.string(tuple_buf, len)
+            end
+            tuple_buf_size = math.max(len, tuple_buf_size * 2)
+            tuple_buf = ffi.new(c_byte_array_type, tuple_buf_size)
+        end
+    end
+
+    local function tuple_pack(...)
+        return tuple_build({...}, select("#", ...), false)
+    end
+
+    local function tuple_read(r, item)
+        local out, n = {}, 0
+        while true do
+            local rc = S.nal_tuple_next(r, item)
+            if rc == MDB_NOTFOUND then
+                break
+            end
+            if rc ~= MDB_SUCCESS then
+                return nil, nal_strerror(rc)
+            end
+
+            local t, v = item.type, nil
+            if t == TUPLE_TYPE_NESTED_END then
+                break
+            elseif t == TUPLE_TYPE_BYTES then
+                if item.raw_len == item.len then
+                    v = ffi.string(item.raw, item.len)
+                else
+                    local buf = ffi.new(c_byte_array_type, item.len)
+                    S.nal_tuple_unescape(item.raw, item.raw_len, buf)
+                    v = ffi.string(buf, item.len)
+                end
+            elseif t == TUPLE_TYPE_INT then
+                v = item.i
+                if v >= -2^53 and v <= 2^53 then
+                    v = tonumber(v)
+                end
+            elseif t == TUPLE_TYPE_UINT then
+                v = item.u
+            elseif t == TUPLE_TYPE_DOUBLE then
+                v = item.d
+            elseif t == TUPLE_TYPE_BOOL then
+                v = item.i ~= 0
+            elseif t == TUPLE_TYPE_NESTED_BEGIN then
+                local err
+                v, err = tuple_read(r, item)
+                if v == nil then
+                    return nil, err
+                end
+            end
+            n = n + 1
+            out[n] = v
+        end
+        out.n = n
+        return out
+    end
+
+    -- tuple_unpack returns the elements of a packed key as an array with
+    -- field n, since elements may be nil.
+    local function tuple_unpack(key)
+        local r = ffi.new("nal_tuple_reader_t")
+        S.nal_tuple_reader_init(r, key, #key)
+        return tuple_read(r, ffi.new("nal_tuple_item_t"))
+    end
+
+    local function tuple_range_end(lo)
+        local buf = ffi.new(c_byte_array_type, #lo)
+        local len = S.nal_tuple_range_end(lo, #lo, buf)
+        if len == 0 then
+            return nil
+        end
+        return ffi.string(buf, len)
+    end
+
+    -- tuple_range returns lo, hi such that [lo, hi) is exactly the keys of
+    -- tuples starting with the given elements, for txn:scan_range. Further
+    -- elements start with a type code below 0xff, while lo followed by 0xff
+    -- is a bytes element of lo continuing with an escaped NUL, so hi is lo
+    -- plus 0xff rather than the next prefix.
+    local function tuple_range(...)
+        local lo = tuple_build({...}, select("#", ...), false)
+        if lo == "" then
+            return lo, nil
+        end
+        return lo, lo .. "\255"
+    end
+
+    -- tuple_prefix_range is like tuple_range, but the last element is a
+    -- string that only has to be a prefix of the element at its position.
+    local function tuple_prefix_range(...)
+        local n = select("#", ...)
+        if n == 0 or type((select(n, ...))) ~= "string" then
+            error("nal_lmdb: tuple_prefix_range needs a string last", 2)
+        end
+        local lo = tuple_build({...}, n, true)
+        return lo, tuple_range_end(lo)
+    end
+
+    -- open_changelog must be called in every process that writes to the env
+    -- once the change log is in use, or its writes will not be logged.
+    local function open_changelog(read_only)
+        local txn_fn = read_only and open_view or update
+        return txn_fn(function(txn)
+            local rc = S.nal_changelog_open(txn, read_only and 1 or 0)
+            if rc ~= MDB_SUCCESS then
+                return nal_strerror(rc)
+            end
+            return nil
+        end)
+    end
+
+    local function changelog_last_seq()
+        local seq = ffi.new(c_uint64_type)
+        local err = view(function(txn)
+            local rc = S.nal_changelog_last_seq(txn, seq)
+            if rc ~= MDB_SUCCESS then
+                return nal_strerror(rc)
+            end
+            return nil
+        end)
+        if err ~= nil then
+            return nil, err
+        end
+        return tonumber(seq[0])
+    end
+
+    -- changelog_ship writes up to max_records records after after_seq to fd
+    -- and returns the last shipped sequence number.
+    local function changelog_ship(after_seq, max_records, fd)
+        local last_seq = ffi.new(c_uint64_type)
+        local err = view(function(txn)
+            local rc = S.nal_changelog_ship(txn, after_seq, max_records, fd, last_seq)
+            if rc ~= MDB_SUCCESS then
+                return nal_strerror(rc)
+            end
+            return nil
+        end)
+        if err ~= nil then
+            return nil, err
+        end
+        return tonumber(last_seq[0])
+    end
+
+    local function changelog_truncate(upto_seq)
+        return update(function(txn)
+            local rc = S.nal_changelog_truncate(txn, upto_seq)
+            if rc ~= MDB_SUCCESS then
+                return nal_strerror(rc)
+            end
+            return nil
+        end, "changelog_truncate")
+    end
+
+    local function get(key, db)
+        local val
+        local err = view(function(txn)
+            local err2
+            val, err2 = txn:get(key, db)
+            if err2 ~= nil then
+                return err2
+            end
+
+            return nil
+        end)
+        return val, err
+    end
+
+    -- A shard txn wraps a txn of one shard environment. It is a plain table
+    -- rather than the struct MDB_txn metatype because dbi handles differ per
+    -- shard and must be resolved through the store.
+    local shard_txn_mt = {}
+    shard_txn_mt.__index = shard_txn_mt
+
+    function shard_txn_mt:get(key, db)
+        local nal_key = ffi.new(c_val_type)
+        nal_key[0].mv_size = #key
+        nal_key[0].mv_data = key
+        local nal_data = ffi.new(c_val_type)
+        local rc = S.nal_shard_get(self.store.store, self.txn, self.store.dbs[db], nal_key, nal_data)
+        if rc ~= 0 then
+            if rc == MDB_NOTFOUND then
+                return nil
+            end
+            return nil, nal_strerror(rc)
+        end
+        return ffi.string(nal_data[0].mv_data, nal_data[0].mv_size)
+    end
+
+    function shard_txn_mt:set(key, data, db)
+        local nal_key = ffi.new(c_val_type)
+        local nal_data = ffi.new(c_val_type)
+        nal_key[0].mv_size = #key
+        nal_key[0].mv_data = key
+        nal_data[0].mv_size = #data
+        nal_data[0].mv_data = data
+        local rc = S.nal_shard_put(self.store.store, self.txn, self.store.dbs[db], nal_key, nal_data)
+        if rc ~= MDB_SUCCESS then
+            return nal_strerror(rc)
+        end
+        return nil
+    end
+
+    function shard_txn_mt:del(key, db)
+        local nal_key = ffi.new(c_val_type)
+        nal_key[0].mv_size = #key
+        nal_key[0].mv_data = key
+        local rc = S.nal_shard_del(self.store.store, self.txn, self.store.dbs[db], nal_key)
+        if rc ~= 0 and rc ~= MDB_NOTFOUND then
+            return nal_strerror(rc)
+        end
+        return nil
+    end
+
+    -- phf_export writes db as an immutable perfect hash table to path, which
+    -- phf_open maps for lookups without a txn. Exports replace the file
+    -- atomically; open tables keep serving the old one until reopened.
+    local function phf_export(db, path)
+        return view(function(txn)
+            local rc = S.nal_phf_export(txn, dbis[db], path)
+            if rc ~= MDB_SUCCESS then
+                return nal_strerror(rc)
+            end
+            return nil
+        end)
+    end
+
+    local phf_mt = {}
+    phf_mt.__index = phf_mt
+
+    local function phf_open(path)
+        local phf = ffi.new(c_phf_ptr_type)
+        local rc = S.nal_phf_open(path, phf)
+        if rc ~= MDB_SUCCESS then
+            return nil, nal_strerror(rc)
+        end
+        return setmetatable({
+            phf = ffi.gc(phf[0], S.nal_phf_close),
+        }, phf_mt)
+    end
+
+    function phf_mt:get(key)
+        local nal_key = ffi.new(c_val_type)
+        nal_key[0].mv_size = #key
+        nal_key[0].mv_data = key
+        local nal_data = ffi.new(c_val_type)
+        local rc = S.nal_phf_get(self.phf, nal_key, nal_data)
+        if rc ~= 0 then
+            if rc == MDB_NOTFOUND then
+                return nil
+            end
+            return nil, nal_strerror(rc)
+        end
+        return ffi.string(nal_data[0].mv_data, nal_data[0].mv_size)
+    end
+
+    function phf_mt:count()
+        return tonumber(S.nal_phf_count(self.phf))
+    end
+
+    function phf_mt:close()
+        S.nal_phf_close(ffi.gc(self.phf, nil))
+        self.phf = nil
+    end
+
+    -- Resumable scans. scan_open(db, opts) scans db from opts.start to below
+    -- opts.stop, or right after opts.after, a token of an earlier scan. Each
+    -- call of scan:chunk(f) calls f(key, value) for at most opts.limit
+    -- entries (default 1000) or opts.time_ms milliseconds in a read txn of
+    -- its own that is reset afterwards, so a long scan driven from a timer
+    -- or a coroutine does not keep writers from reusing pages. chunk returns
+    -- true while entries remain; f returning true ends the chunk early.
+    -- scan:token() returns the last key seen, to resume from elsewhere.
+    local SCAN_DEFAULT_LIMIT = 1000
+
+    local scan_mt = {}
+    scan_mt.__index = scan_mt
+
+    local function scan_val(s)
+        if s == nil then
+            return nil
+        end
+        local val = ffi.new(c_val_type)
+        val[0].mv_size = #s
+        val[0].mv_data = ffi.cast(c_char_ptr_type, s)
+        return val
+    end
+
+    local function scan_open(db, opts)
+        opts = opts or {}
+        local scan = ffi.new(c_scan_ptr_type)
+        local rc = S.nal_scan_open(dbis[db], scan_val(opts.start),
+                                   scan_val(opts.stop), scan_val(opts.after),
+                                   opts.limit or SCAN_DEFAULT_LIMIT,
+                                   (opts.time_ms or 0) * 1000, scan)
+        if rc ~= MDB_SUCCESS then
+            return nil, nal_strerror(rc)
+        end
+        return setmetatable({
+            scan = ffi.gc(scan[0], S.nal_scan_close),
+        }, scan_mt)
+    end
+
+    function scan_mt:chunk(f)
+        local key = ffi.new(c_val_type)
+        local data = ffi.new(c_val_type)
+        while true do
+            local rc = S.nal_scan_next(self.scan, key, data)
+            if rc == MDB_NOTFOUND then
+                return false
+            elseif rc == EAGAIN then
+                return true
+            elseif rc ~= MDB_SUCCESS then
+                return nil, nal_strerror(rc)
+            end
+            -- The chunk's read txn must not outlive an error in f.
+            local ok, stop = pcall(f, ffi.string(key[0].mv_data, key[0].mv_size),
+                                   ffi.string(data[0].mv_data, data[0].mv_size))
+            if not ok then
+                S.nal_scan_pause(self.scan)
+                error(stop, 0)
+            end
+            if stop then
+                S.nal_scan_pause(self.scan)
+                return true
+            end
+        end
+    end
+
+    function scan_mt:token()
+        local token = ffi.new(c_val_type)
+        if S.nal_scan_token(self.scan, token) ~= MDB_SUCCESS then
+            return nil
+        end
+        return ffi.string(token[0].mv_data, token[0].mv_size)
+    end
+
+    function scan_mt:count()
+        return tonumber(S.nal_scan_count(self.scan))
+    end
+
+    function scan_mt:close()
+        S.nal_scan_close(ffi.gc(self.scan, nil))
+        self.scan = nil
+    end
+
+    -- Parallel scans. pscan(db, opts) reads db from opts.start to below
+    -- opts.stop on opts.threads worker threads (default: all CPUs) and
+    -- returns {count, sum, skipped, partitions, threads, groups}. opts.sum
+    -- is "size" to add up value sizes or "int64" for 8-byte integer values.
+    -- Setting opts.group_prefix (a length) or opts.group_delim (a one
+    -- character string) fills groups with {count, sum} per key prefix, at
+    -- most opts.max_groups of them. The reduction runs in C: a Lua callback
+    -- cannot be called from the worker threads.
+    local PSCAN_SUM = { size = 1, int64 = 2 }
+
+    local function pscan(db, opts)
+        opts = opts or {}
+        local o = ffi.new(c_pscan_opts_type)
+        S.nal_pscan_opts_init(o)
+        local start, stop = scan_val(opts.start), scan_val(opts.stop)
+        o.start = start
+        o["end"] = stop
+        o.threads = opts.threads or 0
+        if opts.sum ~= nil then
+            o.sum = PSCAN_SUM[opts.sum] or error("unknown sum " .. opts.sum)
+        end
+        o.group_prefix_len = opts.group_prefix or 0
+        if opts.group_delim ~= nil then
+            o.group_delim = opts.group_delim:byte()
+        end
+        o.max_groups = opts.max_groups or 0
+        local res = ffi.new(c_pscan_result_ptr_type)
+        local rc = S.nal_pscan_run(dbis[db], o, res)
+        if rc ~= MDB_SUCCESS then
+            return nil, nal_strerror(rc)
+        end
+        local r = res[0]
+        local groups = {}
+        for i = 0, tonumber(r.num_groups) - 1 do
+            local g = r.groups[i]
+            groups[ffi.string(g.key.mv_data, g.key.mv_size)] = {
+                count = tonumber(g.count),
+                sum = tonumber(g.sum),
+            }
+        end
+        local out = {
+            count = tonumber(r.count),
+            sum = tonumber(r.sum),
+            skipped = tonumber(r.skipped),
+            partitions = tonumber(r.partitions),
+            threads = r.threads,
+            groups = groups,
+        }
+        S.nal_pscan_result_free(r)
+        return out
+    end
+
+    -- Filtered scans. filter_new(spec) builds a filter evaluated in C, so
+    -- only matching entries cross into Lua. All parts of spec are optional:
+    --   prefix = "user:"        keys starting with it; also bounds the scan
+    --   regex = "^user:[0-9]+$" POSIX extended regex on the key (icase = true)
+    --   bytes = {{offset = 0, op = "mask", value = "\1"}, ...}
+    --   fields = {{index = 2, op = "eq", value = true}, ...}
+    -- bytes compare the #value bytes at offset (0-based) and fields the
+    -- element at index (1-based) of a value packed with tuple_pack; add
+    -- key = true to test the key instead. op is eq, ne, lt, le, gt, ge or,
+    -- for bytes, mask (all bits of value set). Scan with txn:filter_scan.
+    local FILTER_OPS = { eq = 0, ne = 1, lt = 2, le = 3, gt = 4, ge = 5,
+                         mask = 6 }
+    local filter_mt = {}
+    filter_mt.__index = filter_mt
+
+    local function filter_add(flt, preds, add, pack)
+        for _, p in ipairs(preds or {}) do
+            local op = FILTER_OPS[p.op or "eq"]
+            if op == nil then
+                return "unknown filter op " .. tostring(p.op)
+            end
+            local value = pack(p.value)
+            local rc = add(flt, p.key and 0 or 1, p.offset or p.index, op,
+                           scan_val(value))
+            if rc ~= MDB_SUCCESS then
+                return nal_strerror(rc)
+            end
+        end
+        return nil
+    end
+
+    local function filter_add_field(flt, target, index, op, operand)
+        return S.nal_filter_add_field(flt, target, index - 1, op, operand)
+    end
+
+    local function filter_new(spec)
+        local flt = ffi.new(c_filter_ptr_type)
+        local rc = S.nal_filter_new(flt)
+        if rc ~= MDB_SUCCESS then
+            return nil, nal_strerror(rc)
+        end
+        local self = setmetatable({
+            filter = ffi.gc(flt[0], S.nal_filter_free),
+        }, filter_mt)
+        if spec.prefix ~= nil then
+            rc = S.nal_filter_key_prefix(self.filter, scan_val(spec.prefix))
+        end
+        if rc == MDB_SUCCESS and spec.regex ~= nil then
+            rc = S.nal_filter_key_regex(self.filter, spec.regex,
+                                        spec.icase and 1 or 0)
+        end
+        if rc ~= MDB_SUCCESS then
+            return nil, nal_strerror(rc)
+        end
+        local err = filter_add(self.filter, spec.bytes, S.nal_filter_add_bytes,
+                               tostring)
+        if err == nil then
+            err = filter_add(self.filter, spec.fields, filter_add_field,
+                             tuple_pack)
+        end
+        if err ~= nil then
+            return nil, err
+        end
+        return self
+    end
+
+    local shard_store_mt = {}
+    shard_store_mt.__index = shard_store_mt
+
+    -- Every txn must end before the envs are closed, including the reset
+    -- ones pooled by view.
+    local function shard_store_abort_ro_txns(ro_txns)
+        for _, pool in pairs(ro_txns) do
+            for i = #pool, 1, -1 do
+                S.nal_txn_abort(pool[i])
+                pool[i] = nil
+            end
+        end
+    end
+
+    local function shard_store_open(base_path, num_shards, max_databases, max_readers, map_size, file_mode, use_tls, read_only)
+        local store = ffi.new(c_shard_store_ptr_type)
+        local rc = S.nal_shard_store_open(base_path, num_shards, max_databases, max_readers, map_size, file_mode, use_tls or 0, read_only or 0, store)
+        if rc ~= MDB_SUCCESS then
+            return nil, nal_strerror(rc)
+        end
+        local ro_txns = {}
+        for i = 0, num_shards - 1 do
+            ro_txns[i] = {}
+        end
+        return setmetatable({
+            store = ffi.gc(store[0], function(s)
+                shard_store_abort_ro_txns(ro_txns)
+                S.nal_shard_store_close(s)
+            end),
+            num_shards = num_shards,
+            dbs = {},
+            ro_txns = ro_txns,
+        }, shard_store_mt)
+    end
+
+    function shard_store_mt:close()
+        shard_store_abort_ro_txns(self.ro_txns)
+        S.nal_shard_store_close(ffi.gc(self.store, nil))
+        self.store = nil
+    end
+
+    function shard_store_mt:open_databases(databases, read_only)
+        local db = ffi.new(c_uint_type)
+        for i, name in ipairs(databases) do
+            local rc = S.nal_shard_dbi_open(self.store, name, read_only and 1 or 0, db)
+            if rc ~= MDB_SUCCESS then
+                return nal_strerror(rc)
+            end
+            self.dbs[name] = db[0]
+        end
+        return nil
+    end
+
+    function shard_store_mt:shard_of(key)
+        local nal_key = ffi.new(c_val_type)
+        nal_key[0].mv_size = #key
+        nal_key[0].mv_data = key
+        return S.nal_shard_of(self.store, nal_key)
+    end
+
+    function shard_store_mt:update(shard, f)
+        local txn = ffi.new(c_txn_ptr_type)
+        local rc = S.nal_shard_txn_begin(self.store, shard, 0, txn)
+        if rc ~= MDB_SUCCESS then
+            return nal_strerror(rc)
+        end
+
+        local err = f(setmetatable({ store = self, txn = txn[0] }, shard_txn_mt))
+        if err ~= nil then
+            S.nal_txn_abort(txn[0])
+            return err
+        end
+        return txn_commit(txn[0])
+    end
+
+    function shard_store_mt:view(shard, f)
+        local pool = self.ro_txns[shard]
+        local txn = table.remove(pool)
+        if txn ~= nil then
+            local err = txn_renew(txn)
+            if err ~= nil then
+                S.nal_txn_abort(txn)
+                return err
+            end
+        else
+            local txnp = ffi.new(c_txn_ptr_type)
+            local rc = S.nal_shard_txn_begin(self.store, shard, 1, txnp)
+            if rc ~= MDB_SUCCESS then
+                return nal_strerror(rc)
+            end
+            txn = txnp[0]
+        end
+
+        local err = f(setmetatable({ store = self, txn = txn }, shard_txn_mt))
+        S.nal_txn_reset(txn)
+        table.insert(pool, txn)
+        return err
+    end
+
+    function shard_store_mt:get(key, db)
+        local val
+        local err = self:view(self:shard_of(key), function(txn)
+            local err2
+            val, err2 = txn:get(key, db)
+            return err2
+        end)
+        return val, err
+    end
+
+    function shard_store_mt:set(key, data, db)
+        return self:update(self:shard_of(key), function(txn)
+            return txn:set(key, data, db)
+        end)
+    end
+
+    function shard_store_mt:del(key, db)
+        return self:update(self:shard_of(key), function(txn)
+            return txn:del(key, db)
+        end)
+    end
+
+    -- write_batch applies ops of the form {"set", key, data, db} or
+    -- {"del", key, db} with one write txn per touched shard. Each shard
+    -- commits independently, so the batch is atomic per shard only.
+    function shard_store_mt:write_batch(ops)
+        local by_shard = {}
+        for i, op in ipairs(ops) do
+            local shard = self:shard_of(op[2])
+            local list = by_shard[shard]
+            if list == nil then
+                list = {}
+                by_shard[shard] = list
+            end
+            list[#list + 1] = op
+        end
+
+        for shard, list in pairs(by_shard) do
+            local err = self:update(shard, function(txn)
+                for i, op in ipairs(list) do
+                    local err2
+                    if op[1] == "set" then
+                        err2 = txn:set(op[2], op[3], op[4])
+                    else
+                        err2 = txn:del(op[2], op[3])
+                    end
+                    if err2 ~= nil then
+                        return err2
+                    end
+                end
+                return nil
+            end)
+            if err ~= nil then
+                return err
+            end
+        end
+        return nil
+    end
+
+    -- scan visits entries of db across all shards in key order, starting at
+    -- start_key (or the first key if nil). Iteration stops when f returns true.
+    function shard_store_mt:scan(db, start_key, f)
+        local nal_start = nil
+        if start_key ~= nil then
+            nal_start = ffi.new(c_val_type)
+            nal_start[0].mv_size = #start_key
+            nal_start[0].mv_data = start_key
+        end
+        local scan = ffi.new(c_shard_scan_ptr_type)
+        local rc = S.nal_shard_scan_open(self.store, self.dbs[db], nal_start, scan)
+        if rc ~= MDB_SUCCESS then
+            return nal_strerror(rc)
+        end
+
+        local nal_key = ffi.new(c_val_type)
+        local nal_data = ffi.new(c_val_type)
+        local err
+        while true do
+            rc = S.nal_shard_scan_next(scan[0], nal_key, nal_data)
+            if rc ~= MDB_SUCCESS then
+                if rc ~= MDB_NOTFOUND then
+                    err = nal_strerror(rc)
+                end
+                break
+            end
+            if f(ffi.string(nal_key[0].mv_data, nal_key[0].mv_size),
+                 ffi.string(nal_data[0].mv_data, nal_data[0].mv_size)) then
+                break
+            end
+        end
+        S.nal_shard_scan_close(scan[0])
+        return err
+    end
+
+    return {
+        env_init = env_init,
+        update = update,
+        try_update = try_update,
+        update_with_backoff = update_with_backoff,
+        WOULD_BLOCK = WOULD_BLOCK,
+        view = view,
+        open_databases = open_databases,
+        dbi_handle = dbi_handle,
+        get = get,
+        with_view = with_view,
+        set_view_debug = set_view_debug,
+        get_versioned = get_versioned,
+        put_if_version = put_if_version,
+        VERSION_CONFLICT = nal_strerror(NAL_VERSION_CONFLICT),
+        shard_store_open = shard_store_open,
+        generation = generation,
+        generation_wait = generation_wait,
+        open_changelog = open_changelog,
+        open_blobs = open_blobs,
+        open_dedup = open_dedup,
+        dedup_stats = dedup_stats,
+        bloom_rebuild = bloom_rebuild,
+        bloom_stats = bloom_stats,
+        cache_evict = cache_evict,
+        cache_stats = cache_stats,
+        env_stats = env_stats,
+        dbi_stats = dbi_stats,
+        freelist_stats = freelist_stats,
+        tuple_pack = tuple_pack,
+        tuple_unpack = tuple_unpack,
+        tuple_range = tuple_range,
+        tuple_prefix_range = tuple_prefix_range,
+        tuple_double = tuple_double,
+        blob_gc = blob_gc,
+        phf_export = phf_export,
+        scan_open = scan_open,
+        pscan = pscan,
+        filter_new = filter_new,
+        txn_stats = txn_stats,
+        txn_stats_reset = txn_stats_reset,
+        set_slow_txn_threshold = set_slow_txn_threshold,
+        set_debug_tag = set_debug_tag,
+        refresh_debug_tags = refresh_debug_tags,
+        phf_open = phf_open,
+        changelog_last_seq = changelog_last_seq,
+        changelog_ship = changelog_ship,
+        changelog_truncate = changelog_truncate,
+
+        -- merge operators
+        MERGE_ADD = MERGE_ADD,
+        MERGE_MIN = MERGE_MIN,
+        MERGE_MAX = MERGE_MAX,
+        MERGE_APPEND = MERGE_APPEND,
+        MERGE_OR = MERGE_OR,
 
         -- cursor operations
+        FIRST = ffi.new("MDB_cursor_op", S.MDB_FIRST),
+        NEXT = ffi.new("MDB_cursor_op", S.MDB_NEXT),
         SET_RANGE = ffi.new("MDB_cursor_op", S.MDB_SET_RANGE),
     }
 end
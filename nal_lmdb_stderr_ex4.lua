@@ -0,0 +1,41 @@
+local lmdb = require "nal_lmdb_stderr"
+
+local env_path = "/tmp/test_lmdb"
+local max_databases = 20
+local max_readers = 128
+local map_size = 50 * 1024 * 1024
+local file_mode = tonumber('666', 8)
+local use_tls = false
+local err = lmdb.env_init(env_path, max_databases, max_readers, map_size, file_mode, use_tls)
+print(string.format("env_init err=%s", err))
+
+err = lmdb.open_databases({"db1"})
+print(string.format("open_databases err=%s", err))
+
+local rows = {
+    {"key1", "value1"},
+    {"key2", "value2"},
+    {"key3", nil},
+    {"key4", "value4"},
+}
+
+-- Import rows in one txn; a bad row only rolls back its own savepoint.
+err = lmdb.update(function(txn)
+    for i, row in ipairs(rows) do
+        local err2 = txn:savepoint(function(sub)
+            if row[2] == nil then
+                return "missing value for " .. row[1]
+            end
+            return sub:set(row[1], row[2], "db1")
+        end)
+        print(string.format("savepoint#%d key=%s err=%s", i, row[1], err2))
+    end
+    return nil
+end)
+print(string.format("update err=%s", err))
+
+for i, row in ipairs(rows) do
+    local val
+    val, err = lmdb.get(row[1], "db1")
+    print(string.format("lmdb.get key=%s val=%s, err=%s", row[1], val, err))
+end
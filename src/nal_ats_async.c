@@ -0,0 +1,491 @@
+#include "nal_ats_async.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nal_log.h"
+#include "nal_txn_stats.h"
+#include "ts_cont.h"
+
+#define NAL_ATS_WRITE_BATCH 64
+#define NAL_ATS_OP_PUT 1
+#define NAL_ATS_OP_DEL 2
+
+#define NAL_ATS_JOB_NEW 0
+#define NAL_ATS_JOB_QUEUED 1
+#define NAL_ATS_JOB_DONE 2
+#define NAL_ATS_JOB_ABANDONED 3
+
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} nal_ats_buf_t;
+
+/* Write ops and scan entries are packed into a buffer as a header followed
+ * by the key and the value. */
+typedef struct {
+    uint32_t op;
+    MDB_dbi dbi;
+    uint32_t key_len;
+    uint32_t val_len;
+} nal_ats_rec_t;
+
+struct nal_ats_job_s {
+    int kind;
+    int rc;
+    uint32_t state;
+    char tag[NAL_TXN_TAG_MAX];
+    nal_ats_async_cb cb;
+    void *arg;
+    nal_ats_job_t *next;
+
+    nal_ats_buf_t recs;    /* write ops, or scan entries */
+    nal_ats_buf_t offsets; /* size_t offset of each scan entry in recs */
+    size_t count;
+
+    MDB_dbi scan_dbi;
+    size_t scan_limit;
+    nal_ats_buf_t scan_start;
+    nal_ats_buf_t scan_end;
+    int has_end;
+    nal_ats_buf_t next_key;
+    int has_next_key;
+};
+
+typedef struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    nal_ats_job_t *head;
+    nal_ats_job_t *tail;
+    size_t len;
+} nal_ats_queue_t;
+
+static nal_ats_queue_t write_queue = {PTHREAD_MUTEX_INITIALIZER,
+                                      PTHREAD_COND_INITIALIZER, NULL, NULL, 0};
+static nal_ats_queue_t scan_queue = {PTHREAD_MUTEX_INITIALIZER,
+                                     PTHREAD_COND_INITIALIZER, NULL, NULL, 0};
+static pthread_mutex_t start_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int started;
+static unsigned int scanners;
+static size_t queue_limit;
+
+static int nal_ats_buf_append(nal_ats_buf_t *b, const void *p, size_t len)
+{
+    if (b->len + len > b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 256;
+        while (cap < b->len + len) {
+            cap *= 2;
+        }
+        char *data = realloc(b->data, cap);
+        if (data == NULL) {
+            return ENOMEM;
+        }
+        b->data = data;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, p, len);
+    b->len += len;
+    return 0;
+}
+
+static int nal_ats_rec_append(nal_ats_buf_t *b, uint32_t op, MDB_dbi dbi,
+                              const MDB_val *key, const MDB_val *data)
+{
+    if (key->mv_size > UINT32_MAX ||
+        (data != NULL && data->mv_size > UINT32_MAX)) {
+        return MDB_BAD_VALSIZE;
+    }
+    nal_ats_rec_t rec = {op, dbi, (uint32_t)key->mv_size,
+                         data != NULL ? (uint32_t)data->mv_size : 0};
+    int rc = nal_ats_buf_append(b, &rec, sizeof(rec));
+    if (rc == 0) {
+        rc = nal_ats_buf_append(b, key->mv_data, key->mv_size);
+    }
+    if (rc == 0 && data != NULL) {
+        rc = nal_ats_buf_append(b, data->mv_data, data->mv_size);
+    }
+    return rc;
+}
+
+/* Reads the record at *off and advances *off past it. */
+static void nal_ats_rec_read(const nal_ats_buf_t *b, size_t *off,
+                             nal_ats_rec_t *rec, MDB_val *key, MDB_val *data)
+{
+    memcpy(rec, b->data + *off, sizeof(*rec));
+    key->mv_data = b->data + *off + sizeof(*rec);
+    key->mv_size = rec->key_len;
+    data->mv_data = (char *)key->mv_data + rec->key_len;
+    data->mv_size = rec->val_len;
+    *off += sizeof(*rec) + rec->key_len + rec->val_len;
+}
+
+nal_ats_job_t *nal_ats_job_new(int kind, const char *tag)
+{
+    if (kind != NAL_ATS_JOB_WRITE && kind != NAL_ATS_JOB_SCAN) {
+        return NULL;
+    }
+    nal_ats_job_t *job = calloc(1, sizeof(*job));
+    if (job == NULL) {
+        return NULL;
+    }
+    job->kind = kind;
+    if (tag != NULL) {
+        strncpy(job->tag, tag, NAL_TXN_TAG_MAX - 1);
+    }
+    return job;
+}
+
+static void nal_ats_job_destroy(nal_ats_job_t *job)
+{
+    free(job->recs.data);
+    free(job->offsets.data);
+    free(job->scan_start.data);
+    free(job->scan_end.data);
+    free(job->next_key.data);
+    free(job);
+}
+
+void nal_ats_job_free(nal_ats_job_t *job)
+{
+    if (job == NULL) {
+        return;
+    }
+    uint32_t expected = NAL_ATS_JOB_QUEUED;
+    if (__atomic_compare_exchange_n(&job->state, &expected,
+                                    NAL_ATS_JOB_ABANDONED, 0, __ATOMIC_ACQ_REL,
+                                    __ATOMIC_ACQUIRE)) {
+        return; /* freed by nal_ats_job_complete */
+    }
+    nal_ats_job_destroy(job);
+}
+
+int nal_ats_job_put(nal_ats_job_t *job, MDB_dbi dbi, const MDB_val *key,
+                    const MDB_val *data)
+{
+    if (job->kind != NAL_ATS_JOB_WRITE || job->state != NAL_ATS_JOB_NEW) {
+        return EINVAL;
+    }
+    return nal_ats_rec_append(&job->recs, NAL_ATS_OP_PUT, dbi, key, data);
+}
+
+int nal_ats_job_del(nal_ats_job_t *job, MDB_dbi dbi, const MDB_val *key)
+{
+    if (job->kind != NAL_ATS_JOB_WRITE || job->state != NAL_ATS_JOB_NEW) {
+        return EINVAL;
+    }
+    return nal_ats_rec_append(&job->recs, NAL_ATS_OP_DEL, dbi, key, NULL);
+}
+
+int nal_ats_job_set_scan(nal_ats_job_t *job, MDB_dbi dbi, const MDB_val *start,
+                         const MDB_val *end, size_t limit)
+{
+    if (job->kind != NAL_ATS_JOB_SCAN || job->state != NAL_ATS_JOB_NEW) {
+        return EINVAL;
+    }
+    job->scan_dbi = dbi;
+    job->scan_limit = limit;
+    job->scan_start.len = 0;
+    job->scan_end.len = 0;
+    job->has_end = end != NULL;
+    int rc = 0;
+    if (start != NULL) {
+        rc = nal_ats_buf_append(&job->scan_start, start->mv_data,
+                                start->mv_size);
+    }
+    if (rc == 0 && end != NULL) {
+        rc = nal_ats_buf_append(&job->scan_end, end->mv_data, end->mv_size);
+    }
+    return rc;
+}
+
+int nal_ats_job_done(nal_ats_job_t *job)
+{
+    return __atomic_load_n(&job->state, __ATOMIC_ACQUIRE) == NAL_ATS_JOB_DONE;
+}
+
+int nal_ats_job_rc(nal_ats_job_t *job)
+{
+    return job->rc;
+}
+
+size_t nal_ats_job_count(nal_ats_job_t *job)
+{
+    return job->count;
+}
+
+int nal_ats_job_entry(nal_ats_job_t *job, size_t i, MDB_val *key,
+                      MDB_val *data)
+{
+    if (job->kind != NAL_ATS_JOB_SCAN || i >= job->count) {
+        return MDB_NOTFOUND;
+    }
+    size_t off;
+    memcpy(&off, job->offsets.data + i * sizeof(off), sizeof(off));
+    nal_ats_rec_t rec;
+    nal_ats_rec_read(&job->recs, &off, &rec, key, data);
+    return 0;
+}
+
+int nal_ats_job_next_key(nal_ats_job_t *job, MDB_val *key)
+{
+    if (!job->has_next_key) {
+        return MDB_NOTFOUND;
+    }
+    key->mv_data = job->next_key.data;
+    key->mv_size = job->next_key.len;
+    return 0;
+}
+
+static int nal_ats_job_event(TSCont contp, TSEvent event, void *edata)
+{
+    (void)event;
+    (void)edata;
+    nal_ats_job_t *job = TSContDataGet(contp);
+    TSContDestroy(contp);
+    job->cb(job, job->arg);
+    return 0;
+}
+
+/* Publishes the result and hands the job back to its owner. A polling owner
+ * may free the job as soon as it sees DONE, so nothing of it is read after
+ * the exchange unless a callback owns it. */
+static void nal_ats_job_complete(nal_ats_job_t *job)
+{
+    nal_ats_async_cb cb = job->cb;
+    uint32_t expected = NAL_ATS_JOB_QUEUED;
+    if (!__atomic_compare_exchange_n(&job->state, &expected,
+                                     NAL_ATS_JOB_DONE, 0, __ATOMIC_ACQ_REL,
+                                     __ATOMIC_ACQUIRE)) {
+        nal_ats_job_destroy(job); /* abandoned by nal_ats_job_free */
+        return;
+    }
+    if (cb == NULL) {
+        return;
+    }
+    TSCont contp = TSContCreate(nal_ats_job_event, TSMutexCreate());
+    TSContDataSet(contp, job);
+    TSContScheduleOnPool(contp, 0, TS_THREAD_POOL_NET);
+}
+
+static void nal_ats_queue_push(nal_ats_queue_t *q, nal_ats_job_t *job)
+{
+    job->next = NULL;
+    if (q->tail != NULL) {
+        q->tail->next = job;
+    } else {
+        q->head = job;
+    }
+    q->tail = job;
+    q->len++;
+}
+
+/* Waits for jobs and takes up to max of them off q as a list. */
+static nal_ats_job_t *nal_ats_queue_take(nal_ats_queue_t *q, size_t max)
+{
+    pthread_mutex_lock(&q->mutex);
+    while (q->head == NULL) {
+        pthread_cond_wait(&q->cond, &q->mutex);
+    }
+    nal_ats_job_t *first = q->head, *last = first;
+    size_t n = 1;
+    while (n < max && last->next != NULL) {
+        last = last->next;
+        n++;
+    }
+    q->head = last->next;
+    if (q->head == NULL) {
+        q->tail = NULL;
+    }
+    q->len -= n;
+    last->next = NULL;
+    pthread_mutex_unlock(&q->mutex);
+    return first;
+}
+
+static int nal_ats_apply(nal_txn_ptr txn, nal_ats_job_t *job)
+{
+    size_t off = 0;
+    while (off < job->recs.len) {
+        nal_ats_rec_t rec;
+        MDB_val key, data;
+        nal_ats_rec_read(&job->recs, &off, &rec, &key, &data);
+        int rc = rec.op == NAL_ATS_OP_PUT ? nal_put(txn, rec.dbi, &key, &data)
+                                          : nal_del(txn, rec.dbi, &key);
+        if (rc != 0 && !(rec.op == NAL_ATS_OP_DEL && rc == MDB_NOTFOUND)) {
+            return rc;
+        }
+    }
+    return 0;
+}
+
+/* Applies a batch of write jobs with the same tag in one txn, each in a
+ * nested txn. */
+static void nal_ats_write_batch(nal_ats_job_t *jobs)
+{
+    nal_txn_set_tag(jobs->tag[0] != '\0' ? jobs->tag : NULL);
+    nal_txn_ptr txn;
+    int rc = nal_txn_begin(NULL, &txn);
+    for (nal_ats_job_t *job = jobs; rc == 0 && job != NULL; job = job->next) {
+        nal_txn_ptr nested;
+        job->rc = nal_txn_begin(txn, &nested);
+        if (job->rc != 0) {
+            continue;
+        }
+        job->rc = nal_ats_apply(nested, job);
+        if (job->rc != 0) {
+            nal_txn_abort(nested);
+        } else {
+            job->rc = nal_txn_commit(nested);
+        }
+    }
+    if (rc == 0) {
+        rc = nal_txn_commit(txn);
+    }
+    if (rc != 0) {
+        nal_log_error("async write batch failed: %s", nal_strerror(rc));
+    }
+
+    nal_ats_job_t *next;
+    for (nal_ats_job_t *job = jobs; job != NULL; job = next) {
+        next = job->next;
+        if (rc != 0) {
+            job->rc = rc;
+        }
+        nal_ats_job_complete(job);
+    }
+}
+
+/* Cuts jobs after the run of jobs sharing the tag of the first one, so each
+ * txn is charged to the tag of every job in it, and returns the rest. */
+static nal_ats_job_t *nal_ats_split_tag(nal_ats_job_t *jobs)
+{
+    nal_ats_job_t *last = jobs;
+    while (last->next != NULL && strcmp(last->next->tag, jobs->tag) == 0) {
+        last = last->next;
+    }
+    nal_ats_job_t *rest = last->next;
+    last->next = NULL;
+    return rest;
+}
+
+static void *nal_ats_writer_run(void *data)
+{
+    (void)data;
+    for (;;) {
+        nal_ats_job_t *jobs = nal_ats_queue_take(&write_queue,
+                                                 NAL_ATS_WRITE_BATCH);
+        while (jobs != NULL) {
+            nal_ats_job_t *rest = nal_ats_split_tag(jobs);
+            nal_ats_write_batch(jobs);
+            jobs = rest;
+        }
+    }
+    return NULL;
+}
+
+static int nal_ats_scan(nal_ats_job_t *job)
+{
+    nal_txn_ptr txn;
+    int rc = nal_readonly_txn_begin(NULL, &txn);
+    if (rc != 0) {
+        return rc;
+    }
+    nal_cursor_ptr cursor;
+    rc = nal_cursor_open(txn, job->scan_dbi, &cursor);
+    if (rc != 0) {
+        nal_txn_abort(txn);
+        return rc;
+    }
+
+    MDB_val key = {job->scan_start.len, job->scan_start.data}, data;
+    MDB_val end = {job->scan_end.len, job->scan_end.data};
+    /* An empty start is the first key; SET_RANGE would reject it. */
+    rc = nal_cursor_get(cursor, &key, &data,
+                        key.mv_size > 0 ? MDB_SET_RANGE : MDB_FIRST);
+    while (rc == 0) {
+        if (job->has_end && mdb_cmp(txn, job->scan_dbi, &key, &end) >= 0) {
+            break;
+        }
+        if (job->count == job->scan_limit) {
+            rc = nal_ats_buf_append(&job->next_key, key.mv_data, key.mv_size);
+            job->has_next_key = rc == 0;
+            break;
+        }
+        size_t off = job->recs.len;
+        rc = nal_ats_buf_append(&job->offsets, &off, sizeof(off));
+        if (rc == 0) {
+            rc = nal_ats_rec_append(&job->recs, 0, job->scan_dbi, &key, &data);
+        }
+        if (rc == 0) {
+            job->count++;
+            rc = nal_cursor_get(cursor, &key, &data, MDB_NEXT);
+        }
+    }
+    nal_cursor_close(cursor);
+    nal_txn_abort(txn);
+    return rc == MDB_NOTFOUND ? 0 : rc;
+}
+
+static void *nal_ats_scanner_run(void *data)
+{
+    (void)data;
+    for (;;) {
+        nal_ats_job_t *job = nal_ats_queue_take(&scan_queue, 1);
+        job->rc = nal_ats_scan(job);
+        nal_ats_job_complete(job);
+    }
+    return NULL;
+}
+
+int nal_ats_async_start(unsigned int scan_threads, size_t max_queued)
+{
+    pthread_mutex_lock(&start_mutex);
+    int rc = 0;
+    if (!started) {
+        queue_limit = max_queued;
+        if (TSThreadCreate(nal_ats_writer_run, NULL) == NULL) {
+            rc = EAGAIN;
+        }
+        for (unsigned int i = 0; rc == 0 && i < scan_threads; i++) {
+            if (TSThreadCreate(nal_ats_scanner_run, NULL) == NULL) {
+                rc = EAGAIN;
+                break;
+            }
+            scanners++;
+        }
+        if (rc != 0) {
+            nal_log_error("cannot create async lmdb threads");
+        }
+        /* Threads already created keep serving their queues. */
+        __atomic_store_n(&started, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&start_mutex);
+    return rc;
+}
+
+int nal_ats_async_submit(nal_ats_job_t *job, nal_ats_async_cb cb, void *arg)
+{
+    if (!__atomic_load_n(&started, __ATOMIC_ACQUIRE) ||
+        job->state != NAL_ATS_JOB_NEW ||
+        (job->kind == NAL_ATS_JOB_SCAN && scanners == 0)) {
+        return EINVAL;
+    }
+    nal_ats_queue_t *q =
+        job->kind == NAL_ATS_JOB_WRITE ? &write_queue : &scan_queue;
+    job->cb = cb;
+    job->arg = arg;
+
+    pthread_mutex_lock(&q->mutex);
+    if (q->len >= queue_limit) {
+        pthread_mutex_unlock(&q->mutex);
+        return EAGAIN;
+    }
+    job->state = NAL_ATS_JOB_QUEUED;
+    nal_ats_queue_push(q, job);
+    pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+    return 0;
+}
@@ -0,0 +1,56 @@
+#ifndef NAL_ATS_ASYNC_H
+#define NAL_ATS_ASYNC_H
+
+#include "nal_lmdb.h"
+
+/* Traffic Server only: runs write batches and scans on threads created with
+ * TSThreadCreate, so commits and their fsync never block an event thread.
+ * Write jobs queued together are applied in one write txn, each in a nested
+ * txn of its own, so they share a single commit and a failing job does not
+ * affect the others. Scans run on separate threads in read txns.
+ *
+ * A job is built on the calling thread, submitted, and then belongs to the
+ * async threads until it is done. When done, the callback passed to
+ * nal_ats_async_submit runs on an ET_NET thread through
+ * TSContScheduleOnPool; without a callback, callers poll nal_ats_job_done. */
+#define NAL_ATS_JOB_WRITE 1
+#define NAL_ATS_JOB_SCAN 2
+
+typedef struct nal_ats_job_s nal_ats_job_t;
+typedef void (*nal_ats_async_cb)(nal_ats_job_t *job, void *arg);
+
+/* Starts the writer thread and scan_threads scan threads. Submissions beyond
+ * max_queued pending jobs of a kind fail with EAGAIN. Calls after the first
+ * one do nothing. */
+int nal_ats_async_start(unsigned int scan_threads, size_t max_queued);
+
+/* tag is the nal_txn_set_tag of the write txn, see nal_txn_stats.h. Only
+ * consecutive write jobs with the same tag share a txn. */
+nal_ats_job_t *nal_ats_job_new(int kind, const char *tag);
+
+/* Frees job. A job freed while still pending is freed once it is done. */
+void nal_ats_job_free(nal_ats_job_t *job);
+
+/* Write job operations. Keys and values are copied. */
+int nal_ats_job_put(nal_ats_job_t *job, MDB_dbi dbi, const MDB_val *key,
+                    const MDB_val *data);
+int nal_ats_job_del(nal_ats_job_t *job, MDB_dbi dbi, const MDB_val *key);
+
+/* Scan job range: up to limit entries from start, or the first key if NULL
+ * or empty, below end, or to the last key if NULL. */
+int nal_ats_job_set_scan(nal_ats_job_t *job, MDB_dbi dbi, const MDB_val *start,
+                         const MDB_val *end, size_t limit);
+
+int nal_ats_async_submit(nal_ats_job_t *job, nal_ats_async_cb cb, void *arg);
+
+int nal_ats_job_done(nal_ats_job_t *job);
+int nal_ats_job_rc(nal_ats_job_t *job);
+
+/* Scan results, valid until the job is freed. next_key is where a following
+ * scan resumes; it is MDB_NOTFOUND once the range is exhausted. */
+size_t nal_ats_job_count(nal_ats_job_t *job);
+int nal_ats_job_entry(nal_ats_job_t *job, size_t i, MDB_val *key,
+                      MDB_val *data);
+int nal_ats_job_next_key(nal_ats_job_t *job, MDB_val *key);
+
+#endif
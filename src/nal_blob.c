@@ -0,0 +1,701 @@
+#include "nal_blob.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "nal_hash.h"
+#include "nal_lmdb_internal.h"
+#include "nal_log.h"
+
+#define NAL_BLOB_MAGIC 0x626c616eU /* "nalb" */
+#define NAL_BLOB_SEED 0x626c6f62U
+#define NAL_BLOB_INLINE 0
+#define NAL_BLOB_REF 1
+#define NAL_BLOB_ACTIVE_KEY "active"
+#define NAL_BLOB_SEG_KEY_PREFIX 's'
+#define NAL_BLOB_GC_MAX_SEGMENTS 64
+#define NAL_BLOB_NAME_MAX 255
+
+/* Segment record, followed by the dbi name, the key and the value. Names and
+ * keys let the GC find the owner of a blob. Segments never leave the host,
+ * so fields are in host byte order. */
+typedef struct {
+    uint32_t magic;
+    uint16_t name_len;
+    uint16_t reserved;
+    uint32_t key_len;
+    uint32_t value_len;
+} nal_blob_rec_t;
+
+/* What a NAL_BLOB_REF value stores after its tag byte. overhead is the size
+ * of the record header, name and key in front of the value. */
+typedef struct {
+    uint64_t offset;
+    uint64_t checksum;
+    uint32_t segment;
+    uint32_t length;
+    uint32_t overhead;
+    uint32_t reserved;
+} nal_blob_ref_t;
+
+typedef struct {
+    uint32_t segment;
+    uint32_t reserved;
+    uint64_t size;
+} nal_blob_active_t;
+
+typedef struct {
+    uint64_t size;
+    uint64_t live;
+    uint64_t freed_txnid; /* 0 while in use */
+} nal_blob_seg_t;
+
+/* Open segments of this process. An entry is dropped once the GC has
+ * unlinked its file, which only happens after every reader has moved past
+ * the txn that stopped referencing it. */
+typedef struct {
+    uint32_t segment;
+    int fd;
+    const char *map;
+    size_t map_len;
+} nal_blob_file_t;
+
+static int blob_on;
+static int blob_read_only;
+static size_t blob_threshold = NAL_BLOB_DEFAULT_THRESHOLD;
+static MDB_dbi blob_dbi;
+
+static pthread_mutex_t files_mutex = PTHREAD_MUTEX_INITIALIZER;
+static nal_blob_file_t *files;
+static size_t files_len;
+static size_t files_cap;
+
+/* Segment written by the current write txn of this thread, plus one; it is
+ * synced before the txn commits. */
+static __thread int sync_fd_plus1;
+
+int nal_blob_open(nal_txn_ptr txn, int read_only, size_t threshold)
+{
+    int rc = mdb_dbi_open(txn, NAL_BLOB_DBI_NAME, read_only ? 0 : MDB_CREATE,
+                          &blob_dbi);
+    if (rc != 0) {
+        return rc;
+    }
+    blob_read_only = read_only;
+    blob_threshold = threshold;
+    blob_on = 1;
+    return 0;
+}
+
+int nal_blob_enabled(void)
+{
+    return blob_on;
+}
+
+static void nal_blob_seg_key(unsigned char *buf, uint32_t segment)
+{
+    buf[0] = NAL_BLOB_SEG_KEY_PREFIX;
+    for (int i = 4; i >= 1; i--) {
+        buf[i] = (unsigned char)segment;
+        segment >>= 8;
+    }
+}
+
+static void nal_blob_path(char *buf, size_t size, uint32_t segment)
+{
+    snprintf(buf, size, "%s/blob-%08u.seg", nal_env_path(), segment);
+}
+
+static void nal_blob_sweep_locked(void)
+{
+    size_t i = 0;
+    while (i < files_len) {
+        struct stat st;
+        if (fstat(files[i].fd, &st) == 0 && st.st_nlink == 0) {
+            if (files[i].map != NULL) {
+                munmap((void *)files[i].map, files[i].map_len);
+            }
+            close(files[i].fd);
+            files[i] = files[--files_len];
+        } else {
+            i++;
+        }
+    }
+}
+
+/* Returns the table entry of segment, opening the file if needed. Must be
+ * called with files_mutex held. */
+static int nal_blob_file_locked(uint32_t segment, int create,
+                                nal_blob_file_t **file)
+{
+    for (size_t i = 0; i < files_len; i++) {
+        if (files[i].segment == segment) {
+            *file = &files[i];
+            return 0;
+        }
+    }
+
+    /* Opening a segment happens about once per rollover, which is a good
+     * moment to let go of segments the GC has removed. */
+    nal_blob_sweep_locked();
+    if (files_len == files_cap) {
+        size_t cap = files_cap == 0 ? 16 : files_cap * 2;
+        nal_blob_file_t *grown = realloc(files, cap * sizeof(*files));
+        if (grown == NULL) {
+            return ENOMEM;
+        }
+        files = grown;
+        files_cap = cap;
+    }
+
+    char path[PATH_MAX];
+    nal_blob_path(path, sizeof(path), segment);
+    int flags = blob_read_only ? O_RDONLY : O_RDWR;
+    if (create) {
+        flags |= O_CREAT;
+    }
+    int fd = open(path, flags | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        int err = errno;
+        nal_log_error("cannot open blob segment %s: %s", path, strerror(err));
+        return err;
+    }
+
+    nal_blob_file_t *f = &files[files_len++];
+    f->segment = segment;
+    f->fd = fd;
+    f->map = NULL;
+    f->map_len = 0;
+    *file = f;
+    return 0;
+}
+
+static int nal_blob_fd(uint32_t segment, int create, int *fd)
+{
+    nal_blob_file_t *file;
+    pthread_mutex_lock(&files_mutex);
+    int rc = nal_blob_file_locked(segment, create, &file);
+    if (rc == 0) {
+        *fd = file->fd;
+    }
+    pthread_mutex_unlock(&files_mutex);
+    return rc;
+}
+
+/* Maps segment so that at least end bytes are covered. The mapping spans a
+ * whole segment, so it keeps working while the file grows. */
+static int nal_blob_map(uint32_t segment, size_t end, const char **map)
+{
+    nal_blob_file_t *file;
+    pthread_mutex_lock(&files_mutex);
+    int rc = nal_blob_file_locked(segment, 0, &file);
+    if (rc != 0) {
+        goto exit;
+    }
+    if (file->map == NULL || end > file->map_len) {
+        /* Only a segment holding a single oversized blob exceeds the usual
+         * length. A mapping it replaces is leaked on purpose, as values
+         * returned in open txns may point into it. */
+        size_t len = end > NAL_BLOB_SEGMENT_SIZE ? end : NAL_BLOB_SEGMENT_SIZE;
+        void *p = mmap(NULL, len, PROT_READ, MAP_SHARED, file->fd, 0);
+        if (p == MAP_FAILED) {
+            rc = errno;
+            nal_log_error("cannot map blob segment %u: %s", segment,
+                          strerror(rc));
+            goto exit;
+        }
+        file->map = p;
+        file->map_len = len;
+    }
+    *map = file->map;
+
+exit:
+    pthread_mutex_unlock(&files_mutex);
+    return rc;
+}
+
+static int nal_blob_pwrite(int fd, const void *buf, size_t len, off_t offset)
+{
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, offset);
+        if (n == -1) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        p += n;
+        len -= (size_t)n;
+        offset += n;
+    }
+    return 0;
+}
+
+static int nal_blob_seg_get(nal_txn_ptr txn, uint32_t segment,
+                            nal_blob_seg_t *seg)
+{
+    unsigned char key_buf[5];
+    nal_blob_seg_key(key_buf, segment);
+    MDB_val key = {sizeof(key_buf), key_buf}, data;
+    int rc = mdb_get(txn, blob_dbi, &key, &data);
+    if (rc == MDB_NOTFOUND) {
+        memset(seg, 0, sizeof(*seg));
+        return 0;
+    }
+    if (rc != 0) {
+        return rc;
+    }
+    if (data.mv_size != sizeof(*seg)) {
+        return MDB_CORRUPTED;
+    }
+    memcpy(seg, data.mv_data, sizeof(*seg));
+    return 0;
+}
+
+static int nal_blob_seg_put(nal_txn_ptr txn, uint32_t segment,
+                            const nal_blob_seg_t *seg)
+{
+    unsigned char key_buf[5];
+    nal_blob_seg_key(key_buf, segment);
+    MDB_val key = {sizeof(key_buf), key_buf};
+    MDB_val data = {sizeof(*seg), (void *)seg};
+    return mdb_put(txn, blob_dbi, &key, &data, 0);
+}
+
+/* Appends one record to the active segment and fills in a reference to its
+ * value. */
+static int nal_blob_append(nal_txn_ptr txn, const char *name, MDB_val *key,
+                           MDB_val *data, nal_blob_ref_t *ref)
+{
+    if (data->mv_size > UINT32_MAX || key->mv_size > UINT32_MAX ||
+        strlen(name) > NAL_BLOB_NAME_MAX) {
+        return MDB_BAD_VALSIZE;
+    }
+
+    nal_blob_active_t active = {1, 0, 0};
+    MDB_val akey = {sizeof(NAL_BLOB_ACTIVE_KEY) - 1, NAL_BLOB_ACTIVE_KEY};
+    MDB_val adata;
+    int rc = mdb_get(txn, blob_dbi, &akey, &adata);
+    if (rc == 0 && adata.mv_size == sizeof(active)) {
+        memcpy(&active, adata.mv_data, sizeof(active));
+    } else if (rc != 0 && rc != MDB_NOTFOUND) {
+        return rc;
+    }
+
+    size_t name_len = strlen(name);
+    size_t overhead = sizeof(nal_blob_rec_t) + name_len + key->mv_size;
+    size_t rec_len = overhead + data->mv_size;
+    if (active.size > 0 && active.size + rec_len > NAL_BLOB_SEGMENT_SIZE) {
+        int fd;
+        if (nal_blob_fd(active.segment, 0, &fd) == 0) {
+            (void)fdatasync(fd);
+        }
+        active.segment++;
+        active.size = 0;
+    }
+
+    int fd;
+    rc = nal_blob_fd(active.segment, 1, &fd);
+    if (rc != 0) {
+        return rc;
+    }
+
+    nal_blob_rec_t rec = {NAL_BLOB_MAGIC, (uint16_t)name_len, 0,
+                          (uint32_t)key->mv_size, (uint32_t)data->mv_size};
+    off_t off = (off_t)active.size;
+    rc = nal_blob_pwrite(fd, &rec, sizeof(rec), off);
+    if (rc == 0) {
+        rc = nal_blob_pwrite(fd, name, name_len, off + sizeof(rec));
+    }
+    if (rc == 0) {
+        rc = nal_blob_pwrite(fd, key->mv_data, key->mv_size,
+                             off + sizeof(rec) + name_len);
+    }
+    if (rc == 0) {
+        rc = nal_blob_pwrite(fd, data->mv_data, data->mv_size,
+                             off + overhead);
+    }
+    if (rc != 0) {
+        nal_log_error("cannot write blob segment %u: %s", active.segment,
+                      strerror(rc));
+        return rc;
+    }
+    sync_fd_plus1 = fd + 1;
+
+    ref->segment = active.segment;
+    ref->offset = active.size + overhead;
+    ref->length = (uint32_t)data->mv_size;
+    ref->overhead = (uint32_t)overhead;
+    ref->reserved = 0;
+    ref->checksum = nal_hash64(data->mv_data, data->mv_size, NAL_BLOB_SEED);
+
+    nal_blob_seg_t seg;
+    rc = nal_blob_seg_get(txn, active.segment, &seg);
+    if (rc != 0) {
+        return rc;
+    }
+    seg.size += rec_len;
+    seg.live += rec_len;
+    rc = nal_blob_seg_put(txn, active.segment, &seg);
+    if (rc != 0) {
+        return rc;
+    }
+
+    active.size += rec_len;
+    adata.mv_size = sizeof(active);
+    adata.mv_data = &active;
+    return mdb_put(txn, blob_dbi, &akey, &adata, 0);
+}
+
+static int nal_blob_store(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key,
+                          MDB_val *data, const char *name)
+{
+    MDB_val stored;
+    if (data->mv_size <= blob_threshold) {
+        stored.mv_size = 1 + data->mv_size;
+        int rc = mdb_put(txn, dbi, key, &stored, MDB_RESERVE);
+        if (rc != 0) {
+            return rc;
+        }
+        *(unsigned char *)stored.mv_data = NAL_BLOB_INLINE;
+        memcpy((char *)stored.mv_data + 1, data->mv_data, data->mv_size);
+        return 0;
+    }
+
+    nal_blob_ref_t ref;
+    int rc = nal_blob_append(txn, name, key, data, &ref);
+    if (rc != 0) {
+        return rc;
+    }
+    unsigned char buf[1 + sizeof(ref)];
+    buf[0] = NAL_BLOB_REF;
+    memcpy(buf + 1, &ref, sizeof(ref));
+    stored.mv_size = sizeof(buf);
+    stored.mv_data = buf;
+    return mdb_put(txn, dbi, key, &stored, 0);
+}
+
+int nal_blob_put(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key, MDB_val *data)
+{
+    if (!blob_on || blob_read_only) {
+        return MDB_INCOMPATIBLE;
+    }
+    /* The GC finds owners by name. */
+    nal_dbi_info_t *info = nal_dbi_info_get(dbi);
+    if (info == NULL || info->name == NULL) {
+        return MDB_BAD_DBI;
+    }
+
+    MDB_val old;
+    int rc = mdb_get(txn, dbi, key, &old);
+    if (rc == 0) {
+        rc = nal_blob_release(txn, &old);
+    } else if (rc == MDB_NOTFOUND) {
+        rc = 0;
+    }
+    if (rc != 0) {
+        return rc;
+    }
+    return nal_blob_store(txn, dbi, key, data, info->name);
+}
+
+static int nal_blob_decode(const MDB_val *stored, nal_blob_ref_t *ref)
+{
+    if (stored->mv_size != 1 + sizeof(*ref)) {
+        return MDB_CORRUPTED;
+    }
+    memcpy(ref, (const char *)stored->mv_data + 1, sizeof(*ref));
+    return 0;
+}
+
+int nal_blob_resolve(MDB_val *data)
+{
+    if (data->mv_size == 0) {
+        return MDB_CORRUPTED;
+    }
+    const unsigned char *p = data->mv_data;
+    if (p[0] == NAL_BLOB_INLINE) {
+        data->mv_data = (char *)data->mv_data + 1;
+        data->mv_size--;
+        return 0;
+    }
+    if (p[0] != NAL_BLOB_REF) {
+        return MDB_CORRUPTED;
+    }
+
+    nal_blob_ref_t ref;
+    int rc = nal_blob_decode(data, &ref);
+    if (rc != 0) {
+        return rc;
+    }
+    const char *map;
+    rc = nal_blob_map(ref.segment, ref.offset + ref.length, &map);
+    if (rc != 0) {
+        return rc;
+    }
+    const char *value = map + ref.offset;
+    if (nal_hash64(value, ref.length, NAL_BLOB_SEED) != ref.checksum) {
+        nal_log_error("blob checksum mismatch, segment=%u, offset=%llu",
+                      ref.segment, (unsigned long long)ref.offset);
+        return MDB_CORRUPTED;
+    }
+    data->mv_data = (void *)value;
+    data->mv_size = ref.length;
+    return 0;
+}
+
+int nal_blob_release(nal_txn_ptr txn, const MDB_val *stored)
+{
+    if (stored->mv_size == 0 ||
+        *(const unsigned char *)stored->mv_data != NAL_BLOB_REF) {
+        return 0;
+    }
+    nal_blob_ref_t ref;
+    int rc = nal_blob_decode(stored, &ref);
+    if (rc != 0) {
+        return rc;
+    }
+
+    nal_blob_seg_t seg;
+    rc = nal_blob_seg_get(txn, ref.segment, &seg);
+    if (rc != 0 || seg.size == 0 || seg.freed_txnid != 0) {
+        return rc;
+    }
+    uint64_t len = (uint64_t)ref.overhead + ref.length;
+    seg.live = seg.live > len ? seg.live - len : 0;
+    return nal_blob_seg_put(txn, ref.segment, &seg);
+}
+
+int nal_blob_sync(void)
+{
+    int fd = sync_fd_plus1 - 1;
+    sync_fd_plus1 = 0;
+    if (fd < 0) {
+        return 0;
+    }
+    unsigned int env_flags = 0;
+    (void)mdb_env_get_flags(nal_env_handle(), &env_flags);
+    if (env_flags & MDB_NOSYNC) {
+        return 0;
+    }
+    return fdatasync(fd) == 0 ? 0 : errno;
+}
+
+static int nal_blob_oldest_reader_cb(const char *msg, void *ctx)
+{
+    uint64_t *oldest = ctx;
+    int pid;
+    size_t thread;
+    unsigned long long txnid;
+    /* Lines are "pid thread txnid"; idle slots show "-" and the header row
+     * does not parse. */
+    if (sscanf(msg, "%d %zx %llu", &pid, &thread, &txnid) == 3 &&
+        txnid < *oldest) {
+        *oldest = txnid;
+    }
+    return 0;
+}
+
+/* Unlinks segments freed by a txn that every current reader has passed. */
+static int nal_blob_unlink_freed(nal_txn_ptr txn)
+{
+    uint64_t oldest = UINT64_MAX;
+    int rc = mdb_reader_list(nal_env_handle(), nal_blob_oldest_reader_cb,
+                             &oldest);
+    if (rc < 0) {
+        return rc;
+    }
+
+    MDB_cursor *cursor;
+    rc = mdb_cursor_open(txn, blob_dbi, &cursor);
+    if (rc != 0) {
+        return rc;
+    }
+    unsigned char start = NAL_BLOB_SEG_KEY_PREFIX;
+    MDB_val key = {1, &start}, data;
+    rc = mdb_cursor_get(cursor, &key, &data, MDB_SET_RANGE);
+    while (rc == 0) {
+        const unsigned char *k = key.mv_data;
+        if (key.mv_size != 5 || k[0] != NAL_BLOB_SEG_KEY_PREFIX) {
+            break;
+        }
+        nal_blob_seg_t seg;
+        if (data.mv_size == sizeof(seg)) {
+            memcpy(&seg, data.mv_data, sizeof(seg));
+        } else {
+            seg.freed_txnid = 0;
+        }
+        if (seg.freed_txnid != 0 && seg.freed_txnid <= oldest) {
+            uint32_t segment = ((uint32_t)k[1] << 24) | ((uint32_t)k[2] << 16) |
+                               ((uint32_t)k[3] << 8) | k[4];
+            char path[PATH_MAX];
+            nal_blob_path(path, sizeof(path), segment);
+            if (unlink(path) == -1 && errno != ENOENT) {
+                nal_log_warning("cannot unlink blob segment %s: %s", path,
+                                strerror(errno));
+            }
+            rc = mdb_cursor_del(cursor, 0);
+            if (rc != 0) {
+                break;
+            }
+        }
+        rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT);
+    }
+    mdb_cursor_close(cursor);
+    return rc == MDB_NOTFOUND ? 0 : rc;
+}
+
+/* Moves the blobs of segment that are still referenced to the active
+ * segment. */
+static int nal_blob_rewrite(nal_txn_ptr txn, uint32_t segment,
+                            const nal_blob_seg_t *seg, size_t *moved_bytes)
+{
+    const char *map;
+    int rc = nal_blob_map(segment, seg->size, &map);
+    if (rc != 0) {
+        return rc;
+    }
+
+    char name[NAL_BLOB_NAME_MAX + 1];
+    uint64_t off = 0;
+    while (off + sizeof(nal_blob_rec_t) <= seg->size) {
+        nal_blob_rec_t rec;
+        memcpy(&rec, map + off, sizeof(rec));
+        /* The lengths are at most 32 bits each, so the sum cannot wrap. */
+        uint64_t overhead = sizeof(rec) + rec.name_len + rec.key_len;
+        if (rec.magic != NAL_BLOB_MAGIC ||
+            overhead + rec.value_len > seg->size - off) {
+            nal_log_error("bad blob record, segment=%u, offset=%llu", segment,
+                          (unsigned long long)off);
+            return MDB_CORRUPTED;
+        }
+        uint64_t value_off = off + overhead;
+        off = value_off + rec.value_len;
+        if (rec.name_len > NAL_BLOB_NAME_MAX) {
+            continue;
+        }
+        memcpy(name, map + value_off - rec.key_len - rec.name_len,
+               rec.name_len);
+        name[rec.name_len] = '\0';
+
+        MDB_dbi dbi;
+        if (mdb_dbi_open(txn, name, 0, &dbi) != 0) {
+            continue;
+        }
+        MDB_val key = {rec.key_len, (void *)(map + value_off - rec.key_len)};
+        MDB_val stored;
+        if (mdb_get(txn, dbi, &key, &stored) != 0) {
+            continue;
+        }
+        nal_blob_ref_t ref;
+        if (stored.mv_size == 0 ||
+            *(const unsigned char *)stored.mv_data != NAL_BLOB_REF ||
+            nal_blob_decode(&stored, &ref) != 0 || ref.segment != segment ||
+            ref.offset != value_off) {
+            continue;
+        }
+
+        MDB_val value = {rec.value_len, (void *)(map + value_off)};
+        rc = nal_blob_store(txn, dbi, &key, &value, name);
+        if (rc != 0) {
+            return rc;
+        }
+        *moved_bytes += rec.value_len;
+    }
+    return 0;
+}
+
+int nal_blob_gc(nal_txn_ptr txn, unsigned int max_live_pct,
+                size_t max_segments, size_t *moved_bytes)
+{
+    *moved_bytes = 0;
+    if (!blob_on || blob_read_only) {
+        return MDB_INCOMPATIBLE;
+    }
+
+    int rc = nal_blob_unlink_freed(txn);
+    if (rc != 0) {
+        return rc;
+    }
+
+    nal_blob_active_t active = {0, 0, 0};
+    MDB_val akey = {sizeof(NAL_BLOB_ACTIVE_KEY) - 1, NAL_BLOB_ACTIVE_KEY};
+    MDB_val adata;
+    rc = mdb_get(txn, blob_dbi, &akey, &adata);
+    if (rc == MDB_NOTFOUND) {
+        return 0;
+    }
+    if (rc != 0) {
+        return rc;
+    }
+    if (adata.mv_size != sizeof(active)) {
+        return MDB_CORRUPTED;
+    }
+    memcpy(&active, adata.mv_data, sizeof(active));
+
+    /* Pick candidates first: rewriting updates the segment records the
+     * cursor would be walking. */
+    if (max_segments > NAL_BLOB_GC_MAX_SEGMENTS) {
+        max_segments = NAL_BLOB_GC_MAX_SEGMENTS;
+    }
+    uint32_t victims[NAL_BLOB_GC_MAX_SEGMENTS];
+    nal_blob_seg_t victim_segs[NAL_BLOB_GC_MAX_SEGMENTS];
+    size_t num_victims = 0;
+
+    MDB_cursor *cursor;
+    rc = mdb_cursor_open(txn, blob_dbi, &cursor);
+    if (rc != 0) {
+        return rc;
+    }
+    unsigned char start = NAL_BLOB_SEG_KEY_PREFIX;
+    MDB_val key = {1, &start}, data;
+    rc = mdb_cursor_get(cursor, &key, &data, MDB_SET_RANGE);
+    while (rc == 0 && num_victims < max_segments) {
+        const unsigned char *k = key.mv_data;
+        if (key.mv_size != 5 || k[0] != NAL_BLOB_SEG_KEY_PREFIX) {
+            break;
+        }
+        uint32_t segment = ((uint32_t)k[1] << 24) | ((uint32_t)k[2] << 16) |
+                           ((uint32_t)k[3] << 8) | k[4];
+        nal_blob_seg_t seg;
+        if (data.mv_size == sizeof(seg)) {
+            memcpy(&seg, data.mv_data, sizeof(seg));
+            if (segment != active.segment && seg.freed_txnid == 0 &&
+                seg.size > 0 && seg.live * 100 <= seg.size * max_live_pct) {
+                victims[num_victims] = segment;
+                victim_segs[num_victims] = seg;
+                num_victims++;
+            }
+        }
+        rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT);
+    }
+    mdb_cursor_close(cursor);
+    if (rc != 0 && rc != MDB_NOTFOUND) {
+        return rc;
+    }
+
+    for (size_t i = 0; i < num_victims; i++) {
+        rc = nal_blob_rewrite(txn, victims[i], &victim_segs[i], moved_bytes);
+        if (rc != 0) {
+            return rc;
+        }
+        /* Readers older than this txn may still follow references into the
+         * segment, so the file is only unlinked by a later run. */
+        victim_segs[i].live = 0;
+        victim_segs[i].freed_txnid = mdb_txn_id(txn);
+        rc = nal_blob_seg_put(txn, victims[i], &victim_segs[i]);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,35 @@
+#ifndef NAL_BLOB_H
+#define NAL_BLOB_H
+
+#include "nal_lmdb.h"
+
+/* Values of NAL_DBI_BLOB dbis larger than the threshold are appended to
+ * segment files blob-NNNNNNNN.seg in the env directory and the dbi only keeps
+ * a reference (segment, offset, length, checksum). Segment bookkeeping lives
+ * in a dbi of the same env, so appends are serialized by the LMDB write lock
+ * and become visible on commit. Every process writing to such dbis must call
+ * nal_blob_open. */
+#define NAL_BLOB_DBI_NAME "__nal_blob"
+#define NAL_BLOB_DEFAULT_THRESHOLD 2048
+#define NAL_BLOB_SEGMENT_SIZE (64UL * 1024 * 1024)
+
+int nal_blob_open(nal_txn_ptr txn, int read_only, size_t threshold);
+int nal_blob_enabled(void);
+
+/* Used by nal_lmdb.c on NAL_DBI_BLOB dbis. nal_blob_resolve turns a stored
+ * value into the caller's value in place; like any LMDB value the result is
+ * valid until the txn ends. nal_blob_release drops the live-byte accounting
+ * of a stored value that is about to be overwritten or deleted. */
+int nal_blob_put(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key, MDB_val *data);
+int nal_blob_resolve(MDB_val *data);
+int nal_blob_release(nal_txn_ptr txn, const MDB_val *stored);
+int nal_blob_sync(void);
+
+/* Rewrites the live blobs of up to max_segments sealed segments whose live
+ * bytes are at most max_live_pct percent of their size, and unlinks segments
+ * freed by earlier runs once no reader can still see them. Run it
+ * periodically in its own write txn. */
+int nal_blob_gc(nal_txn_ptr txn, unsigned int max_live_pct,
+                size_t max_segments, size_t *moved_bytes);
+
+#endif
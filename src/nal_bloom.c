@@ -0,0 +1,359 @@
+#include "nal_bloom.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "nal_hash.h"
+#include "nal_lmdb_internal.h"
+#include "nal_log.h"
+
+#define NAL_BLOOM_MAGIC 0x6e616c66U /* "nalf" */
+#define NAL_BLOOM_FILE_PREFIX "nal_bloom-"
+#define NAL_BLOOM_BLOCK_WORDS 8 /* one cache line per key */
+#define NAL_BLOOM_BLOCK_BITS (NAL_BLOOM_BLOCK_WORDS * 64)
+#define NAL_BLOOM_MAX_HASHES 7  /* 9 bits each out of one 64-bit hash */
+#define NAL_BLOOM_STATE_EMPTY 0
+#define NAL_BLOOM_STATE_READY 1
+#define NAL_BLOOM_BOOT_ID_PATH "/proc/sys/kernel/random/boot_id"
+
+/* The file holds two bit arrays: readers use the active one, and while a
+ * rebuild runs writers also add to the other one, which then becomes
+ * active. seq changes whenever an array a reader may be looking at changes
+ * under it, so a negative answer can be double-checked. */
+typedef struct {
+    uint32_t magic;
+    uint32_t num_hashes;
+    uint64_t num_blocks;
+    uint32_t state;
+    uint32_t active;
+    uint32_t rebuilding;
+    uint32_t seq;
+    uint64_t added;
+    uint64_t deleted;
+    unsigned char boot_id[16]; /* boot the filter was last built in */
+} nal_bloom_hdr_t;
+
+struct nal_bloom_s {
+    nal_bloom_hdr_t *hdr;
+    uint64_t *bits[2];
+    size_t map_len;
+    int fd;
+};
+
+/* Fills id with a digest of the kernel boot id, or returns -1 if there is
+ * none. */
+static int nal_bloom_boot_id(unsigned char id[16])
+{
+    char buf[64];
+    int fd = open(NAL_BLOOM_BOOT_ID_PATH, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return -1;
+    }
+    ssize_t n = read(fd, buf, sizeof(buf));
+    close(fd);
+    if (n <= 0) {
+        return -1;
+    }
+    uint64_t h[2] = {nal_hash64(buf, (size_t)n, NAL_BLOOM_MAGIC),
+                     nal_hash64(buf, (size_t)n, ~NAL_BLOOM_MAGIC)};
+    memcpy(id, h, sizeof(h));
+    return 0;
+}
+
+static uint64_t nal_bloom_hash(const MDB_val *key)
+{
+    return nal_hash64(key->mv_data, key->mv_size, NAL_BLOOM_MAGIC);
+}
+
+static uint64_t *nal_bloom_block(nal_bloom_t *bloom, int which, uint64_t h)
+{
+    uint64_t block = ((h >> 32) * bloom->hdr->num_blocks) >> 32;
+    return bloom->bits[which] + block * NAL_BLOOM_BLOCK_WORDS;
+}
+
+static int nal_bloom_test(nal_bloom_t *bloom, int which, uint64_t h)
+{
+    uint64_t *block = nal_bloom_block(bloom, which, h);
+    uint64_t bits = h * 0x9e3779b97f4a7c15ULL;
+    for (uint32_t i = 0; i < bloom->hdr->num_hashes; i++) {
+        unsigned int bit = (unsigned int)(bits >> (9 * i)) &
+                           (NAL_BLOOM_BLOCK_BITS - 1);
+        uint64_t word = __atomic_load_n(&block[bit / 64], __ATOMIC_RELAXED);
+        if (!(word & ((uint64_t)1 << (bit % 64)))) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void nal_bloom_set(nal_bloom_t *bloom, int which, uint64_t h)
+{
+    uint64_t *block = nal_bloom_block(bloom, which, h);
+    uint64_t bits = h * 0x9e3779b97f4a7c15ULL;
+    for (uint32_t i = 0; i < bloom->hdr->num_hashes; i++) {
+        unsigned int bit = (unsigned int)(bits >> (9 * i)) &
+                           (NAL_BLOOM_BLOCK_BITS - 1);
+        __atomic_fetch_or(&block[bit / 64], (uint64_t)1 << (bit % 64),
+                          __ATOMIC_RELAXED);
+    }
+}
+
+int nal_bloom_may_contain(nal_bloom_t *bloom, const MDB_val *key)
+{
+    nal_bloom_hdr_t *hdr = bloom->hdr;
+    uint32_t seq = __atomic_load_n(&hdr->seq, __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&hdr->state, __ATOMIC_ACQUIRE) !=
+        NAL_BLOOM_STATE_READY) {
+        return 1;
+    }
+    int which = (int)__atomic_load_n(&hdr->active, __ATOMIC_ACQUIRE);
+    if (nal_bloom_test(bloom, which, nal_bloom_hash(key))) {
+        return 1;
+    }
+    /* A swap or clear during the test makes the answer unreliable. */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&hdr->seq, __ATOMIC_RELAXED) != seq;
+}
+
+void nal_bloom_add(nal_bloom_t *bloom, const MDB_val *key)
+{
+    nal_bloom_hdr_t *hdr = bloom->hdr;
+    uint64_t h = nal_bloom_hash(key);
+    /* Read rebuilding before active: the rebuild switches active before it
+     * clears rebuilding, so a writer never misses the new array. */
+    uint32_t rebuilding = __atomic_load_n(&hdr->rebuilding, __ATOMIC_SEQ_CST);
+    int which = (int)__atomic_load_n(&hdr->active, __ATOMIC_SEQ_CST);
+    nal_bloom_set(bloom, which, h);
+    if (rebuilding) {
+        nal_bloom_set(bloom, 1 - which, h);
+    }
+    __atomic_add_fetch(&hdr->added, 1, __ATOMIC_RELAXED);
+}
+
+void nal_bloom_note_del(nal_bloom_t *bloom)
+{
+    __atomic_add_fetch(&bloom->hdr->deleted, 1, __ATOMIC_RELAXED);
+}
+
+static int nal_bloom_map(const char *path, size_t expected_keys,
+                         unsigned int bits_per_key, nal_bloom_t **bloom)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        int err = errno;
+        nal_log_error("cannot open %s: %s", path, strerror(err));
+        return err;
+    }
+
+    /* The first process sizes the file, everybody else uses its header. */
+    int rc = 0;
+    (void)flock(fd, LOCK_EX);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        rc = errno;
+        goto exit;
+    }
+    if (st.st_size == 0) {
+        uint64_t bits = (uint64_t)expected_keys * bits_per_key;
+        uint64_t num_blocks = (bits + NAL_BLOOM_BLOCK_BITS - 1) /
+                              NAL_BLOOM_BLOCK_BITS;
+        if (num_blocks == 0) {
+            num_blocks = 1;
+        }
+        /* k = bits_per_key * ln 2 minimizes false positives. */
+        uint32_t num_hashes = (bits_per_key * 69 + 50) / 100;
+        if (num_hashes < 1) {
+            num_hashes = 1;
+        } else if (num_hashes > NAL_BLOOM_MAX_HASHES) {
+            num_hashes = NAL_BLOOM_MAX_HASHES;
+        }
+        st.st_size = (off_t)(sizeof(nal_bloom_hdr_t) +
+                             2 * num_blocks * NAL_BLOOM_BLOCK_WORDS * 8);
+        nal_bloom_hdr_t hdr = {0};
+        hdr.magic = NAL_BLOOM_MAGIC;
+        hdr.num_hashes = num_hashes;
+        hdr.num_blocks = num_blocks;
+        if (ftruncate(fd, st.st_size) != 0 ||
+            pwrite(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr)) {
+            rc = errno;
+            goto exit;
+        }
+    }
+
+    size_t len = (size_t)st.st_size;
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        rc = errno;
+        goto exit;
+    }
+    nal_bloom_hdr_t *hdr = p;
+    size_t array_len = hdr->num_blocks * NAL_BLOOM_BLOCK_WORDS * 8;
+    if (hdr->magic != NAL_BLOOM_MAGIC || hdr->num_blocks == 0 ||
+        hdr->num_hashes > NAL_BLOOM_MAX_HASHES ||
+        sizeof(*hdr) + 2 * array_len > len) {
+        nal_log_error("%s is corrupt", path);
+        munmap(p, len);
+        rc = MDB_CORRUPTED;
+        goto exit;
+    }
+
+    /* Bits set before a commit sit in the page cache, which LMDB's fsync
+     * does not cover, so a crash of the host can lose them while the commit
+     * survives. A process crash cannot, so the filter is only trusted within
+     * the boot it was built in. */
+    unsigned char boot_id[16];
+    if (nal_bloom_boot_id(boot_id) != 0 ||
+        memcmp(hdr->boot_id, boot_id, sizeof(boot_id)) != 0) {
+        __atomic_store_n(&hdr->state, NAL_BLOOM_STATE_EMPTY, __ATOMIC_RELEASE);
+    }
+
+    nal_bloom_t *b = malloc(sizeof(*b));
+    if (b == NULL) {
+        munmap(p, len);
+        rc = ENOMEM;
+        goto exit;
+    }
+    b->hdr = hdr;
+    b->bits[0] = (uint64_t *)(hdr + 1);
+    b->bits[1] = (uint64_t *)((char *)b->bits[0] + array_len);
+    b->map_len = len;
+    b->fd = fd;
+    *bloom = b;
+
+exit:
+    (void)flock(fd, LOCK_UN);
+    if (rc != 0) {
+        nal_log_error("cannot set up %s: %s", path, nal_strerror(rc));
+        close(fd);
+    }
+    return rc;
+}
+
+int nal_bloom_open(MDB_dbi dbi, size_t expected_keys,
+                   unsigned int bits_per_key)
+{
+    nal_dbi_info_t *info = nal_dbi_info_get(dbi);
+    if (info == NULL || info->name == NULL) {
+        return MDB_BAD_DBI;
+    }
+    if (info->bloom != NULL) {
+        return 0;
+    }
+
+    char path[PATH_MAX];
+    int n = snprintf(path, sizeof(path), "%s/%s%s", nal_env_path(),
+                     NAL_BLOOM_FILE_PREFIX, info->name);
+    if (n < 0 || (size_t)n >= sizeof(path)) {
+        return ENAMETOOLONG;
+    }
+    nal_bloom_t *bloom = NULL;
+    int rc = nal_bloom_map(path, expected_keys, bits_per_key, &bloom);
+    if (rc != 0) {
+        return rc;
+    }
+    /* From here on this process adds its writes. */
+    info->bloom = bloom;
+
+    /* A read-only process cannot take the write lock a build needs; it uses
+     * the filter once a writer has built it. */
+    unsigned int env_flags = 0;
+    (void)mdb_env_get_flags(nal_env_handle(), &env_flags);
+    if (!(env_flags & MDB_RDONLY) &&
+        __atomic_load_n(&bloom->hdr->state, __ATOMIC_ACQUIRE) !=
+            NAL_BLOOM_STATE_READY) {
+        return nal_bloom_rebuild(dbi);
+    }
+    return 0;
+}
+
+int nal_bloom_rebuild(MDB_dbi dbi)
+{
+    nal_dbi_info_t *info = nal_dbi_info_get(dbi);
+    if (info == NULL || info->bloom == NULL) {
+        return MDB_BAD_DBI;
+    }
+    nal_bloom_t *bloom = info->bloom;
+    nal_bloom_hdr_t *hdr = bloom->hdr;
+    MDB_env *env = nal_env_handle();
+
+    /* One rebuild at a time across processes. */
+    (void)flock(bloom->fd, LOCK_EX);
+    int next = 1 - (int)__atomic_load_n(&hdr->active, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&hdr->seq, 1, __ATOMIC_SEQ_CST);
+    memset(bloom->bits[next], 0,
+           hdr->num_blocks * NAL_BLOOM_BLOCK_WORDS * sizeof(uint64_t));
+    __atomic_store_n(&hdr->rebuilding, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&hdr->deleted, 0, __ATOMIC_RELAXED);
+
+    /* Writers check the flag while holding the write lock. Taking the lock
+     * once makes sure every writer that missed it has committed, so the
+     * snapshot below contains its keys. */
+    MDB_txn *txn;
+    int rc = mdb_txn_begin(env, NULL, 0, &txn);
+    if (rc != 0) {
+        goto fail;
+    }
+    mdb_txn_abort(txn);
+
+    rc = mdb_txn_begin(env, NULL, MDB_RDONLY, &txn);
+    if (rc != 0) {
+        goto fail;
+    }
+    MDB_cursor *cursor;
+    rc = mdb_cursor_open(txn, dbi, &cursor);
+    if (rc != 0) {
+        mdb_txn_abort(txn);
+        goto fail;
+    }
+    uint64_t count = 0;
+    MDB_val key, data;
+    while ((rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT_NODUP)) == 0) {
+        nal_bloom_set(bloom, next, nal_bloom_hash(&key));
+        count++;
+    }
+    mdb_cursor_close(cursor);
+    mdb_txn_abort(txn);
+    if (rc != MDB_NOTFOUND) {
+        goto fail;
+    }
+
+    if (nal_bloom_boot_id(hdr->boot_id) != 0) {
+        memset(hdr->boot_id, 0, sizeof(hdr->boot_id));
+    }
+    __atomic_store_n(&hdr->added, count, __ATOMIC_RELAXED);
+    __atomic_store_n(&hdr->active, (uint32_t)next, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&hdr->seq, 1, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&hdr->rebuilding, 0, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&hdr->state, NAL_BLOOM_STATE_READY, __ATOMIC_RELEASE);
+    (void)flock(bloom->fd, LOCK_UN);
+    nal_log_note("rebuilt bloom filter of dbi %s, %llu keys", info->name,
+                 (unsigned long long)count);
+    return 0;
+
+fail:
+    /* The active array is untouched and writers still add to it. */
+    __atomic_store_n(&hdr->rebuilding, 0, __ATOMIC_SEQ_CST);
+    (void)flock(bloom->fd, LOCK_UN);
+    nal_log_error("cannot rebuild bloom filter of dbi %s: %s", info->name,
+                  nal_strerror(rc));
+    return rc;
+}
+
+int nal_bloom_stats(MDB_dbi dbi, uint64_t *added, uint64_t *deleted)
+{
+    nal_dbi_info_t *info = nal_dbi_info_get(dbi);
+    if (info == NULL || info->bloom == NULL) {
+        return MDB_BAD_DBI;
+    }
+    *added = __atomic_load_n(&info->bloom->hdr->added, __ATOMIC_RELAXED);
+    *deleted = __atomic_load_n(&info->bloom->hdr->deleted, __ATOMIC_RELAXED);
+    return 0;
+}
@@ -0,0 +1,38 @@
+#ifndef NAL_BLOOM_H
+#define NAL_BLOOM_H
+
+#include "nal_lmdb.h"
+
+/* Optional per-dbi Bloom filter in a sidecar file nal_bloom-<dbi name> in the
+ * env directory, mapped MAP_SHARED by every process, so it is shared and
+ * survives process restarts. The file is not synced with LMDB's commits, so
+ * after a reboot the filter is rebuilt before it is used. nal_put adds keys
+ * and nal_get answers MDB_NOTFOUND without touching the map when the filter
+ * rules a key out. Deletes cannot be removed from a Bloom filter;
+ * nal_bloom_rebuild rescans the dbi to drop them. Every process writing to
+ * the dbi must open its filter, or the filter would miss keys. */
+#define NAL_BLOOM_DEFAULT_BITS_PER_KEY 10
+
+typedef struct nal_bloom_s nal_bloom_t;
+
+/* Opens or creates the filter of dbi, which must have been opened with
+ * nal_dbi_open or nal_readonly_dbi_open, and builds it if it is not ready.
+ * The size is fixed by the first process creating the file. Must not be
+ * called while this thread has a txn open. */
+int nal_bloom_open(MDB_dbi dbi, size_t expected_keys,
+                   unsigned int bits_per_key);
+
+/* Rebuilds the filter of dbi from a scan. Writers keep going meanwhile. Must
+ * not be called while this thread has a txn open. */
+int nal_bloom_rebuild(MDB_dbi dbi);
+
+/* Keys added, counting those of the last rebuild, and deletes seen since
+ * that rebuild, to decide when the next one is due. */
+int nal_bloom_stats(MDB_dbi dbi, uint64_t *added, uint64_t *deleted);
+
+/* Used by nal_lmdb.c. */
+int nal_bloom_may_contain(nal_bloom_t *bloom, const MDB_val *key);
+void nal_bloom_add(nal_bloom_t *bloom, const MDB_val *key);
+void nal_bloom_note_del(nal_bloom_t *bloom);
+
+#endif
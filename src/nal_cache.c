@@ -0,0 +1,483 @@
+#include "nal_cache.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nal_hash.h"
+#include "nal_lmdb_internal.h"
+#include "nal_log.h"
+
+#define NAL_CACHE_MAGIC 0x6e616c63U /* "nalc" */
+#define NAL_CACHE_FILE_PREFIX "nal_cache-"
+#define NAL_CACHE_MAX_SLOTS ((size_t)1 << 32)
+#define NAL_CACHE_SEEKS 4      /* random positions per eviction */
+#define NAL_CACHE_RUN 4        /* keys looked at per position */
+#define NAL_CACHE_MAX_BATCH 64 /* evictions per put */
+
+/* LFU slots hold the minute of the last decay in the upper 24 bits and a
+ * logarithmic access counter in the lower 8, as in Redis: a new key starts
+ * at NAL_CACHE_LFU_INIT, a hit increments with probability
+ * 1 / ((counter - init) * NAL_CACHE_LFU_LOG_FACTOR + 1), and the counter
+ * loses one per NAL_CACHE_LFU_DECAY_MIN minutes without hits. LRU slots
+ * hold the millisecond of the last access modulo 2^32, so idle times are
+ * right up to 49 days. Both count from the creation of the file. A slot of
+ * 0 belongs to a key never seen, which goes first. */
+#define NAL_CACHE_LFU_INIT 5
+#define NAL_CACHE_LFU_LOG_FACTOR 10
+#define NAL_CACHE_LFU_DECAY_MIN 1
+
+typedef struct {
+    uint32_t magic;
+    uint32_t policy;
+    uint64_t num_slots;
+    uint64_t budget;
+    int64_t epoch; /* CLOCK_REALTIME milliseconds at creation */
+    uint64_t evicted;
+    uint64_t evict_runs;
+    unsigned char pad[16];
+} nal_cache_hdr_t;
+
+struct nal_cache_s {
+    nal_cache_hdr_t *hdr;
+    uint32_t *slots;
+    size_t map_len;
+    size_t key_max; /* mdb_env_get_maxkeysize, sizes the eviction keys */
+};
+
+static __thread uint64_t rand_state;
+
+static uint64_t nal_cache_rand(void)
+{
+    if (rand_state == 0) {
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        rand_state = nal_hash64(&ts, sizeof(ts), (uint64_t)getpid()) | 1;
+    }
+    /* xorshift64* */
+    rand_state ^= rand_state >> 12;
+    rand_state ^= rand_state << 25;
+    rand_state ^= rand_state >> 27;
+    return rand_state * 0x2545f4914f6cdd1dULL;
+}
+
+static uint32_t *nal_cache_slot(nal_cache_t *cache, const MDB_val *key)
+{
+    uint64_t h = nal_hash64(key->mv_data, key->mv_size, NAL_CACHE_MAGIC);
+    return &cache->slots[((h >> 32) * cache->hdr->num_slots) >> 32];
+}
+
+static int64_t nal_cache_realtime_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Milliseconds since the creation of the file. */
+static uint64_t nal_cache_now(nal_cache_t *cache)
+{
+    int64_t ms = nal_cache_realtime_ms() - cache->hdr->epoch;
+    return ms > 0 ? (uint64_t)ms : 0;
+}
+
+static uint32_t nal_cache_lru_slot(uint64_t now)
+{
+    uint32_t slot = (uint32_t)now;
+    return slot != 0 ? slot : 1;
+}
+
+/* Counter of an LFU slot after decay. */
+static uint32_t nal_cache_lfu_counter(uint32_t slot, uint32_t now_min)
+{
+    uint32_t counter = slot & 0xff;
+    uint32_t last_min = slot >> 8;
+    uint32_t elapsed = (now_min - last_min) & 0xffffff;
+    uint32_t decay = elapsed / NAL_CACHE_LFU_DECAY_MIN;
+    return decay < counter ? counter - decay : 0;
+}
+
+static uint32_t nal_cache_lfu_slot(uint32_t counter, uint32_t now_min)
+{
+    return ((now_min & 0xffffff) << 8) | counter;
+}
+
+void nal_cache_touch(nal_cache_t *cache, const MDB_val *key)
+{
+    uint32_t *slot = nal_cache_slot(cache, key);
+    uint64_t now = nal_cache_now(cache);
+    uint32_t old = __atomic_load_n(slot, __ATOMIC_RELAXED);
+    uint32_t next;
+    if (cache->hdr->policy == NAL_CACHE_LRU) {
+        next = nal_cache_lru_slot(now);
+    } else {
+        uint32_t now_min = (uint32_t)(now / 60000);
+        uint32_t counter = nal_cache_lfu_counter(old, now_min);
+        if (counter < 255) {
+            uint32_t base = counter > NAL_CACHE_LFU_INIT
+                                ? counter - NAL_CACHE_LFU_INIT
+                                : 0;
+            uint64_t range = (uint64_t)base * NAL_CACHE_LFU_LOG_FACTOR + 1;
+            if (nal_cache_rand() % range == 0) {
+                counter++;
+            }
+        }
+        next = nal_cache_lfu_slot(counter, now_min);
+    }
+    /* Skip the store when nothing changes to keep the line clean. Racing
+     * updates may lose a hit, which is fine for an approximation. */
+    if (next != old) {
+        __atomic_store_n(slot, next, __ATOMIC_RELAXED);
+    }
+}
+
+void nal_cache_note_put(nal_cache_t *cache, const MDB_val *key)
+{
+    uint32_t *slot = nal_cache_slot(cache, key);
+    uint64_t now = nal_cache_now(cache);
+    uint32_t next = nal_cache_lru_slot(now);
+    if (cache->hdr->policy == NAL_CACHE_LFU) {
+        uint32_t now_min = (uint32_t)(now / 60000);
+        uint32_t counter = nal_cache_lfu_counter(*slot, now_min);
+        if (counter < NAL_CACHE_LFU_INIT) {
+            counter = NAL_CACHE_LFU_INIT;
+        }
+        next = nal_cache_lfu_slot(counter, now_min);
+    }
+    __atomic_store_n(slot, next, __ATOMIC_RELAXED);
+}
+
+/* Higher scores are evicted first. */
+static uint64_t nal_cache_score(nal_cache_t *cache, const MDB_val *key,
+                                uint64_t now)
+{
+    uint32_t slot = __atomic_load_n(nal_cache_slot(cache, key),
+                                    __ATOMIC_RELAXED);
+    if (slot == 0) {
+        return UINT64_MAX;
+    }
+    if (cache->hdr->policy == NAL_CACHE_LRU) {
+        return (uint32_t)now - slot;
+    }
+    return 255 - nal_cache_lfu_counter(slot, (uint32_t)(now / 60000));
+}
+
+typedef struct {
+    unsigned char *data; /* cap bytes */
+    size_t size;
+    size_t cap;
+} nal_cache_key_t;
+
+static int nal_cache_key_copy(nal_cache_key_t *dst, const MDB_val *src)
+{
+    if (src->mv_size > dst->cap) {
+        return MDB_BAD_VALSIZE;
+    }
+    memcpy(dst->data, src->mv_data, src->mv_size);
+    dst->size = src->mv_size;
+    return 0;
+}
+
+/* Builds a key between first and last: their common prefix followed by
+ * the 8 bytes after it read as big endian numbers and picked at random in
+ * between. Keys are spread by key space rather than by count, which is good
+ * enough to sample from, and never sort after last, so a seek does not wrap
+ * around to the first keys and favour them. */
+static void nal_cache_random_key(const nal_cache_key_t *first,
+                                 const nal_cache_key_t *last,
+                                 nal_cache_key_t *out)
+{
+    size_t n = first->size < last->size ? first->size : last->size;
+    size_t p = 0;
+    while (p < n && first->data[p] == last->data[p]) {
+        p++;
+    }
+    if (p > out->cap - 8) {
+        p = out->cap - 8;
+    }
+    uint64_t lo = 0;
+    uint64_t hi = 0;
+    for (size_t i = p; i < p + 8; i++) {
+        lo = lo << 8 | (i < first->size ? first->data[i] : 0);
+        hi = hi << 8 | (i < last->size ? last->data[i] : 0);
+    }
+    uint64_t r = lo;
+    if (hi > lo) {
+        uint64_t range = hi - lo;
+        r += range == UINT64_MAX ? nal_cache_rand()
+                                 : nal_cache_rand() % (range + 1);
+    }
+    memcpy(out->data, first->data, p);
+    for (size_t i = p + 8; i > p; i--, r >>= 8) {
+        out->data[i - 1] = (unsigned char)r;
+    }
+    out->size = p + 8;
+}
+
+/* Deletes the worst of the sampled keys of dbi. Returns MDB_NOTFOUND once
+ * the dbi is empty. */
+static int nal_cache_evict_one(nal_txn_ptr txn, MDB_dbi dbi,
+                               nal_cache_t *cache)
+{
+    nal_cache_key_t first, last, probe, victim;
+    unsigned char *buf = malloc(4 * cache->key_max);
+    if (buf == NULL) {
+        return ENOMEM;
+    }
+    nal_cache_key_t *keys[] = {&first, &last, &probe, &victim};
+    for (size_t i = 0; i < 4; i++) {
+        keys[i]->data = buf + i * cache->key_max;
+        keys[i]->size = 0;
+        keys[i]->cap = cache->key_max;
+    }
+
+    MDB_cursor *cursor;
+    int rc = mdb_cursor_open(txn, dbi, &cursor);
+    if (rc != 0) {
+        free(buf);
+        return rc;
+    }
+    MDB_val key, data;
+    rc = mdb_cursor_get(cursor, &key, &data, MDB_FIRST);
+    if (rc == 0) {
+        rc = nal_cache_key_copy(&first, &key);
+    }
+    if (rc == 0) {
+        rc = mdb_cursor_get(cursor, &key, &data, MDB_LAST);
+    }
+    if (rc == 0) {
+        rc = nal_cache_key_copy(&last, &key);
+    }
+    uint64_t now = nal_cache_now(cache);
+    uint64_t worst = 0;
+    int have_victim = 0;
+    for (int s = 0; rc == 0 && s < NAL_CACHE_SEEKS; s++) {
+        nal_cache_random_key(&first, &last, &probe);
+        key.mv_data = probe.data;
+        key.mv_size = probe.size;
+        rc = mdb_cursor_get(cursor, &key, &data, MDB_SET_RANGE);
+        if (rc == MDB_NOTFOUND) {
+            rc = mdb_cursor_get(cursor, &key, &data, MDB_FIRST);
+        }
+        for (int i = 0; rc == 0 && i < NAL_CACHE_RUN; i++) {
+            uint64_t score = nal_cache_score(cache, &key, now);
+            if (!have_victim || score > worst) {
+                rc = nal_cache_key_copy(&victim, &key);
+                worst = score;
+                have_victim = 1;
+            }
+            if (rc == 0) {
+                rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT_NODUP);
+            }
+        }
+        if (rc == MDB_NOTFOUND) {
+            rc = 0;
+        }
+    }
+    mdb_cursor_close(cursor);
+    if (rc == 0) {
+        key.mv_data = victim.data;
+        key.mv_size = victim.size;
+        rc = nal_del(txn, dbi, &key);
+    }
+    if (rc == 0) {
+        __atomic_add_fetch(&cache->hdr->evicted, 1, __ATOMIC_RELAXED);
+    }
+    free(buf);
+    return rc;
+}
+
+static uint64_t nal_cache_used(nal_txn_ptr txn, MDB_dbi dbi, int *rc)
+{
+    MDB_stat st;
+    *rc = mdb_stat(txn, dbi, &st);
+    if (*rc != 0) {
+        return 0;
+    }
+    return (uint64_t)(st.ms_branch_pages + st.ms_leaf_pages +
+                      st.ms_overflow_pages) *
+           st.ms_psize;
+}
+
+int nal_cache_make_room(nal_txn_ptr txn, MDB_dbi dbi, nal_cache_t *cache,
+                        size_t incoming)
+{
+    uint64_t budget = __atomic_load_n(&cache->hdr->budget, __ATOMIC_RELAXED);
+    int rc;
+    uint64_t used = nal_cache_used(txn, dbi, &rc);
+    if (rc != 0 || used + incoming <= budget) {
+        return rc;
+    }
+
+    uint64_t target = budget / 100 * NAL_CACHE_LOW_WATER_PCT;
+    size_t n = 0;
+    while (n < NAL_CACHE_MAX_BATCH && used + incoming > target) {
+        rc = nal_cache_evict_one(txn, dbi, cache);
+        if (rc != 0) {
+            break;
+        }
+        n++;
+        used = nal_cache_used(txn, dbi, &rc);
+        if (rc != 0) {
+            break;
+        }
+    }
+    __atomic_add_fetch(&cache->hdr->evict_runs, 1, __ATOMIC_RELAXED);
+    nal_log_debug("nal_cache", "evicted %zu keys of dbi %u, %llu bytes used",
+                  n, dbi, (unsigned long long)used);
+    /* An empty dbi cannot shrink further; let the put try. */
+    return rc == MDB_NOTFOUND ? 0 : rc;
+}
+
+int nal_cache_evict(nal_txn_ptr txn, MDB_dbi dbi, size_t count,
+                    size_t *evicted)
+{
+    nal_dbi_info_t *info = nal_dbi_info_get(dbi);
+    if (info == NULL || info->cache == NULL) {
+        return MDB_BAD_DBI;
+    }
+    int rc = 0;
+    size_t n = 0;
+    while (n < count) {
+        rc = nal_cache_evict_one(txn, dbi, info->cache);
+        if (rc != 0) {
+            break;
+        }
+        n++;
+    }
+    if (evicted != NULL) {
+        *evicted = n;
+    }
+    return rc == MDB_NOTFOUND ? 0 : rc;
+}
+
+int nal_cache_stats(nal_txn_ptr txn, MDB_dbi dbi, nal_cache_stats_t *stats)
+{
+    nal_dbi_info_t *info = nal_dbi_info_get(dbi);
+    if (info == NULL || info->cache == NULL) {
+        return MDB_BAD_DBI;
+    }
+    nal_cache_hdr_t *hdr = info->cache->hdr;
+    int rc;
+    stats->used = nal_cache_used(txn, dbi, &rc);
+    stats->budget = __atomic_load_n(&hdr->budget, __ATOMIC_RELAXED);
+    stats->evicted = __atomic_load_n(&hdr->evicted, __ATOMIC_RELAXED);
+    stats->evict_runs = __atomic_load_n(&hdr->evict_runs, __ATOMIC_RELAXED);
+    return rc;
+}
+
+static int nal_cache_map(const char *path, uint64_t budget, int policy,
+                         size_t slots, nal_cache_t **cache)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd == -1) {
+        int err = errno;
+        nal_log_error("cannot open %s: %s", path, strerror(err));
+        return err;
+    }
+
+    /* The first process sizes the file, everybody else uses its header. */
+    int rc = 0;
+    (void)flock(fd, LOCK_EX);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        rc = errno;
+        goto exit;
+    }
+    if (st.st_size == 0) {
+        st.st_size = (off_t)(sizeof(nal_cache_hdr_t) + slots * 4);
+        nal_cache_hdr_t hdr = {0};
+        hdr.magic = NAL_CACHE_MAGIC;
+        hdr.policy = (uint32_t)policy;
+        hdr.num_slots = slots;
+        hdr.budget = budget;
+        hdr.epoch = nal_cache_realtime_ms();
+        if (ftruncate(fd, st.st_size) != 0 ||
+            pwrite(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr)) {
+            rc = errno;
+            goto exit;
+        }
+    }
+
+    size_t len = (size_t)st.st_size;
+    void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        rc = errno;
+        goto exit;
+    }
+    nal_cache_hdr_t *hdr = p;
+    if (hdr->magic != NAL_CACHE_MAGIC || hdr->num_slots == 0 ||
+        hdr->num_slots > NAL_CACHE_MAX_SLOTS ||
+        hdr->policy > NAL_CACHE_LFU ||
+        sizeof(*hdr) + hdr->num_slots * 4 > len) {
+        nal_log_error("%s is corrupt", path);
+        munmap(p, len);
+        rc = MDB_CORRUPTED;
+        goto exit;
+    }
+    if (hdr->policy != (uint32_t)policy) {
+        nal_log_note("%s keeps its policy %u", path, hdr->policy);
+    }
+    __atomic_store_n(&hdr->budget, budget, __ATOMIC_RELAXED);
+
+    nal_cache_t *c = malloc(sizeof(*c));
+    if (c == NULL) {
+        munmap(p, len);
+        rc = ENOMEM;
+        goto exit;
+    }
+    c->hdr = hdr;
+    c->slots = (uint32_t *)(hdr + 1);
+    c->map_len = len;
+    c->key_max = (size_t)mdb_env_get_maxkeysize(nal_env_handle());
+    *cache = c;
+
+exit:
+    (void)flock(fd, LOCK_UN);
+    close(fd);
+    if (rc != 0) {
+        nal_log_error("cannot set up %s: %s", path, nal_strerror(rc));
+    }
+    return rc;
+}
+
+int nal_cache_open(MDB_dbi dbi, uint64_t budget, int policy, size_t slots)
+{
+    nal_dbi_info_t *info = nal_dbi_info_get(dbi);
+    if (info == NULL || info->name == NULL) {
+        return MDB_BAD_DBI;
+    }
+    if ((policy != NAL_CACHE_LRU && policy != NAL_CACHE_LFU) ||
+        slots > NAL_CACHE_MAX_SLOTS || budget == 0) {
+        return EINVAL;
+    }
+    if (info->cache != NULL) {
+        __atomic_store_n(&info->cache->hdr->budget, budget, __ATOMIC_RELAXED);
+        return 0;
+    }
+    if (slots == 0) {
+        slots = NAL_CACHE_DEFAULT_SLOTS;
+    }
+
+    char path[PATH_MAX];
+    int n = snprintf(path, sizeof(path), "%s/%s%s", nal_env_path(),
+                     NAL_CACHE_FILE_PREFIX, info->name);
+    if (n < 0 || (size_t)n >= sizeof(path)) {
+        return ENAMETOOLONG;
+    }
+    nal_cache_t *cache = NULL;
+    int rc = nal_cache_map(path, budget, policy, slots, &cache);
+    if (rc != 0) {
+        return rc;
+    }
+    info->cache = cache;
+    return 0;
+}
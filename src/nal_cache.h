@@ -0,0 +1,59 @@
+#ifndef NAL_CACHE_H
+#define NAL_CACHE_H
+
+#include "nal_lmdb.h"
+
+/* Cache mode for a dbi: nal_put keeps the pages of the dbi, as counted by
+ * mdb_stat, below a byte budget by deleting the least recently or least
+ * frequently used keys, so an env used as a disk cache never runs into
+ * MDB_MAP_FULL. The budget must leave room in the map for the other dbis
+ * and for the pages LMDB keeps for older snapshots.
+ *
+ * Access metadata lives in a sidecar file nal_cache-<dbi name> in the env
+ * directory, mapped MAP_SHARED by every process: one 32-bit word per slot,
+ * indexed by key hash. nal_get updates it with a plain store, without the
+ * write lock. Keys sharing a slot share their metadata, which only makes the
+ * eviction order fuzzier.
+ *
+ * Eviction is sampled like in Redis: an eviction seeks to a few random
+ * positions in the dbi, looks at the keys there and deletes the one that
+ * scores worst. Once a put finds the dbi over budget, it evicts in a batch
+ * until the dbi is NAL_CACHE_LOW_WATER_PCT percent of the budget, so most
+ * puts do not evict at all. Evictions go through nal_del and so reach the
+ * change log and blob segments like any delete. nal_merge makes room like
+ * nal_put; nal_cursor_put returns MDB_INCOMPATIBLE on a cache dbi, as an
+ * eviction could delete the entry under the cursor. */
+#define NAL_CACHE_LRU 0
+#define NAL_CACHE_LFU 1
+
+#define NAL_CACHE_DEFAULT_SLOTS (1 << 20)
+#define NAL_CACHE_LOW_WATER_PCT 95
+
+typedef struct nal_cache_s nal_cache_t;
+
+typedef struct nal_cache_stats_s {
+    uint64_t budget;     /* bytes */
+    uint64_t used;       /* bytes of pages of the dbi in txn */
+    uint64_t evicted;    /* keys, by all processes since creation */
+    uint64_t evict_runs; /* batches */
+} nal_cache_stats_t;
+
+/* Turns on cache mode for dbi, which must have been opened with
+ * nal_dbi_open. The policy and the number of slots are fixed by the first
+ * process creating the file; the budget is updated by each call. */
+int nal_cache_open(MDB_dbi dbi, uint64_t budget, int policy, size_t slots);
+
+/* Evicts up to count keys of dbi in txn ahead of demand, e.g. from a timer,
+ * whether or not the dbi is over budget. */
+int nal_cache_evict(nal_txn_ptr txn, MDB_dbi dbi, size_t count,
+                    size_t *evicted);
+
+int nal_cache_stats(nal_txn_ptr txn, MDB_dbi dbi, nal_cache_stats_t *stats);
+
+/* Used by nal_lmdb.c. */
+void nal_cache_touch(nal_cache_t *cache, const MDB_val *key);
+void nal_cache_note_put(nal_cache_t *cache, const MDB_val *key);
+int nal_cache_make_room(nal_txn_ptr txn, MDB_dbi dbi, nal_cache_t *cache,
+                        size_t incoming);
+
+#endif
@@ -0,0 +1,639 @@
+#include "nal_changelog.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nal_lmdb_internal.h"
+#include "nal_log.h"
+
+/* Record layout (little-endian):
+ *   u8 op, u16 name_len, u32 key_len, u32 data_len, name, key, data
+ * Frame layout on the wire:
+ *   u32 frame_len (seq + record), u64 seq, record */
+#define NAL_CHANGELOG_REC_HDR_SIZE 11
+#define NAL_CHANGELOG_FRAME_HDR_SIZE 12
+#define NAL_FOLLOWER_META_DBI_NAME "__nal_follower"
+#define NAL_FOLLOWER_APPLIED_KEY "applied_seq"
+#define NAL_FOLLOWER_READ_SIZE 65536
+
+static int changelog_on;
+static MDB_dbi changelog_dbi;
+
+struct nal_follower_s {
+    MDB_env *env;
+    MDB_dbi meta_dbi;
+    uint64_t applied_seq;
+    size_t max_databases;
+    size_t num_dbis;
+    char **dbi_names;
+    MDB_dbi *dbis;
+    unsigned char *buf;
+    size_t buf_len;
+    size_t buf_cap;
+    size_t frame_max; /* longer frames are corrupt, not worth buffering */
+};
+
+static void nal_put_u16le(unsigned char *p, uint16_t v)
+{
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+}
+
+static void nal_put_u32le(unsigned char *p, uint32_t v)
+{
+    for (int i = 0; i < 4; i++) {
+        p[i] = (unsigned char)(v >> (8 * i));
+    }
+}
+
+static void nal_put_u64le(unsigned char *p, uint64_t v)
+{
+    for (int i = 0; i < 8; i++) {
+        p[i] = (unsigned char)(v >> (8 * i));
+    }
+}
+
+static uint16_t nal_get_u16le(const unsigned char *p)
+{
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t nal_get_u32le(const unsigned char *p)
+{
+    uint32_t v = 0;
+    for (int i = 3; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static uint64_t nal_get_u64le(const unsigned char *p)
+{
+    uint64_t v = 0;
+    for (int i = 7; i >= 0; i--) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static void nal_seq_encode(unsigned char *p, uint64_t seq)
+{
+    for (int i = 7; i >= 0; i--) {
+        p[i] = (unsigned char)seq;
+        seq >>= 8;
+    }
+}
+
+static uint64_t nal_seq_decode(const MDB_val *key)
+{
+    const unsigned char *p = key->mv_data;
+    uint64_t seq = 0;
+    if (key->mv_size != 8) {
+        return 0;
+    }
+    for (int i = 0; i < 8; i++) {
+        seq = (seq << 8) | p[i];
+    }
+    return seq;
+}
+
+int nal_changelog_open(nal_txn_ptr txn, int read_only)
+{
+    int rc = mdb_dbi_open(txn, NAL_CHANGELOG_DBI_NAME,
+                          read_only ? 0 : MDB_CREATE, &changelog_dbi);
+    if (rc != 0) {
+        return rc;
+    }
+    changelog_on = 1;
+    return 0;
+}
+
+int nal_changelog_enabled(void)
+{
+    return changelog_on;
+}
+
+static int nal_changelog_last(MDB_cursor *cursor, uint64_t *seq)
+{
+    MDB_val key, data;
+    int rc = mdb_cursor_get(cursor, &key, &data, MDB_LAST);
+    if (rc == MDB_NOTFOUND) {
+        *seq = 0;
+        return 0;
+    }
+    if (rc != 0) {
+        return rc;
+    }
+    *seq = nal_seq_decode(&key);
+    return 0;
+}
+
+int nal_changelog_record(nal_txn_ptr txn, int op, MDB_dbi dbi, MDB_val *key,
+                         MDB_val *data)
+{
+    if (!changelog_on || dbi == changelog_dbi) {
+        return 0;
+    }
+
+    /* Followers resolve dbis by name, so unnamed dbis cannot be logged. */
+    nal_dbi_info_t *info = nal_dbi_info_get(dbi);
+    if (info == NULL || info->name == NULL) {
+        return MDB_BAD_DBI;
+    }
+    size_t name_len = strlen(info->name);
+    size_t data_len = data != NULL ? data->mv_size : 0;
+    if (name_len > UINT16_MAX || key->mv_size > UINT32_MAX ||
+        data_len > NAL_CHANGELOG_VALUE_MAX) {
+        return MDB_BAD_VALSIZE;
+    }
+
+    MDB_cursor *cursor;
+    int rc = mdb_cursor_open(txn, changelog_dbi, &cursor);
+    if (rc != 0) {
+        return rc;
+    }
+    uint64_t seq;
+    rc = nal_changelog_last(cursor, &seq);
+    if (rc != 0) {
+        goto exit;
+    }
+
+    unsigned char seq_buf[8];
+    nal_seq_encode(seq_buf, seq + 1);
+    MDB_val log_key = {sizeof(seq_buf), seq_buf};
+    MDB_val log_data = {
+        NAL_CHANGELOG_REC_HDR_SIZE + name_len + key->mv_size + data_len, NULL};
+    rc = mdb_cursor_put(cursor, &log_key, &log_data, MDB_APPEND | MDB_RESERVE);
+    if (rc != 0) {
+        goto exit;
+    }
+
+    unsigned char *p = log_data.mv_data;
+    p[0] = (unsigned char)op;
+    nal_put_u16le(p + 1, (uint16_t)name_len);
+    nal_put_u32le(p + 3, (uint32_t)key->mv_size);
+    nal_put_u32le(p + 7, (uint32_t)data_len);
+    p += NAL_CHANGELOG_REC_HDR_SIZE;
+    memcpy(p, info->name, name_len);
+    p += name_len;
+    memcpy(p, key->mv_data, key->mv_size);
+    p += key->mv_size;
+    if (data_len > 0) {
+        memcpy(p, data->mv_data, data_len);
+    }
+
+exit:
+    mdb_cursor_close(cursor);
+    return rc;
+}
+
+int nal_changelog_last_seq(nal_txn_ptr txn, uint64_t *seq)
+{
+    if (!changelog_on) {
+        return MDB_INCOMPATIBLE;
+    }
+    MDB_cursor *cursor;
+    int rc = mdb_cursor_open(txn, changelog_dbi, &cursor);
+    if (rc != 0) {
+        return rc;
+    }
+    rc = nal_changelog_last(cursor, seq);
+    mdb_cursor_close(cursor);
+    return rc;
+}
+
+static int nal_write_full(int fd, const unsigned char *buf, size_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+int nal_changelog_ship(nal_txn_ptr txn, uint64_t after_seq, size_t max_records,
+                       int fd, uint64_t *last_seq)
+{
+    if (!changelog_on) {
+        return MDB_INCOMPATIBLE;
+    }
+    MDB_cursor *cursor;
+    int rc = mdb_cursor_open(txn, changelog_dbi, &cursor);
+    if (rc != 0) {
+        return rc;
+    }
+
+    unsigned char seq_buf[8];
+    nal_seq_encode(seq_buf, after_seq + 1);
+    MDB_val key = {sizeof(seq_buf), seq_buf};
+    MDB_val data;
+    unsigned char *frame = NULL;
+    size_t frame_cap = 0;
+    size_t shipped = 0;
+    *last_seq = after_seq;
+
+    rc = mdb_cursor_get(cursor, &key, &data, MDB_SET_RANGE);
+    while (rc == 0 && shipped < max_records) {
+        size_t frame_len = NAL_CHANGELOG_FRAME_HDR_SIZE + data.mv_size;
+        if (frame_len > frame_cap) {
+            unsigned char *p = realloc(frame, frame_len);
+            if (p == NULL) {
+                rc = ENOMEM;
+                break;
+            }
+            frame = p;
+            frame_cap = frame_len;
+        }
+        uint64_t seq = nal_seq_decode(&key);
+        nal_put_u32le(frame, (uint32_t)(8 + data.mv_size));
+        nal_put_u64le(frame + 4, seq);
+        memcpy(frame + NAL_CHANGELOG_FRAME_HDR_SIZE, data.mv_data,
+               data.mv_size);
+        rc = nal_write_full(fd, frame, frame_len);
+        if (rc != 0) {
+            nal_log_error("nal_changelog_ship write failed: %s",
+                          strerror(rc));
+            break;
+        }
+        *last_seq = seq;
+        shipped++;
+        rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT);
+    }
+    if (rc == MDB_NOTFOUND) {
+        rc = 0;
+    }
+
+    free(frame);
+    mdb_cursor_close(cursor);
+    return rc;
+}
+
+/* Deletes records up to upto_seq but always keeps the newest one, so the
+ * sequence stays monotonic even when the whole log has been shipped. */
+int nal_changelog_truncate(nal_txn_ptr txn, uint64_t upto_seq)
+{
+    if (!changelog_on) {
+        return MDB_INCOMPATIBLE;
+    }
+    MDB_cursor *cursor;
+    int rc = mdb_cursor_open(txn, changelog_dbi, &cursor);
+    if (rc != 0) {
+        return rc;
+    }
+
+    uint64_t last;
+    rc = nal_changelog_last(cursor, &last);
+    if (rc != 0 || last == 0) {
+        goto exit;
+    }
+    if (upto_seq >= last) {
+        upto_seq = last - 1;
+    }
+
+    MDB_val key, data;
+    rc = mdb_cursor_get(cursor, &key, &data, MDB_FIRST);
+    while (rc == 0 && nal_seq_decode(&key) <= upto_seq) {
+        rc = mdb_cursor_del(cursor, 0);
+        if (rc != 0) {
+            break;
+        }
+        /* After a delete MDB_NEXT yields the item that followed it. */
+        rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT);
+    }
+    if (rc == MDB_NOTFOUND) {
+        rc = 0;
+    }
+
+exit:
+    mdb_cursor_close(cursor);
+    return rc;
+}
+
+int nal_follower_open(const char *env_path, size_t max_databases,
+                      size_t map_size, uint32_t file_mode,
+                      nal_follower_t **follower)
+{
+    nal_follower_t *f = calloc(1, sizeof(*f));
+    if (f == NULL) {
+        return ENOMEM;
+    }
+    f->max_databases = max_databases;
+    f->dbi_names = calloc(max_databases, sizeof(char *));
+    f->dbis = calloc(max_databases, sizeof(MDB_dbi));
+    if (f->dbi_names == NULL || f->dbis == NULL) {
+        nal_follower_close(f);
+        return ENOMEM;
+    }
+
+    int rc = mdb_env_create(&f->env);
+    if (rc != 0) {
+        nal_log_error("mdb_env_create failed: %s", mdb_strerror(rc));
+        goto fail;
+    }
+    /* One extra slot for the follower's own meta dbi. */
+    rc = mdb_env_set_maxdbs(f->env, max_databases + 1);
+    if (rc != 0) {
+        nal_log_error("mdb_env_set_maxdbs failed: %s", mdb_strerror(rc));
+        goto fail;
+    }
+    rc = mdb_env_set_mapsize(f->env, map_size);
+    if (rc != 0) {
+        nal_log_error("mdb_env_set_mapsize failed: %s", mdb_strerror(rc));
+        goto fail;
+    }
+    rc = mdb_env_open(f->env, env_path, MDB_NOTLS, (mdb_mode_t)file_mode);
+    if (rc != 0) {
+        nal_log_error("mdb_env_open failed for follower %s: %s", env_path,
+                      mdb_strerror(rc));
+        goto fail;
+    }
+    /* Dbi names are keys of the main dbi, so both are below the key size. */
+    f->frame_max = 8 + NAL_CHANGELOG_REC_HDR_SIZE +
+                   2 * (size_t)mdb_env_get_maxkeysize(f->env) +
+                   NAL_CHANGELOG_VALUE_MAX;
+
+    MDB_txn *txn;
+    rc = mdb_txn_begin(f->env, NULL, 0, &txn);
+    if (rc != 0) {
+        goto fail;
+    }
+    rc = mdb_dbi_open(txn, NAL_FOLLOWER_META_DBI_NAME, MDB_CREATE,
+                      &f->meta_dbi);
+    if (rc == 0) {
+        MDB_val key = {sizeof(NAL_FOLLOWER_APPLIED_KEY) - 1,
+                       NAL_FOLLOWER_APPLIED_KEY};
+        MDB_val data;
+        rc = mdb_get(txn, f->meta_dbi, &key, &data);
+        if (rc == 0 && data.mv_size == 8) {
+            f->applied_seq = nal_get_u64le(data.mv_data);
+        } else if (rc == MDB_NOTFOUND) {
+            rc = 0;
+        }
+    }
+    if (rc != 0) {
+        mdb_txn_abort(txn);
+        goto fail;
+    }
+    rc = mdb_txn_commit(txn);
+    if (rc != 0) {
+        goto fail;
+    }
+
+    nal_log_note("nal_follower_open: path=%s, applied_seq=%llu", env_path,
+                 (unsigned long long)f->applied_seq);
+    *follower = f;
+    return 0;
+
+fail:
+    nal_follower_close(f);
+    return rc;
+}
+
+uint64_t nal_follower_applied_seq(nal_follower_t *follower)
+{
+    return follower->applied_seq;
+}
+
+void nal_follower_close(nal_follower_t *follower)
+{
+    if (follower == NULL) {
+        return;
+    }
+    if (follower->env != NULL) {
+        mdb_env_close(follower->env);
+    }
+    if (follower->dbi_names != NULL) {
+        for (size_t i = 0; i < follower->num_dbis; i++) {
+            free(follower->dbi_names[i]);
+        }
+        free(follower->dbi_names);
+    }
+    free(follower->dbis);
+    free(follower->buf);
+    free(follower);
+}
+
+/* Handles opened in an aborted txn are closed by LMDB, so the name cache is
+ * only trusted for handles created by committed txns. */
+static void nal_follower_forget_dbis(nal_follower_t *f)
+{
+    for (size_t i = 0; i < f->num_dbis; i++) {
+        free(f->dbi_names[i]);
+    }
+    f->num_dbis = 0;
+}
+
+static int nal_follower_dbi(nal_follower_t *f, MDB_txn *txn, const char *name,
+                            size_t name_len, MDB_dbi *dbi)
+{
+    for (size_t i = 0; i < f->num_dbis; i++) {
+        if (strlen(f->dbi_names[i]) == name_len &&
+            memcmp(f->dbi_names[i], name, name_len) == 0) {
+            *dbi = f->dbis[i];
+            return 0;
+        }
+    }
+    if (f->num_dbis == f->max_databases) {
+        return MDB_DBS_FULL;
+    }
+
+    char *copy = malloc(name_len + 1);
+    if (copy == NULL) {
+        return ENOMEM;
+    }
+    memcpy(copy, name, name_len);
+    copy[name_len] = '\0';
+    int rc = mdb_dbi_open(txn, copy, MDB_CREATE, dbi);
+    if (rc != 0) {
+        free(copy);
+        return rc;
+    }
+    f->dbi_names[f->num_dbis] = copy;
+    f->dbis[f->num_dbis] = *dbi;
+    f->num_dbis++;
+    return 0;
+}
+
+static int nal_follower_apply_record(nal_follower_t *f, MDB_txn *txn,
+                                     const unsigned char *rec, size_t len)
+{
+    if (len < NAL_CHANGELOG_REC_HDR_SIZE) {
+        return MDB_CORRUPTED;
+    }
+    int op = rec[0];
+    size_t name_len = nal_get_u16le(rec + 1);
+    size_t key_len = nal_get_u32le(rec + 3);
+    size_t data_len = nal_get_u32le(rec + 7);
+    if (NAL_CHANGELOG_REC_HDR_SIZE + name_len + key_len + data_len != len) {
+        return MDB_CORRUPTED;
+    }
+    const unsigned char *name = rec + NAL_CHANGELOG_REC_HDR_SIZE;
+
+    MDB_dbi dbi;
+    int rc = nal_follower_dbi(f, txn, (const char *)name, name_len, &dbi);
+    if (rc != 0) {
+        return rc;
+    }
+    MDB_val key = {key_len, (void *)(name + name_len)};
+    switch (op) {
+    case NAL_CHANGELOG_PUT: {
+        MDB_val data = {data_len, (void *)(name + name_len + key_len)};
+        return mdb_put(txn, dbi, &key, &data, 0);
+    }
+    case NAL_CHANGELOG_DEL:
+        rc = mdb_del(txn, dbi, &key, NULL);
+        return rc == MDB_NOTFOUND ? 0 : rc;
+    default:
+        return MDB_CORRUPTED;
+    }
+}
+
+static int nal_follower_commit(nal_follower_t *f, MDB_txn *txn,
+                               uint64_t applied_seq)
+{
+    unsigned char seq_buf[8];
+    nal_put_u64le(seq_buf, applied_seq);
+    MDB_val key = {sizeof(NAL_FOLLOWER_APPLIED_KEY) - 1,
+                   NAL_FOLLOWER_APPLIED_KEY};
+    MDB_val data = {sizeof(seq_buf), seq_buf};
+    int rc = mdb_put(txn, f->meta_dbi, &key, &data, 0);
+    if (rc != 0) {
+        mdb_txn_abort(txn);
+        nal_follower_forget_dbis(f);
+        return rc;
+    }
+    rc = mdb_txn_commit(txn);
+    if (rc != 0) {
+        nal_follower_forget_dbis(f);
+        return rc;
+    }
+    f->applied_seq = applied_seq;
+    return 0;
+}
+
+/* Reads frames from fd until EOF or EAGAIN and applies them. A txn is
+ * committed after at most batch_size records and whenever the input runs
+ * dry, so a follower fed from a pipe never holds a txn across a blocking
+ * read. A partial trailing frame is kept for the next call, which makes it
+ * possible to tail a file that is still being appended to. */
+int nal_follower_apply(nal_follower_t *follower, int fd, size_t batch_size,
+                       size_t *applied)
+{
+    nal_follower_t *f = follower;
+    MDB_txn *txn = NULL;
+    size_t in_txn = 0;
+    uint64_t txn_seq = f->applied_seq;
+    int rc = 0;
+
+    *applied = 0;
+    if (batch_size == 0) {
+        batch_size = 1;
+    }
+
+    for (;;) {
+        if (f->buf_cap - f->buf_len < NAL_FOLLOWER_READ_SIZE) {
+            size_t cap = f->buf_len + NAL_FOLLOWER_READ_SIZE;
+            unsigned char *p = realloc(f->buf, cap);
+            if (p == NULL) {
+                rc = ENOMEM;
+                break;
+            }
+            f->buf = p;
+            f->buf_cap = cap;
+        }
+        ssize_t n = read(fd, f->buf + f->buf_len, NAL_FOLLOWER_READ_SIZE);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                rc = errno;
+            }
+            break;
+        }
+        if (n == 0) {
+            break;
+        }
+        f->buf_len += (size_t)n;
+
+        size_t pos = 0;
+        while (f->buf_len - pos >= 4) {
+            size_t frame_len = nal_get_u32le(f->buf + pos);
+            if (frame_len < 8 || frame_len > f->frame_max) {
+                rc = MDB_CORRUPTED;
+                break;
+            }
+            if (f->buf_len - pos - 4 < frame_len) {
+                break;
+            }
+            uint64_t seq = nal_get_u64le(f->buf + pos + 4);
+            const unsigned char *rec =
+                f->buf + pos + NAL_CHANGELOG_FRAME_HDR_SIZE;
+            pos += 4 + frame_len;
+            if (seq <= txn_seq) {
+                continue;
+            }
+
+            if (txn == NULL) {
+                rc = mdb_txn_begin(f->env, NULL, 0, &txn);
+                if (rc != 0) {
+                    break;
+                }
+            }
+            rc = nal_follower_apply_record(f, txn, rec, frame_len - 8);
+            if (rc != 0) {
+                nal_log_error("follower failed to apply seq %llu: %s",
+                              (unsigned long long)seq, mdb_strerror(rc));
+                break;
+            }
+            txn_seq = seq;
+            in_txn++;
+            if (in_txn == batch_size) {
+                rc = nal_follower_commit(f, txn, txn_seq);
+                txn = NULL;
+                if (rc != 0) {
+                    break;
+                }
+                *applied += in_txn;
+                in_txn = 0;
+            }
+        }
+        memmove(f->buf, f->buf + pos, f->buf_len - pos);
+        f->buf_len -= pos;
+        if (rc != 0) {
+            break;
+        }
+
+        if (txn != NULL) {
+            rc = nal_follower_commit(f, txn, txn_seq);
+            txn = NULL;
+            if (rc != 0) {
+                break;
+            }
+            *applied += in_txn;
+            in_txn = 0;
+        }
+    }
+
+    if (txn != NULL) {
+        if (rc == 0) {
+            rc = nal_follower_commit(f, txn, txn_seq);
+            if (rc == 0) {
+                *applied += in_txn;
+            }
+        } else {
+            mdb_txn_abort(txn);
+            nal_follower_forget_dbis(f);
+        }
+    }
+    return rc;
+}
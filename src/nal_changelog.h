@@ -0,0 +1,43 @@
+#ifndef NAL_CHANGELOG_H
+#define NAL_CHANGELOG_H
+
+#include "nal_lmdb.h"
+
+/* The change log is an optional dbi in the same env that gets one record per
+ * put/del, written inside the caller's write txn. Keys are 8-byte big-endian
+ * sequence numbers so the log sorts in commit order and can be appended with
+ * MDB_APPEND. Every process writing to the env must enable it. */
+#define NAL_CHANGELOG_DBI_NAME "__nal_changelog"
+
+/* Largest value a put may log; larger ones fail with MDB_BAD_VALSIZE while
+ * the change log is on. Followers reject frames above what it allows. */
+#define NAL_CHANGELOG_VALUE_MAX (256UL * 1024 * 1024)
+
+#define NAL_CHANGELOG_PUT 1
+#define NAL_CHANGELOG_DEL 2
+
+typedef struct nal_follower_s nal_follower_t;
+
+int nal_changelog_open(nal_txn_ptr txn, int read_only);
+int nal_changelog_enabled(void);
+int nal_changelog_record(nal_txn_ptr txn, int op, MDB_dbi dbi, MDB_val *key,
+                         MDB_val *data);
+/* These three return MDB_INCOMPATIBLE before nal_changelog_open. */
+int nal_changelog_last_seq(nal_txn_ptr txn, uint64_t *seq);
+int nal_changelog_ship(nal_txn_ptr txn, uint64_t after_seq, size_t max_records,
+                       int fd, uint64_t *last_seq);
+int nal_changelog_truncate(nal_txn_ptr txn, uint64_t upto_seq);
+
+/* A follower applies shipped records to a second env in batched write txns.
+ * The last applied sequence is stored in that env, so frames replayed after a
+ * restart are skipped. After an error the follower should be closed and the
+ * shipper restarted from nal_follower_applied_seq(). */
+int nal_follower_open(const char *env_path, size_t max_databases,
+                      size_t map_size, uint32_t file_mode,
+                      nal_follower_t **follower);
+int nal_follower_apply(nal_follower_t *follower, int fd, size_t batch_size,
+                       size_t *applied);
+uint64_t nal_follower_applied_seq(nal_follower_t *follower);
+void nal_follower_close(nal_follower_t *follower);
+
+#endif
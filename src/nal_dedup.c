@@ -0,0 +1,280 @@
+#include "nal_dedup.h"
+
+#include <string.h>
+
+#include "nal_hash.h"
+#include "nal_lmdb_internal.h"
+
+#define NAL_DEDUP_SEED 0x64656475U /* "dedu" */
+#define NAL_DEDUP_INLINE 0
+#define NAL_DEDUP_REF 1
+#define NAL_DEDUP_DIGEST_SIZE 16
+#define NAL_DEDUP_VALUE_PREFIX 'v'
+#define NAL_DEDUP_REFS_PREFIX 'r'
+
+static MDB_dbi dedup_dbi;
+static int dedup_on;
+static int dedup_read_only;
+static size_t dedup_min_size;
+
+int nal_dedup_open(nal_txn_ptr txn, int read_only, size_t min_size)
+{
+    int rc = mdb_dbi_open(txn, NAL_DEDUP_DBI_NAME, read_only ? 0 : MDB_CREATE,
+                          &dedup_dbi);
+    if (rc != 0) {
+        return rc;
+    }
+    dedup_read_only = read_only;
+    /* Below the size of a reference nothing is saved. */
+    dedup_min_size = min_size > 1 + NAL_DEDUP_DIGEST_SIZE
+                         ? min_size
+                         : 1 + NAL_DEDUP_DIGEST_SIZE;
+    dedup_on = 1;
+    return 0;
+}
+
+int nal_dedup_enabled(void)
+{
+    return dedup_on;
+}
+
+/* Keys of the dedup dbi: a prefix byte followed by the digest. */
+static void nal_dedup_key(unsigned char *buf, MDB_val *key,
+                          unsigned char prefix, const unsigned char *digest)
+{
+    buf[0] = prefix;
+    memcpy(buf + 1, digest, NAL_DEDUP_DIGEST_SIZE);
+    key->mv_data = buf;
+    key->mv_size = 1 + NAL_DEDUP_DIGEST_SIZE;
+}
+
+static void nal_dedup_digest(const MDB_val *data, unsigned char *digest)
+{
+    uint64_t h[2];
+    nal_hash128(data->mv_data, data->mv_size, NAL_DEDUP_SEED, h);
+    memcpy(digest, h, NAL_DEDUP_DIGEST_SIZE);
+}
+
+/* Copies the digest of a stored reference, or returns MDB_NOTFOUND for an
+ * inline value. */
+static int nal_dedup_ref_digest(const MDB_val *stored, unsigned char *digest)
+{
+    if (stored->mv_size == 0) {
+        return MDB_CORRUPTED;
+    }
+    const unsigned char *p = stored->mv_data;
+    if (p[0] == NAL_DEDUP_INLINE) {
+        return MDB_NOTFOUND;
+    }
+    if (p[0] != NAL_DEDUP_REF ||
+        stored->mv_size != 1 + NAL_DEDUP_DIGEST_SIZE) {
+        return MDB_CORRUPTED;
+    }
+    memcpy(digest, p + 1, NAL_DEDUP_DIGEST_SIZE);
+    return 0;
+}
+
+static int nal_dedup_refs_get(nal_txn_ptr txn, const unsigned char *digest,
+                              uint64_t *refs)
+{
+    unsigned char buf[1 + NAL_DEDUP_DIGEST_SIZE];
+    MDB_val key, data;
+    nal_dedup_key(buf, &key, NAL_DEDUP_REFS_PREFIX, digest);
+    int rc = mdb_get(txn, dedup_dbi, &key, &data);
+    if (rc != 0) {
+        return rc == MDB_NOTFOUND ? MDB_CORRUPTED : rc;
+    }
+    if (data.mv_size != sizeof(*refs)) {
+        return MDB_CORRUPTED;
+    }
+    memcpy(refs, data.mv_data, sizeof(*refs));
+    return 0;
+}
+
+static int nal_dedup_refs_put(nal_txn_ptr txn, const unsigned char *digest,
+                              uint64_t refs)
+{
+    unsigned char buf[1 + NAL_DEDUP_DIGEST_SIZE];
+    MDB_val key;
+    MDB_val data = {sizeof(refs), &refs};
+    nal_dedup_key(buf, &key, NAL_DEDUP_REFS_PREFIX, digest);
+    return mdb_put(txn, dedup_dbi, &key, &data, 0);
+}
+
+/* Adds a reference to data under digest, storing it if it is new. Sets
+ * *collision instead if digest already belongs to different bytes. */
+static int nal_dedup_add(nal_txn_ptr txn, const unsigned char *digest,
+                         const MDB_val *data, int *collision)
+{
+    unsigned char buf[1 + NAL_DEDUP_DIGEST_SIZE];
+    MDB_val key, cur;
+    *collision = 0;
+    nal_dedup_key(buf, &key, NAL_DEDUP_VALUE_PREFIX, digest);
+    int rc = mdb_get(txn, dedup_dbi, &key, &cur);
+    if (rc == MDB_NOTFOUND) {
+        MDB_val value = *data;
+        rc = mdb_put(txn, dedup_dbi, &key, &value, 0);
+        return rc == 0 ? nal_dedup_refs_put(txn, digest, 1) : rc;
+    }
+    if (rc != 0) {
+        return rc;
+    }
+    if (cur.mv_size != data->mv_size ||
+        memcmp(cur.mv_data, data->mv_data, data->mv_size) != 0) {
+        *collision = 1;
+        return 0;
+    }
+    uint64_t refs;
+    rc = nal_dedup_refs_get(txn, digest, &refs);
+    if (rc != 0) {
+        return rc;
+    }
+    return nal_dedup_refs_put(txn, digest, refs + 1);
+}
+
+static int nal_dedup_put_inline(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key,
+                                const MDB_val *data)
+{
+    MDB_val stored = {1 + data->mv_size, NULL};
+    int rc = mdb_put(txn, dbi, key, &stored, MDB_RESERVE);
+    if (rc != 0) {
+        return rc;
+    }
+    *(unsigned char *)stored.mv_data = NAL_DEDUP_INLINE;
+    memcpy((char *)stored.mv_data + 1, data->mv_data, data->mv_size);
+    return 0;
+}
+
+int nal_dedup_put(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key, MDB_val *data)
+{
+    if (!dedup_on || dedup_read_only) {
+        return MDB_INCOMPATIBLE;
+    }
+    unsigned char ref[1 + NAL_DEDUP_DIGEST_SIZE];
+    int shared = data->mv_size >= dedup_min_size;
+    if (shared) {
+        ref[0] = NAL_DEDUP_REF;
+        nal_dedup_digest(data, ref + 1);
+    }
+
+    MDB_val old;
+    int rc = mdb_get(txn, dbi, key, &old);
+    if (rc == 0) {
+        /* Rewriting the same value is common for caches: keep the
+         * reference rather than dropping and adding it. */
+        unsigned char digest[NAL_DEDUP_DIGEST_SIZE];
+        if (shared && nal_dedup_ref_digest(&old, digest) == 0 &&
+            memcmp(digest, ref + 1, sizeof(digest)) == 0) {
+            MDB_val cur = old;
+            rc = nal_dedup_resolve(txn, &cur);
+            if (rc != 0 || (cur.mv_size == data->mv_size &&
+                            memcmp(cur.mv_data, data->mv_data,
+                                   data->mv_size) == 0)) {
+                return rc;
+            }
+        }
+        rc = nal_dedup_release(txn, &old);
+    } else if (rc == MDB_NOTFOUND) {
+        rc = 0;
+    }
+    if (rc != 0) {
+        return rc;
+    }
+
+    if (shared) {
+        int collision;
+        rc = nal_dedup_add(txn, ref + 1, data, &collision);
+        if (rc != 0) {
+            return rc;
+        }
+        if (!collision) {
+            MDB_val stored = {sizeof(ref), ref};
+            return mdb_put(txn, dbi, key, &stored, 0);
+        }
+    }
+    return nal_dedup_put_inline(txn, dbi, key, data);
+}
+
+int nal_dedup_resolve(nal_txn_ptr txn, MDB_val *data)
+{
+    unsigned char digest[NAL_DEDUP_DIGEST_SIZE];
+    int rc = nal_dedup_ref_digest(data, digest);
+    if (rc == MDB_NOTFOUND) {
+        data->mv_data = (char *)data->mv_data + 1;
+        data->mv_size--;
+        return 0;
+    }
+    if (rc != 0) {
+        return rc;
+    }
+    if (!dedup_on) {
+        return MDB_INCOMPATIBLE;
+    }
+    unsigned char buf[1 + NAL_DEDUP_DIGEST_SIZE];
+    MDB_val key;
+    nal_dedup_key(buf, &key, NAL_DEDUP_VALUE_PREFIX, digest);
+    rc = mdb_get(txn, dedup_dbi, &key, data);
+    return rc == MDB_NOTFOUND ? MDB_CORRUPTED : rc;
+}
+
+int nal_dedup_release(nal_txn_ptr txn, const MDB_val *stored)
+{
+    unsigned char digest[NAL_DEDUP_DIGEST_SIZE];
+    int rc = nal_dedup_ref_digest(stored, digest);
+    if (rc != 0) {
+        return rc == MDB_NOTFOUND ? 0 : rc;
+    }
+    uint64_t refs;
+    rc = nal_dedup_refs_get(txn, digest, &refs);
+    if (rc != 0) {
+        return rc;
+    }
+    if (refs > 1) {
+        return nal_dedup_refs_put(txn, digest, refs - 1);
+    }
+    unsigned char buf[1 + NAL_DEDUP_DIGEST_SIZE];
+    MDB_val key;
+    nal_dedup_key(buf, &key, NAL_DEDUP_VALUE_PREFIX, digest);
+    rc = mdb_del(txn, dedup_dbi, &key, NULL);
+    if (rc == 0) {
+        nal_dedup_key(buf, &key, NAL_DEDUP_REFS_PREFIX, digest);
+        rc = mdb_del(txn, dedup_dbi, &key, NULL);
+    }
+    return rc;
+}
+
+int nal_dedup_stats(nal_txn_ptr txn, nal_dedup_stats_t *stats)
+{
+    if (!dedup_on) {
+        return MDB_INCOMPATIBLE;
+    }
+    MDB_cursor *cursor;
+    int rc = mdb_cursor_open(txn, dedup_dbi, &cursor);
+    if (rc != 0) {
+        return rc;
+    }
+    memset(stats, 0, sizeof(*stats));
+    MDB_val key, data;
+    for (rc = mdb_cursor_get(cursor, &key, &data, MDB_FIRST); rc == 0;
+         rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT)) {
+        if (key.mv_size != 1 + NAL_DEDUP_DIGEST_SIZE) {
+            rc = MDB_CORRUPTED;
+            break;
+        }
+        unsigned char prefix = *(const unsigned char *)key.mv_data;
+        if (prefix == NAL_DEDUP_VALUE_PREFIX) {
+            stats->values++;
+            stats->value_bytes += data.mv_size;
+        } else if (prefix == NAL_DEDUP_REFS_PREFIX &&
+                   data.mv_size == sizeof(uint64_t)) {
+            uint64_t refs;
+            memcpy(&refs, data.mv_data, sizeof(refs));
+            stats->refs += refs;
+        } else {
+            rc = MDB_CORRUPTED;
+            break;
+        }
+    }
+    mdb_cursor_close(cursor);
+    return rc == MDB_NOTFOUND ? 0 : rc;
+}
@@ -0,0 +1,37 @@
+#ifndef NAL_DEDUP_H
+#define NAL_DEDUP_H
+
+#include "nal_lmdb.h"
+
+/* Values of NAL_DBI_DEDUP dbis of at least the minimum size are stored once
+ * per content in a dbi of the same env, keyed by their 128-bit digest, with
+ * a reference count under a separate key so that counting a reference does
+ * not rewrite the overflow pages of a large value. The dbi itself keeps a
+ * tag byte and the digest, or the value when it is small or its digest
+ * collides with a different value. Reads resolve the digest with one more
+ * lookup in the same txn, so every process using such dbis must call
+ * nal_dedup_open, readers with read_only set. */
+#define NAL_DEDUP_DBI_NAME "__nal_dedup"
+#define NAL_DEDUP_DEFAULT_MIN_SIZE 64
+
+int nal_dedup_open(nal_txn_ptr txn, int read_only, size_t min_size);
+int nal_dedup_enabled(void);
+
+typedef struct nal_dedup_stats_s {
+    uint64_t values;     /* distinct values stored */
+    uint64_t refs;       /* references to them from all dedup dbis */
+    uint64_t value_bytes;
+} nal_dedup_stats_t;
+
+/* Walks the dedup dbi; takes time proportional to the distinct values. */
+int nal_dedup_stats(nal_txn_ptr txn, nal_dedup_stats_t *stats);
+
+/* Used by nal_lmdb.c on NAL_DBI_DEDUP dbis. nal_dedup_resolve turns a stored
+ * value into the caller's value in place, valid until the txn ends.
+ * nal_dedup_release drops the reference of a stored value that is about to
+ * be overwritten or deleted. */
+int nal_dedup_put(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key, MDB_val *data);
+int nal_dedup_resolve(nal_txn_ptr txn, MDB_val *data);
+int nal_dedup_release(nal_txn_ptr txn, const MDB_val *stored);
+
+#endif
@@ -0,0 +1,397 @@
+#include "nal_filter.h"
+
+#include <errno.h>
+#include <regex.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "nal_log.h"
+#include "nal_lmdb_internal.h"
+#include "nal_tuple.h"
+
+/* What the key predicates make of an entry. */
+#define NAL_FILTER_SKIP 0
+#define NAL_FILTER_MATCH 1
+#define NAL_FILTER_BEFORE 2 /* before the prefix, seek to it */
+#define NAL_FILTER_PAST 3   /* past the prefix, stop */
+
+typedef struct {
+    int target;
+    int field; /* index is a field index rather than a byte offset */
+    int op;
+    size_t index;
+    unsigned char *operand;
+    size_t len;
+} nal_filter_pred_t;
+
+struct nal_filter_s {
+    unsigned char *prefix;
+    size_t prefix_len;
+    int has_prefix;
+    regex_t re;
+    int has_re;
+    nal_filter_pred_t *preds; /* byte ranges first, then fields */
+    size_t num_preds;
+    size_t num_bytes_preds;
+    int value_preds;
+};
+
+int nal_filter_new(nal_filter_t **filter)
+{
+    nal_filter_t *f = calloc(1, sizeof(*f));
+    if (f == NULL) {
+        return ENOMEM;
+    }
+    *filter = f;
+    return 0;
+}
+
+void nal_filter_free(nal_filter_t *filter)
+{
+    if (filter == NULL) {
+        return;
+    }
+    free(filter->prefix);
+    if (filter->has_re) {
+        regfree(&filter->re);
+    }
+    for (size_t i = 0; i < filter->num_preds; i++) {
+        free(filter->preds[i].operand);
+    }
+    free(filter->preds);
+    free(filter);
+}
+
+int nal_filter_key_prefix(nal_filter_t *filter, const MDB_val *prefix)
+{
+    unsigned char *copy;
+
+    if (prefix->mv_size == 0) {
+        free(filter->prefix);
+        filter->prefix = NULL;
+        filter->prefix_len = 0;
+        filter->has_prefix = 0;
+        return 0;
+    }
+    copy = malloc(prefix->mv_size);
+    if (copy == NULL) {
+        return ENOMEM;
+    }
+    memcpy(copy, prefix->mv_data, prefix->mv_size);
+    free(filter->prefix);
+    filter->prefix = copy;
+    filter->prefix_len = prefix->mv_size;
+    filter->has_prefix = 1;
+    return 0;
+}
+
+int nal_filter_key_regex(nal_filter_t *filter, const char *pattern,
+                         int icase)
+{
+    regex_t re;
+    int flags = REG_EXTENDED | REG_NOSUB | (icase ? REG_ICASE : 0);
+    int rc = regcomp(&re, pattern, flags);
+    if (rc != 0) {
+        char msg[128];
+        regerror(rc, &re, msg, sizeof(msg));
+        nal_log_error("nal_filter: bad key regex \"%s\": %s", pattern, msg);
+        return EINVAL;
+    }
+    if (filter->has_re) {
+        regfree(&filter->re);
+    }
+    filter->re = re;
+    filter->has_re = 1;
+    return 0;
+}
+
+/* Finds the element at index of a packed tuple, nested tuples counting as
+ * one element, and sets span to its encoding. */
+static int nal_filter_field_span(const MDB_val *data, size_t index,
+                                 MDB_val *span)
+{
+    nal_tuple_reader_t r;
+    nal_tuple_item_t item;
+    nal_tuple_reader_init(&r, data->mv_data, data->mv_size);
+    for (size_t i = 0;; i++) {
+        const unsigned char *start = r.p;
+        int rc = nal_tuple_next(&r, &item);
+        while (rc == 0 && r.depth > 0) {
+            rc = nal_tuple_next(&r, &item);
+        }
+        if (rc != 0) {
+            return rc;
+        }
+        if (i == index) {
+            span->mv_data = (void *)start;
+            span->mv_size = (size_t)(r.p - start);
+            return 0;
+        }
+    }
+}
+
+static int nal_filter_add(nal_filter_t *filter, int target, int field,
+                          size_t index, int op, const MDB_val *operand)
+{
+    if ((target != NAL_FILTER_KEY && target != NAL_FILTER_VALUE) ||
+        op < NAL_FILTER_EQ || op > NAL_FILTER_MASK ||
+        (field && op == NAL_FILTER_MASK)) {
+        return EINVAL;
+    }
+    nal_filter_pred_t *preds =
+        realloc(filter->preds, (filter->num_preds + 1) * sizeof(*preds));
+    if (preds == NULL) {
+        return ENOMEM;
+    }
+    filter->preds = preds;
+    unsigned char *copy = malloc(operand->mv_size > 0 ? operand->mv_size : 1);
+    if (copy == NULL) {
+        return ENOMEM;
+    }
+    memcpy(copy, operand->mv_data, operand->mv_size);
+
+    /* Keep byte ranges ahead of the fields, which need parsing. */
+    size_t at = field ? filter->num_preds : filter->num_bytes_preds;
+    memmove(&preds[at + 1], &preds[at],
+            (filter->num_preds - at) * sizeof(*preds));
+    preds[at].target = target;
+    preds[at].field = field;
+    preds[at].op = op;
+    preds[at].index = index;
+    preds[at].operand = copy;
+    preds[at].len = operand->mv_size;
+    filter->num_preds++;
+    if (!field) {
+        filter->num_bytes_preds++;
+    }
+    if (target == NAL_FILTER_VALUE) {
+        filter->value_preds = 1;
+    }
+    return 0;
+}
+
+int nal_filter_add_bytes(nal_filter_t *filter, int target, size_t offset,
+                         int op, const MDB_val *operand)
+{
+    return nal_filter_add(filter, target, 0, offset, op, operand);
+}
+
+int nal_filter_add_field(nal_filter_t *filter, int target,
+                         unsigned int index, int op, const MDB_val *operand)
+{
+    MDB_val span, rest;
+    if (nal_filter_field_span(operand, 0, &span) != 0 ||
+        span.mv_size != operand->mv_size ||
+        nal_filter_field_span(operand, 1, &rest) != MDB_NOTFOUND) {
+        return EINVAL;
+    }
+    return nal_filter_add(filter, target, 1, index, op, operand);
+}
+
+/* memcmp order, shorter first on a tie, as for the default key order. */
+static int nal_filter_cmp(const void *a, size_t a_len, const void *b,
+                          size_t b_len)
+{
+    int c = memcmp(a, b, a_len < b_len ? a_len : b_len);
+    if (c != 0) {
+        return c;
+    }
+    return a_len < b_len ? -1 : a_len > b_len;
+}
+
+static int nal_filter_op_holds(int op, int c)
+{
+    switch (op) {
+    case NAL_FILTER_EQ:
+        return c == 0;
+    case NAL_FILTER_NE:
+        return c != 0;
+    case NAL_FILTER_LT:
+        return c < 0;
+    case NAL_FILTER_LE:
+        return c <= 0;
+    case NAL_FILTER_GT:
+        return c > 0;
+    default:
+        return c >= 0;
+    }
+}
+
+static int nal_filter_pred_holds(const nal_filter_pred_t *pred,
+                                 const MDB_val *val)
+{
+    const unsigned char *p;
+    size_t len;
+    if (pred->field) {
+        MDB_val span;
+        if (nal_filter_field_span(val, pred->index, &span) != 0) {
+            return 0;
+        }
+        p = span.mv_data;
+        len = span.mv_size;
+    } else {
+        if (pred->index > val->mv_size ||
+            val->mv_size - pred->index < pred->len) {
+            return 0;
+        }
+        p = (const unsigned char *)val->mv_data + pred->index;
+        len = pred->len;
+    }
+    if (pred->op == NAL_FILTER_MASK) {
+        for (size_t i = 0; i < len; i++) {
+            if ((p[i] & pred->operand[i]) != pred->operand[i]) {
+                return 0;
+            }
+        }
+        return 1;
+    }
+    return nal_filter_op_holds(
+        pred->op, nal_filter_cmp(p, len, pred->operand, pred->len));
+}
+
+static int nal_filter_preds_hold(const nal_filter_t *f, int target,
+                                 const MDB_val *val)
+{
+    for (size_t i = 0; i < f->num_preds; i++) {
+        if (f->preds[i].target == target &&
+            !nal_filter_pred_holds(&f->preds[i], val)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static int nal_filter_regex_matches(const nal_filter_t *f, const MDB_val *key)
+{
+#ifdef REG_STARTEND
+    /* Keys are not NUL terminated and may contain NUL bytes. */
+    regmatch_t m;
+    m.rm_so = 0;
+    m.rm_eo = (regoff_t)key->mv_size;
+    return regexec(&f->re, key->mv_data, 1, &m, REG_STARTEND) == 0;
+#else
+    char buf[key->mv_size + 1];
+    memcpy(buf, key->mv_data, key->mv_size);
+    buf[key->mv_size] = '\0';
+    return regexec(&f->re, buf, 0, NULL, 0) == 0;
+#endif
+}
+
+static int nal_filter_key(const nal_filter_t *f, const MDB_val *key)
+{
+    if (f->has_prefix &&
+        (key->mv_size < f->prefix_len ||
+         memcmp(key->mv_data, f->prefix, f->prefix_len) != 0)) {
+        return nal_filter_cmp(key->mv_data, key->mv_size, f->prefix,
+                              f->prefix_len) < 0
+                   ? NAL_FILTER_BEFORE
+                   : NAL_FILTER_PAST;
+    }
+    if (!nal_filter_preds_hold(f, NAL_FILTER_KEY, key)) {
+        return NAL_FILTER_SKIP;
+    }
+    if (f->has_re && !nal_filter_regex_matches(f, key)) {
+        return NAL_FILTER_SKIP;
+    }
+    return NAL_FILTER_MATCH;
+}
+
+/* nal_filter_get, counting the entries looked at in *scanned. */
+static int nal_filter_step(nal_cursor_ptr cursor, const nal_filter_t *f,
+                           MDB_val *key, MDB_val *data, MDB_cursor_op op,
+                           size_t *scanned)
+{
+    MDB_val prefix = {f->prefix_len, f->prefix};
+    int rc;
+    switch (op) {
+    case MDB_FIRST:
+        if (f->has_prefix) {
+            *key = prefix;
+            rc = mdb_cursor_get(cursor, key, data, MDB_SET_RANGE);
+        } else {
+            rc = mdb_cursor_get(cursor, key, data, MDB_FIRST);
+        }
+        break;
+    case MDB_SET_RANGE:
+        if (f->has_prefix && nal_filter_cmp(key->mv_data, key->mv_size,
+                                            f->prefix, f->prefix_len) < 0) {
+            *key = prefix;
+        }
+        rc = mdb_cursor_get(cursor, key, data, MDB_SET_RANGE);
+        break;
+    case MDB_NEXT:
+        rc = mdb_cursor_get(cursor, key, data, MDB_NEXT);
+        break;
+    default:
+        return EINVAL;
+    }
+
+    MDB_txn *txn = mdb_cursor_txn(cursor);
+    MDB_dbi dbi = mdb_cursor_dbi(cursor);
+    for (; rc == 0; rc = mdb_cursor_get(cursor, key, data, MDB_NEXT)) {
+        int m = nal_filter_key(f, key);
+        if (m == NAL_FILTER_BEFORE) {
+            /* The cursor was placed ahead of the prefix. */
+            *key = prefix;
+            rc = mdb_cursor_get(cursor, key, data, MDB_SET_RANGE);
+            if (rc != 0) {
+                break;
+            }
+            m = nal_filter_key(f, key);
+        }
+        (*scanned)++;
+        if (m == NAL_FILTER_PAST) {
+            return MDB_NOTFOUND;
+        }
+        if (m != NAL_FILTER_MATCH) {
+            continue;
+        }
+        rc = nal_value_decode(txn, dbi, data);
+        if (rc != 0) {
+            return rc;
+        }
+        if (!f->value_preds || nal_filter_preds_hold(f, NAL_FILTER_VALUE,
+                                                     data)) {
+            return 0;
+        }
+    }
+    return rc;
+}
+
+int nal_filter_get(nal_cursor_ptr cursor, const nal_filter_t *filter,
+                   MDB_val *key, MDB_val *data, MDB_cursor_op op)
+{
+    size_t scanned = 0;
+    return nal_filter_step(cursor, filter, key, data, op, &scanned);
+}
+
+int nal_filter_batch(nal_cursor_ptr cursor, const nal_filter_t *filter,
+                     MDB_cursor_op op, const MDB_val *key, MDB_val *keys,
+                     MDB_val *values, size_t max, size_t *n)
+{
+    size_t scanned = 0;
+    MDB_val k = {0, NULL};
+    MDB_val d;
+    if (key != NULL) {
+        k = *key;
+    }
+    int rc = 0;
+    *n = 0;
+    while (*n < max) {
+        rc = nal_filter_step(cursor, filter, &k, &d, op, &scanned);
+        if (rc != 0) {
+            break;
+        }
+        keys[*n] = k;
+        values[*n] = d;
+        (*n)++;
+        op = MDB_NEXT;
+    }
+    nal_log_debug("nal_filter",
+                  "filter batch dbi=%u matched %zu of %zu entries rc=%d",
+                  mdb_cursor_dbi(cursor), *n, scanned, rc);
+    if (rc == MDB_NOTFOUND && *n > 0) {
+        return 0;
+    }
+    return rc;
+}
@@ -0,0 +1,68 @@
+#ifndef NAL_FILTER_H
+#define NAL_FILTER_H
+
+#include "nal_lmdb.h"
+
+/* Predicates evaluated in C while a cursor walks a dbi, so that selective
+ * scans return only the matching entries instead of crossing into Lua for
+ * every one of them. A filter is the conjunction of:
+ *
+ * - a key prefix, which also bounds the walk: it starts at the prefix and
+ *   stops at the first key past it;
+ * - a POSIX extended regex on the key;
+ * - byte range compares on the key or value: the len bytes at offset
+ *   compared with memcmp, or tested for all bits of the operand set;
+ * - field compares on a key or value holding a packed tuple (nal_tuple.h):
+ *   the element at an index compared with a tuple of one element in tuple
+ *   order, so elements of different types compare by type.
+ *
+ * Cheap predicates run first and the regex last; values are decoded as by
+ * nal_cursor_get only for entries that passed the key predicates. A byte
+ * range past the end, a missing field and data that is not a tuple do not
+ * match. A filter is read-only once built and can be shared by threads. */
+#define NAL_FILTER_KEY 0
+#define NAL_FILTER_VALUE 1
+
+#define NAL_FILTER_EQ 0
+#define NAL_FILTER_NE 1
+#define NAL_FILTER_LT 2
+#define NAL_FILTER_LE 3
+#define NAL_FILTER_GT 4
+#define NAL_FILTER_GE 5
+#define NAL_FILTER_MASK 6 /* all bits set; byte ranges only */
+
+typedef struct nal_filter_s nal_filter_t;
+
+int nal_filter_new(nal_filter_t **filter);
+void nal_filter_free(nal_filter_t *filter);
+
+/* Replaces the key prefix; an empty one removes it, as MDB_SET_RANGE rejects
+ * empty keys. */
+int nal_filter_key_prefix(nal_filter_t *filter, const MDB_val *prefix);
+
+/* Replaces the key regex. Returns EINVAL if pattern does not compile. */
+int nal_filter_key_regex(nal_filter_t *filter, const char *pattern,
+                         int icase);
+
+int nal_filter_add_bytes(nal_filter_t *filter, int target, size_t offset,
+                         int op, const MDB_val *operand);
+
+/* operand is a packed tuple of exactly one element. */
+int nal_filter_add_field(nal_filter_t *filter, int target,
+                         unsigned int index, int op, const MDB_val *operand);
+
+/* Like nal_cursor_get, but moves on to the first matching entry. op is
+ * MDB_FIRST, MDB_SET_RANGE with key as the start, or MDB_NEXT to continue
+ * after the current entry. Returns MDB_NOTFOUND when no entry is left. */
+int nal_filter_get(nal_cursor_ptr cursor, const nal_filter_t *filter,
+                   MDB_val *key, MDB_val *data, MDB_cursor_op op);
+
+/* Fills keys and values with up to max matching entries, starting like
+ * nal_filter_get with op and key, and sets *n. The cursor stays on the last
+ * one, so the next batch continues with MDB_NEXT. Returns MDB_NOTFOUND only
+ * when no entry was found. Entries are valid like those of nal_cursor_get. */
+int nal_filter_batch(nal_cursor_ptr cursor, const nal_filter_t *filter,
+                     MDB_cursor_op op, const MDB_val *key, MDB_val *keys,
+                     MDB_val *values, size_t max, size_t *n);
+
+#endif
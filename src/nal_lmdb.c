@@ -1,9 +1,47 @@
 #include "nal_lmdb.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "nal_blob.h"
+#include "nal_dedup.h"
+#include "nal_bloom.h"
+#include "nal_cache.h"
+#include "nal_changelog.h"
+#include "nal_hash.h"
+#include "nal_lmdb_internal.h"
 #include "nal_log.h"
+#include "nal_probe.h"
+#include "nal_txn_stats.h"
+
+#define NAL_LMDB_LOG_TAG "nal_lmdb"
+#define NAL_GEN_FILE_NAME "nal_generation"
+#define NAL_WRITER_FILE_NAME "nal_writer"
+#define NAL_WRITER_MAGIC 0x6e616c77U /* "nalw" */
+#define NAL_GEN_MAGIC 0x6e616c67U /* "nalg" */
+#define NAL_GEN_NAME_MAX 40
+#define NAL_GEN_SLOT_FREE 0
+#define NAL_GEN_SLOT_CLAIMED 1
+#define NAL_GEN_SLOT_READY 2
+#define NAL_GEN_CLAIM_WAIT_MS 100
+#define NAL_DIRTY_WORDS 4
+#define NAL_VIEW_BUCKETS 64
+/* Non-canonical on x86-64 and unmapped elsewhere, so any read through a
+ * poisoned view faults right away instead of returning reused page data. */
+#define NAL_VIEW_POISON ((const char *)(uintptr_t)0xdead5eedd00dfeedULL)
 
 typedef struct nal_env_s {
     const char *env_path;
@@ -14,12 +52,393 @@ typedef struct nal_env_s {
     int use_tls;
     int read_only;
     MDB_env *env;
+    char *env_dir; /* owned copy of env_path, kept for sidecar files */
 } nal_env_t;
 
+/* Generation counters live in a small file mapped MAP_SHARED by every process
+ * using the env. Slots are claimed by dbi name because dbi handles are only
+ * meaningful inside one process. Each slot is one cache line. */
+struct nal_gen_slot_s {
+    uint64_t generation;
+    uint32_t futex_seq; /* bumped with generation; the futex word */
+    uint32_t waiters;
+    uint32_t state;
+    uint32_t name_len;
+    char name[NAL_GEN_NAME_MAX];
+};
+
+typedef struct {
+    uint32_t magic;
+    uint32_t num_slots;
+    unsigned char pad[56];
+    nal_gen_slot_t slots[];
+} nal_gen_file_t;
+
+static nal_gen_file_t *gen_file;
+
+/* Write txns of this library first take a robust process-shared mutex kept
+ * in a sidecar file, then LMDB's own write lock, which is then free. Unlike
+ * LMDB's lock it can be tried, so nal_txn_try_begin never blocks on another
+ * process's write txn. */
+typedef struct {
+    uint32_t magic;
+    uint32_t pad;
+    pthread_mutex_t mutex;
+} nal_writer_file_t;
+
+static nal_writer_file_t *writer_file;
+static __thread int writer_locked;
+
+/* The top-level write txn of this thread and the dbis it has modified. LMDB
+ * write txns are bound to the thread that began them, so thread-local state is
+ * enough and costs no lookups on the write path. */
+static __thread nal_txn_ptr write_txn_top;
+static __thread uint64_t dirty_dbis[NAL_DIRTY_WORDS];
+static __thread int dirty_overflow;
+
+/* Handle of NAL_VERSIONS_DBI_NAME, opened by the first versioned put in a
+ * top-level write txn. LMDB closes it again if that txn aborts, so it is
+ * only used by later txns once that one committed. Write txns of the env
+ * run one at a time, so no locking is needed. */
+#define NAL_VERSIONS_CLOSED 0
+#define NAL_VERSIONS_PENDING 1
+#define NAL_VERSIONS_OPEN 2
+static MDB_dbi versions_dbi;
+static int versions_state;
+
+/* Registry of live views by txn, so that ending or resetting a txn can detach
+ * the views still pointing into its snapshot, and in debug mode poison them.
+ * view_count lets txns skip the mutex while no view is registered. */
+static int view_debug;
+static unsigned long view_count;
+static pthread_mutex_t view_mutex = PTHREAD_MUTEX_INITIALIZER;
+static nal_view_t *view_buckets[NAL_VIEW_BUCKETS];
+
 static pthread_once_t env_init_once = PTHREAD_ONCE_INIT;
 static int env_init_rc;
 static nal_env_t env;
 
+/* Per-dbi bookkeeping indexed by MDB_dbi. LMDB hands out handles below
+ * max_databases plus its two core dbis, so a flat array is enough. */
+static nal_dbi_info_t *dbi_infos;
+static size_t dbi_infos_len;
+
+static void nal_gen_map(void)
+{
+    char path[PATH_MAX];
+    int n = snprintf(path, sizeof(path), "%s/%s", env.env_dir,
+                     NAL_GEN_FILE_NAME);
+    if (n < 0 || (size_t)n >= sizeof(path)) {
+        nal_log_warning("generation file path too long, notifications off");
+        return;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, env.file_mode);
+    if (fd == -1) {
+        nal_log_warning("cannot open %s, notifications off: %s", path,
+                        strerror(errno));
+        return;
+    }
+
+    /* Serialize initialization so that the first process sizes the file and
+     * everybody else uses the slot count recorded in its header. */
+    (void)flock(fd, LOCK_EX);
+    struct stat st;
+    size_t size;
+    if (fstat(fd, &st) != 0) {
+        goto fail;
+    }
+    if (st.st_size == 0) {
+        uint32_t num_slots = (uint32_t)(env.max_databases * 2 + 8);
+        size = sizeof(nal_gen_file_t) + num_slots * sizeof(nal_gen_slot_t);
+        if (ftruncate(fd, (off_t)size) != 0) {
+            goto fail;
+        }
+        nal_gen_file_t hdr = {NAL_GEN_MAGIC, num_slots, {0}};
+        if (pwrite(fd, &hdr, sizeof(hdr), 0) != (ssize_t)sizeof(hdr)) {
+            goto fail;
+        }
+    } else {
+        size = (size_t)st.st_size;
+    }
+
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (p == MAP_FAILED) {
+        goto fail;
+    }
+    nal_gen_file_t *f = p;
+    if (f->magic != NAL_GEN_MAGIC ||
+        sizeof(nal_gen_file_t) + f->num_slots * sizeof(nal_gen_slot_t) >
+            size) {
+        nal_log_warning("%s is corrupt, notifications off", path);
+        munmap(p, size);
+        goto unlock;
+    }
+    gen_file = f;
+    goto unlock;
+
+fail:
+    nal_log_warning("cannot set up %s, notifications off: %s", path,
+                    strerror(errno));
+unlock:
+    (void)flock(fd, LOCK_UN);
+    close(fd);
+}
+
+static void nal_writer_map(void)
+{
+    char path[PATH_MAX];
+    int n = snprintf(path, sizeof(path), "%s/%s", env.env_dir,
+                     NAL_WRITER_FILE_NAME);
+    if (n < 0 || (size_t)n >= sizeof(path)) {
+        nal_log_warning("writer lock path too long, try_begin off");
+        return;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, env.file_mode);
+    if (fd == -1) {
+        nal_log_warning("cannot open %s, try_begin off: %s", path,
+                        strerror(errno));
+        return;
+    }
+
+    (void)flock(fd, LOCK_EX);
+    struct stat st;
+    nal_writer_file_t *f = MAP_FAILED;
+    if (fstat(fd, &st) != 0 ||
+        (st.st_size == 0 &&
+         ftruncate(fd, (off_t)sizeof(nal_writer_file_t)) != 0)) {
+        goto fail;
+    }
+    f = mmap(NULL, sizeof(*f), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (f == MAP_FAILED) {
+        goto fail;
+    }
+    if (f->magic != NAL_WRITER_MAGIC) {
+        pthread_mutexattr_t attr;
+        int rc = pthread_mutexattr_init(&attr);
+        if (rc == 0) {
+            rc = pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        }
+        if (rc == 0) {
+            rc = pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        }
+        if (rc == 0) {
+            rc = pthread_mutex_init(&f->mutex, &attr);
+        }
+        pthread_mutexattr_destroy(&attr);
+        if (rc != 0) {
+            errno = rc;
+            goto fail;
+        }
+        __atomic_store_n(&f->magic, NAL_WRITER_MAGIC, __ATOMIC_RELEASE);
+    }
+    writer_file = f;
+    goto unlock;
+
+fail:
+    nal_log_warning("cannot set up %s, try_begin off: %s", path,
+                    strerror(errno));
+    if (f != MAP_FAILED) {
+        munmap(f, sizeof(*f));
+    }
+unlock:
+    (void)flock(fd, LOCK_UN);
+    close(fd);
+}
+
+/* Returns 0 with the writer mutex held, or EAGAIN if try is set and another
+ * thread or process holds it. */
+static int nal_writer_lock(int try)
+{
+    int rc = try ? pthread_mutex_trylock(&writer_file->mutex)
+                 : pthread_mutex_lock(&writer_file->mutex);
+    if (rc == EOWNERDEAD) {
+        /* The holder died; LMDB recovers its own lock the same way, and
+         * the mutex protects no data of its own. */
+        nal_log_warning("previous writer died holding the writer lock");
+        rc = pthread_mutex_consistent(&writer_file->mutex);
+    }
+    if (rc == EBUSY) {
+        return EAGAIN;
+    }
+    if (rc == 0) {
+        writer_locked = 1;
+    }
+    return rc;
+}
+
+static void nal_writer_unlock(void)
+{
+    if (writer_locked) {
+        writer_locked = 0;
+        pthread_mutex_unlock(&writer_file->mutex);
+    }
+}
+
+/* Waits up to NAL_GEN_CLAIM_WAIT_MS for a claimed slot to get its name,
+ * which its claimer writes right after the claim. Returns the last state. */
+static uint32_t nal_gen_slot_wait_ready(nal_gen_slot_t *slot)
+{
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (;;) {
+        uint32_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+        if (state != NAL_GEN_SLOT_CLAIMED) {
+            return state;
+        }
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - start.tv_sec) * 1000 +
+                (now.tv_nsec - start.tv_nsec) / 1000000 >=
+            NAL_GEN_CLAIM_WAIT_MS) {
+            return state;
+        }
+        sched_yield();
+    }
+}
+
+static nal_gen_slot_t *nal_gen_slot_bind(const char *name)
+{
+    size_t name_len = strlen(name);
+    if (gen_file == NULL || name_len > NAL_GEN_NAME_MAX) {
+        return NULL;
+    }
+
+    uint32_t n = gen_file->num_slots;
+    uint32_t i = (uint32_t)(nal_hash64(name, name_len, 0) % n);
+    for (uint32_t probes = 0; probes < n; probes++, i = (i + 1) % n) {
+        nal_gen_slot_t *slot = &gen_file->slots[i];
+        uint32_t state = __atomic_load_n(&slot->state, __ATOMIC_ACQUIRE);
+        if (state == NAL_GEN_SLOT_FREE) {
+            uint32_t expected = NAL_GEN_SLOT_FREE;
+            if (__atomic_compare_exchange_n(&slot->state, &expected,
+                                            NAL_GEN_SLOT_CLAIMED, 0,
+                                            __ATOMIC_ACQ_REL,
+                                            __ATOMIC_ACQUIRE)) {
+                memcpy(slot->name, name, name_len);
+                slot->name_len = (uint32_t)name_len;
+                __atomic_store_n(&slot->state, NAL_GEN_SLOT_READY,
+                                 __ATOMIC_RELEASE);
+                return slot;
+            }
+            state = expected;
+        }
+        if (state == NAL_GEN_SLOT_CLAIMED) {
+            state = nal_gen_slot_wait_ready(slot);
+            if (state == NAL_GEN_SLOT_CLAIMED) {
+                /* The claimer likely died before publishing the name; its
+                 * dbi and ours can no longer be told apart. */
+                nal_log_warning("generation slot %u stuck, dbi %s has no "
+                                "generation counter", i, name);
+                return NULL;
+            }
+        }
+        if (slot->name_len == name_len &&
+            memcmp(slot->name, name, name_len) == 0) {
+            return slot;
+        }
+    }
+    nal_log_warning("no free generation slot for dbi %s", name);
+    return NULL;
+}
+
+static void nal_gen_bump(nal_gen_slot_t *slot)
+{
+    __atomic_add_fetch(&slot->generation, 1, __ATOMIC_SEQ_CST);
+    __atomic_add_fetch(&slot->futex_seq, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&slot->waiters, __ATOMIC_SEQ_CST) > 0) {
+        syscall(SYS_futex, &slot->futex_seq, FUTEX_WAKE, INT_MAX, NULL, NULL,
+                0);
+    }
+}
+
+static void nal_mark_dirty(MDB_dbi dbi)
+{
+    if (dbi < NAL_DIRTY_WORDS * 64) {
+        dirty_dbis[dbi / 64] |= (uint64_t)1 << (dbi % 64);
+    } else {
+        dirty_overflow = 1;
+    }
+}
+
+static void nal_write_txn_end(nal_txn_ptr txn, int committed)
+{
+    if (txn != write_txn_top) {
+        return;
+    }
+    write_txn_top = NULL;
+    if (versions_state == NAL_VERSIONS_PENDING) {
+        versions_state = committed ? NAL_VERSIONS_OPEN : NAL_VERSIONS_CLOSED;
+    }
+    nal_writer_unlock();
+    nal_txn_stats_end(committed);
+
+    if (committed && gen_file != NULL) {
+        for (size_t dbi = 0; dbi < dbi_infos_len; dbi++) {
+            int dirty = dbi < NAL_DIRTY_WORDS * 64
+                            ? (int)((dirty_dbis[dbi / 64] >> (dbi % 64)) & 1)
+                            : dirty_overflow;
+            if (dirty && dbi_infos[dbi].gen != NULL) {
+                nal_gen_bump(dbi_infos[dbi].gen);
+            }
+        }
+    }
+    memset(dirty_dbis, 0, sizeof(dirty_dbis));
+    dirty_overflow = 0;
+}
+
+/* Common bookkeeping after a successful modification of dbi in txn. */
+static int nal_after_write(nal_txn_ptr txn, int op, MDB_dbi dbi, MDB_val *key,
+                           MDB_val *data)
+{
+    nal_mark_dirty(dbi);
+    nal_dbi_info_t *info = nal_dbi_info_get(dbi);
+    if (info != NULL && info->bloom != NULL) {
+        if (op == NAL_CHANGELOG_PUT) {
+            nal_bloom_add(info->bloom, key);
+        } else {
+            nal_bloom_note_del(info->bloom);
+        }
+    }
+    if (info != NULL && info->cache != NULL && op == NAL_CHANGELOG_PUT) {
+        nal_cache_note_put(info->cache, key);
+    }
+    return nal_changelog_record(txn, op, dbi, key, data);
+}
+
+static size_t nal_view_bucket(nal_txn_ptr txn)
+{
+    return ((uintptr_t)txn >> 4) % NAL_VIEW_BUCKETS;
+}
+
+static void nal_view_detach(nal_txn_ptr txn)
+{
+    if (__atomic_load_n(&view_count, __ATOMIC_ACQUIRE) == 0) {
+        return;
+    }
+
+    int poison = __atomic_load_n(&view_debug, __ATOMIC_RELAXED);
+    pthread_mutex_lock(&view_mutex);
+    nal_view_t **pp = &view_buckets[nal_view_bucket(txn)];
+    while (*pp != NULL) {
+        nal_view_t *v = *pp;
+        if (v->txn == txn) {
+            *pp = v->next;
+            if (poison) {
+                v->data = NAL_VIEW_POISON;
+            }
+            v->size = 0;
+            v->txn = NULL;
+            v->next = NULL;
+            v->registered = 0;
+            __atomic_sub_fetch(&view_count, 1, __ATOMIC_RELEASE);
+        } else {
+            pp = &v->next;
+        }
+    }
+    pthread_mutex_unlock(&view_mutex);
+}
+
 static void nal_do_init_env(void)
 {
     int rc = mdb_env_create(&env.env);
@@ -56,6 +475,15 @@ static void nal_do_init_env(void)
         goto exit;
     }
 
+    env.env_dir = strdup(env.env_path);
+    dbi_infos_len = env.max_databases + 2;
+    dbi_infos = calloc(dbi_infos_len, sizeof(nal_dbi_info_t));
+    if (env.env_dir == NULL || dbi_infos == NULL) {
+        nal_log_error("cannot allocate dbi table");
+        rc = ENOMEM;
+        goto exit;
+    }
+
     int dead = 0;
     rc = mdb_reader_check(env.env, &dead);
     if (rc != 0) {
@@ -64,6 +492,16 @@ static void nal_do_init_env(void)
         nal_log_warning("found and cleared %d stale readers from LMDB", dead);
     }
 
+    nal_gen_map();
+    if (!env.read_only) {
+        nal_writer_map();
+    }
+
+    const char *debug = getenv("NAL_VIEW_DEBUG");
+    if (debug != NULL && debug[0] != '\0' && debug[0] != '0') {
+        nal_view_set_debug(1);
+    }
+
 exit:
     nal_log_note("nal_do_init_env exit: use_tls=%d, rc=%d", env.use_tls, rc);
     env_init_rc = rc;
@@ -86,62 +524,797 @@ int nal_env_init(const char *env_path, size_t max_databases,
 
 const char *nal_strerror(int err)
 {
-    return mdb_strerror(err);
+    switch (err) {
+    case NAL_VERSION_CONFLICT:
+        return "NAL_VERSION_CONFLICT: Value version does not match";
+    default:
+        return mdb_strerror(err);
+    }
+}
+
+MDB_env *nal_env_handle(void)
+{
+    return env.env;
+}
+
+const char *nal_env_path(void)
+{
+    return env.env_dir;
+}
+
+nal_dbi_info_t *nal_dbi_info_get(MDB_dbi dbi)
+{
+    if (dbi >= dbi_infos_len) {
+        return NULL;
+    }
+    return &dbi_infos[dbi];
+}
+
+static int nal_dbi_register(MDB_dbi dbi, const char *name)
+{
+    nal_dbi_info_t *info = nal_dbi_info_get(dbi);
+    if (info == NULL) {
+        return MDB_BAD_DBI;
+    }
+    if (info->name == NULL && name != NULL) {
+        info->name = strdup(name);
+        if (info->name == NULL) {
+            return ENOMEM;
+        }
+        info->gen = nal_gen_slot_bind(name);
+        NAL_PROBE2(dbi__open, dbi, info->name);
+        nal_log_debug(NAL_LMDB_LOG_TAG, "dbi open name=%s dbi=%u", info->name,
+                      dbi);
+    }
+    return 0;
+}
+
+static unsigned int nal_dbi_flags_of(MDB_dbi dbi)
+{
+    nal_dbi_info_t *info = nal_dbi_info_get(dbi);
+    return info != NULL ? info->flags : 0;
 }
 
+int nal_dbi_set_flags(MDB_dbi dbi, unsigned int flags)
+{
+    nal_dbi_info_t *info = nal_dbi_info_get(dbi);
+    if (info == NULL) {
+        return MDB_BAD_DBI;
+    }
+    /* These modes own the value format. */
+    unsigned int formats =
+        flags & (NAL_DBI_VERSIONED | NAL_DBI_BLOB | NAL_DBI_DEDUP);
+    if ((formats & (formats - 1)) != 0) {
+        return EINVAL;
+    }
+    info->flags = flags;
+    return 0;
+}
+
+uint64_t nal_generation(MDB_dbi dbi)
+{
+    nal_dbi_info_t *info = nal_dbi_info_get(dbi);
+    if (info == NULL || info->gen == NULL) {
+        return 0;
+    }
+    return __atomic_load_n(&info->gen->generation, __ATOMIC_ACQUIRE);
+}
+
+const volatile uint64_t *nal_generation_ptr(MDB_dbi dbi)
+{
+    nal_dbi_info_t *info = nal_dbi_info_get(dbi);
+    if (info == NULL || info->gen == NULL) {
+        return NULL;
+    }
+    return &info->gen->generation;
+}
+
+int nal_generation_wait(MDB_dbi dbi, uint64_t last_seen, int timeout_ms,
+                        uint64_t *current)
+{
+    nal_dbi_info_t *info = nal_dbi_info_get(dbi);
+    if (info == NULL || info->gen == NULL) {
+        return ENOTSUP;
+    }
+    nal_gen_slot_t *slot = info->gen;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    int rc = 0;
+    __atomic_add_fetch(&slot->waiters, 1, __ATOMIC_SEQ_CST);
+    for (;;) {
+        uint32_t seq = __atomic_load_n(&slot->futex_seq, __ATOMIC_SEQ_CST);
+        *current = __atomic_load_n(&slot->generation, __ATOMIC_SEQ_CST);
+        if (*current != last_seen) {
+            break;
+        }
+
+        struct timespec now, rel;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        rel.tv_sec = deadline.tv_sec - now.tv_sec;
+        rel.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+        if (rel.tv_nsec < 0) {
+            rel.tv_sec--;
+            rel.tv_nsec += 1000000000;
+        }
+        if (timeout_ms >= 0 && rel.tv_sec < 0) {
+            rc = ETIMEDOUT;
+            break;
+        }
+        if (syscall(SYS_futex, &slot->futex_seq, FUTEX_WAIT, seq,
+                    timeout_ms >= 0 ? &rel : NULL, NULL, 0) == -1 &&
+            errno != EAGAIN && errno != EINTR && errno != ETIMEDOUT) {
+            rc = errno;
+            break;
+        }
+    }
+    __atomic_sub_fetch(&slot->waiters, 1, __ATOMIC_SEQ_CST);
+    return rc;
+}
+
+static int nal_write_txn_begin(nal_txn_ptr parent, nal_txn_ptr *txn, int try)
+{
+    if (parent != NULL) {
+        return mdb_txn_begin(env.env, parent, 0, txn);
+    }
+    if (writer_file == NULL && try) {
+        return ENOTSUP;
+    }
+
+    uint64_t start_ns = nal_txn_stats_now();
+    int rc = writer_file != NULL ? nal_writer_lock(try) : 0;
+    if (rc != 0) {
+        return rc;
+    }
+    rc = mdb_txn_begin(env.env, NULL, 0, txn);
+    if (rc != 0) {
+        nal_writer_unlock();
+        return rc;
+    }
+    write_txn_top = *txn;
+    nal_txn_stats_begin(start_ns);
+    return 0;
+}
+
+/* The time between txn__begin__start and txn__begin__done of a write txn
+ * is the wait for the write lock. */
 int nal_txn_begin(nal_txn_ptr parent, nal_txn_ptr *txn)
 {
-    return mdb_txn_begin(env.env, parent, 0, txn);
+    NAL_PROBE2(txn__begin__start, parent, 0);
+    int rc = nal_write_txn_begin(parent, txn, 0);
+    NAL_PROBE3(txn__begin__done, rc == 0 ? *txn : NULL, 0, rc);
+    nal_log_debug(NAL_LMDB_LOG_TAG, "txn begin parent=%p txn=%p rc=%d",
+                  (void *)parent, rc == 0 ? (void *)*txn : NULL, rc);
+    return rc;
+}
+
+int nal_txn_try_begin(nal_txn_ptr parent, nal_txn_ptr *txn)
+{
+    NAL_PROBE2(txn__begin__start, parent, 0);
+    int rc = nal_write_txn_begin(parent, txn, 1);
+    NAL_PROBE3(txn__begin__done, rc == 0 ? *txn : NULL, 0, rc);
+    nal_log_debug(NAL_LMDB_LOG_TAG, "txn try begin parent=%p txn=%p rc=%d",
+                  (void *)parent, rc == 0 ? (void *)*txn : NULL, rc);
+    return rc;
 }
 
 int nal_readonly_txn_begin(nal_txn_ptr parent, nal_txn_ptr *txn)
 {
-    return mdb_txn_begin(env.env, parent, MDB_RDONLY, txn);
+    NAL_PROBE2(txn__begin__start, parent, 1);
+    int rc = mdb_txn_begin(env.env, parent, MDB_RDONLY, txn);
+    NAL_PROBE3(txn__begin__done, rc == 0 ? *txn : NULL, 1, rc);
+    nal_log_debug(NAL_LMDB_LOG_TAG, "readonly txn begin parent=%p txn=%p rc=%d",
+                  (void *)parent, rc == 0 ? (void *)*txn : NULL, rc);
+    return rc;
+}
+
+static int nal_do_txn_commit(nal_txn_ptr txn)
+{
+    nal_view_detach(txn);
+    if (txn == write_txn_top) {
+        nal_txn_stats_commit();
+        /* Blobs must be durable before the references to them are. */
+        int rc = nal_blob_sync();
+        if (rc != 0) {
+            mdb_txn_abort(txn);
+            nal_write_txn_end(txn, 0);
+            return rc;
+        }
+    }
+    int rc = mdb_txn_commit(txn);
+    nal_write_txn_end(txn, rc == 0);
+    return rc;
 }
 
 int nal_txn_commit(nal_txn_ptr txn)
 {
-    return mdb_txn_commit(txn);
+    NAL_PROBE1(txn__commit__start, txn);
+    int rc = nal_do_txn_commit(txn);
+    NAL_PROBE2(txn__commit__done, txn, rc);
+    nal_log_debug(NAL_LMDB_LOG_TAG, "txn commit txn=%p rc=%d", (void *)txn, rc);
+    return rc;
 }
 
 void nal_txn_abort(nal_txn_ptr txn)
 {
+    NAL_PROBE1(txn__abort, txn);
+    nal_log_debug(NAL_LMDB_LOG_TAG, "txn abort txn=%p", (void *)txn);
+    nal_view_detach(txn);
     mdb_txn_abort(txn);
+    nal_write_txn_end(txn, 0);
 }
 
 int nal_txn_renew(nal_txn_ptr txn)
 {
-    return mdb_txn_renew(txn);
+    NAL_PROBE1(txn__renew__start, txn);
+    int rc = mdb_txn_renew(txn);
+    NAL_PROBE2(txn__renew__done, txn, rc);
+    nal_log_debug(NAL_LMDB_LOG_TAG, "txn renew txn=%p rc=%d", (void *)txn, rc);
+    return rc;
 }
 
 void nal_txn_reset(nal_txn_ptr txn)
 {
+    NAL_PROBE1(txn__reset, txn);
+    nal_log_debug(NAL_LMDB_LOG_TAG, "txn reset txn=%p", (void *)txn);
+    nal_view_detach(txn);
     mdb_txn_reset(txn);
 }
 
 int nal_dbi_open(nal_txn_ptr txn, const char *name, MDB_dbi *dbi)
 {
-    return mdb_dbi_open(txn, name, MDB_CREATE, dbi);
+    int rc = mdb_dbi_open(txn, name, MDB_CREATE, dbi);
+    if (rc != 0) {
+        return rc;
+    }
+    return nal_dbi_register(*dbi, name);
 }
 
 int nal_readonly_dbi_open(nal_txn_ptr txn, const char *name, MDB_dbi *dbi)
 {
-    return mdb_dbi_open(txn, name, 0, dbi);
+    int rc = mdb_dbi_open(txn, name, 0, dbi);
+    if (rc != 0) {
+        return rc;
+    }
+    return nal_dbi_register(*dbi, name);
+}
+
+/* Values of a NAL_DBI_VERSIONED dbi start with an 8-byte version in host
+ * byte order. Callers only ever see the payload. */
+static int nal_version_split(MDB_val *stored, uint64_t *version)
+{
+    if (stored->mv_size < NAL_VERSION_SIZE) {
+        return MDB_CORRUPTED;
+    }
+    if (version != NULL) {
+        memcpy(version, stored->mv_data, NAL_VERSION_SIZE);
+    }
+    stored->mv_data = (char *)stored->mv_data + NAL_VERSION_SIZE;
+    stored->mv_size -= NAL_VERSION_SIZE;
+    return 0;
+}
+
+static int nal_version_current(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key,
+                               uint64_t *version)
+{
+    MDB_val stored;
+    int rc = mdb_get(txn, dbi, key, &stored);
+    if (rc == MDB_NOTFOUND) {
+        *version = 0;
+        return 0;
+    }
+    if (rc != 0) {
+        return rc;
+    }
+    return nal_version_split(&stored, version);
+}
+
+/* Versions come from a counter per dbi kept in NAL_VERSIONS_DBI_NAME, so a
+ * key that is deleted and written again never gets back a version that an
+ * earlier value had. Values written before the counter existed may be ahead
+ * of it, hence the max with the current version. */
+static int nal_version_next(nal_txn_ptr txn, MDB_dbi dbi, uint64_t cur,
+                            uint64_t *next)
+{
+    MDB_dbi versions = versions_dbi;
+    int rc;
+    if (versions_state == NAL_VERSIONS_CLOSED) {
+        rc = mdb_dbi_open(txn, NAL_VERSIONS_DBI_NAME, MDB_CREATE, &versions);
+        if (rc != 0) {
+            return rc;
+        }
+        /* A handle opened in a nested txn dies with it on abort. */
+        if (txn == write_txn_top) {
+            versions_dbi = versions;
+            versions_state = NAL_VERSIONS_PENDING;
+        }
+    }
+    /* Names cannot contain NUL, so "\0" stands for the unnamed dbi. */
+    nal_dbi_info_t *info = nal_dbi_info_get(dbi);
+    MDB_val key = {1, ""};
+    if (info != NULL && info->name != NULL) {
+        key.mv_size = strlen(info->name);
+        key.mv_data = info->name;
+    }
+    MDB_val data;
+    uint64_t last = 0;
+    rc = mdb_get(txn, versions, &key, &data);
+    if (rc == 0) {
+        if (data.mv_size != sizeof(last)) {
+            return MDB_CORRUPTED;
+        }
+        memcpy(&last, data.mv_data, sizeof(last));
+    } else if (rc != MDB_NOTFOUND) {
+        return rc;
+    }
+    *next = (last > cur ? last : cur) + 1;
+    data.mv_size = sizeof(*next);
+    data.mv_data = next;
+    return mdb_put(txn, versions, &key, &data, 0);
+}
+
+/* Stores data with the next version. If check is set, the write only
+ * happens when the current version (0 for a missing key) equals expected.
+ * *version receives the new version on success and the current one on
+ * conflict. */
+static int nal_versioned_put(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key,
+                             MDB_val *data, int check, uint64_t expected,
+                             uint64_t *version)
+{
+    uint64_t cur;
+    int rc = nal_version_current(txn, dbi, key, &cur);
+    if (rc != 0) {
+        return rc;
+    }
+    if (check && cur != expected) {
+        *version = cur;
+        return NAL_VERSION_CONFLICT;
+    }
+
+    uint64_t next;
+    rc = nal_version_next(txn, dbi, cur, &next);
+    if (rc != 0) {
+        return rc;
+    }
+    MDB_val stored = {NAL_VERSION_SIZE + data->mv_size, NULL};
+    rc = mdb_put(txn, dbi, key, &stored, MDB_RESERVE);
+    if (rc != 0) {
+        return rc;
+    }
+    memcpy(stored.mv_data, &next, NAL_VERSION_SIZE);
+    memcpy((char *)stored.mv_data + NAL_VERSION_SIZE, data->mv_data,
+           data->mv_size);
+    *version = next;
+    return nal_after_write(txn, NAL_CHANGELOG_PUT, dbi, key, &stored);
+}
+
+int nal_put_if_absent(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key,
+                      MDB_val *data, uint64_t *version)
+{
+    unsigned int flags = nal_dbi_flags_of(dbi);
+    if (flags & NAL_DBI_VERSIONED) {
+        int rc = nal_versioned_put(txn, dbi, key, data, 1, 0, version);
+        return rc == NAL_VERSION_CONFLICT ? MDB_KEYEXIST : rc;
+    }
+
+    *version = 0;
+    int rc;
+    if (flags & (NAL_DBI_BLOB | NAL_DBI_DEDUP)) {
+        MDB_val old;
+        rc = mdb_get(txn, dbi, key, &old);
+        if (rc == 0) {
+            return MDB_KEYEXIST;
+        }
+        if (rc == MDB_NOTFOUND) {
+            rc = (flags & NAL_DBI_BLOB) ? nal_blob_put(txn, dbi, key, data)
+                                        : nal_dedup_put(txn, dbi, key, data);
+        }
+    } else {
+        rc = mdb_put(txn, dbi, key, data, MDB_NOOVERWRITE);
+    }
+    if (rc != 0) {
+        return rc;
+    }
+    return nal_after_write(txn, NAL_CHANGELOG_PUT, dbi, key, data);
+}
+
+int nal_put_if_version(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key,
+                       MDB_val *data, uint64_t expected, uint64_t *version)
+{
+    if (!(nal_dbi_flags_of(dbi) & NAL_DBI_VERSIONED)) {
+        return MDB_INCOMPATIBLE;
+    }
+    return nal_versioned_put(txn, dbi, key, data, 1, expected, version);
+}
+
+int nal_del_if_version(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key,
+                       uint64_t expected, uint64_t *version)
+{
+    if (!(nal_dbi_flags_of(dbi) & NAL_DBI_VERSIONED)) {
+        return MDB_INCOMPATIBLE;
+    }
+    int rc = nal_version_current(txn, dbi, key, version);
+    if (rc != 0) {
+        return rc;
+    }
+    if (*version != expected) {
+        return NAL_VERSION_CONFLICT;
+    }
+    if (expected == 0) {
+        return MDB_NOTFOUND;
+    }
+    rc = mdb_del(txn, dbi, key, NULL);
+    if (rc != 0) {
+        return rc;
+    }
+    *version = 0;
+    return nal_after_write(txn, NAL_CHANGELOG_DEL, dbi, key, NULL);
+}
+
+int nal_get_version(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key,
+                    MDB_val *data, uint64_t *version)
+{
+    if (!(nal_dbi_flags_of(dbi) & NAL_DBI_VERSIONED)) {
+        return MDB_INCOMPATIBLE;
+    }
+    int rc = mdb_get(txn, dbi, key, data);
+    if (rc != 0) {
+        return rc;
+    }
+    return nal_version_split(data, version);
+}
+
+static int nal_do_put(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key,
+                      MDB_val *data)
+{
+    nal_dbi_info_t *info = nal_dbi_info_get(dbi);
+    if (info != NULL && info->cache != NULL) {
+        int rc = nal_cache_make_room(txn, dbi, info->cache,
+                                     key->mv_size + data->mv_size);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+
+    unsigned int flags = nal_dbi_flags_of(dbi);
+    if (flags & NAL_DBI_VERSIONED) {
+        uint64_t version;
+        return nal_versioned_put(txn, dbi, key, data, 0, 0, &version);
+    }
+
+    /* The change log gets the caller's value: followers have no segments
+     * and their own dedup dbi. */
+    int rc;
+    if (flags & NAL_DBI_BLOB) {
+        rc = nal_blob_put(txn, dbi, key, data);
+    } else if (flags & NAL_DBI_DEDUP) {
+        rc = nal_dedup_put(txn, dbi, key, data);
+    } else {
+        rc = mdb_put(txn, dbi, key, data, 0);
+    }
+    if (rc != 0) {
+        return rc;
+    }
+    return nal_after_write(txn, NAL_CHANGELOG_PUT, dbi, key, data);
 }
 
 int nal_put(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key, MDB_val *data)
 {
-    return mdb_put(txn, dbi, key, data, 0);
+    NAL_PROBE3(put__start, dbi, key->mv_size, data->mv_size);
+    int rc = nal_do_put(txn, dbi, key, data);
+    NAL_PROBE4(put__done, dbi, key->mv_size, data->mv_size, rc);
+    nal_log_debug(NAL_LMDB_LOG_TAG,
+                  "put dbi=%u key=%zu bytes data=%zu bytes rc=%d", dbi,
+                  key->mv_size, data->mv_size, rc);
+    return rc;
+}
+
+/* Drops what a stored value of dbi holds outside of it before it is
+ * overwritten or deleted. */
+static int nal_value_release(nal_txn_ptr txn, MDB_dbi dbi,
+                             const MDB_val *stored)
+{
+    unsigned int flags = nal_dbi_flags_of(dbi);
+    if (flags & NAL_DBI_BLOB) {
+        return nal_blob_release(txn, stored);
+    }
+    if (flags & NAL_DBI_DEDUP) {
+        return nal_dedup_release(txn, stored);
+    }
+    return 0;
+}
+
+static int nal_do_del(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key)
+{
+    if (nal_dbi_flags_of(dbi) & (NAL_DBI_BLOB | NAL_DBI_DEDUP)) {
+        MDB_val old;
+        int rc = mdb_get(txn, dbi, key, &old);
+        if (rc == 0) {
+            rc = nal_value_release(txn, dbi, &old);
+        }
+        if (rc != 0) {
+            return rc;
+        }
+    }
+
+    int rc = mdb_del(txn, dbi, key, NULL);
+    if (rc != 0) {
+        return rc;
+    }
+    return nal_after_write(txn, NAL_CHANGELOG_DEL, dbi, key, NULL);
 }
 
 int nal_del(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key)
 {
-    return mdb_del(txn, dbi, key, NULL);
+    NAL_PROBE2(del__start, dbi, key->mv_size);
+    int rc = nal_do_del(txn, dbi, key);
+    NAL_PROBE3(del__done, dbi, key->mv_size, rc);
+    nal_log_debug(NAL_LMDB_LOG_TAG, "del dbi=%u key=%zu bytes rc=%d", dbi,
+                  key->mv_size, rc);
+    return rc;
+}
+
+/* Turns a stored value of dbi into what the caller put. */
+int nal_value_decode(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *data)
+{
+    unsigned int flags = nal_dbi_flags_of(dbi);
+    if (flags & NAL_DBI_VERSIONED) {
+        return nal_version_split(data, NULL);
+    }
+    if (flags & NAL_DBI_BLOB) {
+        return nal_blob_resolve(data);
+    }
+    if (flags & NAL_DBI_DEDUP) {
+        return nal_dedup_resolve(txn, data);
+    }
+    return 0;
 }
 
 int nal_get(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key, MDB_val *data)
 {
-    return mdb_get(txn, dbi, key, data);
+    NAL_PROBE2(get__start, dbi, key->mv_size);
+    int rc;
+    nal_dbi_info_t *info = nal_dbi_info_get(dbi);
+    if (info != NULL && info->bloom != NULL &&
+        !nal_bloom_may_contain(info->bloom, key)) {
+        rc = MDB_NOTFOUND;
+    } else {
+        rc = mdb_get(txn, dbi, key, data);
+        if (rc == 0) {
+            rc = nal_value_decode(txn, dbi, data);
+        }
+        if (rc == 0 && info != NULL && info->cache != NULL) {
+            nal_cache_touch(info->cache, key);
+        }
+    }
+    NAL_PROBE4(get__done, dbi, key->mv_size, rc == 0 ? data->mv_size : 0,
+               rc);
+    nal_log_debug(NAL_LMDB_LOG_TAG,
+                  "get dbi=%u key=%zu bytes data=%zu bytes rc=%d", dbi,
+                  key->mv_size, rc == 0 ? data->mv_size : 0, rc);
+    return rc;
+}
+
+static int nal_merge_int64(int op, int64_t cur, int64_t arg, int64_t *out)
+{
+    switch (op) {
+    case NAL_MERGE_ADD:
+        /* Wrap around like the Lua side would with int64 cdata. */
+        *out = (int64_t)((uint64_t)cur + (uint64_t)arg);
+        return 0;
+    case NAL_MERGE_MIN:
+        *out = arg < cur ? arg : cur;
+        return 0;
+    case NAL_MERGE_MAX:
+        *out = arg > cur ? arg : cur;
+        return 0;
+    default:
+        return EINVAL;
+    }
+}
+
+/* Size of the merged value for op given the sizes of the current value
+ * (0 if absent) and the operand. */
+static size_t nal_merge_size(int op, size_t cur_size, size_t arg_size,
+                             size_t limit)
+{
+    size_t size;
+    switch (op) {
+    case NAL_MERGE_APPEND:
+        size = cur_size + arg_size;
+        return limit > 0 && size > limit ? limit : size;
+    case NAL_MERGE_OR:
+        return cur_size > arg_size ? cur_size : arg_size;
+    default:
+        return sizeof(int64_t);
+    }
+}
+
+static void nal_merge_bytes(int op, unsigned char *dst, size_t dst_size,
+                            const unsigned char *cur, size_t cur_size,
+                            const unsigned char *arg, size_t arg_size)
+{
+    if (op == NAL_MERGE_OR) {
+        for (size_t i = 0; i < dst_size; i++) {
+            dst[i] = (i < cur_size ? cur[i] : 0) | (i < arg_size ? arg[i] : 0);
+        }
+        return;
+    }
+
+    /* NAL_MERGE_APPEND keeps the newest dst_size bytes of cur || arg. */
+    size_t total = cur_size + arg_size;
+    size_t skip = total - dst_size;
+    if (skip < cur_size) {
+        memcpy(dst, cur + skip, cur_size - skip);
+        memcpy(dst + cur_size - skip, arg, arg_size);
+    } else {
+        memcpy(dst, arg + (skip - cur_size), dst_size);
+    }
+}
+
+int nal_merge(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key, int op,
+              MDB_val *operand, size_t limit, MDB_val *result)
+{
+    int int_op = op == NAL_MERGE_ADD || op == NAL_MERGE_MIN ||
+                 op == NAL_MERGE_MAX;
+    if (!int_op && op != NAL_MERGE_APPEND && op != NAL_MERGE_OR) {
+        return EINVAL;
+    }
+    if (int_op && operand->mv_size != sizeof(int64_t)) {
+        return MDB_BAD_VALSIZE;
+    }
+    if (nal_dbi_flags_of(dbi) &
+        (NAL_DBI_VERSIONED | NAL_DBI_BLOB | NAL_DBI_DEDUP)) {
+        return MDB_INCOMPATIBLE;
+    }
+
+    /* Evict before the cursor is positioned: eviction deletes keys. The
+     * operand size is what a merge adds at most, APPEND aside. */
+    int rc;
+    nal_dbi_info_t *info = nal_dbi_info_get(dbi);
+    if (info != NULL && info->cache != NULL) {
+        rc = nal_cache_make_room(txn, dbi, info->cache,
+                                 key->mv_size + operand->mv_size);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+
+    MDB_cursor *cursor;
+    rc = mdb_cursor_open(txn, dbi, &cursor);
+    if (rc != 0) {
+        return rc;
+    }
+
+    MDB_val cur_key = *key, cur;
+    rc = mdb_cursor_get(cursor, &cur_key, &cur, MDB_SET_KEY);
+    if (rc != 0 && rc != MDB_NOTFOUND) {
+        goto exit;
+    }
+    int found = rc == 0;
+    if (!found) {
+        cur.mv_size = 0;
+        cur.mv_data = NULL;
+    }
+    if (int_op && found && cur.mv_size != sizeof(int64_t)) {
+        rc = MDB_BAD_VALSIZE;
+        goto exit;
+    }
+
+    /* The current value lives in a page that the put below may copy or
+     * rewrite, so take what we need from it first. Counters only need the
+     * integer itself; byte ops keep a temporary copy. */
+    int64_t cur_int = 0, new_int = 0;
+    unsigned char stack_buf[256];
+    unsigned char *cur_copy = NULL;
+    if (int_op) {
+        int64_t arg_int;
+        memcpy(&arg_int, operand->mv_data, sizeof(arg_int));
+        if (found) {
+            memcpy(&cur_int, cur.mv_data, sizeof(cur_int));
+            rc = nal_merge_int64(op, cur_int, arg_int, &new_int);
+            if (rc != 0) {
+                goto exit;
+            }
+        } else {
+            new_int = arg_int;
+        }
+    } else if (cur.mv_size > 0) {
+        cur_copy = cur.mv_size <= sizeof(stack_buf) ? stack_buf
+                                                    : malloc(cur.mv_size);
+        if (cur_copy == NULL) {
+            rc = ENOMEM;
+            goto exit;
+        }
+        memcpy(cur_copy, cur.mv_data, cur.mv_size);
+    }
+
+    MDB_val data = {nal_merge_size(op, cur.mv_size, operand->mv_size, limit),
+                    NULL};
+    if (found) {
+        /* A same-size MDB_CURRENT put overwrites the value in place on the
+         * already dirty page, without deleting and re-inserting the node. */
+        rc = mdb_cursor_put(cursor, &cur_key, &data, MDB_CURRENT | MDB_RESERVE);
+    } else {
+        rc = mdb_cursor_put(cursor, key, &data, MDB_RESERVE);
+    }
+    if (rc == 0) {
+        if (int_op) {
+            memcpy(data.mv_data, &new_int, sizeof(new_int));
+        } else {
+            nal_merge_bytes(op, data.mv_data, data.mv_size, cur_copy,
+                            cur.mv_size, operand->mv_data, operand->mv_size);
+        }
+        if (result != NULL) {
+            *result = data;
+        }
+        rc = nal_after_write(txn, NAL_CHANGELOG_PUT, dbi, key, &data);
+    }
+    if (cur_copy != stack_buf) {
+        free(cur_copy);
+    }
+
+exit:
+    mdb_cursor_close(cursor);
+    return rc;
+}
+
+void nal_view_set_debug(int on)
+{
+    __atomic_store_n(&view_debug, on, __ATOMIC_RELAXED);
+}
+
+int nal_view_get(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key, nal_view_t *view)
+{
+    MDB_val data;
+    int rc = nal_get(txn, dbi, key, &data);
+    if (rc != 0) {
+        return rc;
+    }
+    view->data = data.mv_data;
+    view->size = data.mv_size;
+    view->txn = txn;
+    view->next = NULL;
+
+    pthread_mutex_lock(&view_mutex);
+    nal_view_t **head = &view_buckets[nal_view_bucket(txn)];
+    view->next = *head;
+    *head = view;
+    view->registered = 1;
+    __atomic_add_fetch(&view_count, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&view_mutex);
+    return 0;
+}
+
+void nal_view_release(nal_view_t *view)
+{
+    if (view->registered) {
+        pthread_mutex_lock(&view_mutex);
+        /* Re-check under the lock: the txn may have just poisoned it. */
+        if (view->registered) {
+            nal_view_t **pp = &view_buckets[nal_view_bucket(view->txn)];
+            while (*pp != NULL && *pp != view) {
+                pp = &(*pp)->next;
+            }
+            if (*pp != NULL) {
+                *pp = view->next;
+                __atomic_sub_fetch(&view_count, 1, __ATOMIC_RELEASE);
+            }
+            view->registered = 0;
+        }
+        pthread_mutex_unlock(&view_mutex);
+    }
+    view->data = NULL;
+    view->size = 0;
+    view->txn = NULL;
+    view->next = NULL;
 }
 
 int nal_cursor_open(nal_txn_ptr txn, MDB_dbi dbi, nal_cursor_ptr *cursor)
@@ -157,16 +1330,125 @@ void nal_cursor_close(nal_cursor_ptr cursor)
 int nal_cursor_get(nal_cursor_ptr cursor, MDB_val *key, MDB_val *data,
                    MDB_cursor_op op)
 {
-    return mdb_cursor_get(cursor, key, data, op);
+    NAL_PROBE2(cursor__get__start, cursor, op);
+    MDB_dbi dbi = mdb_cursor_dbi(cursor);
+    int rc = mdb_cursor_get(cursor, key, data, op);
+    if (rc == 0) {
+        rc = nal_value_decode(mdb_cursor_txn(cursor), dbi, data);
+    }
+    NAL_PROBE5(cursor__get__done, cursor, dbi, op,
+               rc == 0 ? data->mv_size : 0, rc);
+    nal_log_debug(NAL_LMDB_LOG_TAG,
+                  "cursor get dbi=%u op=%d data=%zu bytes rc=%d", dbi,
+                  (int)op, rc == 0 ? data->mv_size : 0, rc);
+    return rc;
+}
+
+static int nal_do_cursor_put(nal_cursor_ptr cursor, MDB_val *key,
+                             MDB_val *data, unsigned int flags)
+{
+    /* Versions and blob and dedup references are maintained by nal_put; a
+     * raw cursor write would store a value without a header. */
+    if (nal_dbi_flags_of(mdb_cursor_dbi(cursor)) &
+        (NAL_DBI_VERSIONED | NAL_DBI_BLOB | NAL_DBI_DEDUP)) {
+        return MDB_INCOMPATIBLE;
+    }
+    /* Making room evicts keys, which could be the one under the cursor. */
+    nal_dbi_info_t *info = nal_dbi_info_get(mdb_cursor_dbi(cursor));
+    if (info != NULL && info->cache != NULL) {
+        return MDB_INCOMPATIBLE;
+    }
+    /* With MDB_RESERVE the value is only written after we return, too late
+     * for the change log to copy it. */
+    if ((flags & MDB_RESERVE) && nal_changelog_enabled()) {
+        return MDB_INCOMPATIBLE;
+    }
+
+    int rc = mdb_cursor_put(cursor, key, data, flags);
+    if (rc != 0) {
+        return rc;
+    }
+    if (!nal_changelog_enabled() && (info == NULL || info->bloom == NULL)) {
+        nal_mark_dirty(mdb_cursor_dbi(cursor));
+        return 0;
+    }
+
+    /* With MDB_CURRENT the caller's key may be empty, so log what the
+     * cursor actually points at. */
+    MDB_val cur_key, cur_data;
+    rc = mdb_cursor_get(cursor, &cur_key, &cur_data, MDB_GET_CURRENT);
+    if (rc != 0) {
+        return rc;
+    }
+    return nal_after_write(mdb_cursor_txn(cursor), NAL_CHANGELOG_PUT,
+                           mdb_cursor_dbi(cursor), &cur_key, &cur_data);
 }
 
 int nal_cursor_put(nal_cursor_ptr cursor, MDB_val *key, MDB_val *data,
                    unsigned int flags)
 {
-    return mdb_cursor_put(cursor, key, data, flags);
+    NAL_PROBE3(cursor__put__start, cursor, key->mv_size, data->mv_size);
+    int rc = nal_do_cursor_put(cursor, key, data, flags);
+    NAL_PROBE4(cursor__put__done, cursor, mdb_cursor_dbi(cursor),
+               data->mv_size, rc);
+    nal_log_debug(NAL_LMDB_LOG_TAG,
+                  "cursor put dbi=%u data=%zu bytes flags=0x%x rc=%d",
+                  mdb_cursor_dbi(cursor), data->mv_size, flags, rc);
+    return rc;
+}
+
+static int nal_do_cursor_del(nal_cursor_ptr cursor, unsigned int flags)
+{
+    MDB_dbi dbi = mdb_cursor_dbi(cursor);
+    if (nal_dbi_flags_of(dbi) & (NAL_DBI_BLOB | NAL_DBI_DEDUP)) {
+        MDB_val cur_key, cur_data;
+        int rc = mdb_cursor_get(cursor, &cur_key, &cur_data, MDB_GET_CURRENT);
+        if (rc == 0) {
+            rc = nal_value_release(mdb_cursor_txn(cursor), dbi, &cur_data);
+        }
+        if (rc != 0) {
+            return rc;
+        }
+    }
+
+    nal_dbi_info_t *info = nal_dbi_info_get(dbi);
+    if (!nal_changelog_enabled() &&
+        (info == NULL || (info->bloom == NULL && info->cache == NULL))) {
+        int rc = mdb_cursor_del(cursor, flags);
+        if (rc == 0) {
+            nal_mark_dirty(dbi);
+        }
+        return rc;
+    }
+
+    /* The key must be copied before the delete invalidates the page. */
+    MDB_val cur_key, cur_data;
+    int rc = mdb_cursor_get(cursor, &cur_key, &cur_data, MDB_GET_CURRENT);
+    if (rc != 0) {
+        return rc;
+    }
+    char *key_copy = malloc(cur_key.mv_size);
+    if (key_copy == NULL) {
+        return ENOMEM;
+    }
+    memcpy(key_copy, cur_key.mv_data, cur_key.mv_size);
+    cur_key.mv_data = key_copy;
+
+    rc = mdb_cursor_del(cursor, flags);
+    if (rc == 0) {
+        rc = nal_after_write(mdb_cursor_txn(cursor), NAL_CHANGELOG_DEL,
+                             mdb_cursor_dbi(cursor), &cur_key, NULL);
+    }
+    free(key_copy);
+    return rc;
 }
 
 int nal_cursor_del(nal_cursor_ptr cursor, unsigned int flags)
 {
-    return mdb_cursor_del(cursor, flags);
+    NAL_PROBE1(cursor__del__start, cursor);
+    int rc = nal_do_cursor_del(cursor, flags);
+    NAL_PROBE3(cursor__del__done, cursor, mdb_cursor_dbi(cursor), rc);
+    nal_log_debug(NAL_LMDB_LOG_TAG, "cursor del dbi=%u flags=0x%x rc=%d",
+                  mdb_cursor_dbi(cursor), flags, rc);
+    return rc;
 }
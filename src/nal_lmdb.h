@@ -5,6 +5,23 @@
 #include <stdint.h>
 #include <lmdb.h>
 
+/* Returned by the conditional writes when the stored version differs. */
+#define NAL_VERSION_CONFLICT (-30600)
+
+/* Per-dbi modes for nal_dbi_set_flags. They are process-local settings, so
+ * every process opening the dbi must set the same flags.
+ * NAL_DBI_VERSIONED: values carry an 8-byte version that grows on each put,
+ * also across a delete, from a counter per dbi in NAL_VERSIONS_DBI_NAME.
+ * NAL_DBI_BLOB: large values live in segment files, see nal_blob.h.
+ * NAL_DBI_DEDUP: equal values are stored once, see nal_dedup.h.
+ * Each of them owns the value format, so a dbi takes at most one. */
+#define NAL_DBI_VERSIONED 0x1
+#define NAL_DBI_BLOB 0x2
+#define NAL_DBI_DEDUP 0x4
+
+#define NAL_VERSION_SIZE 8
+#define NAL_VERSIONS_DBI_NAME "__nal_versions"
+
 typedef struct MDB_txn *nal_txn_ptr;
 typedef struct MDB_cursor *nal_cursor_ptr;
 
@@ -15,6 +32,10 @@ int nal_env_init(const char *env_path, size_t max_databases,
 const char *nal_strerror(int err);
 
 int nal_txn_begin(nal_txn_ptr parent, nal_txn_ptr *txn);
+/* Like nal_txn_begin but returns EAGAIN instead of waiting while another
+ * thread or process has a write txn open through this library. Writers
+ * bypassing the library, like mdb_load, can still make it block. */
+int nal_txn_try_begin(nal_txn_ptr parent, nal_txn_ptr *txn);
 int nal_readonly_txn_begin(nal_txn_ptr parent, nal_txn_ptr *txn);
 int nal_txn_commit(nal_txn_ptr txn);
 void nal_txn_abort(nal_txn_ptr txn);
@@ -22,14 +43,67 @@ int nal_txn_renew(nal_txn_ptr txn);
 void nal_txn_reset(nal_txn_ptr txn);
 int nal_dbi_open(nal_txn_ptr txn, const char *name, MDB_dbi *dbi);
 int nal_readonly_dbi_open(nal_txn_ptr txn, const char *name, MDB_dbi *dbi);
+int nal_dbi_set_flags(MDB_dbi dbi, unsigned int flags);
 int nal_put(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key, MDB_val *data);
 int nal_del(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key);
 int nal_get(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key, MDB_val *data);
 
+int nal_get_version(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key,
+                    MDB_val *data, uint64_t *version);
+int nal_put_if_absent(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key,
+                      MDB_val *data, uint64_t *version);
+int nal_put_if_version(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key,
+                       MDB_val *data, uint64_t expected, uint64_t *version);
+int nal_del_if_version(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key,
+                       uint64_t expected, uint64_t *version);
+
+/* Per-dbi generation counters shared by all processes using the env. A
+ * generation is bumped once for every committed top-level write txn that
+ * modified the dbi through this library. A dbi that could not get a counter
+ * (slots full, or one left half claimed by a crashed process) reads 0 and
+ * nal_generation_wait returns ENOTSUP. */
+uint64_t nal_generation(MDB_dbi dbi);
+const volatile uint64_t *nal_generation_ptr(MDB_dbi dbi);
+int nal_generation_wait(MDB_dbi dbi, uint64_t last_seen, int timeout_ms,
+                        uint64_t *current);
+
+/* Merge operators for nal_merge. The integer ops work on 8-byte int64 values
+ * in host byte order and treat a missing value as the operand. APPEND keeps
+ * the newest limit bytes (no bound if limit is 0); OR zero-extends the
+ * shorter side. result points at the stored value until the next write. */
+#define NAL_MERGE_ADD 1
+#define NAL_MERGE_MIN 2
+#define NAL_MERGE_MAX 3
+#define NAL_MERGE_APPEND 4
+#define NAL_MERGE_OR 5
+
+int nal_merge(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key, int op,
+              MDB_val *operand, size_t limit, MDB_val *result);
+
+/* A view points straight into the map and is valid while txn stays open and
+ * is not reset. Views are registered with their txn, and resetting,
+ * committing or aborting it clears their txn and size, so callers can refuse
+ * stale use. With nal_view_set_debug(1) or NAL_VIEW_DEBUG=1 in the
+ * environment their data also gets a poison pointer, so stale use that skips
+ * the check faults at once. Release every view with nal_view_release before
+ * freeing its memory. */
+typedef struct nal_view_s {
+    const char *data;
+    size_t size;
+    nal_txn_ptr txn;
+    struct nal_view_s *next;
+    int registered;
+} nal_view_t;
+
+void nal_view_set_debug(int on);
+int nal_view_get(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *key, nal_view_t *view);
+void nal_view_release(nal_view_t *view);
+
 int nal_cursor_open(nal_txn_ptr txn, MDB_dbi dbi, nal_cursor_ptr *cursor);
 void nal_cursor_close(nal_cursor_ptr cursor);
 int nal_cursor_get(nal_cursor_ptr cursor, MDB_val *key, MDB_val *data,
                    MDB_cursor_op op);
+/* MDB_RESERVE fails with MDB_INCOMPATIBLE while the change log is on. */
 int nal_cursor_put(nal_cursor_ptr cursor, MDB_val *key, MDB_val *data,
                    unsigned int flags);
 int nal_cursor_del(nal_cursor_ptr cursor, unsigned int flags);
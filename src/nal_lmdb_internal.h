@@ -0,0 +1,29 @@
+#ifndef NAL_LMDB_INTERNAL_H
+#define NAL_LMDB_INTERNAL_H
+
+#include "nal_lmdb.h"
+
+/* Declarations shared between the translation units of the library. They are
+ * not part of the FFI surface and must not be declared from Lua. */
+
+typedef struct nal_gen_slot_s nal_gen_slot_t;
+typedef struct nal_bloom_s nal_bloom_t;
+typedef struct nal_cache_s nal_cache_t;
+
+typedef struct nal_dbi_info_s {
+    char *name;
+    unsigned int flags;  /* NAL_DBI_* modes set by nal_dbi_set_flags */
+    nal_gen_slot_t *gen; /* shared generation counter, NULL if unavailable */
+    nal_bloom_t *bloom;  /* key filter set by nal_bloom_open, or NULL */
+    nal_cache_t *cache;  /* set by nal_cache_open, or NULL */
+} nal_dbi_info_t;
+
+MDB_env *nal_env_handle(void);
+const char *nal_env_path(void);
+nal_dbi_info_t *nal_dbi_info_get(MDB_dbi dbi);
+
+/* Turns a stored value of dbi into what nal_get returns: strips the version
+ * and resolves blob and dedup references. */
+int nal_value_decode(nal_txn_ptr txn, MDB_dbi dbi, MDB_val *data);
+
+#endif
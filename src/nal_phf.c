@@ -0,0 +1,543 @@
+#include "nal_phf.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "nal_hash.h"
+#include "nal_log.h"
+
+#define NAL_PHF_MAGIC 0x6e616c68U /* "nalh" */
+#define NAL_PHF_VERSION 1
+#define NAL_PHF_BUCKET_SIZE 5  /* average keys per bucket */
+#define NAL_PHF_LOAD_PCT 98    /* keys per table slot before remapping */
+#define NAL_PHF_MAX_PILOT (1U << 20)
+#define NAL_PHF_MAX_SEEDS 16
+#define NAL_PHF_REC_HDR_SIZE 8 /* u32 key_len, u32 val_len */
+
+/* File layout, every section 8-byte aligned:
+ *   header
+ *   u32 pilots[num_buckets]
+ *   u32 remap[table_size - num_keys]  slots for positions >= num_keys
+ *   u32 or u64 offsets[num_keys + 1]  record offsets by slot into data
+ *   data: records of u32 key_len, u32 val_len, key, value */
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t num_keys;
+    uint64_t num_buckets;
+    uint64_t table_size;
+    uint64_t seed;
+    uint32_t offset_width;
+    uint32_t reserved;
+    uint64_t data_len;
+    uint64_t pad;
+} nal_phf_hdr_t;
+
+struct nal_phf_s {
+    const char *map;
+    size_t map_len;
+    const nal_phf_hdr_t *hdr;
+    const uint32_t *pilots;
+    const uint32_t *remap;
+    const void *offsets;
+    const char *data;
+};
+
+typedef struct {
+    uint64_t hash;
+    MDB_val key;
+    MDB_val data;
+} nal_phf_entry_t;
+
+static uint64_t nal_phf_offset(const nal_phf_t *phf, uint64_t slot)
+{
+    return phf->hdr->offset_width == 4
+               ? ((const uint32_t *)phf->offsets)[slot]
+               : ((const uint64_t *)phf->offsets)[slot];
+}
+
+static size_t nal_phf_align(size_t n)
+{
+    return (n + 7) & ~(size_t)7;
+}
+
+static uint64_t nal_phf_bucket(uint64_t h, uint64_t num_buckets)
+{
+    return ((h >> 32) * num_buckets) >> 32;
+}
+
+static uint64_t nal_phf_pos(uint64_t h, uint32_t pilot, uint64_t table_size)
+{
+    uint64_t x = h ^ ((uint64_t)pilot * 0x9e3779b97f4a7c15ULL);
+    x ^= x >> 29;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 32;
+    return x % table_size;
+}
+
+/* Finds a pilot for every bucket, largest buckets first, so that all keys
+ * land on distinct positions. Returns 0, or EAGAIN if this seed does not
+ * work out. */
+static int nal_phf_search(nal_phf_entry_t *entries, uint64_t n, uint64_t m,
+                          uint64_t table_size, uint32_t *pilots,
+                          uint64_t *positions)
+{
+    int rc = ENOMEM;
+    uint64_t *bucket_start = calloc(m + 1, sizeof(uint64_t));
+    uint64_t *order = malloc(n * sizeof(uint64_t));
+    uint64_t *by_size = malloc(m * sizeof(uint64_t));
+    uint64_t *taken = calloc((table_size + 63) / 64, sizeof(uint64_t));
+    uint64_t max_size = 0;
+    uint64_t *size_start = NULL;
+    if (bucket_start == NULL || order == NULL || by_size == NULL ||
+        taken == NULL) {
+        goto exit;
+    }
+
+    /* Counting sort of keys by bucket, then of buckets by size. */
+    for (uint64_t i = 0; i < n; i++) {
+        bucket_start[nal_phf_bucket(entries[i].hash, m) + 1]++;
+    }
+    for (uint64_t b = 0; b < m; b++) {
+        uint64_t size = bucket_start[b + 1];
+        max_size = size > max_size ? size : max_size;
+        bucket_start[b + 1] += bucket_start[b];
+    }
+    uint64_t *fill = by_size; /* borrowed as a cursor per bucket */
+    memcpy(fill, bucket_start, m * sizeof(uint64_t));
+    for (uint64_t i = 0; i < n; i++) {
+        order[fill[nal_phf_bucket(entries[i].hash, m)]++] = i;
+    }
+    size_start = calloc(max_size + 2, sizeof(uint64_t));
+    if (size_start == NULL) {
+        goto exit;
+    }
+    for (uint64_t b = 0; b < m; b++) {
+        size_start[max_size - (bucket_start[b + 1] - bucket_start[b]) + 1]++;
+    }
+    for (uint64_t s = 0; s <= max_size; s++) {
+        size_start[s + 1] += size_start[s];
+    }
+    for (uint64_t b = 0; b < m; b++) {
+        uint64_t size = bucket_start[b + 1] - bucket_start[b];
+        by_size[size_start[max_size - size]++] = b;
+    }
+
+    rc = EAGAIN;
+    for (uint64_t k = 0; k < m; k++) {
+        uint64_t b = by_size[k];
+        uint64_t first = bucket_start[b], size = bucket_start[b + 1] - first;
+        if (size == 0) {
+            pilots[b] = 0;
+            continue;
+        }
+        uint32_t pilot;
+        for (pilot = 0; pilot < NAL_PHF_MAX_PILOT; pilot++) {
+            uint64_t j;
+            for (j = 0; j < size; j++) {
+                uint64_t p = nal_phf_pos(entries[order[first + j]].hash,
+                                         pilot, table_size);
+                if (taken[p / 64] & ((uint64_t)1 << (p % 64))) {
+                    break;
+                }
+                uint64_t i;
+                for (i = 0; i < j && positions[order[first + i]] != p; i++) {
+                }
+                if (i < j) {
+                    break;
+                }
+                positions[order[first + j]] = p;
+            }
+            if (j == size) {
+                break;
+            }
+        }
+        if (pilot == NAL_PHF_MAX_PILOT) {
+            goto exit;
+        }
+        pilots[b] = pilot;
+        for (uint64_t j = 0; j < size; j++) {
+            uint64_t p = positions[order[first + j]];
+            taken[p / 64] |= (uint64_t)1 << (p % 64);
+        }
+    }
+    rc = 0;
+
+exit:
+    free(bucket_start);
+    free(order);
+    free(by_size);
+    free(taken);
+    free(size_start);
+    return rc;
+}
+
+static int nal_phf_collect(nal_txn_ptr txn, MDB_dbi dbi,
+                           nal_phf_entry_t **entries, uint64_t *count)
+{
+    unsigned int flags;
+    int rc = mdb_dbi_flags(txn, dbi, &flags);
+    if (rc != 0) {
+        return rc;
+    }
+    if (flags & MDB_DUPSORT) {
+        return MDB_INCOMPATIBLE;
+    }
+    MDB_stat st;
+    rc = mdb_stat(txn, dbi, &st);
+    if (rc != 0) {
+        return rc;
+    }
+
+    nal_phf_entry_t *e = malloc((st.ms_entries + 1) * sizeof(*e));
+    if (e == NULL) {
+        return ENOMEM;
+    }
+    nal_cursor_ptr cursor;
+    rc = nal_cursor_open(txn, dbi, &cursor);
+    if (rc != 0) {
+        free(e);
+        return rc;
+    }
+    uint64_t n = 0;
+    MDB_val key, data;
+    while (n < st.ms_entries &&
+           (rc = nal_cursor_get(cursor, &key, &data, MDB_NEXT)) == 0) {
+        if (key.mv_size > UINT32_MAX || data.mv_size > UINT32_MAX) {
+            rc = MDB_BAD_VALSIZE;
+            break;
+        }
+        e[n].key = key;
+        e[n].data = data;
+        n++;
+    }
+    nal_cursor_close(cursor);
+    if (rc != 0 && rc != MDB_NOTFOUND) {
+        free(e);
+        return rc;
+    }
+    *entries = e;
+    *count = n;
+    return 0;
+}
+
+/* Writes p, unless it is NULL, and pads len to the next section. */
+static int nal_phf_write(FILE *f, const void *p, size_t len)
+{
+    static const char zeros[8];
+    if (p != NULL && len > 0 && fwrite(p, 1, len, f) != len) {
+        return EIO;
+    }
+    size_t pad = nal_phf_align(len) - len;
+    if (pad > 0 && fwrite(zeros, 1, pad, f) != pad) {
+        return EIO;
+    }
+    return 0;
+}
+
+static int nal_phf_write_file(const char *path, const nal_phf_hdr_t *hdr,
+                              const uint32_t *pilots, const uint32_t *remap,
+                              const nal_phf_entry_t *entries,
+                              const uint64_t *slot_entry)
+{
+    char tmp[PATH_MAX];
+    int n = snprintf(tmp, sizeof(tmp), "%s.tmp.%d", path, (int)getpid());
+    if (n < 0 || (size_t)n >= sizeof(tmp)) {
+        return ENAMETOOLONG;
+    }
+    FILE *f = fopen(tmp, "wb");
+    if (f == NULL) {
+        return errno;
+    }
+
+    uint64_t num_keys = hdr->num_keys;
+    int rc = nal_phf_write(f, hdr, sizeof(*hdr));
+    if (rc == 0) {
+        rc = nal_phf_write(f, pilots, hdr->num_buckets * sizeof(uint32_t));
+    }
+    if (rc == 0) {
+        rc = nal_phf_write(f, remap,
+                           (hdr->table_size - num_keys) * sizeof(uint32_t));
+    }
+
+    uint64_t off = 0;
+    for (uint64_t s = 0; rc == 0 && s <= num_keys; s++) {
+        if (hdr->offset_width == 4) {
+            uint32_t v = (uint32_t)off;
+            rc = fwrite(&v, sizeof(v), 1, f) == 1 ? 0 : EIO;
+        } else {
+            rc = fwrite(&off, sizeof(off), 1, f) == 1 ? 0 : EIO;
+        }
+        if (s < num_keys) {
+            const nal_phf_entry_t *e = &entries[slot_entry[s]];
+            off += NAL_PHF_REC_HDR_SIZE + e->key.mv_size + e->data.mv_size;
+        }
+    }
+    size_t offsets_len = (num_keys + 1) * hdr->offset_width;
+    if (rc == 0) {
+        rc = nal_phf_write(f, NULL, offsets_len);
+    }
+
+    for (uint64_t s = 0; rc == 0 && s < num_keys; s++) {
+        const nal_phf_entry_t *e = &entries[slot_entry[s]];
+        uint32_t lens[2] = {(uint32_t)e->key.mv_size,
+                            (uint32_t)e->data.mv_size};
+        if (fwrite(lens, sizeof(lens), 1, f) != 1 ||
+            fwrite(e->key.mv_data, 1, e->key.mv_size, f) != e->key.mv_size ||
+            fwrite(e->data.mv_data, 1, e->data.mv_size, f) !=
+                e->data.mv_size) {
+            rc = EIO;
+        }
+    }
+
+    if (rc == 0 && (fflush(f) != 0 || fsync(fileno(f)) != 0)) {
+        rc = errno;
+    }
+    if (fclose(f) != 0 && rc == 0) {
+        rc = errno;
+    }
+    if (rc == 0 && rename(tmp, path) != 0) {
+        rc = errno;
+    }
+    if (rc != 0) {
+        unlink(tmp);
+    }
+    return rc;
+}
+
+int nal_phf_export(nal_txn_ptr txn, MDB_dbi dbi, const char *path)
+{
+    nal_phf_entry_t *entries;
+    uint64_t n;
+    int rc = nal_phf_collect(txn, dbi, &entries, &n);
+    if (rc != 0) {
+        return rc;
+    }
+
+    nal_phf_hdr_t hdr = {0};
+    hdr.magic = NAL_PHF_MAGIC;
+    hdr.version = NAL_PHF_VERSION;
+    hdr.num_keys = n;
+    hdr.num_buckets = n / NAL_PHF_BUCKET_SIZE + 1;
+    hdr.table_size = n * 100 / NAL_PHF_LOAD_PCT + 1;
+
+    uint32_t *pilots = malloc(hdr.num_buckets * sizeof(uint32_t));
+    uint32_t *remap = malloc((hdr.table_size - n + 1) * sizeof(uint32_t));
+    uint64_t *positions = malloc((n + 1) * sizeof(uint64_t));
+    uint64_t *slot_entry = malloc((n + 1) * sizeof(uint64_t));
+    if (pilots == NULL || remap == NULL || positions == NULL ||
+        slot_entry == NULL) {
+        rc = ENOMEM;
+        goto exit;
+    }
+
+    rc = EAGAIN;
+    for (uint64_t seed = 0; seed < NAL_PHF_MAX_SEEDS && rc == EAGAIN;
+         seed++) {
+        hdr.seed = seed;
+        for (uint64_t i = 0; i < n; i++) {
+            entries[i].hash = nal_hash64(entries[i].key.mv_data,
+                                         entries[i].key.mv_size, seed);
+        }
+        rc = nal_phf_search(entries, n, hdr.num_buckets, hdr.table_size,
+                            pilots, positions);
+    }
+    if (rc != 0) {
+        nal_log_error("cannot build perfect hash for %s: %s", path,
+                      nal_strerror(rc));
+        goto exit;
+    }
+
+    /* Make the function minimal: positions past num_keys are sent to the
+     * slots below num_keys that no key hit. */
+    uint64_t *slot_of_pos = slot_entry;
+    for (uint64_t s = 0; s < n; s++) {
+        slot_of_pos[s] = UINT64_MAX;
+    }
+    for (uint64_t i = 0; i < n; i++) {
+        if (positions[i] < n) {
+            slot_of_pos[positions[i]] = i;
+        }
+    }
+    /* Positions no key hit keep slot 0; lookups verify the key anyway. */
+    memset(remap, 0, (hdr.table_size - n) * sizeof(uint32_t));
+    uint64_t free_slot = 0;
+    for (uint64_t i = 0; i < n; i++) {
+        if (positions[i] >= n) {
+            while (slot_of_pos[free_slot] != UINT64_MAX) {
+                free_slot++;
+            }
+            remap[positions[i] - n] = (uint32_t)free_slot;
+            slot_of_pos[free_slot] = i;
+        }
+    }
+
+    uint64_t data_len = 0;
+    for (uint64_t i = 0; i < n; i++) {
+        data_len += NAL_PHF_REC_HDR_SIZE + entries[i].key.mv_size +
+                    entries[i].data.mv_size;
+    }
+    hdr.data_len = data_len;
+    hdr.offset_width = data_len <= UINT32_MAX ? 4 : 8;
+    rc = nal_phf_write_file(path, &hdr, pilots, remap, entries, slot_entry);
+    if (rc != 0) {
+        nal_log_error("cannot write %s: %s", path, nal_strerror(rc));
+    }
+
+exit:
+    free(entries);
+    free(pilots);
+    free(remap);
+    free(positions);
+    free(slot_entry);
+    return rc;
+}
+
+/* Lays out the sections of a mapped file and checks that every count,
+ * offset and remapped slot stays inside the mapping, so lookups can trust
+ * them. Record lengths are checked per lookup against the record's span. */
+static int nal_phf_check(nal_phf_t *h)
+{
+    const nal_phf_hdr_t *hdr = h->hdr;
+    size_t len = h->map_len;
+    /* Bounding the counts by the file size first keeps the section sizes
+     * below from overflowing. */
+    if ((hdr->offset_width != 4 && hdr->offset_width != 8) ||
+        hdr->num_buckets == 0 || hdr->num_buckets > len ||
+        hdr->num_keys >= len || hdr->table_size > len ||
+        hdr->table_size < hdr->num_keys || hdr->data_len > len) {
+        return MDB_CORRUPTED;
+    }
+    uint64_t n = hdr->num_keys;
+    size_t pilots_len = nal_phf_align(hdr->num_buckets * sizeof(uint32_t));
+    size_t remap_len =
+        nal_phf_align((hdr->table_size - n) * sizeof(uint32_t));
+    size_t offsets_len = nal_phf_align((n + 1) * hdr->offset_width);
+    if (sizeof(*hdr) + pilots_len + remap_len + offsets_len + hdr->data_len !=
+        len) {
+        return MDB_CORRUPTED;
+    }
+    h->pilots = (const uint32_t *)(h->map + sizeof(*hdr));
+    h->remap = (const uint32_t *)((const char *)h->pilots + pilots_len);
+    h->offsets = (const char *)h->remap + remap_len;
+    h->data = (const char *)h->offsets + offsets_len;
+
+    /* An empty table is never looked into. */
+    for (uint64_t i = 0; n > 0 && i < hdr->table_size - n; i++) {
+        if (h->remap[i] >= n) {
+            return MDB_CORRUPTED;
+        }
+    }
+    if (nal_phf_offset(h, 0) != 0 || nal_phf_offset(h, n) != hdr->data_len) {
+        return MDB_CORRUPTED;
+    }
+    for (uint64_t s = 0; s < n; s++) {
+        uint64_t off = nal_phf_offset(h, s);
+        uint64_t next = nal_phf_offset(h, s + 1);
+        if (next < off || next - off < NAL_PHF_REC_HDR_SIZE) {
+            return MDB_CORRUPTED;
+        }
+    }
+    return 0;
+}
+
+int nal_phf_open(const char *path, nal_phf_t **phf)
+{
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+        return errno;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int err = errno;
+        close(fd);
+        return err;
+    }
+    size_t len = (size_t)st.st_size;
+    if (len < sizeof(nal_phf_hdr_t)) {
+        close(fd);
+        return MDB_INVALID;
+    }
+    void *p = mmap(NULL, len, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        return errno;
+    }
+    (void)madvise(p, len, MADV_RANDOM);
+
+    const nal_phf_hdr_t *hdr = p;
+    if (hdr->magic != NAL_PHF_MAGIC || hdr->version != NAL_PHF_VERSION) {
+        nal_log_error("%s is not a perfect hash file", path);
+        munmap(p, len);
+        return MDB_INVALID;
+    }
+
+    nal_phf_t *h = malloc(sizeof(*h));
+    if (h == NULL) {
+        munmap(p, len);
+        return ENOMEM;
+    }
+    h->map = p;
+    h->map_len = len;
+    h->hdr = hdr;
+    int rc = nal_phf_check(h);
+    if (rc != 0) {
+        nal_log_error("%s is corrupt", path);
+        nal_phf_close(h);
+        return rc;
+    }
+    *phf = h;
+    return 0;
+}
+
+void nal_phf_close(nal_phf_t *phf)
+{
+    if (phf != NULL) {
+        munmap((void *)phf->map, phf->map_len);
+        free(phf);
+    }
+}
+
+size_t nal_phf_count(nal_phf_t *phf)
+{
+    return (size_t)phf->hdr->num_keys;
+}
+
+int nal_phf_get(nal_phf_t *phf, MDB_val *key, MDB_val *data)
+{
+    const nal_phf_hdr_t *hdr = phf->hdr;
+    uint64_t n = hdr->num_keys;
+    if (n == 0) {
+        return MDB_NOTFOUND;
+    }
+
+    uint64_t h = nal_hash64(key->mv_data, key->mv_size, hdr->seed);
+    uint32_t pilot = phf->pilots[nal_phf_bucket(h, hdr->num_buckets)];
+    uint64_t slot = nal_phf_pos(h, pilot, hdr->table_size);
+    if (slot >= n) {
+        slot = phf->remap[slot - n];
+    }
+    uint64_t off = nal_phf_offset(phf, slot);
+    uint64_t span = nal_phf_offset(phf, slot + 1) - off;
+
+    const char *rec = phf->data + off;
+    uint32_t lens[2];
+    memcpy(lens, rec, sizeof(lens));
+    if ((uint64_t)NAL_PHF_REC_HDR_SIZE + lens[0] + lens[1] != span) {
+        return MDB_CORRUPTED;
+    }
+    if (lens[0] != key->mv_size ||
+        memcmp(rec + NAL_PHF_REC_HDR_SIZE, key->mv_data, lens[0]) != 0) {
+        return MDB_NOTFOUND;
+    }
+    data->mv_data = (void *)(rec + NAL_PHF_REC_HDR_SIZE + lens[0]);
+    data->mv_size = lens[1];
+    return 0;
+}
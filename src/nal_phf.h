@@ -0,0 +1,25 @@
+#ifndef NAL_PHF_H
+#define NAL_PHF_H
+
+#include "nal_lmdb.h"
+
+/* Immutable lookup tables compiled from a dbi: a minimal perfect hash
+ * function in the style of PTHash maps every key to its own slot, and each
+ * slot points at the packed key and value. Lookups verify the stored key, so
+ * absent keys are reported as MDB_NOTFOUND. Files are replaced atomically by
+ * nal_phf_export; readers keep using the file they opened until they reopen
+ * it. */
+typedef struct nal_phf_s nal_phf_t;
+
+/* Writes all entries of dbi as seen by txn to path. */
+int nal_phf_export(nal_txn_ptr txn, MDB_dbi dbi, const char *path);
+
+int nal_phf_open(const char *path, nal_phf_t **phf);
+void nal_phf_close(nal_phf_t *phf);
+size_t nal_phf_count(nal_phf_t *phf);
+
+/* Like nal_get, without a txn. data points into the mapping and stays valid
+ * until nal_phf_close. */
+int nal_phf_get(nal_phf_t *phf, MDB_val *key, MDB_val *data);
+
+#endif
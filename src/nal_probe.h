@@ -0,0 +1,32 @@
+#ifndef NAL_PROBE_H
+#define NAL_PROBE_H
+
+/* USDT probes of provider nal_lmdb, see tools/bpftrace for scripts using
+ * them. A disabled probe is a single nop in the instruction stream plus a
+ * note in the ELF file, so they stay in release builds. Build with
+ * -DNAL_NO_USDT or without sys/sdt.h (systemtap-sdt-dev) to drop them.
+ * Arguments are evaluated even while no tracer is attached, so they must
+ * stay cheap. */
+#if !defined(NAL_NO_USDT) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define NAL_USDT 1
+#endif
+#endif
+
+#ifdef NAL_USDT
+#define NAL_PROBE1(name, a) DTRACE_PROBE1(nal_lmdb, name, a)
+#define NAL_PROBE2(name, a, b) DTRACE_PROBE2(nal_lmdb, name, a, b)
+#define NAL_PROBE3(name, a, b, c) DTRACE_PROBE3(nal_lmdb, name, a, b, c)
+#define NAL_PROBE4(name, a, b, c, d) DTRACE_PROBE4(nal_lmdb, name, a, b, c, d)
+#define NAL_PROBE5(name, a, b, c, d, e)                                       \
+    DTRACE_PROBE5(nal_lmdb, name, a, b, c, d, e)
+#else
+#define NAL_PROBE1(name, a) ((void)0)
+#define NAL_PROBE2(name, a, b) ((void)0)
+#define NAL_PROBE3(name, a, b, c) ((void)0)
+#define NAL_PROBE4(name, a, b, c, d) ((void)0)
+#define NAL_PROBE5(name, a, b, c, d, e) ((void)0)
+#endif
+
+#endif
@@ -0,0 +1,637 @@
+#include "nal_pscan.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nal_hash.h"
+#include "nal_log.h"
+
+#define NAL_PSCAN_MAX_ROUNDS 64
+#define NAL_PSCAN_CHECK_EVERY 4096 /* entries between checks for a stop */
+#define NAL_PSCAN_GROUP_SEED 0x70736361U
+
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    int set;
+} nal_pscan_key_t;
+
+typedef struct {
+    nal_pscan_key_t lo;
+    int splittable;
+} nal_pscan_part_t;
+
+typedef struct {
+    uint64_t hash;
+    size_t off;
+    size_t len;
+    uint64_t count;
+    int64_t sum;
+    int used;
+} nal_pscan_slot_t;
+
+/* Open addressing table of groups; keys live in arena. */
+typedef struct {
+    nal_pscan_slot_t *slots;
+    size_t cap;
+    size_t len;
+    unsigned char *arena;
+    size_t arena_len;
+    size_t arena_cap;
+} nal_pscan_groups_t;
+
+typedef struct nal_pscan_run_s nal_pscan_run_t;
+
+/* The result with the arena its group keys point into. */
+typedef struct {
+    nal_pscan_result_t pub;
+    unsigned char *arena;
+} nal_pscan_result_impl_t;
+
+typedef struct {
+    nal_pscan_run_t *run;
+    unsigned int index;
+    pthread_t thread;
+    uint64_t count;
+    int64_t sum;
+    uint64_t skipped;
+    nal_pscan_groups_t groups;
+} nal_pscan_worker_t;
+
+struct nal_pscan_run_s {
+    MDB_dbi dbi;
+    const nal_pscan_opts_t *opts;
+    nal_pscan_part_t *parts;
+    size_t num_parts;
+    size_t max_groups;
+    int grouped;
+    size_t next; /* next partition to take */
+    int rc;      /* first error, stops all workers */
+};
+
+void nal_pscan_opts_init(nal_pscan_opts_t *opts)
+{
+    memset(opts, 0, sizeof(*opts));
+    opts->group_delim = -1;
+}
+
+static int nal_pscan_key_set(nal_pscan_key_t *k, const void *data,
+                             size_t size)
+{
+    unsigned char *copy = malloc(size > 0 ? size : 1);
+    if (copy == NULL) {
+        return ENOMEM;
+    }
+    memcpy(copy, data, size);
+    free(k->data);
+    k->data = copy;
+    k->size = size;
+    k->set = 1;
+    return 0;
+}
+
+static MDB_val nal_pscan_key_val(const nal_pscan_key_t *k)
+{
+    MDB_val val = {k->size, k->data};
+    return val;
+}
+
+static void nal_pscan_parts_free(nal_pscan_part_t *parts, size_t n)
+{
+    for (size_t i = 0; i < n; i++) {
+        free(parts[i].lo.data);
+    }
+    free(parts);
+}
+
+/* First and last key of [lo, hi), copied to first and last. Returns
+ * MDB_NOTFOUND for an empty partition. */
+static int nal_pscan_part_bounds(MDB_cursor *cursor, MDB_txn *txn,
+                                 MDB_dbi dbi, const nal_pscan_key_t *lo,
+                                 const nal_pscan_key_t *hi,
+                                 nal_pscan_key_t *first, nal_pscan_key_t *last)
+{
+    MDB_val key, data;
+    int rc;
+    if (lo->set && lo->size > 0) {
+        key = nal_pscan_key_val(lo);
+        rc = mdb_cursor_get(cursor, &key, &data, MDB_SET_RANGE);
+    } else {
+        rc = mdb_cursor_get(cursor, &key, &data, MDB_FIRST);
+    }
+    MDB_val end;
+    if (rc == 0 && hi != NULL && hi->set) {
+        end = nal_pscan_key_val(hi);
+        if (mdb_cmp(txn, dbi, &key, &end) >= 0) {
+            rc = MDB_NOTFOUND;
+        }
+    }
+    if (rc == 0) {
+        rc = nal_pscan_key_set(first, key.mv_data, key.mv_size);
+    }
+    if (rc != 0) {
+        return rc;
+    }
+
+    if (hi != NULL && hi->set) {
+        key = end;
+        rc = mdb_cursor_get(cursor, &key, &data, MDB_SET_RANGE);
+        rc = rc == 0 ? mdb_cursor_get(cursor, &key, &data, MDB_PREV)
+                     : mdb_cursor_get(cursor, &key, &data, MDB_LAST);
+    } else {
+        rc = mdb_cursor_get(cursor, &key, &data, MDB_LAST);
+    }
+    if (rc == 0) {
+        rc = nal_pscan_key_set(last, key.mv_data, key.mv_size);
+    }
+    return rc;
+}
+
+/* Builds a key halfway between first and last, which differ: their common
+ * prefix followed by the midpoint of the 8 bytes after it read as big
+ * endian numbers. The result sorts after first and up to last, so both
+ * halves keep at least one key. Returns -1 when first and last are
+ * neighbours at that precision or the key would be too long. */
+static int nal_pscan_midpoint(const nal_pscan_key_t *first,
+                              const nal_pscan_key_t *last, size_t max_key,
+                              nal_pscan_key_t *out)
+{
+    size_t n = first->size < last->size ? first->size : last->size;
+    size_t p = 0;
+    while (p < n && first->data[p] == last->data[p]) {
+        p++;
+    }
+    if (p + 8 > max_key) {
+        return -1;
+    }
+    uint64_t lo = 0;
+    uint64_t hi = 0;
+    for (size_t i = p; i < p + 8; i++) {
+        lo = lo << 8 | (i < first->size ? first->data[i] : 0);
+        hi = hi << 8 | (i < last->size ? last->data[i] : 0);
+    }
+    uint64_t mid = lo + (hi - lo) / 2;
+    if (hi <= lo || mid == lo) {
+        return -1;
+    }
+    unsigned char buf[max_key];
+    memcpy(buf, first->data, p);
+    for (size_t i = p + 8; i > p; i--, mid >>= 8) {
+        buf[i - 1] = (unsigned char)mid;
+    }
+    return nal_pscan_key_set(out, buf, p + 8) == 0 ? 0 : -1;
+}
+
+/* Splits the range into at least target partitions where the keys allow,
+ * halving every splittable partition per round. */
+static int nal_pscan_split(nal_pscan_run_t *run, const nal_pscan_key_t *end,
+                           size_t target)
+{
+    MDB_txn *txn;
+    MDB_cursor *cursor;
+    int rc = nal_readonly_txn_begin(NULL, &txn);
+    if (rc != 0) {
+        return rc;
+    }
+    rc = mdb_cursor_open(txn, run->dbi, &cursor);
+    if (rc != 0) {
+        nal_txn_abort(txn);
+        return rc;
+    }
+    size_t max_key = (size_t)mdb_env_get_maxkeysize(mdb_txn_env(txn));
+    nal_pscan_key_t first = {0}, last = {0}, mid = {0};
+
+    for (int round = 0; rc == 0 && round < NAL_PSCAN_MAX_ROUNDS &&
+                        run->num_parts < target;
+         round++) {
+        nal_pscan_part_t *next =
+            calloc(run->num_parts * 2, sizeof(nal_pscan_part_t));
+        if (next == NULL) {
+            rc = ENOMEM;
+            break;
+        }
+        size_t n = 0;
+        int split = 0;
+        for (size_t i = 0; i < run->num_parts; i++) {
+            nal_pscan_part_t *part = &run->parts[i];
+            const nal_pscan_key_t *hi =
+                i + 1 < run->num_parts ? &run->parts[i + 1].lo : end;
+            next[n] = *part;
+            part->lo.data = NULL;
+            n++;
+            if (!next[n - 1].splittable) {
+                continue;
+            }
+            rc = nal_pscan_part_bounds(cursor, txn, run->dbi,
+                                       &next[n - 1].lo, hi, &first, &last);
+            if (rc == MDB_NOTFOUND) {
+                rc = 0;
+                next[n - 1].splittable = 0;
+                continue;
+            }
+            if (rc != 0) {
+                break;
+            }
+            if (nal_pscan_midpoint(&first, &last, max_key, &mid) != 0) {
+                next[n - 1].splittable = 0;
+                continue;
+            }
+            next[n].lo = mid;
+            next[n].splittable = 1;
+            mid.data = NULL;
+            n++;
+            split = 1;
+        }
+        nal_pscan_parts_free(run->parts, run->num_parts);
+        run->parts = next;
+        run->num_parts = n;
+        if (!split) {
+            break;
+        }
+    }
+    free(first.data);
+    free(last.data);
+    free(mid.data);
+    mdb_cursor_close(cursor);
+    nal_txn_abort(txn);
+    return rc;
+}
+
+static int nal_pscan_groups_grow(nal_pscan_groups_t *g)
+{
+    size_t cap = g->cap != 0 ? g->cap * 2 : 1024;
+    nal_pscan_slot_t *slots = calloc(cap, sizeof(*slots));
+    if (slots == NULL) {
+        return ENOMEM;
+    }
+    for (size_t i = 0; i < g->cap; i++) {
+        if (!g->slots[i].used) {
+            continue;
+        }
+        size_t j = g->slots[i].hash & (cap - 1);
+        while (slots[j].used) {
+            j = (j + 1) & (cap - 1);
+        }
+        slots[j] = g->slots[i];
+    }
+    free(g->slots);
+    g->slots = slots;
+    g->cap = cap;
+    return 0;
+}
+
+static int nal_pscan_groups_add(nal_pscan_groups_t *g, size_t max_groups,
+                                const void *key, size_t len, uint64_t count,
+                                int64_t sum)
+{
+    if (g->len * 2 >= g->cap) {
+        int rc = nal_pscan_groups_grow(g);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+    uint64_t h = nal_hash64(key, len, NAL_PSCAN_GROUP_SEED);
+    size_t j = h & (g->cap - 1);
+    while (g->slots[j].used) {
+        nal_pscan_slot_t *s = &g->slots[j];
+        if (s->hash == h && s->len == len &&
+            memcmp(g->arena + s->off, key, len) == 0) {
+            s->count += count;
+            s->sum += sum;
+            return 0;
+        }
+        j = (j + 1) & (g->cap - 1);
+    }
+    if (g->len >= max_groups) {
+        return E2BIG;
+    }
+    if (g->arena_len + len > g->arena_cap) {
+        size_t cap = g->arena_cap != 0 ? g->arena_cap * 2 : 65536;
+        while (cap < g->arena_len + len) {
+            cap *= 2;
+        }
+        unsigned char *arena = realloc(g->arena, cap);
+        if (arena == NULL) {
+            return ENOMEM;
+        }
+        g->arena = arena;
+        g->arena_cap = cap;
+    }
+    memcpy(g->arena + g->arena_len, key, len);
+    nal_pscan_slot_t *s = &g->slots[j];
+    s->hash = h;
+    s->off = g->arena_len;
+    s->len = len;
+    s->count = count;
+    s->sum = sum;
+    s->used = 1;
+    g->arena_len += len;
+    g->len++;
+    return 0;
+}
+
+static void nal_pscan_groups_free(nal_pscan_groups_t *g)
+{
+    free(g->slots);
+    free(g->arena);
+}
+
+static size_t nal_pscan_group_len(const nal_pscan_opts_t *opts,
+                                  const MDB_val *key)
+{
+    size_t len = key->mv_size;
+    if (opts->group_prefix_len > 0 && opts->group_prefix_len < len) {
+        len = opts->group_prefix_len;
+    }
+    if (opts->group_delim >= 0) {
+        const unsigned char *d = memchr(key->mv_data, opts->group_delim, len);
+        if (d != NULL) {
+            len = (size_t)(d - (const unsigned char *)key->mv_data) + 1;
+        }
+    }
+    return len;
+}
+
+static int nal_pscan_entry(nal_pscan_worker_t *w, const MDB_val *key,
+                           const MDB_val *data)
+{
+    const nal_pscan_opts_t *opts = w->run->opts;
+    int64_t sum = 0;
+    if (opts->sum == NAL_PSCAN_SUM_SIZE) {
+        sum = (int64_t)data->mv_size;
+    } else if (opts->sum == NAL_PSCAN_SUM_INT64) {
+        if (data->mv_size == sizeof(sum)) {
+            memcpy(&sum, data->mv_data, sizeof(sum));
+        } else {
+            w->skipped++;
+        }
+    }
+    w->count++;
+    w->sum += sum;
+    if (w->run->grouped) {
+        int rc = nal_pscan_groups_add(&w->groups, w->run->max_groups,
+                                      key->mv_data,
+                                      nal_pscan_group_len(opts, key), 1, sum);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+    if (opts->fn != NULL) {
+        return opts->fn(opts->arg, w->index, key, data);
+    }
+    return 0;
+}
+
+static int nal_pscan_part(nal_pscan_worker_t *w, nal_cursor_ptr cursor,
+                          MDB_txn *txn, size_t i)
+{
+    nal_pscan_run_t *run = w->run;
+    const nal_pscan_key_t *lo = &run->parts[i].lo;
+    const nal_pscan_opts_t *opts = run->opts;
+    MDB_val hi;
+    int has_hi = 0;
+    if (i + 1 < run->num_parts) {
+        hi = nal_pscan_key_val(&run->parts[i + 1].lo);
+        has_hi = 1;
+    } else if (opts->end != NULL) {
+        hi = *opts->end;
+        has_hi = 1;
+    }
+
+    MDB_val key, data;
+    int rc;
+    if (lo->set && lo->size > 0) {
+        key = nal_pscan_key_val(lo);
+        rc = nal_cursor_get(cursor, &key, &data, MDB_SET_RANGE);
+    } else {
+        rc = nal_cursor_get(cursor, &key, &data, MDB_FIRST);
+    }
+    for (size_t n = 1; rc == 0; n++) {
+        if (has_hi && mdb_cmp(txn, run->dbi, &key, &hi) >= 0) {
+            break;
+        }
+        rc = nal_pscan_entry(w, &key, &data);
+        if (rc != 0) {
+            return rc;
+        }
+        if (n % NAL_PSCAN_CHECK_EVERY == 0 &&
+            __atomic_load_n(&run->rc, __ATOMIC_RELAXED) != 0) {
+            return 0;
+        }
+        rc = nal_cursor_get(cursor, &key, &data, MDB_NEXT);
+    }
+    return rc == MDB_NOTFOUND ? 0 : rc;
+}
+
+static void *nal_pscan_worker(void *arg)
+{
+    nal_pscan_worker_t *w = arg;
+    nal_pscan_run_t *run = w->run;
+    MDB_txn *txn;
+    nal_cursor_ptr cursor;
+    int rc = nal_readonly_txn_begin(NULL, &txn);
+    if (rc == 0) {
+        rc = nal_cursor_open(txn, run->dbi, &cursor);
+        if (rc != 0) {
+            nal_txn_abort(txn);
+        }
+    }
+    if (rc == 0) {
+        while (__atomic_load_n(&run->rc, __ATOMIC_RELAXED) == 0) {
+            size_t i = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED);
+            if (i >= run->num_parts) {
+                break;
+            }
+            rc = nal_pscan_part(w, cursor, txn, i);
+            if (rc != 0) {
+                break;
+            }
+        }
+        nal_cursor_close(cursor);
+        nal_txn_abort(txn);
+    }
+    if (rc != 0) {
+        int expected = 0;
+        __atomic_compare_exchange_n(&run->rc, &expected, rc, 0,
+                                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+    return NULL;
+}
+
+static int nal_pscan_group_cmp(const void *a, const void *b)
+{
+    const nal_pscan_group_t *x = a;
+    const nal_pscan_group_t *y = b;
+    size_t n = x->key.mv_size < y->key.mv_size ? x->key.mv_size
+                                               : y->key.mv_size;
+    int c = memcmp(x->key.mv_data, y->key.mv_data, n);
+    if (c != 0) {
+        return c;
+    }
+    return x->key.mv_size < y->key.mv_size ? -1
+                                           : x->key.mv_size > y->key.mv_size;
+}
+
+/* Merges the workers into the groups of the first one, which result then
+ * points into. */
+static int nal_pscan_merge(nal_pscan_run_t *run, nal_pscan_worker_t *workers,
+                           unsigned int threads, nal_pscan_result_t *result)
+{
+    nal_pscan_groups_t *all = &workers[0].groups;
+    for (unsigned int t = 0; t < threads; t++) {
+        nal_pscan_worker_t *w = &workers[t];
+        result->count += w->count;
+        result->sum += w->sum;
+        result->skipped += w->skipped;
+        if (t == 0) {
+            continue;
+        }
+        for (size_t i = 0; i < w->groups.cap; i++) {
+            nal_pscan_slot_t *s = &w->groups.slots[i];
+            if (!s->used) {
+                continue;
+            }
+            int rc = nal_pscan_groups_add(all, run->max_groups,
+                                          w->groups.arena + s->off, s->len,
+                                          s->count, s->sum);
+            if (rc != 0) {
+                return rc;
+            }
+        }
+    }
+    if (!run->grouped || all->len == 0) {
+        return 0;
+    }
+
+    result->groups = calloc(all->len, sizeof(*result->groups));
+    if (result->groups == NULL) {
+        return ENOMEM;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < all->cap; i++) {
+        nal_pscan_slot_t *s = &all->slots[i];
+        if (s->used) {
+            nal_pscan_group_t *g = &result->groups[n++];
+            g->key.mv_data = all->arena + s->off;
+            g->key.mv_size = s->len;
+            g->count = s->count;
+            g->sum = s->sum;
+        }
+    }
+    result->num_groups = n;
+    qsort(result->groups, n, sizeof(*result->groups), nal_pscan_group_cmp);
+    return 0;
+}
+
+void nal_pscan_result_free(nal_pscan_result_t *result)
+{
+    if (result == NULL) {
+        return;
+    }
+    nal_pscan_result_impl_t *impl = (nal_pscan_result_impl_t *)result;
+    free(impl->arena);
+    free(result->groups);
+    free(impl);
+}
+
+int nal_pscan_run(MDB_dbi dbi, const nal_pscan_opts_t *opts,
+                  nal_pscan_result_t **result)
+{
+    unsigned int threads = opts->threads;
+    if (threads == 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        threads = cpus > 0 ? (unsigned int)cpus : 1;
+    }
+    nal_pscan_run_t run = {0};
+    run.dbi = dbi;
+    run.opts = opts;
+    run.max_groups = opts->max_groups != 0 ? opts->max_groups
+                                           : NAL_PSCAN_DEFAULT_MAX_GROUPS;
+    run.grouped = opts->group_prefix_len > 0 || opts->group_delim >= 0;
+
+    nal_pscan_key_t end = {0};
+    run.parts = calloc(1, sizeof(*run.parts));
+    if (run.parts == NULL) {
+        return ENOMEM;
+    }
+    run.num_parts = 1;
+    run.parts[0].splittable = 1;
+    int rc = 0;
+    if (opts->start != NULL) {
+        rc = nal_pscan_key_set(&run.parts[0].lo, opts->start->mv_data,
+                               opts->start->mv_size);
+    }
+    if (rc == 0 && opts->end != NULL) {
+        rc = nal_pscan_key_set(&end, opts->end->mv_data, opts->end->mv_size);
+    }
+    if (rc == 0 && threads > 1) {
+        rc = nal_pscan_split(&run, &end,
+                             (size_t)threads * NAL_PSCAN_PARTITIONS_PER_THREAD);
+    }
+    free(end.data);
+
+    nal_pscan_worker_t *workers = NULL;
+    unsigned int started = 0;
+    if (rc == 0) {
+        /* No more threads than partitions. */
+        if (threads > run.num_parts) {
+            threads = (unsigned int)run.num_parts;
+        }
+        workers = calloc(threads, sizeof(*workers));
+        if (workers == NULL) {
+            rc = ENOMEM;
+        }
+    }
+    for (; rc == 0 && started < threads; started++) {
+        workers[started].run = &run;
+        workers[started].index = started;
+        rc = pthread_create(&workers[started].thread, NULL, nal_pscan_worker,
+                            &workers[started]);
+    }
+    if (rc != 0 && started > 0) {
+        /* Stop the threads already running. */
+        __atomic_store_n(&run.rc, rc, __ATOMIC_RELAXED);
+        started--;
+    }
+    for (unsigned int t = 0; t < started; t++) {
+        pthread_join(workers[t].thread, NULL);
+    }
+    if (rc == 0) {
+        rc = run.rc;
+    }
+
+    nal_pscan_result_impl_t *res = NULL;
+    if (rc == 0) {
+        res = calloc(1, sizeof(*res));
+        if (res == NULL) {
+            rc = ENOMEM;
+        }
+    }
+    if (rc == 0) {
+        res->pub.partitions = run.num_parts;
+        res->pub.threads = threads;
+        rc = nal_pscan_merge(&run, workers, threads, &res->pub);
+    }
+    if (rc == 0) {
+        res->arena = workers[0].groups.arena;
+        workers[0].groups.arena = NULL;
+        *result = &res->pub;
+        nal_log_debug("nal_pscan",
+                      "scanned %llu entries of dbi %u in %zu partitions on "
+                      "%u threads",
+                      (unsigned long long)res->pub.count, dbi,
+                      res->pub.partitions, threads);
+    } else if (res != NULL) {
+        free(res->pub.groups);
+        free(res);
+    }
+    for (unsigned int t = 0; workers != NULL && t < threads; t++) {
+        nal_pscan_groups_free(&workers[t].groups);
+    }
+    free(workers);
+    nal_pscan_parts_free(run.parts, run.num_parts);
+    return rc;
+}
@@ -0,0 +1,70 @@
+#ifndef NAL_PSCAN_H
+#define NAL_PSCAN_H
+
+#include "nal_lmdb.h"
+
+/* Parallel scans of a key range with built-in reducers. The range is split
+ * into partitions by key space: a partition is halved between its first
+ * and last key, found by cursor seeks, until there are
+ * NAL_PSCAN_PARTITIONS_PER_THREAD times more of them than threads, skipping
+ * empty and single-key ones, so dense key regions end up in many small
+ * partitions. Worker threads, each with a read txn of its own, take
+ * partitions from a shared counter until none are left, and their results
+ * are merged at the end. Splitting assumes the default key order.
+ *
+ * Every entry is counted. The sum adds up value sizes or 8-byte integer
+ * values in host byte order, and grouping reduces per key prefix: the first
+ * group_prefix_len bytes, or the key up to and including group_delim, or
+ * both, whichever is shorter. A callback sees every entry on the worker
+ * thread that reads it, with its worker index to keep per-worker state. */
+#define NAL_PSCAN_SUM_NONE 0
+#define NAL_PSCAN_SUM_SIZE 1  /* value bytes */
+#define NAL_PSCAN_SUM_INT64 2 /* other sizes count as skipped */
+
+#define NAL_PSCAN_PARTITIONS_PER_THREAD 8
+#define NAL_PSCAN_DEFAULT_MAX_GROUPS (1 << 20)
+
+/* Return nonzero to stop the scan with that value. */
+typedef int (*nal_pscan_fn)(void *arg, unsigned int worker,
+                            const MDB_val *key, const MDB_val *data);
+
+typedef struct nal_pscan_opts_s {
+    const MDB_val *start; /* first key, NULL or empty for the first */
+    const MDB_val *end;   /* key past the range, NULL for none */
+    unsigned int threads; /* 0 for the online CPUs */
+    int sum;
+    size_t group_prefix_len; /* 0 for no limit */
+    int group_delim;         /* -1 for none */
+    /* Exceeding it fails the scan with E2BIG; 0 for the default. */
+    size_t max_groups;
+    nal_pscan_fn fn; /* optional */
+    void *arg;
+} nal_pscan_opts_t;
+
+typedef struct nal_pscan_group_s {
+    MDB_val key;
+    uint64_t count;
+    int64_t sum;
+} nal_pscan_group_t;
+
+typedef struct nal_pscan_result_s {
+    uint64_t count;
+    int64_t sum;
+    uint64_t skipped;
+    size_t partitions;
+    unsigned int threads;
+    size_t num_groups;
+    nal_pscan_group_t *groups; /* sorted by key */
+} nal_pscan_result_t;
+
+/* Sets the defaults: the whole dbi, all CPUs, count only. */
+void nal_pscan_opts_init(nal_pscan_opts_t *opts);
+
+/* Scans dbi, which must be open, and blocks until done. Groups are only
+ * collected with group_prefix_len or group_delim set. */
+int nal_pscan_run(MDB_dbi dbi, const nal_pscan_opts_t *opts,
+                  nal_pscan_result_t **result);
+
+void nal_pscan_result_free(nal_pscan_result_t *result);
+
+#endif
@@ -0,0 +1,224 @@
+#include "nal_scan.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "nal_log.h"
+
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    size_t cap;
+    int set;
+} nal_scan_key_t;
+
+struct nal_scan_s {
+    MDB_dbi dbi;
+    nal_txn_ptr txn;
+    nal_cursor_ptr cursor;
+    nal_scan_key_t start;
+    nal_scan_key_t end;
+    nal_scan_key_t last;
+    size_t max_entries;
+    uint64_t max_ns;
+    size_t chunk_entries;
+    uint64_t chunk_start_ns;
+    size_t count;
+    int in_chunk;
+    int done;
+};
+
+static uint64_t nal_scan_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static int nal_scan_key_set(nal_scan_key_t *k, const MDB_val *val)
+{
+    if (val->mv_size > k->cap) {
+        size_t cap = val->mv_size > 64 ? val->mv_size : 64;
+        unsigned char *data = realloc(k->data, cap);
+        if (data == NULL) {
+            return ENOMEM;
+        }
+        k->data = data;
+        k->cap = cap;
+    }
+    memcpy(k->data, val->mv_data, val->mv_size);
+    k->size = val->mv_size;
+    k->set = 1;
+    return 0;
+}
+
+static MDB_val nal_scan_key_val(const nal_scan_key_t *k)
+{
+    MDB_val val = {k->size, k->data};
+    return val;
+}
+
+void nal_scan_close(nal_scan_t *scan)
+{
+    if (scan == NULL) {
+        return;
+    }
+    if (scan->cursor != NULL) {
+        nal_cursor_close(scan->cursor);
+    }
+    if (scan->txn != NULL) {
+        nal_txn_abort(scan->txn);
+    }
+    free(scan->start.data);
+    free(scan->end.data);
+    free(scan->last.data);
+    free(scan);
+}
+
+int nal_scan_open(MDB_dbi dbi, const MDB_val *start, const MDB_val *end,
+                  const MDB_val *after, size_t max_entries, uint64_t max_us,
+                  nal_scan_t **scan)
+{
+    nal_scan_t *s = calloc(1, sizeof(*s));
+    if (s == NULL) {
+        return ENOMEM;
+    }
+    s->dbi = dbi;
+    s->max_entries = max_entries;
+    s->max_ns = max_us * 1000;
+    int rc = 0;
+    if (start != NULL) {
+        rc = nal_scan_key_set(&s->start, start);
+    }
+    if (rc == 0 && end != NULL) {
+        rc = nal_scan_key_set(&s->end, end);
+    }
+    if (rc == 0 && after != NULL) {
+        rc = nal_scan_key_set(&s->last, after);
+    }
+    if (rc != 0) {
+        nal_scan_close(s);
+        return rc;
+    }
+    *scan = s;
+    return 0;
+}
+
+static void nal_scan_end_chunk(nal_scan_t *scan)
+{
+    nal_txn_reset(scan->txn);
+    scan->in_chunk = 0;
+}
+
+/* Renews the read txn and cursor and positions the cursor on the first
+ * entry of the chunk. */
+static int nal_scan_begin_chunk(nal_scan_t *scan, MDB_val *key,
+                                MDB_val *data)
+{
+    int rc;
+    if (scan->txn == NULL) {
+        rc = nal_readonly_txn_begin(NULL, &scan->txn);
+        if (rc == 0) {
+            rc = nal_cursor_open(scan->txn, scan->dbi, &scan->cursor);
+            if (rc != 0) {
+                nal_txn_abort(scan->txn);
+                scan->txn = NULL;
+                scan->cursor = NULL;
+            }
+        }
+    } else {
+        rc = nal_txn_renew(scan->txn);
+        if (rc == 0) {
+            rc = mdb_cursor_renew(scan->txn, scan->cursor);
+        }
+    }
+    if (rc != 0) {
+        return rc;
+    }
+    scan->in_chunk = 1;
+    scan->chunk_entries = 0;
+    scan->chunk_start_ns = scan->max_ns != 0 ? nal_scan_now_ns() : 0;
+
+    /* An empty key bounds nothing, and MDB_SET_RANGE would reject it. */
+    if (scan->last.set && scan->last.size > 0) {
+        MDB_val last = nal_scan_key_val(&scan->last);
+        *key = last;
+        rc = nal_cursor_get(scan->cursor, key, data, MDB_SET_RANGE);
+        if (rc == 0 && mdb_cmp(scan->txn, scan->dbi, key, &last) == 0) {
+            rc = nal_cursor_get(scan->cursor, key, data, MDB_NEXT);
+        }
+    } else if (scan->start.set && scan->start.size > 0) {
+        *key = nal_scan_key_val(&scan->start);
+        rc = nal_cursor_get(scan->cursor, key, data, MDB_SET_RANGE);
+    } else {
+        rc = nal_cursor_get(scan->cursor, key, data, MDB_FIRST);
+    }
+    return rc;
+}
+
+int nal_scan_next(nal_scan_t *scan, MDB_val *key, MDB_val *data)
+{
+    if (scan->done) {
+        return MDB_NOTFOUND;
+    }
+    int rc;
+    if (!scan->in_chunk) {
+        rc = nal_scan_begin_chunk(scan, key, data);
+    } else if ((scan->max_entries != 0 &&
+                scan->chunk_entries >= scan->max_entries) ||
+               (scan->max_ns != 0 &&
+                nal_scan_now_ns() - scan->chunk_start_ns >= scan->max_ns)) {
+        nal_scan_end_chunk(scan);
+        return EAGAIN;
+    } else {
+        rc = nal_cursor_get(scan->cursor, key, data, MDB_NEXT);
+    }
+
+    if (rc == 0 && scan->end.set) {
+        MDB_val end = nal_scan_key_val(&scan->end);
+        if (mdb_cmp(scan->txn, scan->dbi, key, &end) >= 0) {
+            rc = MDB_NOTFOUND;
+        }
+    }
+    if (rc == 0) {
+        rc = nal_scan_key_set(&scan->last, key);
+    }
+    if (rc != 0) {
+        if (rc == MDB_NOTFOUND) {
+            scan->done = 1;
+            nal_log_debug("nal_scan", "scan of dbi %u done after %zu entries",
+                          scan->dbi, scan->count);
+        }
+        /* A failed chunk can be retried by the next call. */
+        if (scan->in_chunk) {
+            nal_scan_end_chunk(scan);
+        }
+        return rc;
+    }
+    scan->chunk_entries++;
+    scan->count++;
+    return 0;
+}
+
+void nal_scan_pause(nal_scan_t *scan)
+{
+    if (scan->in_chunk) {
+        nal_scan_end_chunk(scan);
+    }
+}
+
+int nal_scan_token(const nal_scan_t *scan, MDB_val *token)
+{
+    if (!scan->last.set) {
+        return MDB_NOTFOUND;
+    }
+    *token = nal_scan_key_val(&scan->last);
+    return 0;
+}
+
+size_t nal_scan_count(const nal_scan_t *scan)
+{
+    return scan->count;
+}
@@ -0,0 +1,44 @@
+#ifndef NAL_SCAN_H
+#define NAL_SCAN_H
+
+#include "nal_lmdb.h"
+
+/* Resumable scans that never hold a read txn for long. A scan reads a key
+ * range in chunks of at most max_entries entries or max_us microseconds.
+ * Each chunk renews a read txn of its own and seeks with MDB_SET_RANGE to
+ * just past the last key returned, and the txn is reset when the chunk
+ * ends, so writers can reuse the pages freed meanwhile. Entries written
+ * between chunks show up if they sort after the last key returned.
+ *
+ * The last key returned is also a token that resumes the scan in a later
+ * nal_scan_open, e.g. from a timer or after a restart. */
+typedef struct nal_scan_s nal_scan_t;
+
+/* Scans dbi from start, or the first key if NULL or empty, to below end, or
+ * to the last key if NULL. after, a token of an earlier scan, resumes right
+ * after it instead of start. Keys are copied. 0 for max_entries or max_us means
+ * no limit. */
+int nal_scan_open(MDB_dbi dbi, const MDB_val *start, const MDB_val *end,
+                  const MDB_val *after, size_t max_entries, uint64_t max_us,
+                  nal_scan_t **scan);
+
+/* Returns 0 with the next entry, valid until the next call. Returns EAGAIN
+ * when the current chunk is used up and MDB_NOTFOUND at the end of the
+ * range, with the read txn reset in both cases. The call after EAGAIN
+ * starts the next chunk. */
+int nal_scan_next(nal_scan_t *scan, MDB_val *key, MDB_val *data);
+
+/* Ends the current chunk early, resetting its read txn; the next call of
+ * nal_scan_next starts a new one. */
+void nal_scan_pause(nal_scan_t *scan);
+
+/* The last key returned, or MDB_NOTFOUND before the first one. Valid until
+ * the next call of nal_scan_next. */
+int nal_scan_token(const nal_scan_t *scan, MDB_val *token);
+
+/* Entries returned since nal_scan_open. */
+size_t nal_scan_count(const nal_scan_t *scan);
+
+void nal_scan_close(nal_scan_t *scan);
+
+#endif
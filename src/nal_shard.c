@@ -0,0 +1,410 @@
+#include "nal_shard.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "nal_hash.h"
+#include "nal_log.h"
+
+#define NAL_SHARD_MAX 256
+#define NAL_SHARD_HASH_SEED 0x6e616c5f73686172ULL /* "nal_shar" */
+
+struct nal_shard_store_s {
+    unsigned int num_shards;
+    size_t max_databases;
+    size_t num_dbis;
+    char **dbi_names;
+    MDB_dbi *dbis; /* max_databases rows of num_shards handles */
+    MDB_env *envs[];
+};
+
+typedef struct {
+    MDB_txn *txn;
+    MDB_cursor *cursor;
+    MDB_val key;
+    MDB_val data;
+    int has_item;
+} nal_shard_head_t;
+
+struct nal_shard_scan_s {
+    nal_shard_store_t *store;
+    unsigned int db;
+    int current;
+    nal_shard_head_t heads[];
+};
+
+static int nal_shard_env_open(MDB_env **envp, const char *path,
+                              size_t max_databases, unsigned int max_readers,
+                              size_t map_size, uint32_t file_mode, int use_tls,
+                              int read_only)
+{
+    MDB_env *env;
+    int rc = mdb_env_create(&env);
+    if (rc != 0) {
+        nal_log_error("mdb_env_create failed: %s", mdb_strerror(rc));
+        return rc;
+    }
+
+    rc = mdb_env_set_maxdbs(env, max_databases);
+    if (rc != 0) {
+        nal_log_error("mdb_env_set_maxdbs failed: %s", mdb_strerror(rc));
+        goto fail;
+    }
+
+    rc = mdb_env_set_maxreaders(env, max_readers);
+    if (rc != 0) {
+        nal_log_error("mdb_env_set_maxreaders failed: %s", mdb_strerror(rc));
+        goto fail;
+    }
+
+    rc = mdb_env_set_mapsize(env, map_size);
+    if (rc != 0) {
+        nal_log_error("mdb_env_set_mapsize failed: %s", mdb_strerror(rc));
+        goto fail;
+    }
+
+    if (!read_only) {
+        /* Give the directory search permission wherever the files get read
+         * permission so that the same file_mode works for both. */
+        mode_t dir_mode = (mode_t)(file_mode | ((file_mode & 0444) >> 2));
+        if (mkdir(path, dir_mode) != 0 && errno != EEXIST) {
+            rc = errno;
+            nal_log_error("mkdir %s failed: %s", path, strerror(rc));
+            goto fail;
+        }
+    }
+
+    unsigned int flags =
+        (use_tls ? 0 : MDB_NOTLS) | (read_only ? MDB_RDONLY : 0);
+    rc = mdb_env_open(env, path, flags, (mdb_mode_t)file_mode);
+    if (rc != 0) {
+        nal_log_error("mdb_env_open failed for shard %s: %s", path,
+                      mdb_strerror(rc));
+        goto fail;
+    }
+
+    int dead = 0;
+    rc = mdb_reader_check(env, &dead);
+    if (rc != 0) {
+        nal_log_error("mdb_reader_check failed: %s", mdb_strerror(rc));
+    } else if (dead > 0) {
+        nal_log_warning("found and cleared %d stale readers from shard %s",
+                        dead, path);
+    }
+
+    *envp = env;
+    return 0;
+
+fail:
+    mdb_env_close(env);
+    return rc;
+}
+
+int nal_shard_store_open(const char *base_path, unsigned int num_shards,
+                         size_t max_databases, unsigned int max_readers,
+                         size_t map_size, uint32_t file_mode, int use_tls,
+                         int read_only, nal_shard_store_t **store)
+{
+    if (num_shards == 0 || num_shards > NAL_SHARD_MAX || max_databases == 0) {
+        return EINVAL;
+    }
+
+    nal_shard_store_t *s =
+        calloc(1, sizeof(*s) + num_shards * sizeof(MDB_env *));
+    if (s == NULL) {
+        return ENOMEM;
+    }
+    s->num_shards = num_shards;
+    s->max_databases = max_databases;
+    s->dbi_names = calloc(max_databases, sizeof(char *));
+    s->dbis = calloc(max_databases * num_shards, sizeof(MDB_dbi));
+    if (s->dbi_names == NULL || s->dbis == NULL) {
+        nal_shard_store_close(s);
+        return ENOMEM;
+    }
+
+    int rc = 0;
+    char path[4096];
+    for (unsigned int i = 0; i < num_shards; i++) {
+        int n = snprintf(path, sizeof(path), "%s/shard-%03u", base_path, i);
+        if (n < 0 || (size_t)n >= sizeof(path)) {
+            rc = ENAMETOOLONG;
+            break;
+        }
+        rc = nal_shard_env_open(&s->envs[i], path, max_databases, max_readers,
+                                map_size, file_mode, use_tls, read_only);
+        if (rc != 0) {
+            break;
+        }
+    }
+    if (rc != 0) {
+        nal_shard_store_close(s);
+        return rc;
+    }
+
+    nal_log_note("nal_shard_store_open: path=%s, num_shards=%u", base_path,
+                 num_shards);
+    *store = s;
+    return 0;
+}
+
+void nal_shard_store_close(nal_shard_store_t *store)
+{
+    if (store == NULL) {
+        return;
+    }
+    for (unsigned int i = 0; i < store->num_shards; i++) {
+        if (store->envs[i] != NULL) {
+            mdb_env_close(store->envs[i]);
+        }
+    }
+    if (store->dbi_names != NULL) {
+        for (size_t i = 0; i < store->num_dbis; i++) {
+            free(store->dbi_names[i]);
+        }
+        free(store->dbi_names);
+    }
+    free(store->dbis);
+    free(store);
+}
+
+unsigned int nal_shard_count(nal_shard_store_t *store)
+{
+    return store->num_shards;
+}
+
+unsigned int nal_shard_of(nal_shard_store_t *store, const MDB_val *key)
+{
+    uint64_t h = nal_hash64(key->mv_data, key->mv_size, NAL_SHARD_HASH_SEED);
+    /* Lemire's multiply-shift range reduction avoids a division. */
+    return (unsigned int)(((h >> 32) * store->num_shards) >> 32);
+}
+
+int nal_shard_dbi_open(nal_shard_store_t *store, const char *name,
+                       int read_only, unsigned int *db)
+{
+    for (size_t i = 0; i < store->num_dbis; i++) {
+        if (strcmp(store->dbi_names[i], name) == 0) {
+            *db = (unsigned int)i;
+            return 0;
+        }
+    }
+    if (store->num_dbis == store->max_databases) {
+        return MDB_DBS_FULL;
+    }
+
+    /* All txns stay open until every shard has the dbi, so a failed open
+     * creates it nowhere. */
+    size_t idx = store->num_dbis;
+    MDB_dbi *row = &store->dbis[idx * store->num_shards];
+    MDB_txn **txns = calloc(store->num_shards, sizeof(*txns));
+    if (txns == NULL) {
+        return ENOMEM;
+    }
+    int rc = 0;
+    unsigned int begun = 0;
+    for (; begun < store->num_shards; begun++) {
+        rc = mdb_txn_begin(store->envs[begun], NULL,
+                           read_only ? MDB_RDONLY : 0, &txns[begun]);
+        if (rc != 0) {
+            break;
+        }
+        rc = mdb_dbi_open(txns[begun], name, read_only ? 0 : MDB_CREATE,
+                          &row[begun]);
+        if (rc != 0) {
+            begun++;
+            break;
+        }
+    }
+    for (unsigned int i = 0; i < begun; i++) {
+        if (rc == 0) {
+            rc = mdb_txn_commit(txns[i]);
+        } else {
+            mdb_txn_abort(txns[i]);
+        }
+    }
+    free(txns);
+    if (rc != 0) {
+        return rc;
+    }
+
+    store->dbi_names[idx] = strdup(name);
+    if (store->dbi_names[idx] == NULL) {
+        return ENOMEM;
+    }
+    store->num_dbis++;
+    *db = (unsigned int)idx;
+    return 0;
+}
+
+int nal_shard_txn_begin(nal_shard_store_t *store, unsigned int shard,
+                        int read_only, nal_txn_ptr *txn)
+{
+    if (shard >= store->num_shards) {
+        return EINVAL;
+    }
+    return mdb_txn_begin(store->envs[shard], NULL, read_only ? MDB_RDONLY : 0,
+                         txn);
+}
+
+/* Resolve the per-shard dbi handle for key and check that txn belongs to the
+ * shard the key routes to, so a misrouted write fails instead of landing in
+ * the wrong environment. */
+static int nal_shard_resolve(nal_shard_store_t *store, nal_txn_ptr txn,
+                             unsigned int db, const MDB_val *key,
+                             MDB_dbi *dbi)
+{
+    if (db >= store->num_dbis) {
+        return MDB_BAD_DBI;
+    }
+    unsigned int shard = nal_shard_of(store, key);
+    if (mdb_txn_env(txn) != store->envs[shard]) {
+        return MDB_BAD_TXN;
+    }
+    *dbi = store->dbis[db * store->num_shards + shard];
+    return 0;
+}
+
+int nal_shard_get(nal_shard_store_t *store, nal_txn_ptr txn, unsigned int db,
+                  MDB_val *key, MDB_val *data)
+{
+    MDB_dbi dbi;
+    int rc = nal_shard_resolve(store, txn, db, key, &dbi);
+    if (rc != 0) {
+        return rc;
+    }
+    return mdb_get(txn, dbi, key, data);
+}
+
+int nal_shard_put(nal_shard_store_t *store, nal_txn_ptr txn, unsigned int db,
+                  MDB_val *key, MDB_val *data)
+{
+    MDB_dbi dbi;
+    int rc = nal_shard_resolve(store, txn, db, key, &dbi);
+    if (rc != 0) {
+        return rc;
+    }
+    return mdb_put(txn, dbi, key, data, 0);
+}
+
+int nal_shard_del(nal_shard_store_t *store, nal_txn_ptr txn, unsigned int db,
+                  MDB_val *key)
+{
+    MDB_dbi dbi;
+    int rc = nal_shard_resolve(store, txn, db, key, &dbi);
+    if (rc != 0) {
+        return rc;
+    }
+    return mdb_del(txn, dbi, key, NULL);
+}
+
+int nal_shard_scan_open(nal_shard_store_t *store, unsigned int db,
+                        MDB_val *start, nal_shard_scan_t **scan)
+{
+    if (db >= store->num_dbis) {
+        return MDB_BAD_DBI;
+    }
+
+    nal_shard_scan_t *s = calloc(
+        1, sizeof(*s) + store->num_shards * sizeof(nal_shard_head_t));
+    if (s == NULL) {
+        return ENOMEM;
+    }
+    s->store = store;
+    s->db = db;
+    s->current = -1;
+
+    int rc = 0;
+    for (unsigned int i = 0; i < store->num_shards; i++) {
+        nal_shard_head_t *h = &s->heads[i];
+        rc = mdb_txn_begin(store->envs[i], NULL, MDB_RDONLY, &h->txn);
+        if (rc != 0) {
+            break;
+        }
+        rc = mdb_cursor_open(h->txn, store->dbis[db * store->num_shards + i],
+                             &h->cursor);
+        if (rc != 0) {
+            break;
+        }
+        if (start != NULL && start->mv_size > 0) {
+            h->key = *start;
+            rc = mdb_cursor_get(h->cursor, &h->key, &h->data, MDB_SET_RANGE);
+        } else {
+            rc = mdb_cursor_get(h->cursor, &h->key, &h->data, MDB_FIRST);
+        }
+        if (rc == 0) {
+            h->has_item = 1;
+        } else if (rc == MDB_NOTFOUND) {
+            rc = 0;
+        } else {
+            break;
+        }
+    }
+    if (rc != 0) {
+        nal_shard_scan_close(s);
+        return rc;
+    }
+
+    *scan = s;
+    return 0;
+}
+
+/* Merge step of the scatter-gather scan: advance the shard returned last time,
+ * then return the smallest head among all shards. The shard count is small
+ * enough that a linear pick beats maintaining a heap. */
+int nal_shard_scan_next(nal_shard_scan_t *scan, MDB_val *key, MDB_val *data)
+{
+    nal_shard_store_t *store = scan->store;
+
+    if (scan->current >= 0) {
+        nal_shard_head_t *h = &scan->heads[scan->current];
+        int rc = mdb_cursor_get(h->cursor, &h->key, &h->data, MDB_NEXT);
+        if (rc == MDB_NOTFOUND) {
+            h->has_item = 0;
+        } else if (rc != 0) {
+            return rc;
+        }
+        scan->current = -1;
+    }
+
+    int best = -1;
+    for (unsigned int i = 0; i < store->num_shards; i++) {
+        nal_shard_head_t *h = &scan->heads[i];
+        if (!h->has_item) {
+            continue;
+        }
+        if (best < 0 ||
+            mdb_cmp(h->txn, store->dbis[scan->db * store->num_shards + i],
+                    &h->key, &scan->heads[best].key) < 0) {
+            best = (int)i;
+        }
+    }
+    if (best < 0) {
+        return MDB_NOTFOUND;
+    }
+
+    scan->current = best;
+    *key = scan->heads[best].key;
+    *data = scan->heads[best].data;
+    return 0;
+}
+
+void nal_shard_scan_close(nal_shard_scan_t *scan)
+{
+    if (scan == NULL) {
+        return;
+    }
+    for (unsigned int i = 0; i < scan->store->num_shards; i++) {
+        nal_shard_head_t *h = &scan->heads[i];
+        if (h->cursor != NULL) {
+            mdb_cursor_close(h->cursor);
+        }
+        if (h->txn != NULL) {
+            mdb_txn_abort(h->txn);
+        }
+    }
+    free(scan);
+}
@@ -0,0 +1,38 @@
+#ifndef NAL_SHARD_H
+#define NAL_SHARD_H
+
+#include "nal_lmdb.h"
+
+/* A sharded store is a set of independent LMDB environments under one base
+ * directory. Each key is routed to exactly one shard by hash, so writers to
+ * different shards take different write locks and commit in parallel. */
+typedef struct nal_shard_store_s nal_shard_store_t;
+typedef struct nal_shard_scan_s nal_shard_scan_t;
+
+int nal_shard_store_open(const char *base_path, unsigned int num_shards,
+                         size_t max_databases, unsigned int max_readers,
+                         size_t map_size, uint32_t file_mode, int use_tls,
+                         int read_only, nal_shard_store_t **store);
+void nal_shard_store_close(nal_shard_store_t *store);
+unsigned int nal_shard_count(nal_shard_store_t *store);
+unsigned int nal_shard_of(nal_shard_store_t *store, const MDB_val *key);
+
+/* Opens name in every shard. The txns commit only once all opens succeeded;
+ * should a commit still fail, calling it again opens the remaining shards. */
+int nal_shard_dbi_open(nal_shard_store_t *store, const char *name,
+                       int read_only, unsigned int *db);
+int nal_shard_txn_begin(nal_shard_store_t *store, unsigned int shard,
+                        int read_only, nal_txn_ptr *txn);
+int nal_shard_get(nal_shard_store_t *store, nal_txn_ptr txn, unsigned int db,
+                  MDB_val *key, MDB_val *data);
+int nal_shard_put(nal_shard_store_t *store, nal_txn_ptr txn, unsigned int db,
+                  MDB_val *key, MDB_val *data);
+int nal_shard_del(nal_shard_store_t *store, nal_txn_ptr txn, unsigned int db,
+                  MDB_val *key);
+
+int nal_shard_scan_open(nal_shard_store_t *store, unsigned int db,
+                        MDB_val *start, nal_shard_scan_t **scan);
+int nal_shard_scan_next(nal_shard_scan_t *scan, MDB_val *key, MDB_val *data);
+void nal_shard_scan_close(nal_shard_scan_t *scan);
+
+#endif
@@ -0,0 +1,208 @@
+#include "nal_stats.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "nal_lmdb_internal.h"
+
+/* Page layout of LMDB, see mdb.c: a page header of 16 bytes, a 2 byte
+ * index entry and a node header of 8 bytes per node, nodes padded to even
+ * sizes. A node larger than about half a page moves its value to overflow
+ * pages and keeps their page number. */
+#define NAL_STATS_PAGE_HDR 16
+#define NAL_STATS_NODE_HDR 8
+#define NAL_STATS_NODE_INDEX 2
+#define NAL_STATS_FREE_DBI 0
+
+static size_t nal_stats_node_max(size_t page_size)
+{
+    return (((page_size - NAL_STATS_PAGE_HDR) / 2) & ~(size_t)1) -
+           NAL_STATS_NODE_INDEX;
+}
+
+/* Called by mdb_reader_list once per line, like
+ * "    pid     thread     txnid" followed by one line per reader slot. */
+static int nal_stats_reader_line(const char *msg, void *ctx)
+{
+    uint64_t *oldest = ctx;
+    int pid;
+    size_t thread;
+    uint64_t txnid;
+    if (sscanf(msg, "%d %zx %" SCNu64, &pid, &thread, &txnid) == 3 &&
+        (*oldest == 0 || txnid < *oldest)) {
+        *oldest = txnid;
+    }
+    return 0;
+}
+
+int nal_env_stats(nal_env_stats_t *stats)
+{
+    MDB_env *env = nal_env_handle();
+    MDB_envinfo info;
+    MDB_stat st;
+    int rc = mdb_env_info(env, &info);
+    if (rc == 0) {
+        rc = mdb_env_stat(env, &st);
+    }
+    if (rc != 0) {
+        return rc;
+    }
+    memset(stats, 0, sizeof(*stats));
+    stats->map_size = info.me_mapsize;
+    stats->page_size = st.ms_psize;
+    stats->map_pages = (uint64_t)info.me_last_pgno + 1;
+    stats->last_txnid = info.me_last_txnid;
+    stats->max_readers = info.me_maxreaders;
+    stats->num_readers = info.me_numreaders;
+    stats->dbis = st.ms_entries;
+    stats->main_depth = st.ms_depth;
+    stats->main_pages =
+        (uint64_t)st.ms_branch_pages + st.ms_leaf_pages + st.ms_overflow_pages;
+    if (mdb_reader_list(env, nal_stats_reader_line,
+                        &stats->oldest_reader_txnid) < 0) {
+        stats->oldest_reader_txnid = 0;
+    }
+    return 0;
+}
+
+static int nal_dbi_stats_scan(nal_txn_ptr txn, MDB_dbi dbi,
+                              nal_dbi_stats_t *stats)
+{
+    MDB_cursor *cursor;
+    int rc = mdb_cursor_open(txn, dbi, &cursor);
+    if (rc != 0) {
+        return rc;
+    }
+    size_t node_max = nal_stats_node_max(stats->page_size);
+    uint64_t leaf_bytes = 0;
+    uint64_t overflow_bytes = 0;
+    MDB_val key, data;
+    for (rc = mdb_cursor_get(cursor, &key, &data, MDB_FIRST); rc == 0;
+         rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT)) {
+        stats->key_bytes += key.mv_size;
+        stats->value_bytes += data.mv_size;
+        size_t node = NAL_STATS_NODE_HDR + key.mv_size + data.mv_size;
+        if (node > node_max) {
+            node = NAL_STATS_NODE_HDR + key.mv_size + sizeof(size_t);
+            overflow_bytes += data.mv_size;
+        }
+        leaf_bytes += ((node + 1) & ~(size_t)1) + NAL_STATS_NODE_INDEX;
+    }
+    mdb_cursor_close(cursor);
+    if (rc != MDB_NOTFOUND) {
+        return rc;
+    }
+
+    uint64_t leaf_room =
+        stats->leaf_pages * (stats->page_size - NAL_STATS_PAGE_HDR);
+    if (leaf_room > 0) {
+        stats->leaf_fill = (double)leaf_bytes / (double)leaf_room;
+    }
+    if (stats->overflow_pages > 0) {
+        stats->overflow_fill =
+            (double)overflow_bytes /
+            (double)(stats->overflow_pages * stats->page_size);
+    }
+    return 0;
+}
+
+int nal_dbi_stats(nal_txn_ptr txn, MDB_dbi dbi, int scan,
+                  nal_dbi_stats_t *stats)
+{
+    MDB_stat st;
+    int rc = mdb_stat(txn, dbi, &st);
+    if (rc != 0) {
+        return rc;
+    }
+    memset(stats, 0, sizeof(*stats));
+    stats->page_size = st.ms_psize;
+    stats->depth = st.ms_depth;
+    stats->branch_pages = st.ms_branch_pages;
+    stats->leaf_pages = st.ms_leaf_pages;
+    stats->overflow_pages = st.ms_overflow_pages;
+    stats->entries = st.ms_entries;
+    if (!scan) {
+        return 0;
+    }
+    return nal_dbi_stats_scan(txn, dbi, stats);
+}
+
+static void nal_freelist_add_run(nal_freelist_stats_t *stats, uint64_t len)
+{
+    int bucket = 63 - __builtin_clzll(len);
+    if (bucket >= NAL_FREELIST_RUN_BUCKETS) {
+        bucket = NAL_FREELIST_RUN_BUCKETS - 1;
+    }
+    stats->run_hist[bucket]++;
+    stats->runs++;
+    if (len > stats->max_run) {
+        stats->max_run = len;
+    }
+}
+
+int nal_freelist_stats(nal_txn_ptr txn, nal_freelist_stats_t *stats)
+{
+    nal_env_stats_t env;
+    int rc = nal_env_stats(&env);
+    if (rc != 0) {
+        return rc;
+    }
+    /* A write txn may reuse the pages freed by txns before the oldest
+     * snapshot still read, which is at most the last committed one. */
+    uint64_t oldest = env.last_txnid;
+    if (env.oldest_reader_txnid != 0 && env.oldest_reader_txnid < oldest) {
+        oldest = env.oldest_reader_txnid;
+    }
+
+    MDB_cursor *cursor;
+    rc = mdb_cursor_open(txn, NAL_STATS_FREE_DBI, &cursor);
+    if (rc != 0) {
+        return rc;
+    }
+    memset(stats, 0, sizeof(*stats));
+    MDB_val key, data;
+    for (rc = mdb_cursor_get(cursor, &key, &data, MDB_FIRST); rc == 0;
+         rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT)) {
+        /* The key is the id of the freeing txn, the value a page count
+         * followed by the page numbers in descending order. */
+        size_t txnid;
+        size_t pages;
+        if (key.mv_size != sizeof(txnid) || data.mv_size < sizeof(pages)) {
+            rc = MDB_CORRUPTED;
+            break;
+        }
+        memcpy(&txnid, key.mv_data, sizeof(txnid));
+        memcpy(&pages, data.mv_data, sizeof(pages));
+        if (pages > data.mv_size / sizeof(size_t) - 1) {
+            rc = MDB_CORRUPTED;
+            break;
+        }
+        const unsigned char *ids = (const unsigned char *)data.mv_data;
+        stats->records++;
+        stats->free_pages += pages;
+        if (txnid >= oldest) {
+            stats->pinned_pages += pages;
+        }
+        uint64_t run = 0;
+        size_t prev = 0;
+        for (size_t i = pages; i > 0; i--) {
+            size_t pgno;
+            memcpy(&pgno, ids + i * sizeof(size_t), sizeof(pgno));
+            if (run > 0 && pgno == prev + 1) {
+                run++;
+            } else {
+                if (run > 0) {
+                    nal_freelist_add_run(stats, run);
+                }
+                run = 1;
+            }
+            prev = pgno;
+        }
+        if (run > 0) {
+            nal_freelist_add_run(stats, run);
+        }
+    }
+    mdb_cursor_close(cursor);
+    return rc == MDB_NOTFOUND ? 0 : rc;
+}
@@ -0,0 +1,66 @@
+#ifndef NAL_STATS_H
+#define NAL_STATS_H
+
+#include "nal_lmdb.h"
+
+/* Introspection of the env for capacity planning: how the map is used, how
+ * full the pages of each dbi are and how many pages sit in the freelist,
+ * and how many of those a reader keeps from being reused. Sizes are in
+ * pages of page_size bytes unless noted. */
+
+typedef struct nal_env_stats_s {
+    uint64_t map_size;   /* bytes */
+    uint64_t page_size;  /* bytes */
+    uint64_t map_pages;  /* pages up to the last one used, free or not */
+    uint64_t last_txnid; /* last committed txn */
+    /* Snapshot of the oldest reader, or 0 without readers. Pages freed
+     * by txns from this one on cannot be reused yet. */
+    uint64_t oldest_reader_txnid;
+    uint32_t max_readers;
+    uint32_t num_readers; /* reader slots ever used, not active readers */
+    uint64_t dbis;        /* named dbis, i.e. entries of the main dbi */
+    uint32_t main_depth;
+    uint64_t main_pages; /* pages of the main dbi, which lists the dbis */
+} nal_env_stats_t;
+
+typedef struct nal_dbi_stats_s {
+    uint32_t page_size; /* bytes */
+    uint32_t depth;
+    uint64_t branch_pages;
+    uint64_t leaf_pages;
+    uint64_t overflow_pages; /* pages of values too large for a leaf */
+    uint64_t entries;
+    /* Filled by a scan, 0 otherwise. Sizes are as stored, i.e. with
+     * version prefixes and blob references rather than decoded values. */
+    uint64_t key_bytes;
+    uint64_t value_bytes;
+    double leaf_fill;     /* bytes of leaf nodes / usable leaf page bytes */
+    double overflow_fill; /* bytes of large values / overflow page bytes */
+} nal_dbi_stats_t;
+
+/* Runs of consecutive free pages by length: bucket i counts runs of 2^i
+ * to 2^(i+1) - 1 pages, the last bucket all longer ones. */
+#define NAL_FREELIST_RUN_BUCKETS 16
+
+typedef struct nal_freelist_stats_s {
+    uint64_t records;    /* one per txn that freed pages */
+    uint64_t free_pages;
+    /* Free pages a reader still may see, which a write txn cannot reuse. */
+    uint64_t pinned_pages;
+    uint64_t runs;
+    uint64_t max_run;
+    uint64_t run_hist[NAL_FREELIST_RUN_BUCKETS];
+} nal_freelist_stats_t;
+
+int nal_env_stats(nal_env_stats_t *stats);
+
+/* With scan set, walks all entries of dbi in txn to add up keys and values
+ * and estimate how full its pages are, which takes time proportional to
+ * the size of the dbi. */
+int nal_dbi_stats(nal_txn_ptr txn, MDB_dbi dbi, int scan,
+                  nal_dbi_stats_t *stats);
+
+/* Walks the freelist, i.e. the internal dbi 0, in txn. */
+int nal_freelist_stats(nal_txn_ptr txn, nal_freelist_stats_t *stats);
+
+#endif
@@ -0,0 +1,287 @@
+#include "nal_tuple.h"
+
+#include <string.h>
+
+/* Type codes follow the FoundationDB tuple layer where it has one, so keys
+ * stay readable with existing tooling. */
+#define NAL_TUPLE_CODE_NULL 0x00
+#define NAL_TUPLE_CODE_BYTES 0x01
+#define NAL_TUPLE_CODE_NESTED 0x05
+#define NAL_TUPLE_CODE_INT_ZERO 0x14
+#define NAL_TUPLE_CODE_DOUBLE 0x21
+#define NAL_TUPLE_CODE_FALSE 0x26
+#define NAL_TUPLE_CODE_TRUE 0x27
+#define NAL_TUPLE_ESCAPE 0xff
+
+static void nal_tuple_put(nal_tuple_builder_t *b, unsigned char c)
+{
+    if (b->len < b->cap) {
+        b->buf[b->len] = c;
+    }
+    b->len++;
+}
+
+static void nal_tuple_put_be(nal_tuple_builder_t *b, uint64_t v, int n)
+{
+    for (int i = n - 1; i >= 0; i--) {
+        nal_tuple_put(b, (unsigned char)(v >> (8 * i)));
+    }
+}
+
+static int nal_tuple_byte_len(uint64_t v)
+{
+    int n = 0;
+    while (v != 0) {
+        n++;
+        v >>= 8;
+    }
+    return n;
+}
+
+void nal_tuple_init(nal_tuple_builder_t *b, void *buf, size_t cap)
+{
+    b->buf = buf;
+    b->cap = cap;
+    b->len = 0;
+    b->depth = 0;
+}
+
+void nal_tuple_add_null(nal_tuple_builder_t *b)
+{
+    nal_tuple_put(b, NAL_TUPLE_CODE_NULL);
+    /* Inside a nested tuple a bare 0x00 is the terminator. */
+    if (b->depth > 0) {
+        nal_tuple_put(b, NAL_TUPLE_ESCAPE);
+    }
+}
+
+void nal_tuple_add_bool(nal_tuple_builder_t *b, int v)
+{
+    nal_tuple_put(b, v ? NAL_TUPLE_CODE_TRUE : NAL_TUPLE_CODE_FALSE);
+}
+
+static void nal_tuple_put_escaped(nal_tuple_builder_t *b, const void *data,
+                                  size_t len)
+{
+    const unsigned char *p = data;
+    for (size_t i = 0; i < len; i++) {
+        nal_tuple_put(b, p[i]);
+        if (p[i] == 0x00) {
+            nal_tuple_put(b, NAL_TUPLE_ESCAPE);
+        }
+    }
+}
+
+void nal_tuple_add_bytes(nal_tuple_builder_t *b, const void *data, size_t len)
+{
+    nal_tuple_put(b, NAL_TUPLE_CODE_BYTES);
+    nal_tuple_put_escaped(b, data, len);
+    nal_tuple_put(b, 0x00);
+}
+
+void nal_tuple_add_bytes_prefix(nal_tuple_builder_t *b, const void *data,
+                                size_t len)
+{
+    nal_tuple_put(b, NAL_TUPLE_CODE_BYTES);
+    nal_tuple_put_escaped(b, data, len);
+}
+
+/* Integers use a length-prefixed big-endian magnitude: 0x14 is zero,
+ * 0x14 + n a positive number of n bytes and 0x14 - n a negative one stored
+ * as the one's complement, so both longer and larger sort further out. */
+void nal_tuple_add_uint(nal_tuple_builder_t *b, uint64_t v)
+{
+    int n = nal_tuple_byte_len(v);
+    nal_tuple_put(b, (unsigned char)(NAL_TUPLE_CODE_INT_ZERO + n));
+    nal_tuple_put_be(b, v, n);
+}
+
+void nal_tuple_add_int(nal_tuple_builder_t *b, int64_t v)
+{
+    if (v >= 0) {
+        nal_tuple_add_uint(b, (uint64_t)v);
+        return;
+    }
+    uint64_t mag = ~(uint64_t)v + 1;
+    int n = nal_tuple_byte_len(mag);
+    nal_tuple_put(b, (unsigned char)(NAL_TUPLE_CODE_INT_ZERO - n));
+    nal_tuple_put_be(b, ~mag, n);
+}
+
+void nal_tuple_add_double(nal_tuple_builder_t *b, double v)
+{
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    /* Negative numbers flip entirely so that larger magnitudes sort lower,
+     * positive ones only flip the sign bit to sort above them. */
+    bits = (bits >> 63) ? ~bits : bits ^ ((uint64_t)1 << 63);
+    nal_tuple_put(b, NAL_TUPLE_CODE_DOUBLE);
+    nal_tuple_put_be(b, bits, 8);
+}
+
+void nal_tuple_begin_nested(nal_tuple_builder_t *b)
+{
+    nal_tuple_put(b, NAL_TUPLE_CODE_NESTED);
+    b->depth++;
+}
+
+void nal_tuple_end_nested(nal_tuple_builder_t *b)
+{
+    nal_tuple_put(b, 0x00);
+    if (b->depth > 0) {
+        b->depth--;
+    }
+}
+
+void nal_tuple_reader_init(nal_tuple_reader_t *r, const void *data,
+                           size_t len)
+{
+    r->p = data;
+    r->end = r->p + len;
+    r->depth = 0;
+}
+
+static uint64_t nal_tuple_get_be(const unsigned char *p, int n)
+{
+    uint64_t v = 0;
+    for (int i = 0; i < n; i++) {
+        v = (v << 8) | p[i];
+    }
+    return v;
+}
+
+static int nal_tuple_next_bytes(nal_tuple_reader_t *r, nal_tuple_item_t *item)
+{
+    const unsigned char *p = r->p;
+    size_t len = 0;
+    for (;;) {
+        if (p == r->end) {
+            return MDB_CORRUPTED;
+        }
+        if (*p == 0x00) {
+            if (p + 1 < r->end && p[1] == NAL_TUPLE_ESCAPE) {
+                p += 2;
+                len++;
+                continue;
+            }
+            break;
+        }
+        p++;
+        len++;
+    }
+    item->type = NAL_TUPLE_TYPE_BYTES;
+    item->raw = (const char *)r->p;
+    item->raw_len = (size_t)(p - r->p);
+    item->len = len;
+    r->p = p + 1;
+    return 0;
+}
+
+static int nal_tuple_next_int(nal_tuple_reader_t *r, nal_tuple_item_t *item,
+                              int code)
+{
+    int n = code - NAL_TUPLE_CODE_INT_ZERO;
+    int neg = n < 0;
+    if (neg) {
+        n = -n;
+    }
+    if (r->end - r->p < n) {
+        return MDB_CORRUPTED;
+    }
+    uint64_t v = nal_tuple_get_be(r->p, n);
+    r->p += n;
+
+    if (!neg) {
+        item->u = v;
+        item->type = v > INT64_MAX ? NAL_TUPLE_TYPE_UINT : NAL_TUPLE_TYPE_INT;
+        item->i = (int64_t)v;
+        return 0;
+    }
+    uint64_t mask = n == 8 ? UINT64_MAX : ((uint64_t)1 << (8 * n)) - 1;
+    uint64_t mag = ~v & mask;
+    if (mag > (uint64_t)INT64_MAX + 1) {
+        return MDB_CORRUPTED;
+    }
+    item->type = NAL_TUPLE_TYPE_INT;
+    item->i = (int64_t)(~mag + 1);
+    item->u = (uint64_t)item->i;
+    return 0;
+}
+
+int nal_tuple_next(nal_tuple_reader_t *r, nal_tuple_item_t *item)
+{
+    if (r->p == r->end) {
+        return r->depth == 0 ? MDB_NOTFOUND : MDB_CORRUPTED;
+    }
+    int code = *r->p++;
+
+    if (code == NAL_TUPLE_CODE_NULL) {
+        if (r->depth == 0) {
+            item->type = NAL_TUPLE_TYPE_NULL;
+        } else if (r->p < r->end && *r->p == NAL_TUPLE_ESCAPE) {
+            r->p++;
+            item->type = NAL_TUPLE_TYPE_NULL;
+        } else {
+            r->depth--;
+            item->type = NAL_TUPLE_TYPE_NESTED_END;
+        }
+        return 0;
+    }
+    if (code == NAL_TUPLE_CODE_BYTES) {
+        return nal_tuple_next_bytes(r, item);
+    }
+    if (code == NAL_TUPLE_CODE_NESTED) {
+        r->depth++;
+        item->type = NAL_TUPLE_TYPE_NESTED_BEGIN;
+        return 0;
+    }
+    if (code >= NAL_TUPLE_CODE_INT_ZERO - 8 &&
+        code <= NAL_TUPLE_CODE_INT_ZERO + 8) {
+        return nal_tuple_next_int(r, item, code);
+    }
+    if (code == NAL_TUPLE_CODE_DOUBLE) {
+        if (r->end - r->p < 8) {
+            return MDB_CORRUPTED;
+        }
+        uint64_t bits = nal_tuple_get_be(r->p, 8);
+        r->p += 8;
+        bits = (bits >> 63) ? bits ^ ((uint64_t)1 << 63) : ~bits;
+        memcpy(&item->d, &bits, sizeof(bits));
+        item->type = NAL_TUPLE_TYPE_DOUBLE;
+        return 0;
+    }
+    if (code == NAL_TUPLE_CODE_FALSE || code == NAL_TUPLE_CODE_TRUE) {
+        item->type = NAL_TUPLE_TYPE_BOOL;
+        item->i = code == NAL_TUPLE_CODE_TRUE;
+        return 0;
+    }
+    return MDB_CORRUPTED;
+}
+
+size_t nal_tuple_unescape(const char *raw, size_t raw_len, void *dst)
+{
+    const unsigned char *p = (const unsigned char *)raw;
+    unsigned char *out = dst;
+    size_t n = 0;
+    for (size_t i = 0; i < raw_len; i++) {
+        out[n++] = p[i];
+        if (p[i] == 0x00) {
+            i++; /* skip the escape byte */
+        }
+    }
+    return n;
+}
+
+size_t nal_tuple_range_end(const void *prefix, size_t len, void *dst)
+{
+    const unsigned char *p = prefix;
+    while (len > 0 && p[len - 1] == 0xff) {
+        len--;
+    }
+    if (len == 0) {
+        return 0;
+    }
+    memcpy(dst, p, len);
+    ((unsigned char *)dst)[len - 1]++;
+    return len;
+}
@@ -0,0 +1,81 @@
+#ifndef NAL_TUPLE_H
+#define NAL_TUPLE_H
+
+#include "nal_lmdb.h"
+
+/* Order-preserving encoding of tuples for composite keys: memcmp order of
+ * packed tuples is element-wise order of the tuples, and a packed prefix is a
+ * byte prefix of every tuple that extends it. Elements sort by type first,
+ * in the order null, bytes, nested, integer, double, false, true. Integers
+ * (signed and unsigned) share one type and sort numerically. Integers and
+ * doubles do not compare by value: any integer sorts before any double, so
+ * a field that mixes them must be written as a double every time. */
+#define NAL_TUPLE_TYPE_NULL 0
+#define NAL_TUPLE_TYPE_BYTES 1
+#define NAL_TUPLE_TYPE_INT 2
+#define NAL_TUPLE_TYPE_UINT 3 /* integer above INT64_MAX */
+#define NAL_TUPLE_TYPE_DOUBLE 4
+#define NAL_TUPLE_TYPE_BOOL 5
+#define NAL_TUPLE_TYPE_NESTED_BEGIN 6
+#define NAL_TUPLE_TYPE_NESTED_END 7
+
+/* Builders write into a caller buffer. len keeps counting past cap, so a
+ * result with len > cap means the buffer was too small and nothing but len
+ * is usable. */
+typedef struct nal_tuple_builder_s {
+    unsigned char *buf;
+    size_t cap;
+    size_t len;
+    unsigned int depth;
+} nal_tuple_builder_t;
+
+typedef struct nal_tuple_reader_s {
+    const unsigned char *p;
+    const unsigned char *end;
+    unsigned int depth;
+} nal_tuple_reader_t;
+
+/* For NAL_TUPLE_TYPE_BYTES, raw points at the escaped bytes and len is the
+ * length after nal_tuple_unescape; raw_len == len means there is nothing to
+ * unescape. */
+typedef struct nal_tuple_item_s {
+    int type;
+    int64_t i;
+    uint64_t u;
+    double d;
+    const char *raw;
+    size_t raw_len;
+    size_t len;
+} nal_tuple_item_t;
+
+void nal_tuple_init(nal_tuple_builder_t *b, void *buf, size_t cap);
+void nal_tuple_add_null(nal_tuple_builder_t *b);
+void nal_tuple_add_bool(nal_tuple_builder_t *b, int v);
+void nal_tuple_add_bytes(nal_tuple_builder_t *b, const void *data, size_t len);
+void nal_tuple_add_int(nal_tuple_builder_t *b, int64_t v);
+void nal_tuple_add_uint(nal_tuple_builder_t *b, uint64_t v);
+void nal_tuple_add_double(nal_tuple_builder_t *b, double v);
+void nal_tuple_begin_nested(nal_tuple_builder_t *b);
+void nal_tuple_end_nested(nal_tuple_builder_t *b);
+
+/* Adds an unterminated bytes element, for a range over all tuples whose
+ * element at this position starts with data. It must be the last element. */
+void nal_tuple_add_bytes_prefix(nal_tuple_builder_t *b, const void *data,
+                                size_t len);
+
+/* Returns 0 with the next element in item, MDB_NOTFOUND at the end or
+ * MDB_CORRUPTED if data is not a packed tuple. */
+void nal_tuple_reader_init(nal_tuple_reader_t *r, const void *data,
+                           size_t len);
+int nal_tuple_next(nal_tuple_reader_t *r, nal_tuple_item_t *item);
+size_t nal_tuple_unescape(const char *raw, size_t raw_len, void *dst);
+
+/* Writes the smallest key greater than every key starting with prefix to dst
+ * (at most len bytes) and returns its length. [prefix, dst) is then exactly
+ * the keys starting with prefix. Returns 0 if there is no such key, i.e. the
+ * range is unbounded above. Meant for nal_tuple_add_bytes_prefix: a complete
+ * tuple ending in bytes is also a byte prefix of the tuple whose bytes go on
+ * with a NUL, so the tuples extending it end at the tuple plus 0xff. */
+size_t nal_tuple_range_end(const void *prefix, size_t len, void *dst);
+
+#endif
@@ -0,0 +1,158 @@
+#include "nal_txn_stats.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+
+#include "nal_lmdb_internal.h"
+#include "nal_log.h"
+
+#define NAL_TXN_UNTAGGED "untagged"
+#define NAL_TXN_OTHER "other"
+
+typedef struct {
+    uint64_t start_ns;  /* nal_txn_begin called */
+    uint64_t locked_ns; /* write lock acquired */
+    uint64_t commit_ns; /* nal_txn_commit called */
+    size_t last_pgno;
+    int active;
+} nal_txn_timing_t;
+
+static __thread char txn_tag[NAL_TXN_TAG_MAX] = NAL_TXN_UNTAGGED;
+static __thread nal_txn_timing_t txn_timing;
+
+static pthread_mutex_t stats_mutex = PTHREAD_MUTEX_INITIALIZER;
+static nal_txn_stats_t stats[NAL_TXN_STATS_MAX_TAGS];
+static size_t stats_len;
+static uint64_t slow_threshold_ns;
+
+uint64_t nal_txn_stats_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+void nal_txn_set_tag(const char *tag)
+{
+    if (tag == NULL) {
+        tag = NAL_TXN_UNTAGGED;
+    }
+    strncpy(txn_tag, tag, NAL_TXN_TAG_MAX - 1);
+    txn_tag[NAL_TXN_TAG_MAX - 1] = '\0';
+}
+
+void nal_txn_set_slow_threshold(uint64_t hold_us)
+{
+    __atomic_store_n(&slow_threshold_ns, hold_us * 1000, __ATOMIC_RELAXED);
+}
+
+static size_t nal_txn_last_pgno(void)
+{
+    MDB_envinfo info;
+    if (mdb_env_info(nal_env_handle(), &info) != 0) {
+        return 0;
+    }
+    return info.me_last_pgno;
+}
+
+void nal_txn_stats_begin(uint64_t start_ns)
+{
+    txn_timing.start_ns = start_ns;
+    txn_timing.locked_ns = nal_txn_stats_now();
+    txn_timing.commit_ns = 0;
+    txn_timing.last_pgno = nal_txn_last_pgno();
+    txn_timing.active = 1;
+}
+
+void nal_txn_stats_commit(void)
+{
+    txn_timing.commit_ns = nal_txn_stats_now();
+}
+
+/* Called with stats_mutex held. The last slot collects the tags that do not
+ * fit. */
+static nal_txn_stats_t *nal_txn_stats_slot(const char *tag)
+{
+    for (size_t i = 0; i < stats_len; i++) {
+        if (strcmp(stats[i].tag, tag) == 0) {
+            return &stats[i];
+        }
+    }
+    if (stats_len == NAL_TXN_STATS_MAX_TAGS) {
+        return &stats[NAL_TXN_STATS_MAX_TAGS - 1];
+    }
+    if (stats_len == NAL_TXN_STATS_MAX_TAGS - 1) {
+        tag = NAL_TXN_OTHER;
+    }
+    nal_txn_stats_t *s = &stats[stats_len++];
+    memset(s, 0, sizeof(*s));
+    strcpy(s->tag, tag);
+    return s;
+}
+
+static void nal_txn_stats_max(uint64_t *max, uint64_t v)
+{
+    if (v > *max) {
+        *max = v;
+    }
+}
+
+void nal_txn_stats_end(int committed)
+{
+    if (!txn_timing.active) {
+        return;
+    }
+    txn_timing.active = 0;
+
+    uint64_t end_ns = nal_txn_stats_now();
+    uint64_t wait = txn_timing.locked_ns - txn_timing.start_ns;
+    uint64_t hold = end_ns - txn_timing.locked_ns;
+    uint64_t commit = committed ? end_ns - txn_timing.commit_ns : 0;
+    size_t last_pgno = committed ? nal_txn_last_pgno() : 0;
+    uint64_t new_pages = last_pgno > txn_timing.last_pgno
+                             ? last_pgno - txn_timing.last_pgno
+                             : 0;
+
+    pthread_mutex_lock(&stats_mutex);
+    nal_txn_stats_t *s = nal_txn_stats_slot(txn_tag);
+    if (committed) {
+        s->committed++;
+    } else {
+        s->aborted++;
+    }
+    s->lock_wait_ns += wait;
+    nal_txn_stats_max(&s->lock_wait_max_ns, wait);
+    s->hold_ns += hold;
+    nal_txn_stats_max(&s->hold_max_ns, hold);
+    s->commit_ns += commit;
+    nal_txn_stats_max(&s->commit_max_ns, commit);
+    s->new_pages += new_pages;
+    pthread_mutex_unlock(&stats_mutex);
+
+    uint64_t threshold = __atomic_load_n(&slow_threshold_ns, __ATOMIC_RELAXED);
+    if (threshold > 0 && hold > threshold) {
+        nal_log_warning("slow write txn: tag=%s %s lock_wait=%" PRIu64
+                        "us hold=%" PRIu64 "us commit=%" PRIu64
+                        "us new_pages=%" PRIu64,
+                        txn_tag, committed ? "committed" : "aborted",
+                        wait / 1000, hold / 1000, commit / 1000, new_pages);
+    }
+}
+
+size_t nal_txn_stats_get(nal_txn_stats_t *out, size_t max)
+{
+    pthread_mutex_lock(&stats_mutex);
+    size_t n = stats_len < max ? stats_len : max;
+    memcpy(out, stats, n * sizeof(*out));
+    pthread_mutex_unlock(&stats_mutex);
+    return n;
+}
+
+void nal_txn_stats_reset(void)
+{
+    pthread_mutex_lock(&stats_mutex);
+    stats_len = 0;
+    pthread_mutex_unlock(&stats_mutex);
+}
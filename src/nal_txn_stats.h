@@ -0,0 +1,47 @@
+#ifndef NAL_TXN_STATS_H
+#define NAL_TXN_STATS_H
+
+#include "nal_lmdb.h"
+
+/* Per-tag accounting of top-level write txns in this process: how long
+ * nal_txn_begin waited for the write lock, how long the lock was held until
+ * commit or abort returned, and how long the commit itself took, including
+ * page writes and fsync. new_pages counts pages appended to the map, a lower
+ * bound of the pages written since reused free pages are not visible from
+ * outside LMDB. Times are in nanoseconds. */
+#define NAL_TXN_TAG_MAX 32
+#define NAL_TXN_STATS_MAX_TAGS 64
+
+typedef struct nal_txn_stats_s {
+    char tag[NAL_TXN_TAG_MAX];
+    uint64_t committed;
+    uint64_t aborted;
+    uint64_t lock_wait_ns;
+    uint64_t lock_wait_max_ns;
+    uint64_t hold_ns;
+    uint64_t hold_max_ns;
+    uint64_t commit_ns;
+    uint64_t commit_max_ns;
+    uint64_t new_pages;
+} nal_txn_stats_t;
+
+/* Attributes the following write txns of the calling thread to tag, which
+ * is copied and truncated to NAL_TXN_TAG_MAX - 1 bytes. NULL resets it to
+ * "untagged". Tags beyond NAL_TXN_STATS_MAX_TAGS are counted as "other". */
+void nal_txn_set_tag(const char *tag);
+
+/* Logs a warning for each write txn holding the lock longer than hold_us
+ * microseconds. 0, the default, turns it off. */
+void nal_txn_set_slow_threshold(uint64_t hold_us);
+
+/* Copies up to max tag entries to stats and returns their number. */
+size_t nal_txn_stats_get(nal_txn_stats_t *stats, size_t max);
+void nal_txn_stats_reset(void);
+
+/* Used by nal_lmdb.c. */
+uint64_t nal_txn_stats_now(void);
+void nal_txn_stats_begin(uint64_t start_ns);
+void nal_txn_stats_commit(void);
+void nal_txn_stats_end(int committed);
+
+#endif
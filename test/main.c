@@ -0,0 +1,928 @@
+#include <dirent.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "unity/unity.h"
+
+#include "nal_blob.h"
+#include "nal_bloom.h"
+#include "nal_cache.h"
+#include "nal_changelog.h"
+#include "nal_dedup.h"
+#include "nal_filter.h"
+#include "nal_lmdb.h"
+#include "nal_phf.h"
+#include "nal_pscan.h"
+#include "nal_scan.h"
+#include "nal_tuple.h"
+
+#define TEST_DB_DIR "/tmp/test_lmdb"
+#define TEST_FOLLOWER_DIR "/tmp/test_lmdb_follower"
+#define TEST_PHF_PATH TEST_DB_DIR "/test.phf"
+#define TEST_MAP_SIZE (64UL * 1024 * 1024)
+
+void setUp(void)
+{
+}
+
+void tearDown(void)
+{
+}
+
+/* Removes the files of an env directory left by an earlier run. */
+static void test_clear_dir(const char *path)
+{
+    mkdir(path, 0755);
+    DIR *dir = opendir(path);
+    if (dir == NULL) {
+        return;
+    }
+    struct dirent *ent;
+    char file[512];
+    while ((ent = readdir(dir)) != NULL) {
+        if (ent->d_name[0] == '.') {
+            continue;
+        }
+        snprintf(file, sizeof(file), "%s/%s", path, ent->d_name);
+        unlink(file);
+    }
+    closedir(dir);
+}
+
+static MDB_val test_val(const char *s)
+{
+    MDB_val val = {strlen(s), (void *)s};
+    return val;
+}
+
+static MDB_dbi test_dbi_open(const char *name, unsigned int flags)
+{
+    nal_txn_ptr txn;
+    MDB_dbi dbi;
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_begin(NULL, &txn));
+    TEST_ASSERT_EQUAL_INT(0, nal_dbi_open(txn, name, &dbi));
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_commit(txn));
+    if (flags != 0) {
+        TEST_ASSERT_EQUAL_INT(0, nal_dbi_set_flags(dbi, flags));
+    }
+    return dbi;
+}
+
+static void test_put(MDB_dbi dbi, const char *key, const char *value)
+{
+    nal_txn_ptr txn;
+    MDB_val k = test_val(key);
+    MDB_val v = test_val(value);
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_begin(NULL, &txn));
+    TEST_ASSERT_EQUAL_INT(0, nal_put(txn, dbi, &k, &v));
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_commit(txn));
+}
+
+static void test_del(MDB_dbi dbi, const char *key)
+{
+    nal_txn_ptr txn;
+    MDB_val k = test_val(key);
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_begin(NULL, &txn));
+    TEST_ASSERT_EQUAL_INT(0, nal_del(txn, dbi, &k));
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_commit(txn));
+}
+
+/* Checks that key holds value, or is missing if value is NULL. */
+static void test_expect(MDB_dbi dbi, const char *key, const char *value)
+{
+    nal_txn_ptr txn;
+    MDB_val k = test_val(key);
+    MDB_val v;
+    TEST_ASSERT_EQUAL_INT(0, nal_readonly_txn_begin(NULL, &txn));
+    int rc = nal_get(txn, dbi, &k, &v);
+    if (value == NULL) {
+        TEST_ASSERT_EQUAL_INT(MDB_NOTFOUND, rc);
+    } else {
+        TEST_ASSERT_EQUAL_INT(0, rc);
+        TEST_ASSERT_EQUAL_size_t(strlen(value), v.mv_size);
+        TEST_ASSERT_EQUAL_MEMORY(value, v.mv_data, v.mv_size);
+    }
+    nal_txn_abort(txn);
+}
+
+static void test_versioned_no_aba(void)
+{
+    MDB_dbi dbi = test_dbi_open("versioned", NAL_DBI_VERSIONED);
+    nal_txn_ptr txn;
+    MDB_val k = test_val("k");
+    MDB_val v = test_val("v");
+    uint64_t first, second, third, version;
+
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_begin(NULL, &txn));
+    TEST_ASSERT_EQUAL_INT(0, nal_put_if_absent(txn, dbi, &k, &v, &first));
+    TEST_ASSERT_EQUAL_INT(0, nal_put_if_version(txn, dbi, &k, &v, first,
+                                                &second));
+    TEST_ASSERT_TRUE(second > first);
+    TEST_ASSERT_EQUAL_INT(0, nal_del_if_version(txn, dbi, &k, second,
+                                                &version));
+    TEST_ASSERT_EQUAL_UINT64(0, version);
+
+    /* Written again after the delete, the key must not get back a version
+     * that a stale writer could still be holding. */
+    TEST_ASSERT_EQUAL_INT(0, nal_put_if_absent(txn, dbi, &k, &v, &third));
+    TEST_ASSERT_TRUE(third > second);
+    TEST_ASSERT_EQUAL_INT(NAL_VERSION_CONFLICT,
+                          nal_put_if_version(txn, dbi, &k, &v, first,
+                                             &version));
+    TEST_ASSERT_EQUAL_UINT64(third, version);
+    TEST_ASSERT_EQUAL_INT(NAL_VERSION_CONFLICT,
+                          nal_del_if_version(txn, dbi, &k, second, &version));
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_commit(txn));
+
+    /* The counter survives the txn, also through a plain delete. */
+    test_del(dbi, "k");
+    test_put(dbi, "k", "w");
+    MDB_val data;
+    TEST_ASSERT_EQUAL_INT(0, nal_readonly_txn_begin(NULL, &txn));
+    TEST_ASSERT_EQUAL_INT(0, nal_get_version(txn, dbi, &k, &data, &version));
+    nal_txn_abort(txn);
+    TEST_ASSERT_TRUE(version > third);
+    test_expect(dbi, "k", "w");
+}
+
+static void test_view_tied_to_txn(void)
+{
+    MDB_dbi dbi = test_dbi_open("views", 0);
+    test_put(dbi, "k", "value");
+
+    nal_txn_ptr txn;
+    nal_view_t view;
+    MDB_val k = test_val("k");
+    TEST_ASSERT_EQUAL_INT(0, nal_readonly_txn_begin(NULL, &txn));
+    TEST_ASSERT_EQUAL_INT(0, nal_view_get(txn, dbi, &k, &view));
+    TEST_ASSERT_TRUE(view.txn == txn);
+    TEST_ASSERT_EQUAL_size_t(5, view.size);
+    TEST_ASSERT_EQUAL_MEMORY("value", view.data, view.size);
+
+    nal_txn_reset(txn);
+    TEST_ASSERT_TRUE(view.txn == NULL);
+    TEST_ASSERT_EQUAL_size_t(0, view.size);
+    nal_view_release(&view);
+
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_renew(txn));
+    TEST_ASSERT_EQUAL_INT(0, nal_view_get(txn, dbi, &k, &view));
+    nal_view_release(&view);
+    TEST_ASSERT_TRUE(view.data == NULL);
+    nal_txn_abort(txn);
+}
+
+/* Reads the size and live bytes of the first blob segment. */
+static void test_blob_segment(MDB_dbi blob_dbi, uint64_t *size, uint64_t *live)
+{
+    nal_txn_ptr txn;
+    unsigned char seg_key[5] = {'s', 0, 0, 0, 1};
+    MDB_val k = {sizeof(seg_key), seg_key};
+    MDB_val v;
+    uint64_t seg[3];
+    TEST_ASSERT_EQUAL_INT(0, nal_readonly_txn_begin(NULL, &txn));
+    TEST_ASSERT_EQUAL_INT(0, nal_get(txn, blob_dbi, &k, &v));
+    TEST_ASSERT_EQUAL_size_t(sizeof(seg), v.mv_size);
+    memcpy(seg, v.mv_data, sizeof(seg));
+    nal_txn_abort(txn);
+    *size = seg[0];
+    *live = seg[1];
+}
+
+static void test_blob_live_bytes(void)
+{
+    nal_txn_ptr txn;
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_begin(NULL, &txn));
+    TEST_ASSERT_EQUAL_INT(0, nal_blob_open(txn, 0, 16));
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_commit(txn));
+    MDB_dbi dbi = test_dbi_open("blobs", NAL_DBI_BLOB);
+    MDB_dbi blob_dbi = test_dbi_open(NAL_BLOB_DBI_NAME, 0);
+
+    char big1[101], big2[101];
+    memset(big1, 'a', 100);
+    memset(big2, 'b', 100);
+    big1[100] = big2[100] = '\0';
+    uint64_t size, live, record;
+
+    test_put(dbi, "k", big1);
+    test_expect(dbi, "k", big1);
+    test_blob_segment(blob_dbi, &size, &record);
+    TEST_ASSERT_TRUE(record > 100);
+    TEST_ASSERT_EQUAL_UINT64(record, size);
+
+    /* Overwriting releases the old record, the new one is live. */
+    test_put(dbi, "k", big2);
+    test_expect(dbi, "k", big2);
+    test_blob_segment(blob_dbi, &size, &live);
+    TEST_ASSERT_EQUAL_UINT64(2 * record, size);
+    TEST_ASSERT_EQUAL_UINT64(record, live);
+
+    /* An inline value leaves nothing live in the segment. */
+    test_put(dbi, "k", "x");
+    test_expect(dbi, "k", "x");
+    test_blob_segment(blob_dbi, &size, &live);
+    TEST_ASSERT_EQUAL_UINT64(0, live);
+
+    test_put(dbi, "k", big1);
+    test_del(dbi, "k");
+    test_expect(dbi, "k", NULL);
+    test_blob_segment(blob_dbi, &size, &live);
+    TEST_ASSERT_EQUAL_UINT64(3 * record, size);
+    TEST_ASSERT_EQUAL_UINT64(0, live);
+}
+
+static void test_dedup_expect(uint64_t values, uint64_t refs)
+{
+    nal_txn_ptr txn;
+    nal_dedup_stats_t st;
+    TEST_ASSERT_EQUAL_INT(0, nal_readonly_txn_begin(NULL, &txn));
+    TEST_ASSERT_EQUAL_INT(0, nal_dedup_stats(txn, &st));
+    nal_txn_abort(txn);
+    TEST_ASSERT_EQUAL_UINT64(values, st.values);
+    TEST_ASSERT_EQUAL_UINT64(refs, st.refs);
+}
+
+static void test_dedup_refcounts(void)
+{
+    nal_txn_ptr txn;
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_begin(NULL, &txn));
+    TEST_ASSERT_EQUAL_INT(0, nal_dedup_open(txn, 0, 16));
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_commit(txn));
+    MDB_dbi dbi = test_dbi_open("dedup", NAL_DBI_DEDUP);
+
+    char a[65], b[65];
+    memset(a, 'a', 64);
+    memset(b, 'b', 64);
+    a[64] = b[64] = '\0';
+
+    test_put(dbi, "k1", a);
+    test_put(dbi, "k2", a);
+    test_dedup_expect(1, 2);
+    /* Writing the same value again keeps one reference per key. */
+    test_put(dbi, "k1", a);
+    test_dedup_expect(1, 2);
+
+    test_put(dbi, "k1", b);
+    test_expect(dbi, "k1", b);
+    test_expect(dbi, "k2", a);
+    test_dedup_expect(2, 2);
+    test_put(dbi, "k2", b);
+    test_dedup_expect(1, 2);
+
+    test_del(dbi, "k1");
+    test_expect(dbi, "k2", b);
+    test_dedup_expect(1, 1);
+    test_put(dbi, "k2", "small");
+    test_dedup_expect(0, 0);
+    test_expect(dbi, "k2", "small");
+}
+
+static void test_phf_rejects_bad_offsets(void)
+{
+    MDB_dbi dbi = test_dbi_open("phf", 0);
+    test_put(dbi, "a", "1");
+    test_put(dbi, "b", "22");
+    test_put(dbi, "c", "333");
+
+    nal_txn_ptr txn;
+    TEST_ASSERT_EQUAL_INT(0, nal_readonly_txn_begin(NULL, &txn));
+    TEST_ASSERT_EQUAL_INT(0, nal_phf_export(txn, dbi, TEST_PHF_PATH));
+    nal_txn_abort(txn);
+
+    nal_phf_t *phf;
+    MDB_val k = test_val("b");
+    MDB_val v;
+    TEST_ASSERT_EQUAL_INT(0, nal_phf_open(TEST_PHF_PATH, &phf));
+    TEST_ASSERT_EQUAL_size_t(3, nal_phf_count(phf));
+    TEST_ASSERT_EQUAL_INT(0, nal_phf_get(phf, &k, &v));
+    TEST_ASSERT_EQUAL_size_t(2, v.mv_size);
+    TEST_ASSERT_EQUAL_MEMORY("22", v.mv_data, 2);
+    nal_phf_close(phf);
+
+    /* Offsets are four u32s right before the data section; point the one of
+     * the last record past the end of the data. */
+    FILE *f = fopen(TEST_PHF_PATH, "r+b");
+    TEST_ASSERT_NOT_NULL(f);
+    TEST_ASSERT_EQUAL_INT(0, fseek(f, 0, SEEK_END));
+    long data_len = 3 * 8 + 3 + 1 + 2 + 3;
+    long offsets_end = ftell(f) - data_len;
+    uint32_t bad = 1000;
+    TEST_ASSERT_EQUAL_INT(0, fseek(f, offsets_end - 8, SEEK_SET));
+    TEST_ASSERT_EQUAL_size_t(1, fwrite(&bad, sizeof(bad), 1, f));
+    fclose(f);
+    TEST_ASSERT_EQUAL_INT(MDB_CORRUPTED, nal_phf_open(TEST_PHF_PATH, &phf));
+}
+
+/* Appends the digit of each key "kN" in the current chunk of scan to keys
+ * and returns what ended the chunk. */
+static int test_scan_chunk(nal_scan_t *scan, char *keys)
+{
+    MDB_val k, v;
+    int rc;
+    size_t n = strlen(keys);
+    while ((rc = nal_scan_next(scan, &k, &v)) == 0) {
+        TEST_ASSERT_EQUAL_size_t(2, k.mv_size);
+        keys[n++] = ((const char *)k.mv_data)[1];
+        keys[n] = '\0';
+    }
+    return rc;
+}
+
+static void test_scan_resumable(void)
+{
+    MDB_dbi dbi = test_dbi_open("scan", 0);
+    char key[3] = "k0";
+    for (char c = '0'; c <= '8'; c += 2) {
+        key[1] = c;
+        test_put(dbi, key, "v");
+    }
+
+    /* An empty start is the first key. */
+    nal_scan_t *scan;
+    MDB_val start = {0, ""};
+    char keys[16] = "";
+    TEST_ASSERT_EQUAL_INT(0, nal_scan_open(dbi, &start, NULL, NULL, 2, 0,
+                                           &scan));
+    TEST_ASSERT_EQUAL_INT(EAGAIN, test_scan_chunk(scan, keys));
+    TEST_ASSERT_EQUAL_STRING("02", keys);
+
+    /* Writes between chunks show up once they sort after the last key. */
+    test_put(dbi, "k1", "v");
+    test_put(dbi, "k3", "v");
+    TEST_ASSERT_EQUAL_INT(EAGAIN, test_scan_chunk(scan, keys));
+    TEST_ASSERT_EQUAL_STRING("0234", keys);
+
+    MDB_val token;
+    TEST_ASSERT_EQUAL_INT(0, nal_scan_token(scan, &token));
+    nal_scan_t *resumed;
+    MDB_val end = test_val("k8");
+    TEST_ASSERT_EQUAL_INT(0, nal_scan_open(dbi, NULL, &end, &token, 0, 0,
+                                           &resumed));
+    nal_scan_close(scan);
+    keys[0] = '\0';
+    TEST_ASSERT_EQUAL_INT(MDB_NOTFOUND, test_scan_chunk(resumed, keys));
+    TEST_ASSERT_EQUAL_STRING("6", keys);
+    TEST_ASSERT_EQUAL_size_t(1, nal_scan_count(resumed));
+    nal_scan_close(resumed);
+}
+
+static int test_pscan_fn(void *arg, unsigned int worker, const MDB_val *key,
+                         const MDB_val *data)
+{
+    (void)worker;
+    (void)key;
+    (void)data;
+    __atomic_add_fetch((uint64_t *)arg, 1, __ATOMIC_RELAXED);
+    return 0;
+}
+
+static void test_pscan_groups(void)
+{
+    MDB_dbi dbi = test_dbi_open("pscan", 0);
+    nal_txn_ptr txn;
+    char key[16];
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_begin(NULL, &txn));
+    for (int i = 0; i < 500; i++) {
+        snprintf(key, sizeof(key), "%c:%04d", i < 300 ? 'a' : 'b', i);
+        MDB_val k = test_val(key);
+        MDB_val v = test_val(i < 300 ? "x" : "yy");
+        TEST_ASSERT_EQUAL_INT(0, nal_put(txn, dbi, &k, &v));
+    }
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_commit(txn));
+
+    uint64_t seen = 0;
+    nal_pscan_opts_t opts;
+    nal_pscan_opts_init(&opts);
+    opts.threads = 4;
+    opts.sum = NAL_PSCAN_SUM_SIZE;
+    opts.group_delim = ':';
+    opts.fn = test_pscan_fn;
+    opts.arg = &seen;
+    nal_pscan_result_t *res;
+    TEST_ASSERT_EQUAL_INT(0, nal_pscan_run(dbi, &opts, &res));
+    TEST_ASSERT_EQUAL_UINT64(500, res->count);
+    TEST_ASSERT_EQUAL_UINT64(500, seen);
+    TEST_ASSERT_EQUAL_INT64(300 + 2 * 200, res->sum);
+    TEST_ASSERT_TRUE(res->partitions > 1);
+    TEST_ASSERT_EQUAL_size_t(2, res->num_groups);
+    TEST_ASSERT_EQUAL_MEMORY("a:", res->groups[0].key.mv_data, 2);
+    TEST_ASSERT_EQUAL_UINT64(300, res->groups[0].count);
+    TEST_ASSERT_EQUAL_MEMORY("b:", res->groups[1].key.mv_data, 2);
+    TEST_ASSERT_EQUAL_INT64(400, res->groups[1].sum);
+    nal_pscan_result_free(res);
+
+    /* A range inside the dbi. */
+    MDB_val start = test_val("a:0100");
+    MDB_val end = test_val("b:0400");
+    nal_pscan_opts_init(&opts);
+    opts.start = &start;
+    opts.end = &end;
+    opts.threads = 3;
+    TEST_ASSERT_EQUAL_INT(0, nal_pscan_run(dbi, &opts, &res));
+    TEST_ASSERT_EQUAL_UINT64(300, res->count);
+    TEST_ASSERT_EQUAL_size_t(0, res->num_groups);
+    nal_pscan_result_free(res);
+
+    /* An empty start is the first key. */
+    MDB_val empty = {0, ""};
+    nal_pscan_opts_init(&opts);
+    opts.start = &empty;
+    opts.threads = 2;
+    TEST_ASSERT_EQUAL_INT(0, nal_pscan_run(dbi, &opts, &res));
+    TEST_ASSERT_EQUAL_UINT64(500, res->count);
+    nal_pscan_result_free(res);
+}
+
+/* Collects the keys of the entries matching filter, in the walk's order. */
+static size_t test_filter_keys(MDB_dbi dbi, const nal_filter_t *filter,
+                               char *keys, size_t size)
+{
+    nal_txn_ptr txn;
+    nal_cursor_ptr cursor;
+    MDB_val k[4];
+    MDB_val v[4];
+    size_t n;
+    size_t total = 0;
+    MDB_cursor_op op = MDB_FIRST;
+    int rc;
+    keys[0] = '\0';
+    TEST_ASSERT_EQUAL_INT(0, nal_readonly_txn_begin(NULL, &txn));
+    TEST_ASSERT_EQUAL_INT(0, nal_cursor_open(txn, dbi, &cursor));
+    while ((rc = nal_filter_batch(cursor, filter, op, NULL, k, v, 4,
+                                  &n)) == 0) {
+        for (size_t i = 0; i < n; i++) {
+            size_t len = strlen(keys);
+            snprintf(keys + len, size - len, "%s%.*s", len > 0 ? "," : "",
+                     (int)k[i].mv_size, (const char *)k[i].mv_data);
+        }
+        total += n;
+        op = MDB_NEXT;
+    }
+    TEST_ASSERT_EQUAL_INT(MDB_NOTFOUND, rc);
+    nal_cursor_close(cursor);
+    nal_txn_abort(txn);
+    return total;
+}
+
+static void test_filter_prefix_regex(void)
+{
+    MDB_dbi dbi = test_dbi_open("filter", 0);
+    test_put(dbi, "a1", "x");
+    test_put(dbi, "user:1", "x");
+    test_put(dbi, "user:12", "y");
+    test_put(dbi, "user:ab", "x");
+    test_put(dbi, "v1", "y");
+
+    nal_filter_t *filter;
+    char keys[128];
+    TEST_ASSERT_EQUAL_INT(0, nal_filter_new(&filter));
+    MDB_val prefix = test_val("user:");
+    TEST_ASSERT_EQUAL_INT(0, nal_filter_key_prefix(filter, &prefix));
+    TEST_ASSERT_EQUAL_size_t(3, test_filter_keys(dbi, filter, keys,
+                                                 sizeof(keys)));
+    TEST_ASSERT_EQUAL_STRING("user:1,user:12,user:ab", keys);
+
+    TEST_ASSERT_EQUAL_INT(0, nal_filter_key_regex(filter, "^user:[0-9]+$",
+                                                  0));
+    MDB_val y = test_val("y");
+    TEST_ASSERT_EQUAL_INT(0, nal_filter_add_bytes(filter, NAL_FILTER_VALUE, 0,
+                                                  NAL_FILTER_EQ, &y));
+    TEST_ASSERT_EQUAL_size_t(1, test_filter_keys(dbi, filter, keys,
+                                                 sizeof(keys)));
+    TEST_ASSERT_EQUAL_STRING("user:12", keys);
+
+    /* An empty prefix removes it, so the walk covers the whole dbi. */
+    MDB_val empty = {0, ""};
+    TEST_ASSERT_EQUAL_INT(0, nal_filter_key_prefix(filter, &empty));
+    TEST_ASSERT_EQUAL_INT(0, nal_filter_key_regex(filter, "1", 0));
+    TEST_ASSERT_EQUAL_size_t(2, test_filter_keys(dbi, filter, keys,
+                                                 sizeof(keys)));
+    TEST_ASSERT_EQUAL_STRING("user:12,v1", keys);
+    TEST_ASSERT_EQUAL_INT(EINVAL, nal_filter_key_regex(filter, "(", 0));
+    nal_filter_free(filter);
+}
+
+static void test_generation_bump(void)
+{
+    MDB_dbi dbi = test_dbi_open("gen", 0);
+    MDB_dbi other = test_dbi_open("gen_other", 0);
+    TEST_ASSERT_NOT_NULL(nal_generation_ptr(dbi));
+    uint64_t gen = nal_generation(dbi);
+    uint64_t other_gen = nal_generation(other);
+
+    /* One bump per committed txn, however many writes it holds. */
+    nal_txn_ptr txn;
+    MDB_val k = test_val("k");
+    MDB_val v = test_val("v");
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_begin(NULL, &txn));
+    TEST_ASSERT_EQUAL_INT(0, nal_put(txn, dbi, &k, &v));
+    TEST_ASSERT_EQUAL_INT(0, nal_put(txn, dbi, &v, &k));
+    TEST_ASSERT_EQUAL_UINT64(gen, nal_generation(dbi));
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_commit(txn));
+    TEST_ASSERT_EQUAL_UINT64(gen + 1, nal_generation(dbi));
+    TEST_ASSERT_EQUAL_UINT64(other_gen, nal_generation(other));
+
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_begin(NULL, &txn));
+    TEST_ASSERT_EQUAL_INT(0, nal_del(txn, dbi, &k));
+    nal_txn_abort(txn);
+    TEST_ASSERT_EQUAL_UINT64(gen + 1, nal_generation(dbi));
+
+    uint64_t current;
+    TEST_ASSERT_EQUAL_INT(0, nal_generation_wait(dbi, gen, 0, &current));
+    TEST_ASSERT_EQUAL_UINT64(gen + 1, current);
+    TEST_ASSERT_EQUAL_INT(ETIMEDOUT,
+                          nal_generation_wait(dbi, gen + 1, 10, &current));
+}
+
+/* Merges operand into key with op in a txn of its own; *out gets the result
+ * for the integer ops. */
+static void test_merge_int(MDB_dbi dbi, const char *key, int op,
+                           int64_t operand, int64_t *out)
+{
+    nal_txn_ptr txn;
+    MDB_val k = test_val(key);
+    MDB_val arg = {sizeof(operand), &operand};
+    MDB_val result;
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_begin(NULL, &txn));
+    TEST_ASSERT_EQUAL_INT(0, nal_merge(txn, dbi, &k, op, &arg, 0, &result));
+    TEST_ASSERT_EQUAL_size_t(sizeof(*out), result.mv_size);
+    memcpy(out, result.mv_data, sizeof(*out));
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_commit(txn));
+}
+
+static void test_merge_ops(void)
+{
+    MDB_dbi dbi = test_dbi_open("merge", 0);
+    int64_t n;
+
+    /* A missing counter starts at the operand, as txn:incr relies on. */
+    test_merge_int(dbi, "count", NAL_MERGE_ADD, 5, &n);
+    TEST_ASSERT_EQUAL_INT64(5, n);
+    test_merge_int(dbi, "count", NAL_MERGE_ADD, -7, &n);
+    TEST_ASSERT_EQUAL_INT64(-2, n);
+    test_merge_int(dbi, "count", NAL_MERGE_MAX, 3, &n);
+    TEST_ASSERT_EQUAL_INT64(3, n);
+    test_merge_int(dbi, "count", NAL_MERGE_MIN, 1, &n);
+    TEST_ASSERT_EQUAL_INT64(1, n);
+
+    nal_txn_ptr txn;
+    MDB_val k = test_val("log");
+    MDB_val result;
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_begin(NULL, &txn));
+    MDB_val arg = test_val("abc");
+    TEST_ASSERT_EQUAL_INT(0, nal_merge(txn, dbi, &k, NAL_MERGE_APPEND, &arg,
+                                       4, &result));
+    arg = test_val("def");
+    TEST_ASSERT_EQUAL_INT(0, nal_merge(txn, dbi, &k, NAL_MERGE_APPEND, &arg,
+                                       4, &result));
+    TEST_ASSERT_EQUAL_size_t(4, result.mv_size);
+    TEST_ASSERT_EQUAL_MEMORY("cdef", result.mv_data, 4);
+
+    MDB_val bits_key = test_val("bits");
+    unsigned char a[2] = {0x01, 0x80};
+    unsigned char b[1] = {0x02};
+    arg.mv_size = sizeof(a);
+    arg.mv_data = a;
+    TEST_ASSERT_EQUAL_INT(0, nal_merge(txn, dbi, &bits_key, NAL_MERGE_OR, &arg,
+                                       0, &result));
+    arg.mv_size = sizeof(b);
+    arg.mv_data = b;
+    TEST_ASSERT_EQUAL_INT(0, nal_merge(txn, dbi, &bits_key, NAL_MERGE_OR, &arg,
+                                       0, &result));
+    unsigned char expect[2] = {0x03, 0x80};
+    TEST_ASSERT_EQUAL_size_t(2, result.mv_size);
+    TEST_ASSERT_EQUAL_MEMORY(expect, result.mv_data, 2);
+
+    /* Integer ops need 8-byte values on both sides. */
+    k = test_val("log");
+    int64_t one = 1;
+    arg.mv_size = sizeof(one);
+    arg.mv_data = &one;
+    TEST_ASSERT_EQUAL_INT(MDB_BAD_VALSIZE,
+                          nal_merge(txn, dbi, &k, NAL_MERGE_ADD, &arg, 0,
+                                    &result));
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_commit(txn));
+}
+
+/* txn:savepoint is a nested txn: aborting it drops only its own writes. */
+static void test_savepoint_rollback(void)
+{
+    MDB_dbi dbi = test_dbi_open("savepoint", 0);
+    uint64_t gen = nal_generation(dbi);
+    nal_txn_ptr txn, sub;
+    MDB_val k1 = test_val("k1");
+    MDB_val k2 = test_val("k2");
+    MDB_val k3 = test_val("k3");
+    MDB_val v = test_val("v");
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_begin(NULL, &txn));
+    TEST_ASSERT_EQUAL_INT(0, nal_put(txn, dbi, &k1, &v));
+
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_begin(txn, &sub));
+    TEST_ASSERT_EQUAL_INT(0, nal_put(sub, dbi, &k2, &v));
+    TEST_ASSERT_EQUAL_INT(0, nal_del(sub, dbi, &k1));
+    nal_txn_abort(sub);
+
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_begin(txn, &sub));
+    TEST_ASSERT_EQUAL_INT(0, nal_put(sub, dbi, &k3, &v));
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_commit(sub));
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_commit(txn));
+
+    test_expect(dbi, "k1", "v");
+    test_expect(dbi, "k2", NULL);
+    test_expect(dbi, "k3", "v");
+    TEST_ASSERT_EQUAL_UINT64(gen + 1, nal_generation(dbi));
+}
+
+#define TEST_TUPLES 17
+#define TEST_TUPLE_CAP 32
+
+static int test_tuple_cmp(const nal_tuple_builder_t *a,
+                          const nal_tuple_builder_t *b)
+{
+    size_t n = a->len < b->len ? a->len : b->len;
+    int c = memcmp(a->buf, b->buf, n);
+    return c != 0 ? c : (a->len > b->len) - (a->len < b->len);
+}
+
+static void test_tuple_order(void)
+{
+    static unsigned char bufs[TEST_TUPLES][TEST_TUPLE_CAP];
+    nal_tuple_builder_t t[TEST_TUPLES];
+    for (int i = 0; i < TEST_TUPLES; i++) {
+        nal_tuple_init(&t[i], bufs[i], TEST_TUPLE_CAP);
+    }
+
+    /* By type first: null, bytes, nested, integer, double, false, true. */
+    nal_tuple_add_null(&t[0]);
+    nal_tuple_add_bytes(&t[1], "", 0);
+    nal_tuple_add_bytes(&t[2], "a", 1);
+    nal_tuple_add_bytes(&t[3], "a", 1);
+    nal_tuple_add_int(&t[3], 1);
+    nal_tuple_add_bytes(&t[4], "a\0", 2);
+    nal_tuple_add_bytes(&t[5], "b", 1);
+    nal_tuple_begin_nested(&t[6]);
+    nal_tuple_add_null(&t[6]);
+    nal_tuple_end_nested(&t[6]);
+    nal_tuple_begin_nested(&t[7]);
+    nal_tuple_add_int(&t[7], 1);
+    nal_tuple_end_nested(&t[7]);
+    nal_tuple_begin_nested(&t[8]);
+    nal_tuple_add_int(&t[8], 1);
+    nal_tuple_add_int(&t[8], 2);
+    nal_tuple_end_nested(&t[8]);
+    nal_tuple_add_int(&t[9], -300);
+    nal_tuple_add_int(&t[10], -5);
+    nal_tuple_add_int(&t[11], 100);
+    nal_tuple_add_uint(&t[12], UINT64_MAX);
+    /* Every integer sorts before every double. */
+    nal_tuple_add_double(&t[13], -1.5);
+    nal_tuple_add_double(&t[14], 1.5);
+    nal_tuple_add_bool(&t[15], 0);
+    nal_tuple_add_bool(&t[16], 1);
+    for (int i = 0; i < TEST_TUPLES; i++) {
+        TEST_ASSERT_TRUE(t[i].len <= t[i].cap);
+        if (i > 0) {
+            TEST_ASSERT_TRUE(test_tuple_cmp(&t[i - 1], &t[i]) < 0);
+        }
+    }
+
+    /* ("a", 1) lies below ("a") plus 0xff, the end tuple_range uses, and
+     * ("a\0") above it. */
+    unsigned char end_buf[TEST_TUPLE_CAP];
+    memcpy(end_buf, t[2].buf, t[2].len);
+    end_buf[t[2].len] = 0xff;
+    nal_tuple_builder_t end = {end_buf, sizeof(end_buf), t[2].len + 1, 0};
+    TEST_ASSERT_TRUE(test_tuple_cmp(&t[3], &end) < 0);
+    TEST_ASSERT_TRUE(test_tuple_cmp(&t[4], &end) > 0);
+
+    nal_tuple_reader_t r;
+    nal_tuple_item_t item;
+    char bytes[2];
+    nal_tuple_reader_init(&r, t[4].buf, t[4].len);
+    TEST_ASSERT_EQUAL_INT(0, nal_tuple_next(&r, &item));
+    TEST_ASSERT_EQUAL_INT(NAL_TUPLE_TYPE_BYTES, item.type);
+    TEST_ASSERT_EQUAL_size_t(2, item.len);
+    nal_tuple_unescape(item.raw, item.raw_len, bytes);
+    TEST_ASSERT_EQUAL_MEMORY("a\0", bytes, 2);
+    TEST_ASSERT_EQUAL_INT(MDB_NOTFOUND, nal_tuple_next(&r, &item));
+
+    nal_tuple_reader_init(&r, t[8].buf, t[8].len);
+    int types[] = {NAL_TUPLE_TYPE_NESTED_BEGIN, NAL_TUPLE_TYPE_INT,
+                   NAL_TUPLE_TYPE_INT, NAL_TUPLE_TYPE_NESTED_END};
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        TEST_ASSERT_EQUAL_INT(0, nal_tuple_next(&r, &item));
+        TEST_ASSERT_EQUAL_INT(types[i], item.type);
+    }
+    TEST_ASSERT_EQUAL_INT(MDB_NOTFOUND, nal_tuple_next(&r, &item));
+}
+
+static void test_bloom_miss_rebuild(void)
+{
+    MDB_dbi dbi = test_dbi_open("bloom", 0);
+    test_put(dbi, "before", "v");
+    TEST_ASSERT_EQUAL_INT(0, nal_bloom_open(dbi, 1000, 10));
+    test_expect(dbi, "before", "v");
+    test_put(dbi, "after", "v");
+    test_expect(dbi, "after", "v");
+
+    /* Deletes through a cursor count like nal_del. */
+    uint64_t added, deleted;
+    nal_txn_ptr txn;
+    nal_cursor_ptr cursor;
+    MDB_val k = test_val("after"), v;
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_begin(NULL, &txn));
+    TEST_ASSERT_EQUAL_INT(0, nal_cursor_open(txn, dbi, &cursor));
+    TEST_ASSERT_EQUAL_INT(0, nal_cursor_get(cursor, &k, &v, MDB_SET_KEY));
+    TEST_ASSERT_EQUAL_INT(0, nal_cursor_del(cursor, 0));
+    nal_cursor_close(cursor);
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_commit(txn));
+    test_del(dbi, "before");
+    TEST_ASSERT_EQUAL_INT(0, nal_bloom_stats(dbi, &added, &deleted));
+    TEST_ASSERT_EQUAL_UINT64(2, added);
+    TEST_ASSERT_EQUAL_UINT64(2, deleted);
+
+    /* Keys written behind the filter's back are misses until a rebuild. */
+    char key[16];
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_begin(NULL, &txn));
+    for (int i = 0; i < 20; i++) {
+        snprintf(key, sizeof(key), "raw%02d", i);
+        k = test_val(key);
+        v = test_val("v");
+        TEST_ASSERT_EQUAL_INT(0, mdb_put(txn, dbi, &k, &v, 0));
+    }
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_commit(txn));
+    int missed = 0;
+    TEST_ASSERT_EQUAL_INT(0, nal_readonly_txn_begin(NULL, &txn));
+    for (int i = 0; i < 20; i++) {
+        snprintf(key, sizeof(key), "raw%02d", i);
+        k = test_val(key);
+        missed += nal_get(txn, dbi, &k, &v) == MDB_NOTFOUND;
+    }
+    nal_txn_abort(txn);
+    TEST_ASSERT_TRUE(missed >= 15);
+
+    TEST_ASSERT_EQUAL_INT(0, nal_bloom_rebuild(dbi));
+    TEST_ASSERT_EQUAL_INT(0, nal_bloom_stats(dbi, &added, &deleted));
+    TEST_ASSERT_EQUAL_UINT64(20, added);
+    TEST_ASSERT_EQUAL_UINT64(0, deleted);
+    for (int i = 0; i < 20; i++) {
+        snprintf(key, sizeof(key), "raw%02d", i);
+        test_expect(dbi, key, "v");
+    }
+    test_expect(dbi, "before", NULL);
+}
+
+static void test_cache_budget(void)
+{
+    MDB_dbi dbi = test_dbi_open("cache", 0);
+    uint64_t budget = 128 * 1024;
+    TEST_ASSERT_EQUAL_INT(0, nal_cache_open(dbi, budget, NAL_CACHE_LRU, 1024));
+
+    static char value[1000];
+    memset(value, 'x', sizeof(value));
+    value[sizeof(value) - 1] = '\0';
+    char key[16];
+    nal_txn_ptr txn;
+    nal_cache_stats_t stats;
+    for (int i = 0; i < 400; i++) {
+        snprintf(key, sizeof(key), "k%04d", i);
+        test_put(dbi, key, value);
+    }
+    TEST_ASSERT_EQUAL_INT(0, nal_readonly_txn_begin(NULL, &txn));
+    TEST_ASSERT_EQUAL_INT(0, nal_cache_stats(txn, dbi, &stats));
+    nal_txn_abort(txn);
+    TEST_ASSERT_TRUE(stats.used <= budget);
+    TEST_ASSERT_TRUE(stats.evicted > 0);
+    TEST_ASSERT_TRUE(stats.evict_runs > 0);
+    test_expect(dbi, "k0399", value);
+
+    /* Merges make room too; cursor puts are refused. */
+    uint64_t evicted = stats.evicted;
+    MDB_val k = test_val("log");
+    MDB_val arg = {sizeof(value), value};
+    MDB_val result;
+    for (int i = 0; i < 200; i++) {
+        TEST_ASSERT_EQUAL_INT(0, nal_txn_begin(NULL, &txn));
+        TEST_ASSERT_EQUAL_INT(0, nal_merge(txn, dbi, &k, NAL_MERGE_APPEND,
+                                           &arg, 16 * sizeof(value),
+                                           &result));
+        TEST_ASSERT_EQUAL_INT(0, nal_txn_commit(txn));
+        snprintf(key, sizeof(key), "m%04d", i);
+        MDB_val mk = test_val(key);
+        TEST_ASSERT_EQUAL_INT(0, nal_txn_begin(NULL, &txn));
+        TEST_ASSERT_EQUAL_INT(0, nal_merge(txn, dbi, &mk, NAL_MERGE_APPEND,
+                                           &arg, 0, &result));
+        TEST_ASSERT_EQUAL_INT(0, nal_txn_commit(txn));
+    }
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_begin(NULL, &txn));
+    TEST_ASSERT_EQUAL_INT(0, nal_cache_stats(txn, dbi, &stats));
+    TEST_ASSERT_TRUE(stats.used <= budget);
+    TEST_ASSERT_TRUE(stats.evicted > evicted);
+
+    nal_cursor_ptr cursor;
+    MDB_val v = test_val("v");
+    TEST_ASSERT_EQUAL_INT(0, nal_cursor_open(txn, dbi, &cursor));
+    TEST_ASSERT_EQUAL_INT(MDB_INCOMPATIBLE, nal_cursor_put(cursor, &k, &v, 0));
+    nal_cursor_close(cursor);
+    nal_txn_abort(txn);
+}
+
+/* Ships the log after seq through a pipe into follower. */
+static uint64_t test_ship(nal_txn_ptr txn, uint64_t seq,
+                          nal_follower_t *follower, size_t *applied)
+{
+    int fds[2];
+    uint64_t last;
+    TEST_ASSERT_EQUAL_INT(0, pipe(fds));
+    TEST_ASSERT_EQUAL_INT(0, nal_changelog_ship(txn, seq, 1000, fds[1], &last));
+    close(fds[1]);
+    TEST_ASSERT_EQUAL_INT(0, nal_follower_apply(follower, fds[0], 10, applied));
+    close(fds[0]);
+    return last;
+}
+
+/* Runs last: once open, the change log records every later write. */
+static void test_changelog_ship_follow(void)
+{
+    nal_txn_ptr txn;
+    uint64_t seq;
+    TEST_ASSERT_EQUAL_INT(0, nal_readonly_txn_begin(NULL, &txn));
+    TEST_ASSERT_EQUAL_INT(MDB_INCOMPATIBLE, nal_changelog_last_seq(txn, &seq));
+    nal_txn_abort(txn);
+
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_begin(NULL, &txn));
+    TEST_ASSERT_EQUAL_INT(0, nal_changelog_open(txn, 0));
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_commit(txn));
+    MDB_dbi dbi = test_dbi_open("changelog", 0);
+    test_put(dbi, "a", "1");
+    test_put(dbi, "b", "2");
+    test_del(dbi, "a");
+
+    test_clear_dir(TEST_FOLLOWER_DIR);
+    nal_follower_t *follower;
+    TEST_ASSERT_EQUAL_INT(0, nal_follower_open(TEST_FOLLOWER_DIR, 8,
+                                               TEST_MAP_SIZE, 0644, &follower));
+    size_t applied;
+    TEST_ASSERT_EQUAL_INT(0, nal_readonly_txn_begin(NULL, &txn));
+    seq = test_ship(txn, 0, follower, &applied);
+    TEST_ASSERT_EQUAL_UINT64(3, seq);
+    TEST_ASSERT_EQUAL_size_t(3, applied);
+    TEST_ASSERT_EQUAL_UINT64(3, nal_follower_applied_seq(follower));
+
+    /* Follow: the same read txn, reset and renewed, sees new commits. */
+    nal_txn_reset(txn);
+    test_put(dbi, "c", "3");
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_renew(txn));
+    seq = test_ship(txn, seq, follower, &applied);
+    TEST_ASSERT_EQUAL_UINT64(4, seq);
+    TEST_ASSERT_EQUAL_size_t(1, applied);
+
+    /* Frames the follower already has are skipped. */
+    test_ship(txn, 0, follower, &applied);
+    TEST_ASSERT_EQUAL_size_t(0, applied);
+    TEST_ASSERT_EQUAL_UINT64(4, nal_follower_applied_seq(follower));
+    nal_txn_abort(txn);
+    nal_follower_close(follower);
+
+    /* The value of an MDB_RESERVE put is not there yet to be logged. */
+    nal_cursor_ptr cursor;
+    MDB_val k = test_val("d");
+    MDB_val v = {1, NULL};
+    TEST_ASSERT_EQUAL_INT(0, nal_txn_begin(NULL, &txn));
+    TEST_ASSERT_EQUAL_INT(0, nal_cursor_open(txn, dbi, &cursor));
+    TEST_ASSERT_EQUAL_INT(MDB_INCOMPATIBLE,
+                          nal_cursor_put(cursor, &k, &v, MDB_RESERVE));
+    nal_cursor_close(cursor);
+    nal_txn_abort(txn);
+    test_expect(dbi, "b", "2");
+}
+
+int main(void)
+{
+    test_clear_dir(TEST_DB_DIR);
+    if (nal_env_init(TEST_DB_DIR, 32, 126, TEST_MAP_SIZE, 0644, 0, 0) != 0) {
+        fprintf(stderr, "cannot open %s\n", TEST_DB_DIR);
+        return 1;
+    }
+
+    UNITY_BEGIN();
+    RUN_TEST(test_versioned_no_aba);
+    RUN_TEST(test_view_tied_to_txn);
+    RUN_TEST(test_blob_live_bytes);
+    RUN_TEST(test_dedup_refcounts);
+    RUN_TEST(test_phf_rejects_bad_offsets);
+    RUN_TEST(test_scan_resumable);
+    RUN_TEST(test_pscan_groups);
+    RUN_TEST(test_filter_prefix_regex);
+    RUN_TEST(test_generation_bump);
+    RUN_TEST(test_merge_ops);
+    RUN_TEST(test_savepoint_rollback);
+    RUN_TEST(test_tuple_order);
+    RUN_TEST(test_bloom_miss_rebuild);
+    RUN_TEST(test_cache_budget);
+    RUN_TEST(test_changelog_ship_follow);
+    return UNITY_END();
+}
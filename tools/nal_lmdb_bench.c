@@ -0,0 +1,693 @@
+/* Load generator emulating nginx/ATS worker topologies: PROCS forked
+ * processes of THREADS threads each open the env with the same nal_env_init
+ * settings as production and run a read/write mix for DURATION seconds, e.g.
+ *
+ *   nal_lmdb_bench -p 8 -t 4 -d 30 -r 95 -D zipf -k 1000000 /tmp/benchdb
+ *
+ * Reads reuse one read txn per thread through reset/renew, as the Lua
+ * bindings do. -x forks processes that take a read txn and are SIGKILLed
+ * mid-run, leaving stale reader slots behind like a crashed worker.
+ */
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "nal_hash.h"
+#include "nal_lmdb.h"
+#include "nal_lmdb_internal.h"
+
+#define DEFAULT_MAX_DATABASES 20
+#define DEFAULT_MAX_READERS 126
+#define DEFAULT_MAP_SIZE (1024UL * 1024 * 1024)
+#define DEFAULT_KEYS 100000
+#define DEFAULT_VALUE_SIZE 100
+#define DEFAULT_SCAN_LEN 100
+#define DEFAULT_ZIPF_THETA 0.99
+#define BENCH_DB "bench"
+#define KEY_SIZE 16
+#define LOAD_BATCH 10000
+#define READER_SAMPLE_USEC 10000
+
+/* Latencies go to log-linear buckets: 8 sub-buckets per power of two of
+ * nanoseconds, so percentiles are within 12.5%. */
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS (64 << HIST_SUB_BITS)
+
+enum { OP_READ, OP_WRITE, OP_SCAN, OP_LOCK_WAIT, OP_COUNT };
+
+static const char *op_names[OP_COUNT] = {"read", "write", "scan",
+                                         "write-lock wait"};
+
+typedef enum { DIST_UNIFORM, DIST_ZIPF, DIST_SCAN } dist_t;
+
+typedef struct {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[HIST_BUCKETS];
+} hist_t;
+
+typedef struct {
+    hist_t hist[OP_COUNT];
+    uint64_t errors;
+} thread_stats_t;
+
+/* Shared with the children through an anonymous MAP_SHARED mapping. */
+typedef struct {
+    volatile int start;
+    volatile int stop;
+    unsigned int max_readers_used;
+    int stale_cleared;
+    uint64_t last_pgno_start;
+    uint64_t last_pgno_end;
+    thread_stats_t threads[];
+} shared_t;
+
+typedef struct {
+    const char *env_path;
+    size_t max_databases;
+    unsigned int max_readers;
+    size_t map_size;
+    int use_tls;
+    unsigned int procs;
+    unsigned int threads;
+    unsigned int duration;
+    unsigned int read_pct;
+    uint64_t keys;
+    size_t value_size;
+    size_t scan_len;
+    unsigned int batch;
+    unsigned int stale_readers;
+    dist_t dist;
+    double theta;
+    int skip_load;
+} config_t;
+
+static config_t cfg = {
+    .max_databases = DEFAULT_MAX_DATABASES,
+    .max_readers = DEFAULT_MAX_READERS,
+    .map_size = DEFAULT_MAP_SIZE,
+    .procs = 1,
+    .threads = 1,
+    .duration = 10,
+    .read_pct = 90,
+    .keys = DEFAULT_KEYS,
+    .value_size = DEFAULT_VALUE_SIZE,
+    .scan_len = DEFAULT_SCAN_LEN,
+    .batch = 1,
+    .dist = DIST_UNIFORM,
+    .theta = DEFAULT_ZIPF_THETA,
+};
+
+static shared_t *shared;
+static MDB_dbi bench_dbi;
+
+/* Zipfian generator of Gray et al., "Quickly generating billion-record
+ * synthetic databases", as used by YCSB. */
+static double zipf_zetan, zipf_alpha, zipf_eta;
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: nal_lmdb_bench [-p PROCS] [-t THREADS] [-d SECONDS] "
+            "[-r READ_PCT]\n"
+            "           [-D uniform|zipf|scan] [-z THETA] [-l SCAN_LEN] "
+            "[-k KEYS] [-v VALUE_SIZE]\n"
+            "           [-b WRITE_BATCH] [-x STALE_READERS] [-L] [-T] "
+            "[-n MAX_DBS] [-R MAX_READERS]\n"
+            "           [-m MAP_SIZE] ENV_PATH\n");
+    exit(2);
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static unsigned int hist_bucket(uint64_t ns)
+{
+    if (ns < (1 << HIST_SUB_BITS)) {
+        return (unsigned int)ns;
+    }
+    unsigned int msb = 63 - (unsigned int)__builtin_clzll(ns);
+    unsigned int sub = (unsigned int)(ns >> (msb - HIST_SUB_BITS)) &
+                       ((1 << HIST_SUB_BITS) - 1);
+    return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+}
+
+/* Upper bound of a bucket, the value reported for percentiles. */
+static uint64_t hist_bucket_value(unsigned int b)
+{
+    if (b < (1 << HIST_SUB_BITS)) {
+        return b;
+    }
+    unsigned int msb = (b >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+    uint64_t sub = b & ((1 << HIST_SUB_BITS) - 1);
+    return ((((uint64_t)1 << HIST_SUB_BITS) + sub + 1)
+            << (msb - HIST_SUB_BITS)) - 1;
+}
+
+static void hist_add(hist_t *h, uint64_t ns)
+{
+    h->count++;
+    h->total_ns += ns;
+    if (ns > h->max_ns) {
+        h->max_ns = ns;
+    }
+    h->buckets[hist_bucket(ns)]++;
+}
+
+static void hist_merge(hist_t *dst, const hist_t *src)
+{
+    dst->count += src->count;
+    dst->total_ns += src->total_ns;
+    if (src->max_ns > dst->max_ns) {
+        dst->max_ns = src->max_ns;
+    }
+    for (unsigned int b = 0; b < HIST_BUCKETS; b++) {
+        dst->buckets[b] += src->buckets[b];
+    }
+}
+
+static uint64_t hist_percentile(const hist_t *h, double pct)
+{
+    uint64_t rank = (uint64_t)ceil(h->count * pct / 100.0), seen = 0;
+    for (unsigned int b = 0; b < HIST_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen >= rank && seen > 0) {
+            uint64_t v = hist_bucket_value(b);
+            return v < h->max_ns ? v : h->max_ns;
+        }
+    }
+    return h->max_ns;
+}
+
+static uint64_t rand_next(uint64_t *state)
+{
+    /* xorshift64* */
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+static double rand_double(uint64_t *state)
+{
+    return (double)(rand_next(state) >> 11) / (double)(1ULL << 53);
+}
+
+static void zipf_init(void)
+{
+    double zeta2 = 1.0 + pow(0.5, cfg.theta);
+    zipf_zetan = 0;
+    for (uint64_t i = 1; i <= cfg.keys; i++) {
+        zipf_zetan += 1.0 / pow((double)i, cfg.theta);
+    }
+    zipf_alpha = 1.0 / (1.0 - cfg.theta);
+    zipf_eta = (1.0 - pow(2.0 / (double)cfg.keys, 1.0 - cfg.theta)) /
+               (1.0 - zeta2 / zipf_zetan);
+}
+
+static uint64_t zipf_next(uint64_t *state)
+{
+    double u = rand_double(state);
+    double uz = u * zipf_zetan;
+    uint64_t rank;
+    if (uz < 1.0) {
+        rank = 0;
+    } else if (uz < 1.0 + pow(0.5, cfg.theta)) {
+        rank = 1;
+    } else {
+        rank = (uint64_t)((double)cfg.keys *
+                          pow(zipf_eta * u - zipf_eta + 1.0, zipf_alpha));
+    }
+    /* Scatter the hot ranks over the key space so they do not share
+     * pages. */
+    return nal_hash64(&rank, sizeof(rank), 0) % cfg.keys;
+}
+
+static uint64_t next_key(uint64_t *state)
+{
+    if (cfg.dist == DIST_ZIPF) {
+        return zipf_next(state);
+    }
+    return rand_next(state) % cfg.keys;
+}
+
+static void format_key(char *buf, uint64_t k)
+{
+    snprintf(buf, KEY_SIZE + 1, "k%015" PRIu64, k);
+}
+
+static int env_open(void)
+{
+    int rc = nal_env_init(cfg.env_path, cfg.max_databases, cfg.max_readers,
+                          cfg.map_size, 0644, cfg.use_tls, 0);
+    if (rc != 0) {
+        return rc;
+    }
+    nal_txn_ptr txn;
+    rc = nal_txn_begin(NULL, &txn);
+    if (rc != 0) {
+        return rc;
+    }
+    rc = nal_dbi_open(txn, BENCH_DB, &bench_dbi);
+    if (rc != 0) {
+        nal_txn_abort(txn);
+        return rc;
+    }
+    return nal_txn_commit(txn);
+}
+
+static int load(void)
+{
+    int rc = env_open();
+    char key_buf[KEY_SIZE + 1];
+    char *value = calloc(1, cfg.value_size + 1);
+    if (value == NULL) {
+        return ENOMEM;
+    }
+    memset(value, 'v', cfg.value_size);
+
+    for (uint64_t k = 0; rc == 0 && k < cfg.keys; k += LOAD_BATCH) {
+        nal_txn_ptr txn;
+        rc = nal_txn_begin(NULL, &txn);
+        for (uint64_t i = k; rc == 0 && i < k + LOAD_BATCH && i < cfg.keys;
+             i++) {
+            format_key(key_buf, i);
+            MDB_val key = {KEY_SIZE, key_buf};
+            MDB_val data = {cfg.value_size, value};
+            rc = nal_put(txn, bench_dbi, &key, &data);
+        }
+        if (rc == 0) {
+            rc = nal_txn_commit(txn);
+        } else if (txn != NULL) {
+            nal_txn_abort(txn);
+        }
+    }
+    free(value);
+    return rc;
+}
+
+static void sample_env(unsigned int *readers, uint64_t *last_pgno)
+{
+    MDB_envinfo info;
+    if (mdb_env_info(nal_env_handle(), &info) == 0) {
+        *readers = info.me_numreaders;
+        *last_pgno = info.me_last_pgno;
+    }
+}
+
+typedef struct {
+    unsigned int index;
+    pthread_t thread;
+} worker_t;
+
+static int do_read(nal_txn_ptr txn, uint64_t *rng, char *key_buf)
+{
+    format_key(key_buf, next_key(rng));
+    MDB_val key = {KEY_SIZE, key_buf}, data;
+    int rc = nal_get(txn, bench_dbi, &key, &data);
+    return rc == MDB_NOTFOUND ? 0 : rc;
+}
+
+static int do_scan(nal_txn_ptr txn, uint64_t *rng, char *key_buf)
+{
+    format_key(key_buf, next_key(rng));
+    MDB_val key = {KEY_SIZE, key_buf}, data;
+    nal_cursor_ptr cursor;
+    int rc = nal_cursor_open(txn, bench_dbi, &cursor);
+    if (rc != 0) {
+        return rc;
+    }
+    rc = nal_cursor_get(cursor, &key, &data, MDB_SET_RANGE);
+    for (size_t i = 1; rc == 0 && i < cfg.scan_len; i++) {
+        rc = nal_cursor_get(cursor, &key, &data, MDB_NEXT);
+    }
+    nal_cursor_close(cursor);
+    return rc == MDB_NOTFOUND ? 0 : rc;
+}
+
+static int do_write(thread_stats_t *st, uint64_t *rng, char *key_buf,
+                    char *value)
+{
+    uint64_t start = now_ns();
+    nal_txn_ptr txn;
+    int rc = nal_txn_begin(NULL, &txn);
+    if (rc != 0) {
+        return rc;
+    }
+    hist_add(&st->hist[OP_LOCK_WAIT], now_ns() - start);
+    for (unsigned int i = 0; rc == 0 && i < cfg.batch; i++) {
+        format_key(key_buf, next_key(rng));
+        MDB_val key = {KEY_SIZE, key_buf};
+        MDB_val data = {cfg.value_size, value};
+        rc = nal_put(txn, bench_dbi, &key, &data);
+    }
+    if (rc != 0) {
+        nal_txn_abort(txn);
+        return rc;
+    }
+    return nal_txn_commit(txn);
+}
+
+static void *worker_run(void *arg)
+{
+    worker_t *w = arg;
+    thread_stats_t *st = &shared->threads[w->index];
+    uint64_t rng = nal_hash64(&w->index, sizeof(w->index), now_ns()) | 1;
+    char key_buf[KEY_SIZE + 1];
+    char *value = malloc(cfg.value_size + 1);
+    nal_txn_ptr read_txn = NULL;
+    int rc = value == NULL ? ENOMEM : nal_readonly_txn_begin(NULL, &read_txn);
+    if (rc != 0) {
+        fprintf(stderr, "worker %u: %s\n", w->index, nal_strerror(rc));
+        st->errors++;
+        free(value);
+        return NULL;
+    }
+    memset(value, 'w', cfg.value_size);
+    nal_txn_reset(read_txn);
+
+    while (!shared->stop) {
+        int op = rand_next(&rng) % 100 < cfg.read_pct
+                     ? (cfg.dist == DIST_SCAN ? OP_SCAN : OP_READ)
+                     : OP_WRITE;
+        uint64_t start = now_ns();
+        if (op == OP_WRITE) {
+            rc = do_write(st, &rng, key_buf, value);
+        } else {
+            rc = nal_txn_renew(read_txn);
+            if (rc == 0) {
+                rc = op == OP_SCAN ? do_scan(read_txn, &rng, key_buf)
+                                   : do_read(read_txn, &rng, key_buf);
+                nal_txn_reset(read_txn);
+            }
+        }
+        if (rc != 0) {
+            st->errors++;
+            continue;
+        }
+        hist_add(&st->hist[op], now_ns() - start);
+    }
+
+    nal_txn_abort(read_txn);
+    free(value);
+    return NULL;
+}
+
+static int run_process(unsigned int proc)
+{
+    int rc = env_open();
+    if (rc != 0) {
+        fprintf(stderr, "process %u: %s\n", proc, nal_strerror(rc));
+        return 1;
+    }
+    while (!shared->start) {
+        usleep(1000);
+    }
+
+    worker_t *workers = calloc(cfg.threads, sizeof(worker_t));
+    if (workers == NULL) {
+        return 1;
+    }
+    for (unsigned int t = 0; t < cfg.threads; t++) {
+        workers[t].index = proc * cfg.threads + t;
+        if (pthread_create(&workers[t].thread, NULL, worker_run,
+                           &workers[t]) != 0) {
+            fprintf(stderr, "process %u: cannot create thread\n", proc);
+            return 1;
+        }
+    }
+
+    /* The first process samples the reader table while the others run and
+     * finally clears the slots left by crashed readers, as the next
+     * nal_env_init would. */
+    if (proc == 0) {
+        unsigned int readers;
+        uint64_t last_pgno;
+        sample_env(&shared->max_readers_used, &shared->last_pgno_start);
+        while (!shared->stop) {
+            sample_env(&readers, &last_pgno);
+            if (readers > shared->max_readers_used) {
+                shared->max_readers_used = readers;
+            }
+            usleep(READER_SAMPLE_USEC);
+        }
+        sample_env(&readers, &shared->last_pgno_end);
+        mdb_reader_check(nal_env_handle(), &shared->stale_cleared);
+    }
+
+    for (unsigned int t = 0; t < cfg.threads; t++) {
+        pthread_join(workers[t].thread, NULL);
+    }
+    free(workers);
+    return 0;
+}
+
+/* Takes a read txn and holds it until killed. */
+static int run_stale_reader(void)
+{
+    int rc = env_open();
+    nal_txn_ptr txn;
+    if (rc == 0) {
+        rc = nal_readonly_txn_begin(NULL, &txn);
+    }
+    if (rc != 0) {
+        fprintf(stderr, "stale reader: %s\n", nal_strerror(rc));
+        return 1;
+    }
+    for (;;) {
+        pause();
+    }
+}
+
+static void report_op(int op, const hist_t *h, double seconds)
+{
+    if (h->count == 0) {
+        return;
+    }
+    char rate[32] = "-";
+    if (op != OP_LOCK_WAIT) {
+        snprintf(rate, sizeof(rate), "%.0f", h->count / seconds);
+    }
+    printf("%-16s %10" PRIu64 " %12s %9.1f %9.1f %9.1f %9.1f %10.1f\n",
+           op_names[op], h->count, rate, h->total_ns / 1000.0 / h->count,
+           hist_percentile(h, 50) / 1000.0,
+           hist_percentile(h, 99) / 1000.0, hist_percentile(h, 99.9) / 1000.0,
+           h->max_ns / 1000.0);
+}
+
+static void report(double seconds)
+{
+    hist_t total[OP_COUNT];
+    uint64_t errors = 0;
+    memset(total, 0, sizeof(total));
+    for (unsigned int i = 0; i < cfg.procs * cfg.threads; i++) {
+        for (int op = 0; op < OP_COUNT; op++) {
+            hist_merge(&total[op], &shared->threads[i].hist[op]);
+        }
+        errors += shared->threads[i].errors;
+    }
+
+    printf("%u processes x %u threads, %.1f s, %u%% reads\n\n", cfg.procs,
+           cfg.threads, seconds, cfg.read_pct);
+    printf("%-16s %10s %12s %9s %9s %9s %9s %10s\n", "op", "count", "ops/s",
+           "avg us", "p50 us", "p99 us", "p99.9 us", "max us");
+    for (int op = 0; op < OP_COUNT; op++) {
+        report_op(op, &total[op], seconds);
+    }
+
+    const hist_t *wait = &total[OP_LOCK_WAIT];
+    if (wait->count > 0) {
+        printf("\nwrite lock wait: %.1f%% of write time\n",
+               100.0 * wait->total_ns /
+                   (total[OP_WRITE].total_ns ? total[OP_WRITE].total_ns : 1));
+    }
+    printf("reader slots: %u of %u used at peak, %d stale cleared after run\n",
+           shared->max_readers_used, cfg.max_readers, shared->stale_cleared);
+    printf("map pages: %" PRIu64 " -> %" PRIu64 "\n", shared->last_pgno_start,
+           shared->last_pgno_end);
+    printf("errors: %" PRIu64 "\n", errors);
+}
+
+static pid_t spawn(int (*fn)(unsigned int), unsigned int arg)
+{
+    pid_t pid = fork();
+    if (pid == 0) {
+        _exit(fn(arg));
+    }
+    return pid;
+}
+
+static int run_stale_reader_proc(unsigned int unused)
+{
+    (void)unused;
+    return run_stale_reader();
+}
+
+static int load_proc(unsigned int unused)
+{
+    (void)unused;
+    int rc = load();
+    if (rc != 0) {
+        fprintf(stderr, "load: %s\n", nal_strerror(rc));
+        return 1;
+    }
+    return 0;
+}
+
+static int wait_all(pid_t *pids, unsigned int n)
+{
+    int failed = 0;
+    for (unsigned int i = 0; i < n; i++) {
+        int status;
+        if (pids[i] > 0 && waitpid(pids[i], &status, 0) == pids[i] &&
+            !(WIFEXITED(status) && WEXITSTATUS(status) == 0)) {
+            failed = 1;
+        }
+    }
+    return failed;
+}
+
+int main(int argc, char **argv)
+{
+    int opt;
+    while ((opt = getopt(argc, argv, "b:d:D:k:l:Lm:n:p:r:R:t:Tv:x:z:")) !=
+           -1) {
+        switch (opt) {
+        case 'b':
+            cfg.batch = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'd':
+            cfg.duration = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'D':
+            if (strcmp(optarg, "uniform") == 0) {
+                cfg.dist = DIST_UNIFORM;
+            } else if (strcmp(optarg, "zipf") == 0) {
+                cfg.dist = DIST_ZIPF;
+            } else if (strcmp(optarg, "scan") == 0) {
+                cfg.dist = DIST_SCAN;
+            } else {
+                usage();
+            }
+            break;
+        case 'k':
+            cfg.keys = strtoull(optarg, NULL, 10);
+            break;
+        case 'l':
+            cfg.scan_len = strtoul(optarg, NULL, 10);
+            break;
+        case 'L':
+            cfg.skip_load = 1;
+            break;
+        case 'm':
+            cfg.map_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            cfg.max_databases = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            cfg.procs = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'r':
+            cfg.read_pct = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'R':
+            cfg.max_readers = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 't':
+            cfg.threads = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'T':
+            cfg.use_tls = 1;
+            break;
+        case 'v':
+            cfg.value_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'x':
+            cfg.stale_readers = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'z':
+            cfg.theta = strtod(optarg, NULL);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind >= argc || cfg.procs == 0 || cfg.threads == 0 ||
+        cfg.keys == 0 || cfg.read_pct > 100 || cfg.batch == 0) {
+        usage();
+    }
+    cfg.env_path = argv[optind];
+    if (cfg.dist == DIST_ZIPF) {
+        zipf_init();
+    }
+
+    size_t shared_len = sizeof(shared_t) +
+                        cfg.procs * cfg.threads * sizeof(thread_stats_t);
+    shared = mmap(NULL, shared_len, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+
+    /* Nothing touches the env in this process until the children are done:
+     * an LMDB env must not be used across fork. */
+    if (!cfg.skip_load) {
+        pid_t pid = spawn(load_proc, 0);
+        if (wait_all(&pid, 1)) {
+            return 1;
+        }
+    }
+
+    pid_t *pids = calloc(cfg.procs + cfg.stale_readers, sizeof(pid_t));
+    if (pids == NULL) {
+        return 1;
+    }
+    for (unsigned int i = 0; i < cfg.stale_readers; i++) {
+        pids[cfg.procs + i] = spawn(run_stale_reader_proc, i);
+    }
+    for (unsigned int p = 0; p < cfg.procs; p++) {
+        pids[p] = spawn(run_process, p);
+    }
+
+    uint64_t start = now_ns();
+    shared->start = 1;
+    for (unsigned int s = 0; s < cfg.duration; s++) {
+        sleep(1);
+        /* Crash the stale readers halfway, after the workers have run
+         * their reader slot check at init. */
+        if (s == cfg.duration / 2) {
+            for (unsigned int i = 0; i < cfg.stale_readers; i++) {
+                kill(pids[cfg.procs + i], SIGKILL);
+            }
+        }
+    }
+    shared->stop = 1;
+    double seconds = (now_ns() - start) / 1e9;
+    int failed = wait_all(pids, cfg.procs);
+    for (unsigned int i = 0; i < cfg.stale_readers; i++) {
+        kill(pids[cfg.procs + i], SIGKILL);
+        waitpid(pids[cfg.procs + i], NULL, 0);
+    }
+    free(pids);
+
+    report(seconds);
+    return failed;
+}
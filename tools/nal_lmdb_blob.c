@@ -0,0 +1,102 @@
+/* Garbage collects the blob segments of an env, once or every INTERVAL
+ * seconds, e.g.
+ *
+ *   nal_lmdb_blob gc -p 50 -i 60 /var/lib/db
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nal_blob.h"
+
+#define DEFAULT_MAX_DATABASES 20
+#define DEFAULT_MAP_SIZE (1024UL * 1024 * 1024)
+#define DEFAULT_MAX_LIVE_PCT 50
+#define DEFAULT_MAX_SEGMENTS 4
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: nal_lmdb_blob gc [-p MAX_LIVE_PCT] [-s MAX_SEGMENTS] "
+            "[-i INTERVAL] [-n MAX_DBS] [-m MAP_SIZE] ENV_PATH\n");
+    exit(2);
+}
+
+static int gc_once(unsigned int max_live_pct, size_t max_segments)
+{
+    nal_txn_ptr txn;
+    int rc = nal_txn_begin(NULL, &txn);
+    if (rc != 0) {
+        return rc;
+    }
+    rc = nal_blob_open(txn, 0, NAL_BLOB_DEFAULT_THRESHOLD);
+    size_t moved = 0;
+    if (rc == 0) {
+        rc = nal_blob_gc(txn, max_live_pct, max_segments, &moved);
+    }
+    if (rc != 0) {
+        nal_txn_abort(txn);
+        return rc;
+    }
+    rc = nal_txn_commit(txn);
+    if (rc == 0 && moved > 0) {
+        fprintf(stderr, "moved %zu blob bytes\n", moved);
+    }
+    return rc;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2 || strcmp(argv[1], "gc") != 0) {
+        usage();
+    }
+    size_t max_databases = DEFAULT_MAX_DATABASES;
+    size_t map_size = DEFAULT_MAP_SIZE;
+    unsigned int max_live_pct = DEFAULT_MAX_LIVE_PCT;
+    size_t max_segments = DEFAULT_MAX_SEGMENTS;
+    unsigned int interval = 0;
+    int opt;
+
+    optind = 2;
+    while ((opt = getopt(argc, argv, "i:m:n:p:s:")) != -1) {
+        switch (opt) {
+        case 'i':
+            interval = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'm':
+            map_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            max_databases = strtoul(optarg, NULL, 10);
+            break;
+        case 'p':
+            max_live_pct = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            max_segments = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind >= argc) {
+        usage();
+    }
+
+    int rc = nal_env_init(argv[optind], max_databases, 126, map_size, 0644, 0,
+                          0);
+    while (rc == 0) {
+        rc = gc_once(max_live_pct, max_segments);
+        if (interval == 0) {
+            break;
+        }
+        sleep(interval);
+    }
+
+    if (rc != 0) {
+        fprintf(stderr, "nal_lmdb_blob gc: %s\n", nal_strerror(rc));
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,191 @@
+/* Ships the change log of an env to stdout or applies a shipped stream from
+ * stdin to a follower env, e.g.
+ *
+ *   nal_lmdb_changelog ship -f /var/lib/db | nal_lmdb_changelog apply /mnt/db
+ */
+#include <errno.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nal_changelog.h"
+
+#define DEFAULT_MAX_DATABASES 20
+#define DEFAULT_MAP_SIZE (1024UL * 1024 * 1024)
+#define SHIP_CHUNK_RECORDS 1000
+#define SHIP_POLL_USEC 100000
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: nal_lmdb_changelog ship [-f] [-s SEQ] [-n MAX_DBS] "
+            "[-m MAP_SIZE] ENV_PATH\n"
+            "       nal_lmdb_changelog apply [-b BATCH] [-n MAX_DBS] "
+            "[-m MAP_SIZE] ENV_PATH\n"
+            "       nal_lmdb_changelog truncate [-n MAX_DBS] [-m MAP_SIZE] "
+            "ENV_PATH SEQ\n");
+    exit(2);
+}
+
+static int ship(const char *env_path, size_t max_databases, size_t map_size,
+                uint64_t seq, int follow)
+{
+    int rc = nal_env_init(env_path, max_databases, 126, map_size, 0644, 0, 1);
+    if (rc != 0) {
+        return rc;
+    }
+
+    /* A dbi opened in a txn only outlives it once the txn commits; a reset
+     * would close it again. */
+    nal_txn_ptr txn;
+    rc = nal_readonly_txn_begin(NULL, &txn);
+    if (rc != 0) {
+        return rc;
+    }
+    rc = nal_changelog_open(txn, 1);
+    if (rc != 0) {
+        nal_txn_abort(txn);
+        return rc;
+    }
+    rc = nal_txn_commit(txn);
+    if (rc == 0) {
+        rc = nal_readonly_txn_begin(NULL, &txn);
+    }
+    if (rc != 0) {
+        return rc;
+    }
+
+    for (;;) {
+        uint64_t last;
+        rc = nal_changelog_ship(txn, seq, SHIP_CHUNK_RECORDS, STDOUT_FILENO,
+                                &last);
+        if (rc != 0) {
+            break;
+        }
+        int drained = last == seq;
+        seq = last;
+        if (drained) {
+            if (!follow) {
+                break;
+            }
+            usleep(SHIP_POLL_USEC);
+        }
+
+        /* Renew so the next chunk sees new commits and the snapshot does not
+         * pin pages while we wait. */
+        nal_txn_reset(txn);
+        rc = nal_txn_renew(txn);
+        if (rc != 0) {
+            return rc;
+        }
+    }
+    nal_txn_abort(txn);
+    return rc;
+}
+
+static int apply(const char *env_path, size_t max_databases, size_t map_size,
+                 size_t batch_size)
+{
+    nal_follower_t *follower;
+    int rc = nal_follower_open(env_path, max_databases, map_size, 0644,
+                               &follower);
+    if (rc != 0) {
+        return rc;
+    }
+
+    size_t applied;
+    rc = nal_follower_apply(follower, STDIN_FILENO, batch_size, &applied);
+    fprintf(stderr, "applied %zu records, applied_seq=%" PRIu64 "\n", applied,
+            nal_follower_applied_seq(follower));
+    nal_follower_close(follower);
+    return rc;
+}
+
+static int truncate_log(const char *env_path, size_t max_databases,
+                        size_t map_size, uint64_t seq)
+{
+    int rc = nal_env_init(env_path, max_databases, 126, map_size, 0644, 0, 0);
+    if (rc != 0) {
+        return rc;
+    }
+
+    nal_txn_ptr txn;
+    rc = nal_txn_begin(NULL, &txn);
+    if (rc != 0) {
+        return rc;
+    }
+    rc = nal_changelog_open(txn, 0);
+    if (rc == 0) {
+        rc = nal_changelog_truncate(txn, seq);
+    }
+    if (rc != 0) {
+        nal_txn_abort(txn);
+        return rc;
+    }
+    return nal_txn_commit(txn);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        usage();
+    }
+    const char *cmd = argv[1];
+    size_t max_databases = DEFAULT_MAX_DATABASES;
+    size_t map_size = DEFAULT_MAP_SIZE;
+    size_t batch_size = 1000;
+    uint64_t seq = 0;
+    int follow = 0;
+    int opt;
+
+    optind = 2;
+    while ((opt = getopt(argc, argv, "b:fm:n:s:")) != -1) {
+        switch (opt) {
+        case 'b':
+            batch_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'f':
+            follow = 1;
+            break;
+        case 'm':
+            map_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            max_databases = strtoul(optarg, NULL, 10);
+            break;
+        case 's':
+            seq = strtoull(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind >= argc) {
+        usage();
+    }
+    const char *env_path = argv[optind];
+
+    int rc;
+    if (strcmp(cmd, "ship") == 0) {
+        rc = ship(env_path, max_databases, map_size, seq, follow);
+    } else if (strcmp(cmd, "apply") == 0) {
+        rc = apply(env_path, max_databases, map_size, batch_size);
+    } else if (strcmp(cmd, "truncate") == 0) {
+        if (optind + 1 >= argc) {
+            usage();
+        }
+        seq = strtoull(argv[optind + 1], NULL, 10);
+        rc = truncate_log(env_path, max_databases, map_size, seq);
+    } else {
+        usage();
+        return 2;
+    }
+
+    if (rc != 0) {
+        fprintf(stderr, "nal_lmdb_changelog %s: %s\n", cmd, nal_strerror(rc));
+        return 1;
+    }
+    return 0;
+}
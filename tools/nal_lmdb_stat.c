@@ -0,0 +1,215 @@
+/* Prints how the map of an env is used: pages and fill factor per dbi and
+ * the freelist with its runs of consecutive pages, e.g.
+ *
+ *   nal_lmdb_stat -f /var/lib/db
+ *
+ * Fill factors come from a scan of every dbi, which -q skips.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "nal_stats.h"
+
+#define DEFAULT_MAX_DATABASES 20
+#define DEFAULT_MAP_SIZE (1024UL * 1024 * 1024)
+#define NAME_MAX_LEN 511
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: nal_lmdb_stat [-f] [-q] [-n MAX_DBS] "
+                    "[-m MAP_SIZE] ENV_PATH\n");
+    exit(2);
+}
+
+static double pct(uint64_t part, uint64_t whole)
+{
+    return whole > 0 ? 100.0 * (double)part / (double)whole : 0.0;
+}
+
+static void print_env(const nal_env_stats_t *env)
+{
+    printf("map: %llu of %llu pages used (%.1f%%), page size %llu\n",
+           (unsigned long long)env->map_pages,
+           (unsigned long long)(env->map_size / env->page_size),
+           pct(env->map_pages * env->page_size, env->map_size),
+           (unsigned long long)env->page_size);
+    printf("txn: last %llu, oldest reader %llu, readers %u of %u\n",
+           (unsigned long long)env->last_txnid,
+           (unsigned long long)env->oldest_reader_txnid, env->num_readers,
+           env->max_readers);
+    printf("dbis: %llu, main dbi depth %u, %llu pages\n",
+           (unsigned long long)env->dbis, env->main_depth,
+           (unsigned long long)env->main_pages);
+}
+
+static int print_dbi(nal_txn_ptr txn, const char *name, int scan,
+                     uint64_t *pages)
+{
+    MDB_dbi dbi;
+    int rc = nal_readonly_dbi_open(txn, name, &dbi);
+    if (rc == MDB_INCOMPATIBLE) {
+        /* A plain key of the main dbi rather than a dbi. */
+        return 0;
+    }
+    nal_dbi_stats_t st;
+    if (rc == 0) {
+        rc = nal_dbi_stats(txn, dbi, scan, &st);
+    }
+    if (rc != 0) {
+        return rc;
+    }
+    uint64_t total = st.branch_pages + st.leaf_pages + st.overflow_pages;
+    *pages += total;
+    printf("%-24s %5u %10llu %10llu %10llu %10llu %12llu", name, st.depth,
+           (unsigned long long)st.branch_pages,
+           (unsigned long long)st.leaf_pages,
+           (unsigned long long)st.overflow_pages,
+           (unsigned long long)total, (unsigned long long)st.entries);
+    if (scan) {
+        printf(" %6.1f%% %6.1f%%", 100.0 * st.leaf_fill,
+               100.0 * st.overflow_fill);
+    }
+    printf("\n");
+    return 0;
+}
+
+static int print_dbis(nal_txn_ptr txn, int scan, uint64_t *pages)
+{
+    MDB_dbi main_dbi;
+    MDB_cursor *cursor;
+    int rc = mdb_dbi_open(txn, NULL, 0, &main_dbi);
+    if (rc == 0) {
+        rc = mdb_cursor_open(txn, main_dbi, &cursor);
+    }
+    if (rc != 0) {
+        return rc;
+    }
+    printf("\n%-24s %5s %10s %10s %10s %10s %12s", "dbi", "depth", "branch",
+           "leaf", "overflow", "pages", "entries");
+    if (scan) {
+        printf(" %7s %7s", "leaf", "ovfl");
+    }
+    printf("\n");
+    MDB_val key, data;
+    char name[NAME_MAX_LEN + 1];
+    for (rc = mdb_cursor_get(cursor, &key, &data, MDB_FIRST); rc == 0;
+         rc = mdb_cursor_get(cursor, &key, &data, MDB_NEXT)) {
+        if (key.mv_size > NAME_MAX_LEN ||
+            memchr(key.mv_data, '\0', key.mv_size) != NULL) {
+            continue;
+        }
+        memcpy(name, key.mv_data, key.mv_size);
+        name[key.mv_size] = '\0';
+        rc = print_dbi(txn, name, scan, pages);
+        if (rc != 0) {
+            break;
+        }
+    }
+    mdb_cursor_close(cursor);
+    return rc == MDB_NOTFOUND ? 0 : rc;
+}
+
+static int print_freelist(nal_txn_ptr txn, int histogram,
+                          uint64_t *free_pages)
+{
+    nal_freelist_stats_t st;
+    int rc = nal_freelist_stats(txn, &st);
+    if (rc != 0) {
+        return rc;
+    }
+    *free_pages = st.free_pages;
+    printf("\nfreelist: %llu pages in %llu records, %llu pinned by "
+           "readers, %llu runs, longest %llu\n",
+           (unsigned long long)st.free_pages, (unsigned long long)st.records,
+           (unsigned long long)st.pinned_pages, (unsigned long long)st.runs,
+           (unsigned long long)st.max_run);
+    if (!histogram) {
+        return 0;
+    }
+    for (int i = 0; i < NAL_FREELIST_RUN_BUCKETS; i++) {
+        if (st.run_hist[i] == 0) {
+            continue;
+        }
+        if (i == NAL_FREELIST_RUN_BUCKETS - 1) {
+            printf("  %10llu+       %12llu\n", 1ULL << i,
+                   (unsigned long long)st.run_hist[i]);
+        } else {
+            printf("  %10llu-%-10llu %12llu\n", 1ULL << i,
+                   (1ULL << (i + 1)) - 1, (unsigned long long)st.run_hist[i]);
+        }
+    }
+    return 0;
+}
+
+int main(int argc, char **argv)
+{
+    size_t max_databases = DEFAULT_MAX_DATABASES;
+    size_t map_size = DEFAULT_MAP_SIZE;
+    int histogram = 0;
+    int scan = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "fm:n:q")) != -1) {
+        switch (opt) {
+        case 'f':
+            histogram = 1;
+            break;
+        case 'm':
+            map_size = strtoul(optarg, NULL, 10);
+            break;
+        case 'n':
+            max_databases = strtoul(optarg, NULL, 10);
+            break;
+        case 'q':
+            scan = 0;
+            break;
+        default:
+            usage();
+        }
+    }
+    if (optind >= argc) {
+        usage();
+    }
+
+    int rc = nal_env_init(argv[optind], max_databases, 126, map_size, 0644, 0,
+                          1);
+    nal_txn_ptr txn = NULL;
+    if (rc == 0) {
+        rc = nal_readonly_txn_begin(NULL, &txn);
+    }
+    nal_env_stats_t env;
+    if (rc == 0) {
+        rc = nal_env_stats(&env);
+    }
+    uint64_t pages = 0;
+    uint64_t free_pages = 0;
+    if (rc == 0) {
+        print_env(&env);
+        rc = print_dbis(txn, scan, &pages);
+    }
+    if (rc == 0) {
+        rc = print_freelist(txn, histogram, &free_pages);
+    }
+    if (rc == 0) {
+        /* The rest are the meta pages and those of the freelist itself. */
+        uint64_t known = pages + env.main_pages + free_pages;
+        printf("\nmap pages: %llu in dbis, %llu in the main dbi, %llu free, "
+               "%llu other\n",
+               (unsigned long long)pages, (unsigned long long)env.main_pages,
+               (unsigned long long)free_pages,
+               (unsigned long long)(env.map_pages > known
+                                        ? env.map_pages - known
+                                        : 0));
+    }
+    if (txn != NULL) {
+        nal_txn_abort(txn);
+    }
+
+    if (rc != 0) {
+        fprintf(stderr, "nal_lmdb_stat: %s\n", nal_strerror(rc));
+        return 1;
+    }
+    return 0;
+}